@@ -0,0 +1,940 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Benchmarks loading, loading at scale, region decoding and saving over a corpus of synthetic images.
+// The corpus is generated on the first run: 8 bit RGB and RGBA through the module's own encoder with gdk_pixbuf_save,
+// everything a pixbuf can't hold (gray, sYCC, CMYK, 12 and 16 bit) through libopenjp2 with the same settings.
+// Every median is also divided by the time of a fixed calibration loop, which cancels out most of the speed of the machine,
+// so a run can be checked against a baseline recorded elsewhere with --baseline.
+// libopenjp2 can't encode HTJ2K, an image encoded with it by another encoder and placed next to its classic twin as
+// NAME.jph is measured as NAME-ht and compared with it at the end.
+
+#include <stdio.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+
+#define BENCHMARK_TILE_SIZE 256
+#define BENCHMARK_RESOLUTIONS 6
+#define CALIBRATION_WORDS (1 << 20) // 4 MiB, more than most L2 caches
+#define CALIBRATION_PASSES 16
+#define CALIBRATION_RUNS 5
+
+typedef enum {
+	KIND_RGB = 0,
+	KIND_GRAY = 1,
+	KIND_SYCC420 = 2,
+	KIND_SYCC422 = 3,
+	KIND_SYCC444 = 4,
+	KIND_CMYK = 5,
+	KINDS = 6,
+} KIND;
+
+static const gchar *kind_names[KINDS] = {"rgb", "gray", "sycc420", "sycc422", "sycc444", "cmyk"};
+static const gint sizes[] = {64, 256, 1024, 4096, 16384};
+static const gint precisions[] = {8, 12, 16};
+
+typedef enum {
+	OPERATION_LOAD = 0,  // gdk_pixbuf_new_from_file
+	OPERATION_SCALE = 1, // gdk_pixbuf_new_from_file_at_scale to a quarter of the size
+	OPERATION_ROI = 2,   // the middle half of the image, decoded with opj_set_decode_area and converted
+	OPERATION_SAVE = 3,  // gdk_pixbuf_save of the loaded image
+	OPERATIONS = 4,
+} OPERATION;
+
+static const gchar *operation_names[OPERATIONS] = {"load", "scale", "roi", "save"};
+
+typedef struct {
+	KIND kind;
+	gint size;
+	gint precision;
+	gboolean alpha;
+	gboolean tiled;
+	gboolean ht;    // an HTJ2K twin of the image before it, never generated
+	gchar *name;
+	gchar *path;
+} CorpusImage;
+
+static gchar *corpus = NULL;
+static gint max_size = 1024;
+static gint iterations = 5;
+static gchar *operations = NULL;
+static gchar *filter = NULL;
+static gchar *json = NULL;
+static gchar *baseline = NULL;
+static gdouble threshold = 30.0;
+static FILE *out = NULL; // human readable results, standard error when the JSON goes to standard output
+
+static gdouble calibration_us = 1.0;
+static GHashTable *normalized = NULL; // "image operation" to the median divided by calibration_us, of every scenario that ran
+static volatile guint32 calibration_sink;
+
+static GOptionEntry entries[] =
+{
+	{ "corpus", 'c', 0, G_OPTION_ARG_FILENAME, &corpus, "Directory of the generated corpus (default: benchmark-corpus)", "DIR" },
+	{ "max-size", 's', 0, G_OPTION_ARG_INT, &max_size, "Largest image side to generate and measure, up to 16384 (default: 1024)", "N" },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Runs of every operation on every image (default: 5)", "N" },
+	{ "operations", 'o', 0, G_OPTION_ARG_STRING, &operations, "Comma separated operations: load, scale, roi, save (default: all)", "LIST" },
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only images whose name contains TEXT", "TEXT" },
+	{ "json", 'j', 0, G_OPTION_ARG_FILENAME, &json, "Write the results as JSON to FILE, - for standard output", "FILE" },
+	{ "baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline, "Compare with the JSON results in FILE and fail when a scenario got slower", "FILE" },
+	{ "threshold", 't', 0, G_OPTION_ARG_DOUBLE, &threshold, "Percentage a normalized median may grow over the baseline (default: 30)", "PERCENT" },
+	{ NULL }
+};
+
+// Corpus
+
+static int corpus_colors(KIND kind)
+{
+	switch(kind)
+	{
+		case KIND_GRAY:
+			return 1;
+		case KIND_CMYK:
+			return 4;
+		default:
+			return 3;
+	}
+}
+
+/**
+ * Deterministic content with smooth gradients and some texture, so the codec has something realistic to chew on.
+ */
+static OPJ_INT32 corpus_sample(gint x, gint y, gint width, gint height, int component, int precision)
+{
+	guint32 max = (1u << precision) - 1;
+	guint64 gradient = ((guint64) x * max / (guint64) MAX(width, 1) + (guint64) y * max / (guint64) MAX(height, 1)) / 2;
+	guint32 texture = (((guint32) x * 7u) ^ ((guint32) y * 13u) ^ ((guint32) component * 61u)) & 31u;
+
+	return (OPJ_INT32) MIN(max, (guint32) gradient + (texture << (precision - 8)));
+}
+
+/**
+ * Encode image with libopenjp2, lossy at 10:1 like a typical photo, with the tiling the module writes with tile-size.
+ */
+static gboolean corpus_encode_opj(const CorpusImage *image, const gchar *path, GError **error)
+{
+	int colors = corpus_colors(image->kind);
+	int count = colors + (image->alpha ? 1 : 0);
+	opj_image_cmptparm_t parameters[5];
+	opj_cparameters_t cparameters;
+	opj_image_t *opj_image;
+	opj_codec_t *codec;
+	opj_stream_t *stream;
+	OPJ_COLOR_SPACE color_space;
+	gboolean ok;
+
+	memset(parameters, 0, sizeof(parameters));
+
+	for(int i = 0; i < count; i++)
+	{
+		gboolean chroma = (i == 1 || i == 2) && image->kind != KIND_RGB && image->kind != KIND_CMYK;
+
+		parameters[i].dx = chroma && (image->kind == KIND_SYCC420 || image->kind == KIND_SYCC422) ? 2 : 1;
+		parameters[i].dy = chroma && image->kind == KIND_SYCC420 ? 2 : 1;
+		parameters[i].w = (OPJ_UINT32) (image->size + (gint) parameters[i].dx - 1) / parameters[i].dx;
+		parameters[i].h = (OPJ_UINT32) (image->size + (gint) parameters[i].dy - 1) / parameters[i].dy;
+		parameters[i].prec = (OPJ_UINT32) image->precision;
+		parameters[i].sgnd = 0;
+	}
+
+	switch(image->kind)
+	{
+		case KIND_GRAY:
+			color_space = OPJ_CLRSPC_GRAY;
+			break;
+		case KIND_CMYK:
+			color_space = OPJ_CLRSPC_CMYK;
+			break;
+		case KIND_RGB:
+			color_space = OPJ_CLRSPC_SRGB;
+			break;
+		default:
+			color_space = OPJ_CLRSPC_SYCC;
+			break;
+	}
+
+	opj_image = opj_image_create((OPJ_UINT32) count, parameters, color_space);
+	if(!opj_image)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Failed to create %s", image->name);
+		return FALSE;
+	}
+
+	opj_image->x0 = 0;
+	opj_image->y0 = 0;
+	opj_image->x1 = (OPJ_UINT32) image->size;
+	opj_image->y1 = (OPJ_UINT32) image->size;
+
+	for(int i = 0; i < count; i++)
+	{
+		opj_image_comp_t *component = &opj_image->comps[i];
+
+		component->alpha = (OPJ_UINT16) (image->alpha && i == count - 1);
+
+		for(OPJ_UINT32 y = 0; y < component->h; y++)
+		{
+			for(OPJ_UINT32 x = 0; x < component->w; x++)
+			{
+				component->data[(gsize) y * component->w + x] = corpus_sample((gint) x, (gint) y, (gint) component->w, (gint) component->h, i, image->precision);
+			}
+		}
+	}
+
+	opj_set_default_encoder_parameters(&cparameters);
+	cparameters.tcp_numlayers = 1;
+	cparameters.tcp_rates[0] = 10;
+	cparameters.cp_disto_alloc = 1;
+	cparameters.irreversible = 1;
+	cparameters.numresolution = BENCHMARK_RESOLUTIONS;
+	cparameters.tcp_mct = (char) (image->kind == KIND_RGB ? 1 : 0);
+
+	if(image->tiled)
+	{
+		cparameters.tile_size_on = OPJ_TRUE;
+		cparameters.cp_tdx = BENCHMARK_TILE_SIZE;
+		cparameters.cp_tdy = BENCHMARK_TILE_SIZE;
+	}
+
+	codec = opj_create_compress(OPJ_CODEC_JP2);
+	stream = opj_stream_create_default_file_stream(path, OPJ_FALSE);
+
+	ok = codec && stream &&
+		opj_setup_encoder(codec, &cparameters, opj_image) &&
+		opj_start_compress(codec, opj_image, stream) &&
+		opj_encode(codec, stream) &&
+		opj_end_compress(codec, stream);
+
+	util_destroy(codec, stream, opj_image);
+
+	if(!ok)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to encode %s", image->name);
+	}
+
+	return ok;
+}
+
+/**
+ * Encode an 8 bit RGB or RGBA image through the module.
+ */
+static gboolean corpus_encode_pixbuf(const CorpusImage *image, const gchar *path, GError **error)
+{
+	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, image->alpha, 8, image->size, image->size);
+	int channels;
+	gchar tile_size[16];
+	gboolean ok;
+
+	if(!pixbuf)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Failed to create %s", image->name);
+		return FALSE;
+	}
+
+	channels = gdk_pixbuf_get_n_channels(pixbuf);
+
+	for(gint y = 0; y < image->size; y++)
+	{
+		guchar *row = gdk_pixbuf_get_pixels(pixbuf) + (gsize) y * (gsize) gdk_pixbuf_get_rowstride(pixbuf);
+
+		for(gint x = 0; x < image->size; x++)
+		{
+			for(int i = 0; i < channels; i++)
+			{
+				row[x * channels + i] = (guchar) corpus_sample(x, y, image->size, image->size, i, 8);
+			}
+		}
+	}
+
+	g_snprintf(tile_size, sizeof(tile_size), "%d", BENCHMARK_TILE_SIZE);
+
+	if(image->tiled)
+	{
+		ok = gdk_pixbuf_save(pixbuf, path, "jp2", error, "tile-size", tile_size, NULL);
+	} else {
+		ok = gdk_pixbuf_save(pixbuf, path, "jp2", error, NULL);
+	}
+
+	g_object_unref(pixbuf);
+
+	return ok;
+}
+
+/**
+ * Every combination up to max_size, CMYK has no alpha. Tiling only makes a difference above one tile.
+ */
+static void corpus_list(GPtrArray *images, const gchar *directory)
+{
+	for(gsize s = 0; s < G_N_ELEMENTS(sizes) && sizes[s] <= max_size; s++)
+	{
+		for(int kind = 0; kind < KINDS; kind++)
+		{
+			for(gsize p = 0; p < G_N_ELEMENTS(precisions); p++)
+			{
+				for(int alpha = 0; alpha <= (kind == KIND_CMYK ? 0 : 1); alpha++)
+				{
+					for(int tiled = 0; tiled <= (sizes[s] > BENCHMARK_TILE_SIZE ? 1 : 0); tiled++)
+					{
+						CorpusImage *image = g_new0(CorpusImage, 1);
+						gchar *file, *twin;
+
+						image->kind = (KIND) kind;
+						image->size = sizes[s];
+						image->precision = precisions[p];
+						image->alpha = alpha;
+						image->tiled = tiled;
+						image->name = g_strdup_printf("%s%s-%d-%d%s", kind_names[kind], alpha ? "a" : "", image->precision, image->size, tiled ? "-tiled" : "");
+
+						if(filter && !strstr(image->name, filter))
+						{
+							g_free(image->name);
+							g_free(image);
+							continue;
+						}
+
+						file = g_strconcat(image->name, ".jp2", NULL);
+						image->path = g_build_filename(directory, file, NULL);
+						g_free(file);
+
+						g_ptr_array_add(images, image);
+
+						file = g_strconcat(image->name, ".jph", NULL);
+						twin = g_build_filename(directory, file, NULL);
+						g_free(file);
+
+						if(g_file_test(twin, G_FILE_TEST_IS_REGULAR))
+						{
+							CorpusImage *ht = g_new0(CorpusImage, 1);
+
+							*ht = *image;
+							ht->ht = TRUE;
+							ht->name = g_strconcat(image->name, "-ht", NULL);
+							ht->path = twin;
+							g_ptr_array_add(images, ht);
+						} else {
+							g_free(twin);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Encode the images that aren't in the corpus yet. Each is written under a temporary name and renamed when complete,
+ * so an interrupted run never leaves a truncated image behind.
+ */
+static gboolean corpus_generate(GPtrArray *images, GError **error)
+{
+	for(guint i = 0; i < images->len; i++)
+	{
+		const CorpusImage *image = g_ptr_array_index(images, i);
+		gchar *partial;
+		gboolean ok;
+
+		if(g_file_test(image->path, G_FILE_TEST_EXISTS))
+		{
+			continue;
+		}
+
+		g_printerr("Generating %s\n", image->name);
+		partial = g_strconcat(image->path, ".partial", NULL);
+
+		if(image->kind == KIND_RGB && image->precision == 8)
+		{
+			ok = corpus_encode_pixbuf(image, partial, error);
+		} else {
+			ok = corpus_encode_opj(image, partial, error);
+		}
+
+		if(ok && g_rename(partial, image->path) != 0)
+		{
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to rename '%s'", partial);
+			ok = FALSE;
+		}
+
+		if(!ok)
+		{
+			g_remove(partial);
+		}
+
+		g_free(partial);
+
+		if(!ok)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void corpus_free(gpointer data)
+{
+	CorpusImage *image = (CorpusImage *) data;
+
+	g_free(image->name);
+	g_free(image->path);
+	g_free(image);
+}
+
+// Operations
+
+/**
+ * Decode the middle half of the file at path and convert it like the module does, returning the pixels converted.
+ */
+static guint64 run_roi(const gchar *path, GError **error)
+{
+	FILE *fp = g_fopen(path, "rb");
+	opj_dparameters_t parameters;
+	opj_codec_t *codec = NULL;
+	opj_image_t *image = NULL;
+	opj_stream_t *stream = NULL;
+	int components = -1;
+	COLOR_SPACE colorspace = -1;
+	guint8 *data;
+	guint64 pixels;
+
+	if(!fp)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "Failed to open %s", path);
+		return 0;
+	}
+
+	opj_set_default_decoder_parameters(&parameters);
+	stream = util_create_stream(fp, OPJ_TRUE);
+	codec = opj_create_decompress(OPJ_CODEC_JP2);
+
+	if(!stream || !codec || !opj_setup_decoder(codec, &parameters) || !opj_read_header(stream, codec, &image) ||
+		!opj_set_decode_area(codec, image, (OPJ_INT32) (image->x1 / 4), (OPJ_INT32) (image->y1 / 4), (OPJ_INT32) (image->x1 - image->x1 / 4), (OPJ_INT32) (image->y1 - image->y1 / 4)) ||
+		!opj_decode(codec, stream, image) || !opj_end_decompress(codec, stream))
+	{
+		util_destroy(codec, stream, image);
+		fclose(fp);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode the region of %s", path);
+		return 0;
+	}
+
+	util_destroy(codec, stream, NULL);
+	fclose(fp);
+
+	if(!color_info(image, &components, &colorspace))
+	{
+		util_destroy(NULL, NULL, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unsupported colorspace in %s", path);
+		return 0;
+	}
+
+	pixels = (guint64) image->comps[0].w * image->comps[0].h;
+	data = g_malloc(pixels * (guint64) components);
+	color_convert(image, colorspace, data);
+
+	g_free(data);
+	util_destroy(NULL, NULL, image);
+
+	return pixels;
+}
+
+/**
+ * Run operation once on image, returning the pixels it produced or 0 with error set.
+ */
+static guint64 run(OPERATION operation, const CorpusImage *image, GdkPixbuf *loaded, const gchar *save_path, GError **error)
+{
+	GdkPixbuf *pixbuf = NULL;
+	guint64 pixels = 0;
+
+	switch(operation)
+	{
+		case OPERATION_LOAD:
+			pixbuf = gdk_pixbuf_new_from_file(image->path, error);
+			break;
+		case OPERATION_SCALE:
+			pixbuf = gdk_pixbuf_new_from_file_at_scale(image->path, MAX(image->size / 4, 1), MAX(image->size / 4, 1), TRUE, error);
+			break;
+		case OPERATION_ROI:
+			return run_roi(image->path, error);
+		case OPERATION_SAVE:
+			if(!gdk_pixbuf_save(loaded, save_path, "jp2", error, NULL))
+			{
+				return 0;
+			}
+			return (guint64) gdk_pixbuf_get_width(loaded) * (guint64) gdk_pixbuf_get_height(loaded);
+		default:
+			return 0;
+	}
+
+	if(pixbuf)
+	{
+		pixels = (guint64) gdk_pixbuf_get_width(pixbuf) * (guint64) gdk_pixbuf_get_height(pixbuf);
+		g_object_unref(pixbuf);
+	}
+
+	return pixels;
+}
+
+// Calibration
+
+/**
+ * Best time in microseconds of a fixed mix of integer work and memory traffic over more than the L2 cache.
+ * Decoding slows down and speeds up with the machine about as much as this loop does, so medians divided by it compare
+ * between machines, and between runs on a busy one.
+ */
+static gdouble calibrate(void)
+{
+	guint32 *words = g_new0(guint32, CALIBRATION_WORDS);
+	guint32 state = 2463534242u;
+	gint64 best = G_MAXINT64;
+
+	for(int run = 0; run < CALIBRATION_RUNS; run++)
+	{
+		gint64 start = g_get_monotonic_time();
+
+		for(int pass = 0; pass < CALIBRATION_PASSES; pass++)
+		{
+			for(gsize i = 0; i < CALIBRATION_WORDS; i++)
+			{
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				words[i] = words[i] * 31u + state;
+			}
+		}
+
+		best = MIN(best, g_get_monotonic_time() - start);
+	}
+
+	// Keep the compiler from dropping the loop
+	calibration_sink = words[state % CALIBRATION_WORDS];
+	g_free(words);
+
+	return (gdouble) MAX(best, 1);
+}
+
+// Results
+
+static int compare_durations(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * The q-th quantile of sorted durations, nearest rank.
+ */
+static gint64 percentile(const gint64 *durations, guint count, gdouble q)
+{
+	guint rank = (guint) (q * (count - 1) + 0.5);
+
+	return durations[MIN(rank, count - 1)];
+}
+
+static void report(GString *results, const CorpusImage *image, OPERATION operation, guint64 pixels, gint64 *durations, guint count, const GError *error)
+{
+	gboolean first = results->len == 0;
+
+	g_string_append_printf(results, "%s\n    {\"image\": \"%s\", \"operation\": \"%s\", \"kind\": \"%s\", \"size\": %d, \"precision\": %d, \"alpha\": %s, \"tiled\": %s",
+		first ? "" : ",", image->name, operation_names[operation], kind_names[image->kind], image->size, image->precision,
+		image->alpha ? "true" : "false", image->tiled ? "true" : "false");
+
+	if(error || count == 0)
+	{
+		gchar *message = g_strescape(error ? error->message : "Nothing was produced", NULL);
+
+		g_string_append_printf(results, ", \"error\": \"%s\"}", message);
+		fprintf(out, "%-28s %-6s  error: %s\n", image->name, operation_names[operation], message);
+		g_free(message);
+		return;
+	}
+
+	qsort(durations, count, sizeof(gint64), compare_durations);
+
+	gint64 p50 = percentile(durations, count, 0.5), p90 = percentile(durations, count, 0.9), p99 = percentile(durations, count, 0.99);
+	gdouble mpix = p50 > 0 ? (gdouble) pixels / (gdouble) p50 : 0.0; // pixels per microsecond is MPix/s
+
+	gdouble *score = g_new(gdouble, 1);
+
+	*score = (gdouble) p50 / calibration_us;
+
+	g_string_append_printf(results, ", \"pixels\": %" G_GUINT64_FORMAT ", \"iterations\": %u, \"mpix_per_s\": %.3f, \"p50_us\": %" G_GINT64_FORMAT ", \"p90_us\": %" G_GINT64_FORMAT ", \"p99_us\": %" G_GINT64_FORMAT ", \"normalized\": %.6f}",
+		pixels, count, mpix, p50, p90, p99, *score);
+	g_hash_table_insert(normalized, g_strdup_printf("%s %s", image->name, operation_names[operation]), score);
+	fprintf(out, "%-28s %-6s %10.2f MPix/s  p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms\n", image->name, operation_names[operation], mpix, p50 / 1000.0, p90 / 1000.0, p99 / 1000.0);
+}
+
+// Baseline
+
+/**
+ * Read the normalized medians of a previous --json run into a table from "image operation" to gdouble.
+ * Only what this program writes is understood: one result per line, image and operation first and normalized last.
+ */
+static GHashTable *baseline_read(const gchar *path, GError **error)
+{
+	GHashTable *table;
+	GRegex *regex;
+	gchar *contents;
+	gchar **lines;
+
+	if(!g_file_get_contents(path, &contents, NULL, error))
+	{
+		return NULL;
+	}
+
+	regex = g_regex_new("\"image\": \"([^\"]*)\", \"operation\": \"([^\"]*)\".*\"normalized\": ([0-9.eE+-]+)", 0, 0, NULL);
+	table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	lines = g_strsplit(contents, "\n", -1);
+
+	for(gchar **line = lines; *line; line++)
+	{
+		GMatchInfo *match;
+
+		if(g_regex_match(regex, *line, 0, &match))
+		{
+			gchar *image = g_match_info_fetch(match, 1);
+			gchar *operation = g_match_info_fetch(match, 2);
+			gchar *value = g_match_info_fetch(match, 3);
+			gdouble *score = g_new(gdouble, 1);
+
+			*score = g_ascii_strtod(value, NULL);
+			g_hash_table_insert(table, g_strdup_printf("%s %s", image, operation), score);
+
+			g_free(image);
+			g_free(operation);
+			g_free(value);
+		}
+
+		g_match_info_free(match);
+	}
+
+	g_strfreev(lines);
+	g_regex_unref(regex);
+	g_free(contents);
+
+	return table;
+}
+
+static int compare_keys(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/**
+ * Print every scenario of this run next to the baseline, and those of the baseline that didn't run.
+ * Returns the number of scenarios whose normalized median grew by more than threshold percent.
+ */
+static guint baseline_compare(GHashTable *previous)
+{
+	GPtrArray *keys = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer key;
+	guint regressions = 0;
+
+	g_hash_table_iter_init(&iter, normalized);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		g_ptr_array_add(keys, key);
+	}
+
+	g_hash_table_iter_init(&iter, previous);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		if(!g_hash_table_contains(normalized, key))
+		{
+			g_ptr_array_add(keys, key);
+		}
+	}
+
+	g_ptr_array_sort(keys, compare_keys);
+
+	fprintf(out, "\n%-36s %12s %12s %9s\n", "scenario", "baseline", "current", "change");
+
+	for(guint i = 0; i < keys->len; i++)
+	{
+		const gchar *name = g_ptr_array_index(keys, i);
+		const gdouble *before = g_hash_table_lookup(previous, name);
+		const gdouble *after = g_hash_table_lookup(normalized, name);
+
+		if(!before)
+		{
+			fprintf(out, "%-36s %12s %12.4f %9s  new\n", name, "-", *after, "");
+		}
+		else if(!after)
+		{
+			fprintf(out, "%-36s %12.4f %12s %9s  missing\n", name, *before, "-", "");
+		} else {
+			gdouble change = *before > 0.0 ? (*after / *before - 1.0) * 100.0 : 0.0;
+			const gchar *status = "ok";
+
+			if(change > threshold)
+			{
+				status = "REGRESSED";
+				regressions++;
+			}
+			else if(change < -threshold)
+			{
+				status = "faster";
+			}
+
+			fprintf(out, "%-36s %12.4f %12.4f %+8.1f%%  %s\n", name, *before, *after, change, status);
+		}
+	}
+
+	fprintf(out, "%u of %u scenarios regressed by more than %.1f%%\n", regressions, keys->len, threshold);
+	g_ptr_array_free(keys, TRUE);
+
+	return regressions;
+}
+
+/**
+ * Print how much faster every HTJ2K twin was than its classic image, for every operation both ran.
+ */
+static void ht_compare(GPtrArray *images)
+{
+	gboolean header = FALSE;
+
+	for(guint i = 0; i < images->len; i++)
+	{
+		const CorpusImage *image = g_ptr_array_index(images, i);
+		const CorpusImage *classic = i > 0 ? g_ptr_array_index(images, i - 1) : NULL;
+
+		if(!image->ht || !classic)
+		{
+			continue;
+		}
+
+		for(int operation = 0; operation < OPERATIONS; operation++)
+		{
+			gchar *classic_key = g_strdup_printf("%s %s", classic->name, operation_names[operation]);
+			gchar *ht_key = g_strdup_printf("%s %s", image->name, operation_names[operation]);
+			const gdouble *before = g_hash_table_lookup(normalized, classic_key);
+			const gdouble *after = g_hash_table_lookup(normalized, ht_key);
+
+			if(before && after && *after > 0.0)
+			{
+				if(!header)
+				{
+					fprintf(out, "\n%-28s %-6s %10s\n", "HTJ2K twin", "", "speedup");
+					header = TRUE;
+				}
+
+				fprintf(out, "%-28s %-6s %9.2fx\n", classic->name, operation_names[operation], *before / *after);
+			}
+
+			g_free(classic_key);
+			g_free(ht_key);
+		}
+	}
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	GPtrArray *images;
+	GString *results;
+	gboolean enabled[OPERATIONS];
+	gchar *save_path;
+	GHashTable *previous = NULL;
+	guint regressions = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_set_summary(context, "Measure loading, loading at scale, region decoding and saving of JPEG2000 images over a generated corpus.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(iterations < 1 || max_size < sizes[0] || threshold <= 0.0)
+	{
+		g_printerr("Usage: %s [--corpus DIR] [--max-size N] [--iterations N] [--operations LIST] [--filter TEXT] [--json FILE] [--baseline FILE] [--threshold PERCENT]\n", argv[0]);
+		return 1;
+	}
+
+	for(int i = 0; i < OPERATIONS; i++)
+	{
+		enabled[i] = operations == NULL;
+	}
+
+	if(operations)
+	{
+		gchar **names = g_strsplit(operations, ",", -1);
+
+		for(gchar **name = names; *name; name++)
+		{
+			int i = 0;
+
+			while(i < OPERATIONS && g_ascii_strcasecmp(g_strstrip(*name), operation_names[i]) != 0)
+			{
+				i++;
+			}
+
+			if(i == OPERATIONS)
+			{
+				g_printerr("Unknown operation '%s', expected load, scale, roi or save\n", *name);
+				g_strfreev(names);
+				return 1;
+			}
+
+			enabled[i] = TRUE;
+		}
+
+		g_strfreev(names);
+	}
+
+	if(!corpus)
+	{
+		corpus = g_strdup("benchmark-corpus");
+	}
+
+	out = g_strcmp0(json, "-") == 0 ? stderr : stdout;
+
+	// 77 is what meson counts as a skipped test
+
+	if(baseline)
+	{
+		if(!(previous = baseline_read(baseline, &error)))
+		{
+			g_printerr("%s\n", error->message);
+			return 1;
+		}
+
+		if(g_hash_table_size(previous) == 0)
+		{
+			g_printerr("No results in '%s', record them on the reference machine with --json\n", baseline);
+			g_hash_table_unref(previous);
+			return 77;
+		}
+	}
+
+	if(g_mkdir_with_parents(corpus, 0755) != 0)
+	{
+		g_printerr("Failed to create '%s'\n", corpus);
+		return 1;
+	}
+
+	images = g_ptr_array_new_with_free_func(corpus_free);
+	corpus_list(images, corpus);
+
+	if(!corpus_generate(images, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	save_path = g_build_filename(corpus, "save.jp2", NULL);
+	results = g_string_new(NULL);
+	normalized = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	calibration_us = calibrate();
+
+	fprintf(out, "Calibration loop %.3f ms, normalized results are medians divided by it\n", calibration_us / 1000.0);
+
+	for(guint i = 0; i < images->len; i++)
+	{
+		const CorpusImage *image = g_ptr_array_index(images, i);
+		GdkPixbuf *loaded = NULL;
+
+		for(int operation = 0; operation < OPERATIONS; operation++)
+		{
+			gint64 *durations;
+			guint64 pixels = 0;
+			guint count = 0;
+
+			// Saving encodes with the classic block coder whatever was loaded
+
+			if(!enabled[operation] || (operation == OPERATION_SAVE && image->ht))
+			{
+				continue;
+			}
+
+			if(operation == OPERATION_SAVE && !loaded && !(loaded = gdk_pixbuf_new_from_file(image->path, &error)))
+			{
+				report(results, image, (OPERATION) operation, 0, NULL, 0, error);
+				g_clear_error(&error);
+				continue;
+			}
+
+			// One untimed run to warm the file cache and the loader
+
+			durations = g_new(gint64, iterations);
+
+			if(run((OPERATION) operation, image, loaded, save_path, &error) > 0)
+			{
+				for(count = 0; count < (guint) iterations; count++)
+				{
+					gint64 start = g_get_monotonic_time();
+
+					pixels = run((OPERATION) operation, image, loaded, save_path, &error);
+					durations[count] = g_get_monotonic_time() - start;
+
+					if(error)
+					{
+						break;
+					}
+				}
+			}
+
+			report(results, image, (OPERATION) operation, pixels, durations, count, error);
+			g_clear_error(&error);
+			g_free(durations);
+		}
+
+		g_clear_object(&loaded);
+	}
+
+	g_remove(save_path);
+	g_free(save_path);
+
+	ht_compare(images);
+
+	if(json)
+	{
+		gchar *document = g_strdup_printf("{\n  \"max_size\": %d,\n  \"iterations\": %d,\n  \"calibration_us\": %.0f,\n  \"results\": [%s\n  ]\n}\n", max_size, iterations, calibration_us, results->str);
+
+		if(g_strcmp0(json, "-") == 0)
+		{
+			g_print("%s", document);
+		}
+		else if(!g_file_set_contents(json, document, -1, &error))
+		{
+			g_printerr("%s\n", error->message);
+			g_free(document);
+			return 1;
+		}
+
+		g_free(document);
+	}
+
+	if(previous)
+	{
+		regressions = baseline_compare(previous);
+		g_hash_table_unref(previous);
+	}
+
+	g_hash_table_unref(normalized);
+	g_string_free(results, TRUE);
+	g_ptr_array_unref(images);
+
+	return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,389 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Microbenchmarks of the color conversion kernels on synthetic decoded images, without any I/O or entropy decoding.
+// Every colorspace color_info recognizes is timed through color_convert, and where the image allows it also in place
+// over its first plane and a strip of rows at a time, the ways the loader calls the kernels.
+
+#ifdef __linux__
+	#define _GNU_SOURCE
+	#include <sched.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define HAVE_TSC 1
+#endif
+
+#define STRIP_BYTES 65536 // output per strip, as scale_convert_tile uses
+
+typedef struct {
+	const gchar *name;
+	OPJ_COLOR_SPACE color_space;
+	int numcomps;
+	int precision;
+	int chroma_dx, chroma_dy; // subsampling of components 1 and 2
+	COLOR_SPACE expected;     // what color_info should make of it
+} ColorCase;
+
+static const ColorCase cases[] = {
+	{"rgb", OPJ_CLRSPC_SRGB, 3, 8, 1, 1, COLOR_SPACE_RGB},
+	{"rgba", OPJ_CLRSPC_SRGB, 4, 8, 1, 1, COLOR_SPACE_RGB},
+	{"gray", OPJ_CLRSPC_GRAY, 1, 8, 1, 1, COLOR_SPACE_GRAY},
+	{"graya", OPJ_CLRSPC_GRAY, 2, 8, 1, 1, COLOR_SPACE_GRAY},
+	{"gray12", OPJ_CLRSPC_GRAY, 1, 12, 1, 1, COLOR_SPACE_GRAY12},
+	{"sycc420", OPJ_CLRSPC_SYCC, 3, 8, 2, 2, COLOR_SPACE_SYCC420},
+	{"sycc422", OPJ_CLRSPC_SYCC, 3, 8, 2, 1, COLOR_SPACE_SYCC422},
+	{"sycc444", OPJ_CLRSPC_SYCC, 3, 8, 1, 1, COLOR_SPACE_SYCC444},
+	{"sycc444a", OPJ_CLRSPC_SYCC, 4, 8, 1, 1, COLOR_SPACE_SYCC444},
+	{"cmyk", OPJ_CLRSPC_CMYK, 4, 8, 1, 1, COLOR_SPACE_CMYK},
+};
+
+typedef enum {
+	VARIANT_CONVERT = 0,  // color_convert into a separate buffer
+	VARIANT_IN_PLACE = 1, // color_convert over the first plane, when color_convert_in_place allows it
+	VARIANT_ROWS = 2,     // color_convert_rows a strip at a time, when color_convert_by_rows allows it
+	VARIANTS = 3,
+} VARIANT;
+
+static const gchar *variant_names[VARIANTS] = {"convert", "in-place", "rows"};
+
+static gchar *widths_option = NULL;
+static gint pixels_option = 1 << 22;
+static gint repeat = 20;
+static gboolean stable = FALSE;
+static gint pin = -1;
+static gchar *filter = NULL;
+static gchar *json = NULL;
+static FILE *out = NULL;
+
+static GOptionEntry entries[] =
+{
+	{ "widths", 'w', 0, G_OPTION_ARG_STRING, &widths_option, "Comma separated image widths (default: 64,256,1024,4096)", "LIST" },
+	{ "pixels", 'p', 0, G_OPTION_ARG_INT, &pixels_option, "Pixels per image, the height follows from the width (default: 4194304)", "N" },
+	{ "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Timed runs per kernel, or the most runs with --stable (default: 20)", "N" },
+	{ "stable", 's', 0, G_OPTION_ARG_NONE, &stable, "Repeat until the best of the last runs stops improving by more than 1%", NULL },
+	{ "pin", 'c', 0, G_OPTION_ARG_INT, &pin, "Pin the benchmark to CPU N", "N" },
+	{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only cases whose name contains TEXT", "TEXT" },
+	{ "json", 'j', 0, G_OPTION_ARG_FILENAME, &json, "Write the results as JSON to FILE, - for standard output", "FILE" },
+	{ NULL }
+};
+
+typedef struct {
+	gint64 ns;       // best run
+	guint64 cycles;  // TSC ticks of the best run, 0 without a TSC
+	guint runs;
+} KernelTiming;
+
+/**
+ * Create the image for a case with deterministic samples in range, and a copy of its first plane to restore it from.
+ */
+static opj_image_t *create_image(const ColorCase *c, guint32 width, guint32 height, OPJ_INT32 **plane)
+{
+	opj_image_cmptparm_t parameters[4];
+	opj_image_t *image;
+	guint32 state = 0x2545F491;
+
+	memset(parameters, 0, sizeof(parameters));
+
+	for(int i = 0; i < c->numcomps; i++)
+	{
+		gboolean chroma = i == 1 || i == 2;
+
+		parameters[i].dx = (OPJ_UINT32) (chroma ? c->chroma_dx : 1);
+		parameters[i].dy = (OPJ_UINT32) (chroma ? c->chroma_dy : 1);
+		parameters[i].w = (width + parameters[i].dx - 1) / parameters[i].dx;
+		parameters[i].h = (height + parameters[i].dy - 1) / parameters[i].dy;
+		parameters[i].prec = (OPJ_UINT32) c->precision;
+	}
+
+	image = opj_image_create((OPJ_UINT32) c->numcomps, parameters, c->color_space);
+	if(!image)
+	{
+		return NULL;
+	}
+
+	image->x1 = width;
+	image->y1 = height;
+
+	for(int i = 0; i < c->numcomps; i++)
+	{
+		gsize samples = (gsize) image->comps[i].w * image->comps[i].h;
+
+		for(gsize s = 0; s < samples; s++)
+		{
+			// xorshift, so no kernel gets to branch-predict its clamps
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			image->comps[i].data[s] = (OPJ_INT32) (state & ((1u << c->precision) - 1));
+		}
+	}
+
+	*plane = g_new(OPJ_INT32, (gsize) image->comps[0].w * image->comps[0].h);
+	memcpy(*plane, image->comps[0].data, (gsize) image->comps[0].w * image->comps[0].h * sizeof(OPJ_INT32));
+
+	return image;
+}
+
+static inline guint64 read_cycles(void)
+{
+	#ifdef HAVE_TSC
+		return __rdtsc();
+	#else
+		return 0;
+	#endif
+}
+
+/**
+ * Run variant once, returning its time in nanoseconds and TSC ticks.
+ */
+static gint64 run_once(opj_image_t *image, COLOR_SPACE colorspace, int components, VARIANT variant, guint8 *data, const OPJ_INT32 *plane, guint64 *cycles)
+{
+	gsize width = image->comps[0].w, height = image->comps[0].h;
+	gsize strip = CLAMP(STRIP_BYTES / (width * (gsize) components), 1, height);
+	gint64 start;
+	guint64 start_cycles;
+
+	if(variant == VARIANT_IN_PLACE)
+	{
+		memcpy(image->comps[0].data, plane, width * height * sizeof(OPJ_INT32));
+	}
+
+	start = g_get_monotonic_time();
+	start_cycles = read_cycles();
+
+	switch(variant)
+	{
+		case VARIANT_CONVERT:
+			color_convert(image, colorspace, data);
+			break;
+		case VARIANT_IN_PLACE:
+			color_convert(image, colorspace, (guint8 *) image->comps[0].data);
+			break;
+		case VARIANT_ROWS:
+			for(gsize row = 0; row < height; row += strip)
+			{
+				color_convert_rows(image, colorspace, row, MIN(strip, height - row), data);
+			}
+			break;
+		default:
+			break;
+	}
+
+	*cycles = read_cycles() - start_cycles;
+
+	return (g_get_monotonic_time() - start) * 1000;
+}
+
+/**
+ * Time variant: the best of repeat runs, or with stable, runs until the best of the last ten improves by under 1%.
+ */
+static KernelTiming measure(opj_image_t *image, COLOR_SPACE colorspace, int components, VARIANT variant, guint8 *data, const OPJ_INT32 *plane)
+{
+	KernelTiming best = { G_MAXINT64, 0, 0 };
+	gint64 window_best = G_MAXINT64;
+	guint64 cycles;
+
+	// Warm up caches and page in the output
+
+	run_once(image, colorspace, components, variant, data, plane, &cycles);
+
+	for(guint run = 0; run < (guint) repeat; run++)
+	{
+		gint64 ns = run_once(image, colorspace, components, variant, data, plane, &cycles);
+
+		best.runs++;
+
+		if(ns < best.ns)
+		{
+			best.ns = ns;
+			best.cycles = cycles;
+		}
+
+		if(stable && best.runs % 10 == 0)
+		{
+			if(window_best != G_MAXINT64 && (gdouble) (window_best - best.ns) < 0.01 * (gdouble) window_best)
+			{
+				break;
+			}
+
+			window_best = best.ns;
+		}
+	}
+
+	return best;
+}
+
+static void pin_thread(void)
+{
+	#ifdef __linux__
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(pin, &set);
+
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+		{
+			g_printerr("Failed to pin to CPU %d, running unpinned\n", pin);
+		}
+	#else
+		g_printerr("Pinning is only supported on Linux, running unpinned\n");
+	#endif
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	GString *results = g_string_new(NULL);
+	gchar **widths;
+
+	context = g_option_context_new(NULL);
+	g_option_context_set_summary(context, "Measure the color conversion kernels on synthetic decoded images.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(repeat < 1 || pixels_option < 1)
+	{
+		g_printerr("Usage: %s [--widths LIST] [--pixels N] [--repeat N] [--stable] [--pin CPU] [--filter TEXT] [--json FILE]\n", argv[0]);
+		return 1;
+	}
+
+	if(stable && repeat < 1000)
+	{
+		repeat = 1000;
+	}
+
+	if(pin >= 0)
+	{
+		pin_thread();
+	}
+
+	out = g_strcmp0(json, "-") == 0 ? stderr : stdout;
+	widths = g_strsplit(widths_option ? widths_option : "64,256,1024,4096", ",", -1);
+
+	fprintf(out, "%-10s %-9s %6s %6s %10s %10s %8s %6s\n", "case", "variant", "width", "height", "ns/px", "cycles/px", "GB/s", "runs");
+
+	for(gsize c = 0; c < G_N_ELEMENTS(cases); c++)
+	{
+		if(filter && !strstr(cases[c].name, filter))
+		{
+			continue;
+		}
+
+		for(gchar **w = widths; *w; w++)
+		{
+			guint32 width = (guint32) g_ascii_strtoull(*w, NULL, 10);
+			guint32 height = (guint32) MAX(1, (guint64) pixels_option / MAX(width, 1));
+			OPJ_INT32 *plane = NULL;
+			opj_image_t *image;
+			int components = -1;
+			COLOR_SPACE colorspace = -1;
+			guint8 *data;
+
+			if(width == 0)
+			{
+				continue;
+			}
+
+			image = create_image(&cases[c], width, height, &plane);
+
+			if(!image || !color_info(image, &components, &colorspace) || colorspace != cases[c].expected)
+			{
+				g_printerr("%s is not handled as expected, skipped\n", cases[c].name);
+				util_destroy(NULL, NULL, image);
+				g_free(plane);
+				continue;
+			}
+
+			data = g_malloc((gsize) width * height * (gsize) components);
+
+			for(int variant = 0; variant < VARIANTS; variant++)
+			{
+				KernelTiming timing;
+				guint64 pixels = (guint64) width * height;
+				guint64 bytes = (guint64) width * height * (guint64) components;
+
+				if((variant == VARIANT_IN_PLACE && !color_convert_in_place(image, colorspace)) || (variant == VARIANT_ROWS && !color_convert_by_rows(image)))
+				{
+					continue;
+				}
+
+				// Bytes moved: every sample read as 32 bits and every output byte written
+
+				for(int i = 0; i < cases[c].numcomps; i++)
+				{
+					bytes += (guint64) image->comps[i].w * image->comps[i].h * sizeof(OPJ_INT32);
+				}
+
+				timing = measure(image, colorspace, components, (VARIANT) variant, data, plane);
+
+				gdouble ns_per_pixel = (gdouble) timing.ns / (gdouble) pixels;
+				gdouble cycles_per_pixel = (gdouble) timing.cycles / (gdouble) pixels;
+				gdouble gb_per_s = timing.ns > 0 ? (gdouble) bytes / (gdouble) timing.ns : 0.0;
+
+				fprintf(out, "%-10s %-9s %6u %6u %10.3f %10.3f %8.2f %6u\n", cases[c].name, variant_names[variant], width, height, ns_per_pixel, cycles_per_pixel, gb_per_s, timing.runs);
+
+				g_string_append_printf(results, "%s\n    {\"case\": \"%s\", \"variant\": \"%s\", \"width\": %u, \"height\": %u, \"ns_per_pixel\": %.4f, \"cycles_per_pixel\": %.4f, \"gb_per_s\": %.3f, \"runs\": %u}",
+					results->len ? "," : "", cases[c].name, variant_names[variant], width, height, ns_per_pixel, cycles_per_pixel, gb_per_s, timing.runs);
+			}
+
+			g_free(data);
+			g_free(plane);
+			util_destroy(NULL, NULL, image);
+		}
+	}
+
+	if(json)
+	{
+		gchar *document = g_strdup_printf("{\n  \"tsc\": %s,\n  \"pinned\": %d,\n  \"results\": [%s\n  ]\n}\n",
+			read_cycles() ? "true" : "false", pin, results->str);
+
+		if(g_strcmp0(json, "-") == 0)
+		{
+			g_print("%s", document);
+		}
+		else if(!g_file_set_contents(json, document, -1, &error))
+		{
+			g_printerr("%s\n", error->message);
+			g_free(document);
+			return 1;
+		}
+
+		g_free(document);
+	}
+
+	g_strfreev(widths);
+	g_string_free(results, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,520 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Stress and scaling test of concurrent loading, which fill_info allows with GDK_PIXBUF_FORMAT_THREADSAFE.
+// Every fixture is first loaded on one thread to record a checksum of its pixels, then N threads load all of them at
+// once, both with gdk_pixbuf_new_from_file and with GdkPixbufLoader fed in chunks. Every result is checked against the
+// checksum, and throughput is reported for every N, so contention on shared state shows up as poor scaling.
+
+#include <stdio.h>
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#define CHUNK_SIZE 65536 // bytes per gdk_pixbuf_loader_write
+
+typedef enum {
+	MODE_FILE = 0,   // gdk_pixbuf_new_from_file
+	MODE_LOADER = 1, // GdkPixbufLoader, written CHUNK_SIZE bytes at a time
+	MODES = 2,
+} MODE;
+
+static const gchar *mode_names[MODES] = {"file", "loader"};
+
+typedef struct {
+	gchar *path;
+	gchar *name;
+	gchar *contents;
+	gsize length;
+	gchar *checksums[MODES]; // of the single-threaded load
+	guint64 pixels;
+} Fixture;
+
+typedef struct {
+	GPtrArray *fixtures;
+	MODE mode;
+	guint iterations;
+
+	GMutex mutex;
+	GCond cond;
+	gboolean go;     // set once every thread is waiting, so they all start loading together
+	gint loads;      // atomic
+	gint mismatches; // atomic, wrong pixels
+	gint failures;   // atomic, load errors
+	gint64 pixels;   // guarded by mutex
+} Run;
+
+typedef struct {
+	Run *run;
+	guint index;
+} Worker;
+
+static gchar *threads_option = NULL;
+static gint iterations = 10;
+static gchar *modes_option = NULL;
+static gchar *json = NULL;
+static FILE *out = NULL; // human readable results, standard error when the JSON goes to standard output
+
+static GOptionEntry entries[] =
+{
+	{ "threads", 't', 0, G_OPTION_ARG_STRING, &threads_option, "Comma separated thread counts (default: 1, 2, 4 and so on up to twice the processors)", "LIST" },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Loads of every fixture by every thread (default: 10)", "N" },
+	{ "modes", 'm', 0, G_OPTION_ARG_STRING, &modes_option, "Comma separated modes: file, loader (default: both)", "LIST" },
+	{ "json", 'j', 0, G_OPTION_ARG_FILENAME, &json, "Write the results as JSON to FILE, - for standard output", "FILE" },
+	{ NULL }
+};
+
+// Loading
+
+static GdkPixbuf *load(const Fixture *fixture, MODE mode, GError **error)
+{
+	GdkPixbufLoader *loader;
+	GdkPixbuf *pixbuf = NULL;
+	gboolean ok = TRUE;
+
+	if(mode == MODE_FILE)
+	{
+		return gdk_pixbuf_new_from_file(fixture->path, error);
+	}
+
+	loader = gdk_pixbuf_loader_new();
+
+	for(gsize offset = 0; ok && offset < fixture->length; offset += CHUNK_SIZE)
+	{
+		ok = gdk_pixbuf_loader_write(loader, (const guchar *) fixture->contents + offset, MIN(CHUNK_SIZE, fixture->length - offset), error);
+	}
+
+	if(ok && gdk_pixbuf_loader_close(loader, error))
+	{
+		pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+	} else {
+		gdk_pixbuf_loader_close(loader, NULL);
+	}
+
+	g_object_unref(loader);
+
+	return pixbuf;
+}
+
+/**
+ * SHA-256 of the size, layout and pixels of pixbuf, leaving out the padding at the end of the rows.
+ */
+static gchar *checksum(GdkPixbuf *pixbuf)
+{
+	GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+	gint width = gdk_pixbuf_get_width(pixbuf), height = gdk_pixbuf_get_height(pixbuf);
+	gint channels = gdk_pixbuf_get_n_channels(pixbuf), rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+	gchar *header = g_strdup_printf("%dx%dx%d", width, height, channels);
+	gchar *result;
+
+	g_checksum_update(sum, (const guchar *) header, -1);
+
+	for(gint y = 0; y < height; y++)
+	{
+		g_checksum_update(sum, pixels + (gsize) y * (gsize) rowstride, (gssize) width * channels);
+	}
+
+	result = g_strdup(g_checksum_get_string(sum));
+	g_checksum_free(sum);
+	g_free(header);
+
+	return result;
+}
+
+static gpointer worker_main(gpointer data)
+{
+	Worker *worker = (Worker *) data;
+	Run *run = worker->run;
+	guint count = run->fixtures->len;
+	gint64 pixels = 0;
+
+	g_mutex_lock(&run->mutex);
+	while(!run->go)
+	{
+		g_cond_wait(&run->cond, &run->mutex);
+	}
+	g_mutex_unlock(&run->mutex);
+
+	// Every thread starts at a different fixture, so different images are decoded at the same time
+
+	for(guint i = 0; i < run->iterations * count; i++)
+	{
+		const Fixture *fixture = g_ptr_array_index(run->fixtures, (worker->index + i) % count);
+		GError *error = NULL;
+		GdkPixbuf *pixbuf = load(fixture, run->mode, &error);
+		gchar *sum;
+
+		if(!pixbuf)
+		{
+			g_printerr("%s %s: %s\n", mode_names[run->mode], fixture->name, error ? error->message : "no pixbuf");
+			g_clear_error(&error);
+			g_atomic_int_inc(&run->failures);
+			continue;
+		}
+
+		sum = checksum(pixbuf);
+
+		if(strcmp(sum, fixture->checksums[run->mode]) != 0)
+		{
+			g_printerr("%s %s: pixels differ from the single-threaded load on thread %u\n", mode_names[run->mode], fixture->name, worker->index);
+			g_atomic_int_inc(&run->mismatches);
+		}
+
+		pixels += (gint64) fixture->pixels;
+		g_atomic_int_inc(&run->loads);
+
+		g_free(sum);
+		g_object_unref(pixbuf);
+	}
+
+	g_mutex_lock(&run->mutex);
+	run->pixels += pixels;
+	g_mutex_unlock(&run->mutex);
+
+	return NULL;
+}
+
+/**
+ * Load every fixture iterations times on each of threads threads at once, returning the wall time in microseconds or -1.
+ */
+static gint64 run_threads(Run *run, guint threads)
+{
+	GThread **handles = g_new0(GThread *, threads);
+	Worker *workers = g_new0(Worker, threads);
+	gint64 start;
+	guint started = 0;
+
+	for(guint i = 0; i < threads; i++)
+	{
+		GError *error = NULL;
+
+		workers[i].run = run;
+		workers[i].index = i;
+		handles[i] = g_thread_try_new("jp2-stress", worker_main, &workers[i], &error);
+
+		if(!handles[i])
+		{
+			g_printerr("%s\n", error->message);
+			g_clear_error(&error);
+			break;
+		}
+
+		started++;
+	}
+
+	g_mutex_lock(&run->mutex);
+	start = g_get_monotonic_time();
+	run->go = TRUE;
+	g_cond_broadcast(&run->cond);
+	g_mutex_unlock(&run->mutex);
+
+	for(guint i = 0; i < started; i++)
+	{
+		g_thread_join(handles[i]);
+	}
+
+	g_free(handles);
+	g_free(workers);
+
+	return started == threads ? g_get_monotonic_time() - start : -1;
+}
+
+// Fixtures
+
+static void fixture_free(gpointer data)
+{
+	Fixture *fixture = (Fixture *) data;
+
+	g_free(fixture->path);
+	g_free(fixture->name);
+	g_free(fixture->contents);
+
+	for(int mode = 0; mode < MODES; mode++)
+	{
+		g_free(fixture->checksums[mode]);
+	}
+
+	g_free(fixture);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/**
+ * Add the image at path, or every JPEG2000 image in it when it is a directory.
+ */
+static void fixtures_add(GPtrArray *paths, const gchar *path)
+{
+	static const gchar *suffixes[] = {".jp2", ".jpf", ".j2k", ".j2c"};
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const gchar *name;
+
+	if(!dir)
+	{
+		g_ptr_array_add(paths, g_strdup(path));
+		return;
+	}
+
+	while((name = g_dir_read_name(dir)))
+	{
+		for(gsize i = 0; i < G_N_ELEMENTS(suffixes); i++)
+		{
+			if(g_str_has_suffix(name, suffixes[i]))
+			{
+				g_ptr_array_add(paths, g_build_filename(path, name, NULL));
+				break;
+			}
+		}
+	}
+
+	g_dir_close(dir);
+}
+
+/**
+ * Read every fixture and record the checksums of its single-threaded loads. Fixtures the loader rejects are left out.
+ */
+static GPtrArray *fixtures_load(GPtrArray *paths, const gboolean *enabled)
+{
+	GPtrArray *fixtures = g_ptr_array_new_with_free_func(fixture_free);
+
+	g_ptr_array_sort(paths, compare_names);
+
+	for(guint i = 0; i < paths->len; i++)
+	{
+		Fixture *fixture = g_new0(Fixture, 1);
+		GError *error = NULL;
+		gboolean ok;
+
+		fixture->path = g_strdup(g_ptr_array_index(paths, i));
+		fixture->name = g_path_get_basename(fixture->path);
+		ok = g_file_get_contents(fixture->path, &fixture->contents, &fixture->length, &error);
+
+		for(int mode = 0; ok && mode < MODES; mode++)
+		{
+			GdkPixbuf *pixbuf;
+
+			if(!enabled[mode])
+			{
+				continue;
+			}
+
+			if(!(pixbuf = load(fixture, (MODE) mode, &error)))
+			{
+				ok = FALSE;
+				break;
+			}
+
+			fixture->checksums[mode] = checksum(pixbuf);
+			fixture->pixels = (guint64) gdk_pixbuf_get_width(pixbuf) * (guint64) gdk_pixbuf_get_height(pixbuf);
+			g_object_unref(pixbuf);
+		}
+
+		if(!ok)
+		{
+			g_printerr("Leaving out %s: %s\n", fixture->name, error ? error->message : "no pixbuf");
+			g_clear_error(&error);
+			fixture_free(fixture);
+			continue;
+		}
+
+		g_ptr_array_add(fixtures, fixture);
+	}
+
+	return fixtures;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	GPtrArray *paths, *fixtures;
+	GArray *threads = g_array_new(FALSE, FALSE, sizeof(guint));
+	GString *results = g_string_new(NULL);
+	gboolean enabled[MODES];
+	guint failed = 0;
+
+	context = g_option_context_new("FILE|DIR...");
+	g_option_context_set_summary(context, "Load JPEG2000 images from many threads at once, checking the pixels and measuring how throughput scales.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(argc < 2 || iterations < 1)
+	{
+		g_printerr("Usage: %s [--threads LIST] [--iterations N] [--modes LIST] [--json FILE] FILE|DIR...\n", argv[0]);
+		return 1;
+	}
+
+	for(int mode = 0; mode < MODES; mode++)
+	{
+		enabled[mode] = modes_option == NULL;
+	}
+
+	if(modes_option)
+	{
+		gchar **names = g_strsplit(modes_option, ",", -1);
+
+		for(gchar **name = names; *name; name++)
+		{
+			int mode = 0;
+
+			while(mode < MODES && g_ascii_strcasecmp(g_strstrip(*name), mode_names[mode]) != 0)
+			{
+				mode++;
+			}
+
+			if(mode == MODES)
+			{
+				g_printerr("Unknown mode '%s', expected file or loader\n", *name);
+				g_strfreev(names);
+				return 1;
+			}
+
+			enabled[mode] = TRUE;
+		}
+
+		g_strfreev(names);
+	}
+
+	if(threads_option)
+	{
+		gchar **counts = g_strsplit(threads_option, ",", -1);
+
+		for(gchar **count = counts; *count; count++)
+		{
+			guint value = (guint) CLAMP(g_ascii_strtoull(*count, NULL, 10), 1, 1024);
+			g_array_append_val(threads, value);
+		}
+
+		g_strfreev(counts);
+	} else {
+		guint most = 2 * (guint) MAX(g_get_num_processors(), 1);
+
+		for(guint value = 1; value < most; value *= 2)
+		{
+			g_array_append_val(threads, value);
+		}
+
+		g_array_append_val(threads, most);
+	}
+
+	out = g_strcmp0(json, "-") == 0 ? stderr : stdout;
+
+	paths = g_ptr_array_new_with_free_func(g_free);
+
+	for(gint i = 1; i < argc; i++)
+	{
+		fixtures_add(paths, argv[i]);
+	}
+
+	fixtures = fixtures_load(paths, enabled);
+	g_ptr_array_unref(paths);
+
+	if(fixtures->len == 0)
+	{
+		g_printerr("No fixtures could be loaded\n");
+		return 1;
+	}
+
+	fprintf(out, "%u fixtures, %d iterations, %u processors\n", fixtures->len, iterations, g_get_num_processors());
+	fprintf(out, "%-6s %7s %10s %10s %9s %10s\n", "mode", "threads", "loads/s", "MPix/s", "speedup", "efficiency");
+
+	for(int mode = 0; mode < MODES; mode++)
+	{
+		gdouble single = 0.0;
+
+		if(!enabled[mode])
+		{
+			continue;
+		}
+
+		for(guint t = 0; t < threads->len; t++)
+		{
+			guint count = g_array_index(threads, guint, t);
+			Run run;
+			gint64 elapsed;
+			gdouble loads_per_s, mpix, speedup;
+
+			memset(&run, 0, sizeof(Run));
+			run.fixtures = fixtures;
+			run.mode = (MODE) mode;
+			run.iterations = (guint) iterations;
+			g_mutex_init(&run.mutex);
+			g_cond_init(&run.cond);
+
+			elapsed = run_threads(&run, count);
+
+			g_cond_clear(&run.cond);
+			g_mutex_clear(&run.mutex);
+
+			if(elapsed < 0)
+			{
+				failed++;
+				continue;
+			}
+
+			failed += (guint) (run.mismatches + run.failures);
+
+			// Throughput in loads per second, speedup over the first thread count measured
+
+			loads_per_s = (gdouble) run.loads * 1e6 / (gdouble) MAX(elapsed, 1);
+			mpix = (gdouble) run.pixels / (gdouble) MAX(elapsed, 1);
+			single = single > 0.0 ? single : loads_per_s / count;
+			speedup = single > 0.0 ? loads_per_s / single : 0.0;
+
+			fprintf(out, "%-6s %7u %10.2f %10.2f %8.2fx %9.0f%%%s\n", mode_names[mode], count, loads_per_s, mpix, speedup, speedup * 100.0 / count,
+				run.mismatches || run.failures ? "  FAILED" : "");
+
+			g_string_append_printf(results, "%s\n    {\"mode\": \"%s\", \"threads\": %u, \"loads\": %d, \"elapsed_us\": %" G_GINT64_FORMAT ", \"loads_per_s\": %.3f, \"mpix_per_s\": %.3f, \"speedup\": %.3f, \"mismatches\": %d, \"failures\": %d}",
+				results->len ? "," : "", mode_names[mode], count, run.loads, elapsed, loads_per_s, mpix, speedup, run.mismatches, run.failures);
+		}
+	}
+
+	if(json)
+	{
+		gchar *document = g_strdup_printf("{\n  \"fixtures\": %u,\n  \"iterations\": %d,\n  \"processors\": %u,\n  \"results\": [%s\n  ]\n}\n", fixtures->len, iterations, g_get_num_processors(), results->str);
+
+		if(g_strcmp0(json, "-") == 0)
+		{
+			g_print("%s", document);
+		}
+		else if(!g_file_set_contents(json, document, -1, &error))
+		{
+			g_printerr("%s\n", error->message);
+			g_free(document);
+			return 1;
+		}
+
+		g_free(document);
+	}
+
+	g_string_free(results, TRUE);
+	g_array_unref(threads);
+	g_ptr_array_unref(fixtures);
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <util.h>
+#include <codestream.h>
+
+// Process-wide memory budget for decodes, so several huge images arriving at once can't exhaust memory.
+// Each load estimates its peak from the main header and is admitted once that much of the budget is free.
+
+typedef enum {
+	BUDGET_POLICY_WAIT = 0,   // block until enough of the budget is free
+	BUDGET_POLICY_REDUCE = 1, // decode at the highest resolution that fits
+	BUDGET_POLICY_FAIL = 2,   // fail right away if it doesn't fit
+} BUDGET_POLICY;
+
+static GMutex budget_mutex;
+static GCond budget_cond;
+static guint64 budget_used;
+
+/**
+ * Budget in bytes from GDK_PIXBUF_JP2_MEMORY_BUDGET, with an optional K, M or G suffix. 0 means unlimited.
+ */
+guint64 budget_limit(void)
+{
+	return util_parse_size(g_getenv("GDK_PIXBUF_JP2_MEMORY_BUDGET"), 0);
+}
+
+/**
+ * What to do with a load that doesn't fit, from GDK_PIXBUF_JP2_MEMORY_POLICY: wait, reduce or fail.
+ */
+BUDGET_POLICY budget_policy(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_MEMORY_POLICY");
+
+	if(value && g_ascii_strcasecmp(value, "reduce") == 0)
+	{
+		return BUDGET_POLICY_REDUCE;
+	}
+	else if(value && g_ascii_strcasecmp(value, "fail") == 0)
+	{
+		return BUDGET_POLICY_FAIL;
+	}
+
+	return BUDGET_POLICY_WAIT;
+}
+
+/**
+ * Bytes of the 32 bit component planes of info with the highest reduce resolution levels discarded,
+ * of the whole image or of one tile.
+ */
+guint64 budget_planes(const CodestreamInfo *info, guint reduce, gboolean whole_image)
+{
+	guint64 samples = (info->samples >> (2 * reduce)) + info->components;
+
+	if(!whole_image)
+	{
+		// Share of the samples that falls in one tile
+
+		samples = (guint64) ((gdouble) samples * MIN(1.0, ((gdouble) info->tile_width * info->tile_height) / (((gdouble) info->x1 - info->x0) * ((gdouble) info->y1 - info->y0))));
+	}
+
+	return samples * 4;
+}
+
+/**
+ * Estimate the peak memory of decoding info with the highest reduce resolution levels discarded.
+ *
+ * Component planes are 32 bits per sample. libopenjp2 holds the planes of the whole image only when decoding it in one go,
+ * tile decodes hold one tile's planes per tile in flight. Every tile being decoded also needs about as much again for its
+ * code-blocks and wavelet buffers. The output is counted at 4 bytes per pixel.
+ */
+guint64 budget_estimate(const CodestreamInfo *info, guint reduce, guint tiles_in_flight, gboolean whole_image)
+{
+	guint64 width = (((guint64) info->x1 - info->x0) + (G_GUINT64_CONSTANT(1) << reduce) - 1) >> reduce;
+	guint64 height = (((guint64) info->y1 - info->y0) + (G_GUINT64_CONSTANT(1) << reduce) - 1) >> reduce;
+	guint64 estimate;
+
+	estimate = width * height * 4;
+	estimate += budget_planes(info, reduce, FALSE) * 2 * MAX(tiles_in_flight, 1);
+
+	if(whole_image)
+	{
+		estimate += budget_planes(info, reduce, TRUE);
+	}
+
+	return estimate;
+}
+
+static gchar *budget_format(guint64 size)
+{
+	return g_format_size_full(size, G_FORMAT_SIZE_IEC_UNITS);
+}
+
+static void budget_wake(GCancellable *cancellable, gpointer data)
+{
+	g_mutex_lock(&budget_mutex);
+	g_cond_broadcast(&budget_cond);
+	g_mutex_unlock(&budget_mutex);
+}
+
+/**
+ * Reserve memory for decoding info from the process-wide budget, applying budget_policy when it doesn't fit.
+ * On input *reduce is the reduction the caller asked for, with BUDGET_POLICY_REDUCE it may come back higher.
+ * *cost is what to pass to budget_release once the decode is done, it is 0 when no budget is set.
+ * Cancelling cancellable gives up waiting for the budget.
+ */
+gboolean budget_acquire(const CodestreamInfo *info, guint tiles_in_flight, gboolean whole_image, GCancellable *cancellable, guint *reduce, guint64 *cost, GError **error)
+{
+	guint64 limit = budget_limit();
+	BUDGET_POLICY policy = budget_policy();
+	guint levels = info->resolutions > 0 ? info->resolutions - 1u : 0;
+	gulong handler = 0;
+
+	*cost = 0;
+
+	if(limit == 0)
+	{
+		return TRUE;
+	}
+
+	// Connected before taking the lock, the handler runs right away when already cancelled
+
+	if(cancellable)
+	{
+		handler = g_cancellable_connect(cancellable, G_CALLBACK(budget_wake), NULL, NULL);
+	}
+
+	g_mutex_lock(&budget_mutex);
+
+	*cost = budget_estimate(info, *reduce, tiles_in_flight, whole_image);
+
+	if(policy == BUDGET_POLICY_REDUCE)
+	{
+		guint64 available = limit - MIN(budget_used, limit);
+		guint fits_now = G_MAXUINT, fits_ever = G_MAXUINT;
+
+		// Prefer the least reduction that fits right now, otherwise wait for the least reduction that fits at all
+
+		for(guint r = *reduce; r <= levels && r < 32; r++)
+		{
+			guint64 estimate = budget_estimate(info, r, tiles_in_flight, whole_image);
+
+			if(estimate <= limit && fits_ever == G_MAXUINT)
+			{
+				fits_ever = r;
+			}
+
+			if(estimate <= available)
+			{
+				fits_now = r;
+				break;
+			}
+		}
+
+		if(fits_now != G_MAXUINT)
+		{
+			*reduce = fits_now;
+		}
+		else if(fits_ever != G_MAXUINT)
+		{
+			*reduce = fits_ever;
+		}
+
+		*cost = budget_estimate(info, *reduce, tiles_in_flight, whole_image);
+	}
+
+	if(*cost > limit || (policy == BUDGET_POLICY_FAIL && budget_used + *cost > limit))
+	{
+		gchar *needed = budget_format(*cost);
+		gchar *available = budget_format(*cost > limit ? limit : limit - MIN(budget_used, limit));
+
+		if(*cost > limit)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Decoding this JPEG2000 image needs about %s, more than the whole memory budget of %s", needed, available);
+		} else {
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Decoding this JPEG2000 image needs about %s, but only %s of the memory budget is free", needed, available);
+		}
+
+		g_free(needed);
+		g_free(available);
+		g_mutex_unlock(&budget_mutex);
+		g_cancellable_disconnect(cancellable, handler);
+		*cost = 0;
+		return FALSE;
+	}
+
+	while(budget_used + *cost > limit && !g_cancellable_is_cancelled(cancellable))
+	{
+		g_cond_wait(&budget_cond, &budget_mutex);
+	}
+
+	if(budget_used + *cost > limit)
+	{
+		g_mutex_unlock(&budget_mutex);
+		g_cancellable_disconnect(cancellable, handler);
+		g_cancellable_set_error_if_cancelled(cancellable, error);
+		*cost = 0;
+		return FALSE;
+	}
+
+	budget_used += *cost;
+	g_mutex_unlock(&budget_mutex);
+	g_cancellable_disconnect(cancellable, handler);
+
+	return TRUE;
+}
+
+/**
+ * Return memory reserved by budget_acquire and wake up loads waiting for it.
+ */
+void budget_release(guint64 cost)
+{
+	if(cost == 0)
+	{
+		return;
+	}
+
+	g_mutex_lock(&budget_mutex);
+	budget_used -= MIN(cost, budget_used);
+	g_cond_broadcast(&budget_cond);
+	g_mutex_unlock(&budget_mutex);
+}
+
+#endif
@@ -0,0 +1,409 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <stdio.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+
+#ifdef G_OS_UNIX
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+// On-disk cache of decoded images, enabled by GDK_PIXBUF_JP2_CACHE_SIZE. An entry is named by the SHA-256 of what
+// determines its pixels: the identity of the file, or a hash of the data for images that arrive as a stream, and the
+// resolution level, layers, components and output size of the decode. It holds a small header and the pixels at a
+// page boundary, so a hit maps the entry into the pixbuf without decoding anything. Hits touch the entry, stores
+// evict the entries touched least recently once the directory is over the size limit.
+
+#define CACHE_MAGIC "JP2CACHE"
+#define CACHE_VERSION 1
+#define CACHE_PIXELS_OFFSET 4096 // pixels start on a page boundary
+#define CACHE_HEADER_BYTES 65536 // start of a file that is hashed into its identity
+#define CACHE_STALE_US (G_USEC_PER_SEC * 3600) // age after which leftover temporary files are removed
+
+typedef struct {
+	gchar magic[8];
+	guint32 version;
+	guint32 width, height;
+	guint32 rowstride;
+	guint32 has_alpha;
+	guint32 reserved;
+	guint64 length; // bytes of pixels after CACHE_PIXELS_OFFSET
+} CacheHeader;
+
+typedef struct {
+	gchar *path;
+	gint64 mtime;
+	guint64 size;
+} CacheEntry;
+
+/**
+ * Size limit of the cache in bytes from GDK_PIXBUF_JP2_CACHE_SIZE, with an optional K, M or G suffix. 0 disables it.
+ */
+guint64 cache_limit(void)
+{
+	#ifdef G_OS_UNIX
+		return util_parse_size(g_getenv("GDK_PIXBUF_JP2_CACHE_SIZE"), 0);
+	#else
+		return 0;
+	#endif
+}
+
+/**
+ * Directory of the cache, GDK_PIXBUF_JP2_CACHE_DIR or gdk-pixbuf-jp2 in the user cache directory.
+ */
+gchar *cache_directory(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_CACHE_DIR");
+
+	if(value && *value)
+	{
+		return g_strdup(value);
+	}
+
+	return g_build_filename(g_get_user_cache_dir(), "gdk-pixbuf-jp2", NULL);
+}
+
+/**
+ * Identity of the open file fp: its device, inode, size and times plus a hash of its first bytes, which catches
+ * rewrites within the resolution of the timestamps. Leaves fp at its start. Returns NULL when the cache is off.
+ */
+gchar *cache_identify_file(FILE *fp)
+{
+	#ifdef G_OS_UNIX
+		struct stat st;
+		GChecksum *checksum;
+		guint8 *buffer;
+		gsize length;
+		gchar *identity;
+
+		if(cache_limit() == 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			return NULL;
+		}
+
+		buffer = g_malloc(CACHE_HEADER_BYTES);
+		fseek(fp, 0, SEEK_SET);
+		length = fread(buffer, 1, CACHE_HEADER_BYTES, fp);
+		fseek(fp, 0, SEEK_SET);
+
+		checksum = g_checksum_new(G_CHECKSUM_SHA256);
+		g_checksum_update(checksum, buffer, length);
+
+		identity = g_strdup_printf("file %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s",
+			(guint64) st.st_dev, (guint64) st.st_ino, (guint64) st.st_size, (gint64) st.st_mtime, (gint64) st.st_ctime, g_checksum_get_string(checksum));
+
+		g_checksum_free(checksum);
+		g_free(buffer);
+
+		return identity;
+	#else
+		return NULL;
+	#endif
+}
+
+/**
+ * Identity of an image that only exists as data, the hash of all of it. Returns NULL when the cache is off.
+ */
+gchar *cache_identify_buffer(const guint8 *data, gsize length)
+{
+	gchar *checksum, *identity;
+
+	if(cache_limit() == 0)
+	{
+		return NULL;
+	}
+
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, length);
+	identity = g_strdup_printf("data %" G_GSIZE_FORMAT " %s", length, checksum);
+	g_free(checksum);
+
+	return identity;
+}
+
+/**
+ * Path of the entry for decoding the image identified by identity at reduce, layers and selection into width x height,
+ * where -1 stands for the decoded size. Returns NULL without an identity.
+ */
+gchar *cache_path(const gchar *identity, guint reduce, guint layers, const ColorComponents *selection, gint width, gint height)
+{
+	gchar *key, *checksum, *name, *directory, *path;
+
+	if(!identity)
+	{
+		return NULL;
+	}
+
+	key = g_strdup_printf("%u %s reduce %u layers %u components %d %u %u %u %u %u size %d %d", CACHE_VERSION, identity, reduce, layers,
+		selection->mode, selection->count, selection->indices[0], selection->indices[1], selection->indices[2], selection->indices[3], width, height);
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+	name = g_strconcat(checksum, ".jp2c", NULL);
+	directory = cache_directory();
+	path = g_build_filename(directory, name, NULL);
+
+	g_free(directory);
+	g_free(name);
+	g_free(checksum);
+	g_free(key);
+
+	return path;
+}
+
+static void cache_unmap(guchar *pixels, gpointer data)
+{
+	g_mapped_file_unref((GMappedFile *) data);
+}
+
+/**
+ * Pixbuf mapped from the entry at path, NULL when there is none or it doesn't hold a whole image.
+ * The mapping is private, so changing the pixels never touches the entry.
+ */
+GdkPixbuf *cache_lookup(const gchar *path)
+{
+	GMappedFile *file;
+	const CacheHeader *header;
+	const gchar *contents;
+	gsize length, size, rowstride;
+	GdkPixbuf *pixbuf;
+
+	if(!path)
+	{
+		return NULL;
+	}
+
+	file = g_mapped_file_new(path, TRUE, NULL);
+	if(!file)
+	{
+		return NULL;
+	}
+
+	contents = g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+	header = (const CacheHeader *) contents;
+
+	if(length < CACHE_PIXELS_OFFSET || memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != CACHE_VERSION ||
+		header->width == 0 || header->height == 0 || header->width > G_MAXINT || header->height > G_MAXINT ||
+		!util_pixels_size(header->width, header->height, header->has_alpha ? 4 : 3, &size, &rowstride) ||
+		header->rowstride != rowstride || header->length != size || length - CACHE_PIXELS_OFFSET < size)
+	{
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+
+	pixbuf = gdk_pixbuf_new_from_data((guchar *) contents + CACHE_PIXELS_OFFSET, GDK_COLORSPACE_RGB, header->has_alpha != 0, 8,
+		(int) header->width, (int) header->height, (int) header->rowstride, cache_unmap, file);
+
+	// The entry was used just now, which keeps it from being evicted first
+
+	g_utime(path, NULL);
+
+	return pixbuf;
+}
+
+#ifdef G_OS_UNIX
+
+static gboolean cache_write(int fd, const guint8 *data, gsize length)
+{
+	while(length > 0)
+	{
+		gssize written = write(fd, data, length);
+
+		if(written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(written <= 0)
+		{
+			return FALSE;
+		}
+
+		data += written;
+		length -= (gsize) written;
+	}
+
+	return TRUE;
+}
+
+static gint cache_compare(gconstpointer a, gconstpointer b)
+{
+	const CacheEntry *first = (const CacheEntry *) a;
+	const CacheEntry *second = (const CacheEntry *) b;
+
+	return first->mtime < second->mtime ? -1 : first->mtime > second->mtime ? 1 : 0;
+}
+
+/**
+ * Remove the entries touched least recently until directory holds at most limit bytes, never removing keep.
+ * Temporary files left behind by stores that never finished are removed once they are old.
+ */
+static void cache_trim(const gchar *directory, guint64 limit, const gchar *keep)
+{
+	GDir *dir = g_dir_open(directory, 0, NULL);
+	GArray *entries;
+	const gchar *name;
+	guint64 total = 0;
+	gint64 now = g_get_real_time();
+
+	if(!dir)
+	{
+		return;
+	}
+
+	entries = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+
+	while((name = g_dir_read_name(dir)))
+	{
+		gchar *path = g_build_filename(directory, name, NULL);
+		GStatBuf st;
+
+		if(g_stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			g_free(path);
+			continue;
+		}
+
+		if(!g_str_has_suffix(name, ".jp2c"))
+		{
+			if(strstr(name, ".jp2c.") && now - (gint64) st.st_mtime * G_USEC_PER_SEC > CACHE_STALE_US)
+			{
+				g_unlink(path);
+			}
+
+			g_free(path);
+			continue;
+		}
+
+		total += (guint64) st.st_size;
+
+		if(g_strcmp0(path, keep) == 0)
+		{
+			g_free(path);
+			continue;
+		}
+
+		CacheEntry entry = { path, (gint64) st.st_mtime, (guint64) st.st_size };
+		g_array_append_val(entries, entry);
+	}
+
+	g_dir_close(dir);
+	g_array_sort(entries, cache_compare);
+
+	for(guint i = 0; i < entries->len; i++)
+	{
+		CacheEntry *entry = &g_array_index(entries, CacheEntry, i);
+
+		if(total > limit && g_unlink(entry->path) == 0)
+		{
+			total -= entry->size;
+		}
+
+		g_free(entry->path);
+	}
+
+	g_array_free(entries, TRUE);
+}
+
+#endif
+
+/**
+ * Write pixbuf to the entry at path, then evict entries past the size limit. Images that are bigger than the limit
+ * on their own are not stored. Failures are ignored, the cache only ever saves work.
+ */
+void cache_store(const gchar *path, GdkPixbuf *pixbuf)
+{
+	#ifdef G_OS_UNIX
+		guint64 limit = cache_limit();
+		CacheHeader header;
+		guint8 padding[CACHE_PIXELS_OFFSET];
+		gchar *directory, *temporary;
+		gsize size, rowstride;
+		gboolean ok;
+		int fd;
+
+		if(!path || !pixbuf || limit == 0 || gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 || gdk_pixbuf_get_colorspace(pixbuf) != GDK_COLORSPACE_RGB)
+		{
+			return;
+		}
+
+		if(!util_pixels_size((guint64) gdk_pixbuf_get_width(pixbuf), (guint64) gdk_pixbuf_get_height(pixbuf), gdk_pixbuf_get_n_channels(pixbuf), &size, &rowstride) ||
+			(gsize) gdk_pixbuf_get_rowstride(pixbuf) != rowstride || gdk_pixbuf_get_byte_length(pixbuf) < size || CACHE_PIXELS_OFFSET + (guint64) size > limit)
+		{
+			return;
+		}
+
+		directory = g_path_get_dirname(path);
+		if(g_mkdir_with_parents(directory, 0700) != 0)
+		{
+			g_free(directory);
+			return;
+		}
+
+		// Written under a temporary name and renamed, so other processes only ever see whole entries
+
+		temporary = g_strconcat(path, ".XXXXXX", NULL);
+		fd = g_mkstemp(temporary);
+		if(fd < 0)
+		{
+			g_free(temporary);
+			g_free(directory);
+			return;
+		}
+
+		memset(&header, 0, sizeof(CacheHeader));
+		memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+		header.version = CACHE_VERSION;
+		header.width = (guint32) gdk_pixbuf_get_width(pixbuf);
+		header.height = (guint32) gdk_pixbuf_get_height(pixbuf);
+		header.rowstride = (guint32) rowstride;
+		header.has_alpha = gdk_pixbuf_get_has_alpha(pixbuf) ? 1 : 0;
+		header.length = size;
+
+		memset(padding, 0, sizeof(padding));
+		memcpy(padding, &header, sizeof(CacheHeader));
+
+		ok = cache_write(fd, padding, sizeof(padding)) && cache_write(fd, gdk_pixbuf_get_pixels(pixbuf), size);
+		ok = close(fd) == 0 && ok;
+
+		if(!ok || g_rename(temporary, path) != 0)
+		{
+			g_unlink(temporary);
+		} else {
+			cache_trim(directory, limit, path);
+		}
+
+		g_free(temporary);
+		g_free(directory);
+	#else
+		(void) path;
+		(void) pixbuf;
+	#endif
+}
+
+#endif
@@ -0,0 +1,458 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef CODESTREAM_H
+#define CODESTREAM_H
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Markers as defined in ITU-T T.800 Annex A
+
+#define CODESTREAM_SOC 0xFF4F
+#define CODESTREAM_CAP 0xFF50
+#define CODESTREAM_SIZ 0xFF51
+#define CODESTREAM_COD 0xFF52
+#define CODESTREAM_TLM 0xFF55
+#define CODESTREAM_PLM 0xFF57
+#define CODESTREAM_PLT 0xFF58
+#define CODESTREAM_PPM 0xFF60
+#define CODESTREAM_SOT 0xFF90
+#define CODESTREAM_SOD 0xFF93
+#define CODESTREAM_EOC 0xFFD9
+
+// Pcap bit of ITU-T T.814 (HTJ2K), and the code-block style bit in COD for HT code-blocks
+
+#define CODESTREAM_CAP_HT 0x00020000
+#define CODESTREAM_BLOCK_HT 0x40
+
+// Box types as defined in ITU-T T.800 Annex I
+
+#define CODESTREAM_BOX_JP2C 0x6A703263 /* jp2c */
+
+typedef enum {
+	CODESTREAM_OK = 0,
+	CODESTREAM_NEED_MORE = 1, // buffer ends before the first tile-part header does
+	CODESTREAM_INVALID = 2,
+} CODESTREAM_STATUS;
+
+typedef struct {
+	gsize offset;           // offset of SOC from start of file
+	gsize length;           // length of the codestream, including SOC and EOC
+	gsize header_length;    // length of the main header, SOC up to the first SOT
+	guint32 x0, y0, x1, y1; // image area on the reference grid
+	guint32 tile_x0, tile_y0, tile_width, tile_height;
+	guint32 tiles_x, tiles_y;
+	guint16 components;
+	guint8 precision;       // precision of the first component
+	guint64 samples;        // samples in all components together, after subsampling
+	guint8 resolutions;     // decomposition levels + 1, from COD
+	guint16 layers;         // quality layers, from COD
+	guint8 progression;     // progression order, from COD
+	guint8 mct;             // multiple component transform, from COD
+	guint8 block_style;     // code-block style, from COD
+	guint32 capabilities;   // Pcap, from CAP
+	gboolean has_cap;
+	gboolean has_tlm;
+	gboolean has_plm;
+	gboolean has_plt;       // only the first tile-part header is inspected
+	gboolean has_ppm;
+} CodestreamInfo;
+
+static guint16 codestream_read16(const guint8 *p)
+{
+	return (guint16) ((p[0] << 8) | p[1]);
+}
+
+static guint32 codestream_read32(const guint8 *p)
+{
+	return ((guint32) p[0] << 24) | ((guint32) p[1] << 16) | ((guint32) p[2] << 8) | (guint32) p[3];
+}
+
+static guint64 codestream_read64(const guint8 *p)
+{
+	return ((guint64) codestream_read32(p) << 32) | codestream_read32(p + 4);
+}
+
+/**
+ * Find the contiguous codestream in buffer.
+ * For raw codestreams this is the whole buffer, for JP2 family files it is the payload of the first jp2c box.
+ */
+gboolean codestream_locate(const guint8 *buffer, gsize length, gsize *offset, gsize *size)
+{
+	gsize pos = 0;
+
+	if(length >= 2 && codestream_read16(buffer) == CODESTREAM_SOC)
+	{
+		*offset = 0;
+		*size = length;
+		return TRUE;
+	}
+
+	while(pos + 8 <= length)
+	{
+		guint64 box_length = codestream_read32(buffer + pos);
+		guint32 box_type = codestream_read32(buffer + pos + 4);
+		gsize header = 8;
+
+		if(box_length == 1)
+		{
+			if(pos + 16 > length)
+			{
+				return FALSE;
+			}
+			box_length = codestream_read64(buffer + pos + 8);
+			header = 16;
+		}
+		else if(box_length == 0)
+		{
+			box_length = length - pos;
+		}
+
+		// Some writers get the codestream box length wrong, let it run up to the end of the file
+		if(box_type == CODESTREAM_BOX_JP2C && box_length > length - pos)
+		{
+			box_length = length - pos;
+		}
+
+		if(box_length < header || box_length > length - pos)
+		{
+			return FALSE;
+		}
+
+		if(box_type == CODESTREAM_BOX_JP2C)
+		{
+			*offset = pos + header;
+			*size = (gsize) box_length - header;
+			return TRUE;
+		}
+
+		pos += (gsize) box_length;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether the codestream uses the HTJ2K block coder, announced by CAP or the default code-block style.
+ */
+gboolean codestream_is_ht(const CodestreamInfo *info)
+{
+	return (info->has_cap && (info->capabilities & CODESTREAM_CAP_HT)) || (info->block_style & CODESTREAM_BLOCK_HT);
+}
+
+/**
+ * Parse the main header and the first tile-part header of the codestream starting at buffer.
+ * Only fills in the header fields of info, offset and length are left to the caller.
+ */
+CODESTREAM_STATUS codestream_parse(const guint8 *buffer, gsize length, CodestreamInfo *info)
+{
+	gsize pos = 2;
+	gboolean has_siz = FALSE;
+
+	if(length < 2 || codestream_read16(buffer) != CODESTREAM_SOC)
+	{
+		return CODESTREAM_INVALID;
+	}
+
+	// Main header
+
+	for(;;)
+	{
+		guint16 marker, segment;
+		const guint8 *data;
+
+		if(pos + 4 > length)
+		{
+			return CODESTREAM_NEED_MORE;
+		}
+
+		marker = codestream_read16(buffer + pos);
+		if(marker == CODESTREAM_SOT)
+		{
+			break;
+		}
+
+		segment = codestream_read16(buffer + pos + 2);
+		if((marker & 0xFF00) != 0xFF00 || segment < 2)
+		{
+			return CODESTREAM_INVALID;
+		}
+		if(pos + 2 + segment > length)
+		{
+			return CODESTREAM_NEED_MORE;
+		}
+
+		data = buffer + pos + 4;
+
+		switch(marker)
+		{
+			case CODESTREAM_SIZ:
+				if(segment < 41)
+				{
+					return CODESTREAM_INVALID;
+				}
+				info->x1 = codestream_read32(data + 2);
+				info->y1 = codestream_read32(data + 6);
+				info->x0 = codestream_read32(data + 10);
+				info->y0 = codestream_read32(data + 14);
+				info->tile_width = codestream_read32(data + 18);
+				info->tile_height = codestream_read32(data + 22);
+				info->tile_x0 = codestream_read32(data + 26);
+				info->tile_y0 = codestream_read32(data + 30);
+				info->components = codestream_read16(data + 34);
+				info->precision = (data[36] & 0x7F) + 1;
+				if(info->tile_width == 0 || info->tile_height == 0 || info->x1 <= info->x0 || info->y1 <= info->y0)
+				{
+					return CODESTREAM_INVALID;
+				}
+				if(info->components == 0 || segment < 38 + 3 * (gsize) info->components)
+				{
+					return CODESTREAM_INVALID;
+				}
+				info->samples = 0;
+				for(guint16 i = 0; i < info->components; i++)
+				{
+					guint8 dx = data[37 + 3 * i], dy = data[38 + 3 * i];
+
+					if(dx == 0 || dy == 0)
+					{
+						return CODESTREAM_INVALID;
+					}
+
+					info->samples +=
+						(((guint64) info->x1 + dx - 1) / dx - ((guint64) info->x0 + dx - 1) / dx) *
+						(((guint64) info->y1 + dy - 1) / dy - ((guint64) info->y0 + dy - 1) / dy);
+				}
+				info->tiles_x = (guint32) (((guint64) info->x1 - info->tile_x0 + info->tile_width - 1) / info->tile_width);
+				info->tiles_y = (guint32) (((guint64) info->y1 - info->tile_y0 + info->tile_height - 1) / info->tile_height);
+				has_siz = TRUE;
+				break;
+			case CODESTREAM_COD:
+				if(segment < 12)
+				{
+					return CODESTREAM_INVALID;
+				}
+				info->progression = data[1];
+				info->layers = codestream_read16(data + 2);
+				info->mct = data[4];
+				info->resolutions = data[5] + 1;
+				info->block_style = data[8];
+				break;
+			case CODESTREAM_CAP:
+				if(segment >= 6)
+				{
+					info->has_cap = TRUE;
+					info->capabilities = codestream_read32(data);
+				}
+				break;
+			case CODESTREAM_TLM:
+				info->has_tlm = TRUE;
+				break;
+			case CODESTREAM_PLM:
+				info->has_plm = TRUE;
+				break;
+			case CODESTREAM_PPM:
+				info->has_ppm = TRUE;
+				break;
+		}
+
+		pos += 2 + segment;
+	}
+
+	if(!has_siz)
+	{
+		return CODESTREAM_INVALID;
+	}
+
+	info->header_length = pos;
+
+	// First tile-part header, SOT is always 12 bytes
+
+	pos += 12;
+
+	for(;;)
+	{
+		guint16 marker, segment;
+
+		if(pos + 2 > length)
+		{
+			return CODESTREAM_NEED_MORE;
+		}
+
+		marker = codestream_read16(buffer + pos);
+		if(marker == CODESTREAM_SOD)
+		{
+			break;
+		}
+
+		if(pos + 4 > length)
+		{
+			return CODESTREAM_NEED_MORE;
+		}
+
+		segment = codestream_read16(buffer + pos + 2);
+		if((marker & 0xFF00) != 0xFF00 || segment < 2)
+		{
+			return CODESTREAM_INVALID;
+		}
+
+		if(marker == CODESTREAM_PLT)
+		{
+			info->has_plt = TRUE;
+		}
+
+		pos += 2 + segment;
+	}
+
+	return CODESTREAM_OK;
+}
+
+/**
+ * Scan the headers of the codestream in fp without reading any compressed data.
+ * Rewinds fp to the start of the file when done, like util_identify.
+ */
+gboolean codestream_scan(FILE *fp, CodestreamInfo *info)
+{
+	guint8 header[16];
+	guint8 *buffer = NULL;
+	gsize file_length, chunk;
+	CODESTREAM_STATUS status = CODESTREAM_INVALID;
+
+	memset(info, 0, sizeof(CodestreamInfo));
+
+	if(fseek(fp, 0, SEEK_END) != 0)
+	{
+		return FALSE;
+	}
+	file_length = (gsize) ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(fread(header, 1, 2, fp) != 2)
+	{
+		fseek(fp, 0, SEEK_SET);
+		return FALSE;
+	}
+
+	if(codestream_read16(header) == CODESTREAM_SOC)
+	{
+		info->offset = 0;
+		info->length = file_length;
+	} else {
+		// Walk the top level boxes until jp2c, seeking over everything else
+		gsize pos = 0;
+
+		for(;;)
+		{
+			guint64 box_length;
+			gsize box_header = 8, read;
+
+			if(pos + 8 > file_length || fseek(fp, (long) pos, SEEK_SET) != 0 || (read = fread(header, 1, 16, fp)) < 8)
+			{
+				fseek(fp, 0, SEEK_SET);
+				return FALSE;
+			}
+
+			box_length = codestream_read32(header);
+			if(box_length == 1)
+			{
+				// The 64 bit length follows the type
+				if(read < 16)
+				{
+					fseek(fp, 0, SEEK_SET);
+					return FALSE;
+				}
+
+				box_length = codestream_read64(header + 8);
+				box_header = 16;
+			}
+			else if(box_length == 0)
+			{
+				box_length = file_length - pos;
+			}
+
+			if(codestream_read32(header + 4) == CODESTREAM_BOX_JP2C && box_length > file_length - pos)
+			{
+				box_length = file_length - pos;
+			}
+
+			if(box_length < box_header || box_length > file_length - pos)
+			{
+				fseek(fp, 0, SEEK_SET);
+				return FALSE;
+			}
+
+			if(codestream_read32(header + 4) == CODESTREAM_BOX_JP2C)
+			{
+				info->offset = pos + box_header;
+				info->length = (gsize) box_length - box_header;
+				break;
+			}
+
+			pos += (gsize) box_length;
+		}
+	}
+
+	// Most main headers fit in the first chunk, but TLM and PPM can make them arbitrarily large
+
+	for(chunk = MIN(info->length, 65536); chunk > 0; chunk = MIN(info->length, chunk * 2))
+	{
+		buffer = g_realloc(buffer, chunk);
+
+		if(fseek(fp, (long) info->offset, SEEK_SET) != 0 || fread(buffer, 1, chunk, fp) != chunk)
+		{
+			break;
+		}
+
+		status = codestream_parse(buffer, chunk, info);
+		if(status != CODESTREAM_NEED_MORE || chunk == info->length)
+		{
+			break;
+		}
+	}
+
+	g_free(buffer);
+	fseek(fp, 0, SEEK_SET);
+
+	return status == CODESTREAM_OK;
+}
+
+/**
+ * Scan the headers of the codestream in a file that is already in memory, such as a mapped one, like codestream_scan.
+ * Only the pages holding the headers are touched.
+ */
+gboolean codestream_scan_buffer(const guint8 *data, gsize length, CodestreamInfo *info)
+{
+	gsize offset, size;
+
+	memset(info, 0, sizeof(CodestreamInfo));
+
+	if(!codestream_locate(data, length, &offset, &size) || codestream_parse(data + offset, size, info) != CODESTREAM_OK)
+	{
+		return FALSE;
+	}
+
+	info->offset = offset;
+	info->length = size;
+
+	return TRUE;
+}
+
+#endif
@@ -22,6 +22,7 @@
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <openjpeg.h>
+#include <string.h>
 
 typedef enum {
 	COLOR_SPACE_RGB = 1, // r,g,b, alpha optional
@@ -33,6 +34,198 @@ typedef enum {
 	COLOR_SPACE_CMYK = 7, // C, M, Y, K
 } COLOR_SPACE;
 
+typedef enum {
+	COLOR_COMPONENTS_ALL = 0,      // decode every component
+	COLOR_COMPONENTS_GRAY = 1,     // only luma, for images that have a luma component
+	COLOR_COMPONENTS_NO_ALPHA = 2, // everything but alpha
+	COLOR_COMPONENTS_LIST = 3,     // the listed codestream components, shown as gray or RGB with alpha after them
+} COLOR_COMPONENTS;
+
+typedef struct {
+	COLOR_COMPONENTS mode;
+	guint count;            // listed components, for COLOR_COMPONENTS_LIST
+	OPJ_UINT32 indices[4];
+	gboolean mct;           // the codestream uses a multiple component transform, component 0 is then luma
+} ColorComponents;
+
+/*
+ * Parse which components to decode: "gray", "no-alpha" or a comma separated list of up to four component indices.
+ * Returns FALSE for anything else, leaving components set to decode everything.
+ */
+gboolean color_components_parse(const gchar *value, ColorComponents *components)
+{
+	gchar **list;
+	gboolean ok = TRUE;
+
+	components->mode = COLOR_COMPONENTS_ALL;
+	components->count = 0;
+
+	if(!value || !*value)
+	{
+		return FALSE;
+	}
+
+	if(g_ascii_strcasecmp(value, "gray") == 0 || g_ascii_strcasecmp(value, "luma") == 0)
+	{
+		components->mode = COLOR_COMPONENTS_GRAY;
+		return TRUE;
+	}
+
+	if(g_ascii_strcasecmp(value, "no-alpha") == 0)
+	{
+		components->mode = COLOR_COMPONENTS_NO_ALPHA;
+		return TRUE;
+	}
+
+	list = g_strsplit(value, ",", -1);
+
+	for(guint i = 0; list[i] && ok; i++)
+	{
+		gchar *end = NULL;
+		guint64 index = g_ascii_strtoull(list[i], &end, 10);
+
+		ok = i < G_N_ELEMENTS(components->indices) && end != list[i] && *end == '\0' && index < 16384;
+		if(!ok)
+		{
+			break;
+		}
+
+		components->indices[i] = (OPJ_UINT32) index;
+		components->count = i + 1;
+	}
+
+	g_strfreev(list);
+
+	if(!ok || components->count == 0)
+	{
+		components->count = 0;
+		return FALSE;
+	}
+
+	components->mode = COLOR_COMPONENTS_LIST;
+
+	return TRUE;
+}
+
+/*
+ * Set up decoder parameters for decoding a subset of the components.
+ * Channel definitions and palettes refer to all components, so libopenjp2 is told to leave them alone.
+ */
+void color_components_setup(opj_dparameters_t *parameters, const ColorComponents *components)
+{
+	if(components->mode != COLOR_COMPONENTS_ALL)
+	{
+		parameters->flags |= OPJ_DPARAMETERS_IGNORE_PCLR_CMAP_CDEF_FLAG;
+	}
+}
+
+/*
+ * Pick the components of the image read by opj_read_header to decode and pass them to codec.
+ * *subset tells whether anything is left out. libopenjp2 applies no multiple component transform to a subset,
+ * which is why luma only comes from component 0 of sYCC images and of codestreams using such a transform.
+ */
+gboolean color_components_select(opj_codec_t *codec, opj_image_t *image, const ColorComponents *components, gboolean *subset, GError **error)
+{
+	OPJ_UINT32 indices[4];
+	guint count = image->numcomps;
+	gboolean has_alpha = image->numcomps == 2 || (image->numcomps == 4 && image->color_space != OPJ_CLRSPC_CMYK);
+
+	*subset = FALSE;
+
+	switch(components->mode)
+	{
+		case COLOR_COMPONENTS_ALL:
+			return TRUE;
+		case COLOR_COMPONENTS_GRAY:
+			if((image->numcomps >= 3 && (image->color_space == OPJ_CLRSPC_SYCC || components->mct)) || image->numcomps == 2)
+			{
+				indices[0] = 0;
+				count = 1;
+			}
+			break;
+		case COLOR_COMPONENTS_NO_ALPHA:
+			// Leaving out alpha would also leave out the transform the colors need
+			if(has_alpha && !components->mct)
+			{
+				count = image->numcomps - 1;
+
+				for(guint i = 0; i < count; i++)
+				{
+					indices[i] = i;
+				}
+			}
+			break;
+		case COLOR_COMPONENTS_LIST:
+			for(guint i = 0; i < components->count; i++)
+			{
+				if(components->indices[i] >= image->numcomps)
+				{
+					g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Component %u does not exist, the image has %u", components->indices[i], image->numcomps);
+					return FALSE;
+				}
+
+				indices[i] = components->indices[i];
+
+				// Listed components are shown as gray or RGB, which take every plane to be the size of the first
+
+				if(image->comps[indices[i]].dx != image->comps[indices[0]].dx || image->comps[indices[i]].dy != image->comps[indices[0]].dy ||
+					image->comps[indices[i]].w != image->comps[indices[0]].w || image->comps[indices[i]].h != image->comps[indices[0]].h)
+				{
+					g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "Component %u is subsampled differently from component %u, they can't be shown together", indices[i], indices[0]);
+					return FALSE;
+				}
+			}
+			count = components->count;
+			*subset = TRUE;
+			break;
+	}
+
+	if(count < image->numcomps)
+	{
+		*subset = TRUE;
+	}
+
+	if(*subset && !opj_set_decoded_components(codec, count, indices, OPJ_FALSE))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to select components to decode");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * After decoding a subset, drop any components that were left empty and set the colorspace the rest is shown in.
+ */
+void color_components_apply(opj_image_t *image, const ColorComponents *components, gboolean subset)
+{
+	OPJ_UINT32 count = 0;
+
+	if(!subset)
+	{
+		return;
+	}
+
+	for(OPJ_UINT32 i = 0; i < image->numcomps; i++)
+	{
+		if(image->comps[i].data)
+		{
+			image->comps[count++] = image->comps[i];
+		}
+	}
+
+	image->numcomps = count;
+
+	if(count < 3)
+	{
+		image->color_space = OPJ_CLRSPC_GRAY;
+	}
+	else if(components->mode == COLOR_COMPONENTS_LIST)
+	{
+		image->color_space = OPJ_CLRSPC_SRGB;
+	}
+}
+
 /*
  * Sets number of components and colorspace
  */
@@ -126,12 +319,30 @@ gboolean color_info(opj_image_t *image, int *components, COLOR_SPACE *colorspace
 	return TRUE;
 }
 
+/*
+ * Name of colorspace, for messages
+ */
+const gchar *color_space_name(COLOR_SPACE colorspace)
+{
+	switch(colorspace)
+	{
+		case COLOR_SPACE_RGB: return "RGB";
+		case COLOR_SPACE_GRAY: return "gray";
+		case COLOR_SPACE_GRAY12: return "gray 12 bit";
+		case COLOR_SPACE_SYCC420: return "sYCC 4:2:0";
+		case COLOR_SPACE_SYCC422: return "sYCC 4:2:2";
+		case COLOR_SPACE_SYCC444: return "sYCC 4:4:4";
+		case COLOR_SPACE_CMYK: return "CMYK";
+		default: return "unknown";
+	}
+}
+
 /*
  * Converts decoded data from opj_decode RGB to GdkPixbuf RGB
  */
 void color_convert_rgb(opj_image_t *image, guint8 *data)
 {
-	int counter = 0;
+	gsize counter = 0;
 	int max = (1 << image->comps[0].prec) - 1;
 	int adjustR = 0, adjustG = 0, adjustB = 0, adjustA = 0;
 	gboolean has_alpha = (image->numcomps == 4 || image->numcomps == 2);
@@ -145,7 +356,7 @@ void color_convert_rgb(opj_image_t *image, guint8 *data)
 		adjustA = (image->comps[image->numcomps - 1].sgnd ? 1 << (image->comps[image->numcomps - 1].prec - 1) : 0);
 	}
 
-	for(int i = 0; i < (int) image->comps[0].w * (int) image->comps[0].h; i++)
+	for(gsize i = 0; i < (gsize) image->comps[0].w * image->comps[0].h; i++)
 	{
 		data[counter++] = util_clamp(image->comps[0].data[i] + adjustR, max);
 		data[counter++] = util_clamp(image->comps[1].data[i] + adjustG, max);
@@ -163,7 +374,7 @@ void color_convert_rgb(opj_image_t *image, guint8 *data)
  */
 void color_convert_cmyk(opj_image_t *image, guint8 *data)
 {
-	int counter = 0;
+	gsize counter = 0;
 	float C, M, Y, K;
 	float sC, sM, sY, sK;
 
@@ -172,7 +383,7 @@ void color_convert_cmyk(opj_image_t *image, guint8 *data)
 	sY = 1.0F / (float)((1 << image->comps[2].prec) - 1);
 	sK = 1.0F / (float)((1 << image->comps[3].prec) - 1);
 
-	for(int i = 0; i < (int) image->comps[0].w * (int) image->comps[0].h; i++)
+	for(gsize i = 0; i < (gsize) image->comps[0].w * image->comps[0].h; i++)
 	{
 		C = 1.0F - (float)(image->comps[0].data[i]) * sC;
 		M = 1.0F - (float)(image->comps[1].data[i]) * sM;
@@ -191,11 +402,11 @@ void color_convert_cmyk(opj_image_t *image, guint8 *data)
 void color_convert_gray(opj_image_t *image, guint8 *data)
 {
 	int buffer = 0;
-	int counter = 0;
+	gsize counter = 0;
 	int max = (1 << image->comps[0].prec) - 1;
 	gboolean has_alpha = (image->numcomps == 4 || image->numcomps == 2);
 
-	for(int i = 0; i < (int) image->comps[0].w * (int) image->comps[0].h; i++)
+	for(gsize i = 0; i < (gsize) image->comps[0].w * image->comps[0].h; i++)
 	{
 		buffer = util_clamp(image->comps[0].data[i], max);
 
@@ -216,11 +427,11 @@ void color_convert_gray(opj_image_t *image, guint8 *data)
 void color_convert_gray12(opj_image_t *image, guint8 *data)
 {
 	int buffer = 0;
-	int counter = 0;
+	gsize counter = 0;
 	int max = (1 << image->comps[0].prec) - 1;
 	gboolean has_alpha = (image->numcomps == 4 || image->numcomps == 2);
 
-	for(int i = 0; i < (int) image->comps[0].w * (int) image->comps[0].h; i++)
+	for(gsize i = 0; i < (gsize) image->comps[0].w * image->comps[0].h; i++)
 	{
 		buffer = util_clamp(image->comps[0].data[i], max) / 16;
 
@@ -238,7 +449,7 @@ void color_convert_gray12(opj_image_t *image, guint8 *data)
 /*
  * Converts input sYCC to RGB, putting RGB into data
  */
-void color_convert_sycc(guint8 *data, int pos, int offset, int upb, int y, int cb, int cr)
+void color_convert_sycc(guint8 *data, gsize pos, int offset, int upb, int y, int cb, int cr)
 {
 	cb -= offset;
 	cr -= offset;
@@ -278,7 +489,7 @@ void color_convert_sycc420(opj_image_t *image, guint8 *data)
 		size_t j;
 
 		for (j = 0; j < maxw; ++j) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, 0, 0);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, 0, 0);
 			++y;
 		}
 	}
@@ -288,30 +499,30 @@ void color_convert_sycc420(opj_image_t *image, guint8 *data)
 		ny = y + maxw;
 
 		if (offx > 0U) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, 0, 0);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, 0, 0);
 			++y;
-			color_convert_sycc(data, (ny - base)*3, offset, upb, *ny, *cb, *cr);
+			color_convert_sycc(data, (gsize) (ny - base) * 3, offset, upb, *ny, *cb, *cr);
 			++ny;
 		}
 
 		for (j = 0; j < (loopmaxw & ~(size_t)1U); j += 2U) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 
-			color_convert_sycc(data, (ny - base)*3, offset, upb, *ny, *cb, *cr);
+			color_convert_sycc(data, (gsize) (ny - base) * 3, offset, upb, *ny, *cb, *cr);
 			++ny;
-			color_convert_sycc(data, (ny - base)*3, offset, upb, *ny, *cb, *cr);
+			color_convert_sycc(data, (gsize) (ny - base) * 3, offset, upb, *ny, *cb, *cr);
 			++ny;
 			++cb;
 			++cr;
 		}
 		if (j < loopmaxw) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 
-			color_convert_sycc(data, (ny - base)*3, offset, upb, *ny, *cb, *cr);
+			color_convert_sycc(data, (gsize) (ny - base) * 3, offset, upb, *ny, *cb, *cr);
 			++ny;
 			++cb;
 			++cr;
@@ -322,16 +533,16 @@ void color_convert_sycc420(opj_image_t *image, guint8 *data)
 		size_t j;
 
 		for (j = 0U; j < (maxw & ~(size_t)1U); j += 2U) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 			++cb;
 			++cr;
 		}
 		if (j < maxw) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 		}
 	}
 }
@@ -365,20 +576,20 @@ void color_convert_sycc422(opj_image_t *image, guint8 *data)
 		size_t j;
 
 		if (offx > 0U) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, 0, 0);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, 0, 0);
 			++y;
 		}
 
 		for (j = 0U; j < (loopmaxw & ~(size_t)1U); j += 2U) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 			++cb;
 			++cr;
 		}
 		if (j < loopmaxw) {
-			color_convert_sycc(data, (y - base)*3, offset, upb, *y, *cb, *cr);
+			color_convert_sycc(data, (gsize) (y - base) * 3, offset, upb, *y, *cb, *cr);
 			++y;
 			++cb;
 			++cr;
@@ -415,4 +626,121 @@ void color_convert_sycc444(opj_image_t *image, guint8 *data)
 	}
 }
 
+/*
+ * Converts decoded data from opj_decode to GdkPixbuf RGB, using the converter for colorspace
+ */
+void color_convert(opj_image_t *image, COLOR_SPACE colorspace, guint8 *data)
+{
+	switch(colorspace)
+	{
+		case COLOR_SPACE_RGB:
+			color_convert_rgb(image, data);
+			break;
+		case COLOR_SPACE_GRAY:
+			color_convert_gray(image, data);
+			break;
+		case COLOR_SPACE_GRAY12:
+			color_convert_gray12(image, data);
+			break;
+		case COLOR_SPACE_SYCC420:
+			color_convert_sycc420(image, data);
+			break;
+		case COLOR_SPACE_SYCC422:
+			color_convert_sycc422(image, data);
+			break;
+		case COLOR_SPACE_SYCC444:
+			color_convert_sycc444(image, data);
+			break;
+		case COLOR_SPACE_CMYK:
+			color_convert_cmyk(image, data);
+			break;
+	}
+}
+
+/*
+ * Whether color_convert can write its output over the first component plane of image.
+ * Holds for the converters that read every component at the pixel they write, as long as no component is subsampled:
+ * pixel i never writes past byte 4 * i + 3, so it only overwrites samples that were already read.
+ */
+gboolean color_convert_in_place(opj_image_t *image, COLOR_SPACE colorspace)
+{
+	if(colorspace != COLOR_SPACE_RGB && colorspace != COLOR_SPACE_GRAY && colorspace != COLOR_SPACE_GRAY12 && colorspace != COLOR_SPACE_CMYK)
+	{
+		return FALSE;
+	}
+
+	for(OPJ_UINT32 i = 0; i < image->numcomps; i++)
+	{
+		if(!image->comps[i].data || image->comps[i].w != image->comps[0].w || image->comps[i].h != image->comps[0].h)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Whether color_convert_rows can convert image a few rows at a time, which needs every component to have as many rows as the first.
+ */
+gboolean color_convert_by_rows(opj_image_t *image)
+{
+	for(OPJ_UINT32 i = 1; i < image->numcomps; i++)
+	{
+		if(image->comps[i].h != image->comps[0].h)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Converts rows first_row up to first_row + rows of a decoded image into data, packed without padding.
+ * Only for images that pass color_convert_by_rows.
+ */
+void color_convert_rows(opj_image_t *image, COLOR_SPACE colorspace, gsize first_row, gsize rows, guint8 *data)
+{
+	opj_image_t view = *image;
+	opj_image_comp_t *comps = g_newa(opj_image_comp_t, image->numcomps);
+
+	for(OPJ_UINT32 i = 0; i < image->numcomps; i++)
+	{
+		comps[i] = image->comps[i];
+		comps[i].data = image->comps[i].data + first_row * image->comps[i].w;
+		comps[i].h = (OPJ_UINT32) rows;
+	}
+
+	view.comps = comps;
+	view.y0 = image->y0 + (OPJ_UINT32) first_row;
+
+	color_convert(&view, colorspace, data);
+}
+
+/*
+ * Converts a decoded tile and copies it to column x, row y of pixels, rows being rowstride bytes apart.
+ * The tile is converted into scratch first, which is grown as needed and can be reused between tiles.
+ */
+void color_convert_tile(opj_image_t *image, COLOR_SPACE colorspace, int components, guint8 *pixels, gsize rowstride, gsize x, gsize y, guint8 **scratch, gsize *scratch_size)
+{
+	gsize width = image->comps[0].w;
+	gsize height = image->comps[0].h;
+	gsize tile_rowstride = width * (gsize) components;
+
+	if(*scratch_size < tile_rowstride * height)
+	{
+		g_free(*scratch);
+		*scratch_size = tile_rowstride * height;
+		*scratch = g_malloc(*scratch_size);
+	}
+
+	color_convert(image, colorspace, *scratch);
+
+	for(gsize row = 0; row < height; row++)
+	{
+		memcpy(pixels + (y + row) * rowstride + x * (gsize) components, *scratch + row * tile_rowstride, tile_rowstride);
+	}
+}
+
 #endif
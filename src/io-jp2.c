@@ -25,6 +25,16 @@
 #include <string.h>
 #include <util.h>
 #include <color.h>
+#include <codestream.h>
+#include <parallel.h>
+#include <pipeline.h>
+#include <budget.h>
+#include <scale.h>
+#include <latency.h>
+#include <timing.h>
+#include <cache.h>
+#include <mj2.h>
+#include <profile.h>
 
 typedef enum {
 	IS_OUTPUT = 0,
@@ -44,39 +54,153 @@ typedef struct {
 	gpointer user_data;
 	GdkPixbuf *pixbuf;
 	GError **error;
+	GByteArray *buffer;     // everything passed to load_increment so far
+	int components;         // layout of pixbuf, decided by the first tile
+	COLOR_SPACE colorspace;
+	guint8 *scratch;        // tile conversion buffer, reused between tiles
+	gsize scratch_size;
+	gint width, height;     // size asked for by size_func
+	gboolean scaling;       // tiles are shrunk to width x height while converting
+	Scale scale;
+	gsize scale_bytes;      // bytes of scale counted by timing so far, the band grows as tiles need
+	GCancellable *cancellable; // the caller's current cancellable when loading started, if any
+	Timing timing_data;
+	Timing *timing;            // &timing_data when GDK_PIXBUF_JP2_TIMING is set, otherwise NULL
 } JP2Context;
 
-static void free_buffer(guchar *pixels, gpointer data)
+/**
+ * Number of threads to decode with, from GDK_PIXBUF_JP2_THREADS or the number of processors.
+ */
+static guint load_threads(void)
 {
-	g_free(pixels);
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_THREADS");
+
+	if(value && *value)
+	{
+		guint64 threads = g_ascii_strtoull(value, NULL, 10);
+		return (guint) CLAMP(threads, 1, 256);
+	}
+
+	return (guint) MAX(g_get_num_processors(), 1);
 }
 
-static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
+/**
+ * Components to decode, from GDK_PIXBUF_JP2_COMPONENTS: "gray" for luma only, "no-alpha", or a comma separated
+ * list of up to four codestream component indices, shown as gray, gray with alpha, RGB or RGB with alpha.
+ */
+static void load_components(const CodestreamInfo *info, gboolean has_info, ColorComponents *selection)
+{
+	color_components_parse(g_getenv("GDK_PIXBUF_JP2_COMPONENTS"), selection);
+	selection->mct = has_info && info->mct != 0;
+}
+
+/**
+ * Decode a tiled image with one codec per thread over the mapped file.
+ * Returns FALSE without touching error when the file isn't mapped, so the caller falls back to decoding from fp.
+ */
+static gboolean load_parallel(GMappedFile *mapped, int codec_type, const CodestreamInfo *info, guint reduce, guint layers, const ColorComponents *selection, guint threads, GCancellable *cancellable, GdkPixbuf **pixbuf, GError **error)
+{
+	if(!mapped)
+	{
+		return FALSE;
+	}
+
+	*pixbuf = parallel_decode(
+		(const guint8 *) g_mapped_file_get_contents(mapped),
+		g_mapped_file_get_length(mapped),
+		codec_type,
+		info->tiles_x * info->tiles_y,
+		reduce,
+		layers,
+		selection,
+		threads,
+		cancellable,
+		error
+	);
+
+	return TRUE;
+}
+
+/**
+ * Bytes of pixels in pixbuf, for memory accounting.
+ */
+static guint64 load_pixbuf_size(GdkPixbuf *pixbuf)
+{
+	return pixbuf ? (guint64) gdk_pixbuf_get_rowstride(pixbuf) * (guint64) gdk_pixbuf_get_height(pixbuf) : 0;
+}
+
+/**
+ * Whether the tile-parallel decoder handles info, which needs several tiles and either threads or a cancellable,
+ * as opj_decode can't be interrupted between tiles.
+ */
+static gboolean load_is_parallel(const CodestreamInfo *info, gboolean has_info, guint threads, GCancellable *cancellable)
+{
+	guint64 tiles = (guint64) info->tiles_x * info->tiles_y;
+
+	return has_info && (threads > 1 || cancellable) && tiles > 1 && tiles <= G_MAXUINT;
+}
+
+/**
+ * Decode the file in fp, from its mapping when mapped isn't NULL, reduce being the number of highest resolution levels
+ * to discard and layers the number of quality layers to decode, 0 for all.
+ */
+static GdkPixbuf *load_file(FILE *fp, GMappedFile *mapped, int codec_type, const CodestreamInfo *info, gboolean has_info, guint reduce, guint layers, const ColorComponents *selection, guint threads, GCancellable *cancellable, Timing *timing, GError **error)
 {
-	int codec_type;
 	GdkPixbuf *pixbuf = NULL;
 	opj_codec_t *codec = NULL;
 	opj_image_t *image = NULL;
 	opj_stream_t *stream = NULL;
 	opj_dparameters_t parameters;
+	gboolean subset = FALSE;
+	gint64 start = timing_now(timing), begin;
+	guint64 planes;
+
+	if(timing)
+	{
+		timing->decodes++;
+	}
+
+	// Tiled images decode one tile per thread, which scales better than libopenjp2's own code-block threads and works without them
+
+	if(load_is_parallel(info, has_info, threads, cancellable))
+	{
+		// Every worker holds the planes of the tile it decodes
+
+		planes = budget_planes(info, reduce, FALSE) * MIN(threads, (guint64) info->tiles_x * info->tiles_y);
+		timing_alloc(timing, planes);
+
+		if(load_parallel(mapped, codec_type, info, reduce, layers, selection, threads, cancellable, &pixbuf, error))
+		{
+			timing_add(timing, TIMING_DECODE, start);
+			timing_alloc(timing, load_pixbuf_size(pixbuf));
+			timing_free(timing, planes);
+			return pixbuf;
+		}
+
+		timing_free(timing, planes);
+	}
 
 	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = reduce;
+	parameters.cp_layer = layers;
+	color_components_setup(&parameters, selection);
 
-	stream = util_create_stream(fp, IS_INPUT);
-	if(!stream)
+	if(mapped)
 	{
-		util_destroy(codec, stream, image);
-		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to create stream from file pointer");
-		return FALSE;
+		stream = util_create_buffer_stream((const guint8 *) g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped));
+	} else {
+		stream = util_create_stream(fp, IS_INPUT);
 	}
 
-	codec_type = util_identify(fp);
-	if(codec_type < 0)
+	if(!stream)
 	{
 		util_destroy(codec, stream, image);
-		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unknown filetype!");
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to create stream from file pointer");
 		return FALSE;
 	}
+
+	timing_alloc(timing, OPJ_J2K_STREAM_CHUNK_SIZE);
+
 	codec = opj_create_decompress(codec_type);
 
 	#if DEBUG == TRUE
@@ -92,13 +216,17 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 		return FALSE;
 	}
 
-	if(!opj_codec_set_threads(codec, 1))
+	if(!opj_codec_set_threads(codec, opj_has_thread_support() ? (int) threads : 1))
 	{
 		util_destroy(codec, stream, image);
 		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to set thread count");
 		return FALSE;
 	}
 
+	timing_add(timing, TIMING_STREAM, start);
+	start = timing_now(timing);
+	begin = PROFILE_BEGIN();
+
 	if(!opj_read_header(stream, codec, &image))
 	{
 		util_destroy(codec, stream, image);
@@ -106,6 +234,18 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 		return FALSE;
 	}
 
+	planes = util_planes_size(image, reduce);
+	timing_alloc(timing, planes);
+
+	timing_add(timing, TIMING_HEADER, start);
+	PROFILE_MARK(begin, "header", "%ux%u, %u components", image->x1 - image->x0, image->y1 - image->y0, image->numcomps);
+
+	if(!color_components_select(codec, image, selection, &subset, error))
+	{
+		util_destroy(codec, stream, image);
+		return FALSE;
+	}
+
 	/* Optional if decoding the entire image, which is why it's commented out
 	if(!opj_set_decode_area(codec, image, (OPJ_INT32) parameters.DA_x0, (OPJ_INT32) parameters.DA_y0, (OPJ_INT32) parameters.DA_x1, (OPJ_INT32) parameters.DA_y1))
 	{
@@ -115,6 +255,17 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 	}
 	*/
 
+	// Last chance to give up, opj_decode runs to the end once started
+
+	if(g_cancellable_set_error_if_cancelled(cancellable, error))
+	{
+		util_destroy(codec, stream, image);
+		return FALSE;
+	}
+
+	start = timing_now(timing);
+	begin = PROFILE_BEGIN();
+
 	if(!opj_decode(codec, stream, image) && opj_end_decompress(codec, stream))
 	{
 		util_destroy(codec, stream, image);
@@ -124,6 +275,12 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 
 	opj_stream_destroy(stream);
 	opj_destroy_codec(codec);
+	timing_free(timing, OPJ_J2K_STREAM_CHUNK_SIZE);
+
+	color_components_apply(image, selection, subset);
+
+	timing_add(timing, TIMING_DECODE, start);
+	PROFILE_MARK(begin, "decode", "%ux%u, reduce %u, layers %u", image->comps[0].w, image->comps[0].h, reduce, layers);
 
 	// Get components and colorspace needed to convert to RGB
 
@@ -138,33 +295,57 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 
 	// Allocate space for GdkPixbuf RGB
 
-	guint8 *data = g_malloc(sizeof(guint8) * (int) image->comps[0].w * (int) image->comps[0].h * components);
+	gsize size, rowstride;
+	GdkPixbufDestroyNotify destroy;
+	gpointer destroy_data;
+	guint64 threshold = util_mmap_threshold();
+	gboolean in_place;
+	guint8 *data;
+
+	if(!util_pixels_size(image->comps[0].w, image->comps[0].h, components, &size, &rowstride))
+	{
+		util_destroy(NULL, NULL, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Image dimensions are too large");
+		return FALSE;
+	}
+
+	// The output is never larger than the first 32 bit component plane, so when possible it takes that plane over
+	// instead of allocating another buffer. Outputs that should be mapped from disk still get their own.
+
+	in_place = (threshold == 0 || size < threshold) && color_convert_in_place(image, colorspace);
+
+	if(in_place)
+	{
+		data = (guint8 *) image->comps[0].data;
+		destroy = util_free_image_data;
+		destroy_data = NULL;
+	} else {
+		start = timing_now(timing);
+		data = util_alloc_pixels(size, &destroy, &destroy_data);
+		timing_add(timing, TIMING_ALLOCATE, start);
+		timing_alloc(timing, size);
+	}
+
+	if(!data)
+	{
+		util_destroy(NULL, NULL, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Not enough memory to load image");
+		return FALSE;
+	}
 
 	// Convert image to RGB depending on the colorspace
 
-	switch(colorspace)
+	start = timing_now(timing);
+	begin = PROFILE_BEGIN();
+	color_convert(image, colorspace, data);
+
+	timing_add(timing, TIMING_CONVERT, start);
+	PROFILE_MARK(begin, "convert", "%ux%u %s", image->comps[0].w, image->comps[0].h, color_space_name(colorspace));
+
+	if(in_place)
 	{
-		case COLOR_SPACE_RGB:
-			color_convert_rgb(image, data);
-			break;
-		case COLOR_SPACE_GRAY:
-			color_convert_gray(image, data);
-			break;
-		case COLOR_SPACE_GRAY12:
-			color_convert_gray12(image, data);
-			break;
-		case COLOR_SPACE_SYCC420:
-			color_convert_sycc420(image, data);
-			break;
-		case COLOR_SPACE_SYCC422:
-			color_convert_sycc422(image, data);
-			break;
-		case COLOR_SPACE_SYCC444:
-			color_convert_sycc444(image, data);
-			break;
-		case COLOR_SPACE_CMYK:
-			color_convert_cmyk(image, data);
-			break;
+		// Detach the plane from the image, the pixbuf owns it now
+		image->comps[0].data = NULL;
 	}
 
 	pixbuf = gdk_pixbuf_new_from_data(
@@ -174,17 +355,534 @@ static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
 		8,                                    // bits_per_sample (only 8 bit supported, again, why even bother)
 		(int) image->comps[0].w,              // width
 		(int) image->comps[0].h,              // height
-		util_rowstride(image, components),    // rowstride: distance in bytes between row starts
-		free_buffer,                          // destroy function
-		NULL                                  // closure data to pass to the destroy notification function
+		(int) rowstride,                      // rowstride: distance in bytes between row starts
+		destroy,                              // destroy function
+		destroy_data                          // closure data to pass to the destroy notification function
 	);
 
+	// A plane taken over by the output lives on in the pixbuf
+
+	if(in_place)
+	{
+		planes -= MIN(planes, (guint64) image->comps[0].w * image->comps[0].h * sizeof(OPJ_INT32));
+	}
+
 	opj_image_destroy(image);
+	timing_free(timing, planes);
 
 	return pixbuf;
 }
 
-#if FALSE
+/**
+ * Decode the file in fp, or its mapping, within budget microseconds: first at the resolution level and layers the cost model predicts
+ * to fit, no finer than min_reduce, then again at finer ones while the model says the remaining time allows.
+ * A tiled refinement still decoding when the budget is spent is cancelled before its next tile and the coarser image kept.
+ * An untiled one can't be stopped midway, so it is only tried when predicted to take a fraction of the time left.
+ * The picked level and layers of the returned pixbuf are stored in reduce and layers.
+ */
+static GdkPixbuf *load_within(FILE *fp, GMappedFile *mapped, int codec_type, const CodestreamInfo *info, guint min_reduce, const ColorComponents *selection, guint threads, GCancellable *cancellable, gint64 budget, Timing *timing, guint *reduce, guint *layers, GError **error)
+{
+	GdkPixbuf *pixbuf = NULL;
+	gint64 start = g_get_monotonic_time();
+	gboolean tiled = (guint64) info->tiles_x * info->tiles_y > 1;
+	gboolean has_deadline = FALSE;
+	LatencyDeadline deadline;
+	guint r, l;
+
+	latency_pick(info, min_reduce, budget, FALSE, 0, 0, &r, &l);
+
+	do {
+		GdkPixbuf *refined;
+		GError *refine_error = NULL;
+		GCancellable *decode_cancellable = cancellable;
+		gint64 decode_start = g_get_monotonic_time();
+
+		// The first decode always runs to the end, tiled refinements stop at the first tile past the budget
+
+		if(pixbuf && tiled)
+		{
+			if(!has_deadline)
+			{
+				latency_deadline_start(&deadline, cancellable, start + budget);
+				has_deadline = TRUE;
+			}
+
+			decode_cancellable = deadline.cancellable;
+		}
+
+		fseek(fp, 0, SEEK_SET);
+		refined = load_file(fp, mapped, codec_type, info, TRUE, r, l, selection, threads, decode_cancellable, timing, pixbuf ? &refine_error : error);
+
+		if(!refined)
+		{
+			// A failed or overdue refinement still leaves the coarser image, unless the caller cancelled
+
+			if(pixbuf && g_error_matches(refine_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) && !(has_deadline && latency_deadline_expired(&deadline)))
+			{
+				g_propagate_error(error, refine_error);
+				g_clear_object(&pixbuf);
+			}
+
+			g_clear_error(&refine_error);
+			break;
+		}
+
+		latency_calibrate(info, r, l, g_get_monotonic_time() - decode_start);
+
+		if(pixbuf)
+		{
+			timing_free(timing, load_pixbuf_size(pixbuf));
+			g_object_unref(pixbuf);
+		}
+
+		pixbuf = refined;
+		*reduce = r;
+		*layers = l;
+	} while(latency_pick(info, min_reduce, (budget - (g_get_monotonic_time() - start)) / (tiled ? 1 : LATENCY_UNTILED_MARGIN), TRUE, *reduce, *layers, &r, &l));
+
+	if(has_deadline)
+	{
+		latency_deadline_stop(&deadline);
+	}
+
+	return pixbuf;
+}
+
+/**
+ * Fail for HTJ2K codestreams when libopenjp2 is too old to decode them, rather than with whatever it reports.
+ */
+static gboolean load_check_ht(const CodestreamInfo *info, GError **error)
+{
+	if(codestream_is_ht(info) && !util_supports_ht())
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "HTJ2K images need libopenjp2 2.5 or newer, this is %s", opj_version());
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Record on pixbuf which markers info has and the resolution level and layers it was decoded at.
+ */
+static void load_options(GdkPixbuf *pixbuf, const CodestreamInfo *info, gboolean has_info, guint reduce, guint layers)
+{
+	if(has_info)
+	{
+		gdk_pixbuf_set_option(pixbuf, "jp2::tlm", info->has_tlm ? "yes" : "no");
+		gdk_pixbuf_set_option(pixbuf, "jp2::plt", info->has_plt ? "yes" : "no");
+		gdk_pixbuf_set_option(pixbuf, "jp2::ht", codestream_is_ht(info) ? "yes" : "no");
+	}
+
+	if(reduce > 0 || layers > 0)
+	{
+		gchar *value = g_strdup_printf("%u", reduce);
+		gdk_pixbuf_set_option(pixbuf, "jp2::reduce", value);
+		g_free(value);
+	}
+
+	if(layers > 0)
+	{
+		gchar *value = g_strdup_printf("%u", layers);
+		gdk_pixbuf_set_option(pixbuf, "jp2::layers", value);
+		g_free(value);
+	}
+}
+
+/**
+ * Animation of the Motion JPEG 2000 file in fp. The file is mapped rather than read, frames are decoded from it as they're shown.
+ */
+static GdkPixbufAnimation *load_movie(FILE *fp, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new_from_fd(fileno(fp), FALSE, error);
+	GdkPixbufAnimation *animation;
+	GBytes *bytes;
+
+	if(!file)
+	{
+		return NULL;
+	}
+
+	bytes = g_mapped_file_get_bytes(file);
+	g_mapped_file_unref(file);
+
+	animation = mj2_animation_new(bytes, error);
+	g_bytes_unref(bytes);
+
+	return animation;
+}
+
+/**
+ * Load the file in fp. When mapped isn't NULL every header is read from the mapping and libopenjp2 decodes from it too,
+ * so a plain load reads the file once. Files that can't be mapped are identified and scanned through fp.
+ */
+static GdkPixbuf *load_image(FILE *fp, GMappedFile *mapped, GError **error)
+{
+	const guint8 *data = mapped ? (const guint8 *) g_mapped_file_get_contents(mapped) : NULL;
+	gsize length = mapped ? g_mapped_file_get_length(mapped) : 0;
+	int codec_type;
+	guint threads, reduce = 0, layers = 0;
+	guint64 cost = 0;
+	gint64 budget = latency_budget();
+	CodestreamInfo info;
+	ColorComponents selection;
+	gboolean has_info, parallel;
+	GdkPixbuf *pixbuf;
+	GCancellable *cancellable = g_cancellable_get_current(); // pushed by the caller, gdk-pixbuf has no way to pass one
+	Timing timing_data;
+	Timing *timing = timing_begin(&timing_data);
+	gint64 start, begin = PROFILE_BEGIN();
+	gchar *cache = NULL;
+
+	codec_type = mapped ? util_identify_buffer(data, length) : util_identify(fp);
+	PROFILE_MARK(begin, "identify", "%s", codec_type == OPJ_CODEC_JP2 ? "JP2" : codec_type == OPJ_CODEC_J2K ? "J2K" : "unknown");
+
+	if(codec_type < 0)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unknown filetype!");
+		return FALSE;
+	}
+
+	// A Motion JPEG 2000 clip loads as a still image of its first frame
+
+	if(codec_type == OPJ_CODEC_JP2 && (mapped ? mj2_identify_buffer(data, length) : mj2_identify(fp)))
+	{
+		GdkPixbufAnimation *animation = load_movie(fp, error);
+
+		if(!animation)
+		{
+			return NULL;
+		}
+
+		pixbuf = g_object_ref(gdk_pixbuf_animation_get_static_image(animation));
+		g_object_unref(animation);
+
+		return pixbuf;
+	}
+
+	// TLM and PLT markers are picked up by libopenjp2 itself for tile and area decodes, record whether they exist
+	start = timing_now(timing);
+	has_info = mapped ? codestream_scan_buffer(data, length, &info) : codestream_scan(fp, &info);
+	timing_add(timing, TIMING_HEADER, start);
+
+	if(has_info && !load_check_ht(&info, error))
+	{
+		return FALSE;
+	}
+
+	threads = load_threads();
+	load_components(&info, has_info, &selection);
+	parallel = load_is_parallel(&info, has_info, threads, cancellable);
+
+	// A decode within a time budget depends on how fast it went, only full decodes are cached
+
+	if(budget == 0)
+	{
+		gchar *identity = cache_identify_file(fp);
+		cache = cache_path(identity, 0, 0, &selection, -1, -1);
+		g_free(identity);
+
+		pixbuf = cache_lookup(cache);
+		if(pixbuf)
+		{
+			g_free(cache);
+			gdk_pixbuf_set_option(pixbuf, "jp2::cache", "hit");
+			load_options(pixbuf, &info, has_info, 0, 0);
+			timing_attach(timing, pixbuf);
+			timing_log(timing, "load");
+			return pixbuf;
+		}
+	}
+
+	// Reserve the estimated peak memory from the process-wide budget before allocating any of it
+
+	if(has_info && !budget_acquire(&info, parallel ? threads : 1, !parallel, cancellable, &reduce, &cost, error))
+	{
+		g_free(cache);
+		return FALSE;
+	}
+
+	// A time budget trades resolution and quality for speed, which needs the header to predict the cost
+
+	if(budget > 0 && has_info)
+	{
+		pixbuf = load_within(fp, mapped, codec_type, &info, reduce, &selection, threads, cancellable, budget, timing, &reduce, &layers, error);
+	} else {
+		pixbuf = load_file(fp, mapped, codec_type, &info, has_info, reduce, 0, &selection, threads, cancellable, timing, error);
+	}
+
+	budget_release(cost);
+
+	// A memory budget may have decoded at a lower resolution, which isn't what the entry stands for
+
+	if(pixbuf && reduce == 0)
+	{
+		cache_store(cache, pixbuf);
+	}
+	g_free(cache);
+
+	if(pixbuf)
+	{
+		load_options(pixbuf, &info, has_info, reduce, layers);
+	}
+
+	timing_attach(timing, pixbuf);
+	timing_log(timing, "load");
+
+	return pixbuf;
+}
+
+static GdkPixbuf *gdk_pixbuf__jp2_image_load(FILE *fp, GError **error)
+{
+	GMappedFile *mapped = g_mapped_file_new_from_fd(fileno(fp), FALSE, NULL);
+	GdkPixbuf *pixbuf = load_image(fp, mapped, error);
+
+	if(mapped)
+	{
+		g_mapped_file_unref(mapped);
+	}
+
+	return pixbuf;
+}
+
+static GdkPixbufAnimation *gdk_pixbuf__jp2_image_load_animation(FILE *fp, GError **error)
+{
+	GdkPixbuf *pixbuf;
+	GdkPixbufAnimation *animation;
+
+	if(util_identify(fp) == OPJ_CODEC_JP2 && mj2_identify(fp))
+	{
+		return load_movie(fp, error);
+	}
+
+	fseek(fp, 0, SEEK_SET);
+	pixbuf = gdk_pixbuf__jp2_image_load(fp, error);
+
+	if(!pixbuf)
+	{
+		return NULL;
+	}
+
+	animation = gdk_pixbuf_non_anim_new(pixbuf);
+	g_object_unref(pixbuf);
+
+	return animation;
+}
+
+/**
+ * Number of decoded tiles that may wait for conversion, from GDK_PIXBUF_JP2_QUEUE_DEPTH.
+ */
+static guint load_queue_depth(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_QUEUE_DEPTH");
+
+	if(value && *value)
+	{
+		guint64 depth = g_ascii_strtoull(value, NULL, 10);
+		return (guint) CLAMP(depth, 1, 1024);
+	}
+
+	return 2;
+}
+
+/**
+ * Convert a tile handed over by the decode pipeline into the pixbuf, creating the pixbuf for the first one.
+ */
+static gboolean load_tile(const PipelineImage *image, opj_image_t *tile, guint index, gpointer user_data, GError **error)
+{
+	JP2Context *context = (JP2Context *) user_data;
+	int components = -1;
+	COLOR_SPACE colorspace = -1;
+	guint32 tile_x0, tile_y0;
+	gsize x, y, width, height;
+	gint64 begin;
+
+	if(!color_info(tile, &components, &colorspace))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unsupported colorspace");
+		return FALSE;
+	}
+
+	if(!context->pixbuf)
+	{
+		guint32 pixbuf_width = image->width, pixbuf_height = image->height;
+		gsize size, rowstride;
+		guint8 *pixels;
+		GdkPixbufDestroyNotify destroy;
+		gpointer destroy_data;
+
+		// Shrink to the size asked for while converting when the decoded resolution is larger, GdkPixbufLoader
+		// then has nothing left to scale. Anything else is left to GdkPixbufLoader.
+
+		context->scaling = scale_init(&context->scale, image->width, image->height, (guint32) context->width, (guint32) context->height, components);
+
+		if(context->scaling)
+		{
+			pixbuf_width = (guint32) context->width;
+			pixbuf_height = (guint32) context->height;
+			context->scale_bytes = scale_size(&context->scale);
+			timing_alloc(context->timing, context->scale_bytes);
+		}
+
+		if(!util_pixels_size(pixbuf_width, pixbuf_height, components, &size, &rowstride))
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Image dimensions are too large");
+			return FALSE;
+		}
+
+		pixels = util_alloc_pixels(size, &destroy, &destroy_data);
+		if(!pixels)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Not enough memory to load image");
+			return FALSE;
+		}
+
+		timing_alloc(context->timing, size);
+
+		// Scaled pixels are only written once their first tile lands, start them out blank
+
+		if(context->scaling)
+		{
+			memset(pixels, 0, size);
+		}
+
+		context->pixbuf = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, components == 4, 8, (int) pixbuf_width, (int) pixbuf_height, (int) rowstride, destroy, destroy_data);
+
+		context->components = components;
+		context->colorspace = colorspace;
+
+		if(context->prepare_func)
+		{
+			context->prepare_func(context->pixbuf, NULL, context->user_data);
+		}
+	}
+
+	if(components != context->components || colorspace != context->colorspace)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Tile %u has a different colorspace than the rest of the image", index);
+		return FALSE;
+	}
+
+	util_tile_origin(tile, &tile_x0, &tile_y0);
+	width = tile->comps[0].w;
+	height = tile->comps[0].h;
+	x = tile_x0 - image->x0;
+	y = tile_y0 - image->y0;
+
+	if(tile_x0 < image->x0 || tile_y0 < image->y0 || x + width > image->width || y + height > image->height)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Tile %u lies outside the image", index);
+		return FALSE;
+	}
+
+	begin = PROFILE_BEGIN();
+
+	if(context->scaling)
+	{
+		guint8 *pixels = gdk_pixbuf_get_pixels(context->pixbuf);
+		gsize rowstride = (gsize) gdk_pixbuf_get_rowstride(context->pixbuf);
+
+		scale_convert_tile(&context->scale, tile, colorspace, x, y, pixels, rowstride, &context->scratch, &context->scratch_size);
+		scale_store(&context->scale, pixels, rowstride, x, y, width, height, &x, &y, &width, &height);
+
+		if(scale_size(&context->scale) > context->scale_bytes)
+		{
+			timing_alloc(context->timing, scale_size(&context->scale) - context->scale_bytes);
+			context->scale_bytes = scale_size(&context->scale);
+		}
+	} else {
+		color_convert_tile(tile, colorspace, components, gdk_pixbuf_get_pixels(context->pixbuf), (gsize) gdk_pixbuf_get_rowstride(context->pixbuf), x, y, &context->scratch, &context->scratch_size);
+	}
+
+	PROFILE_MARK(begin, "convert", "tile %u, %ux%u %s", index, tile->comps[0].w, tile->comps[0].h, color_space_name(colorspace));
+
+	if(context->update_func)
+	{
+		context->update_func(context->pixbuf, (int) x, (int) y, (int) width, (int) height, context->user_data);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Ask size_func for the size to load info at and pick the most resolution levels to discard that still leave at least that size.
+ * The rest of the way down is done by area-averaging while converting. Returns FALSE when size_func asks for nothing.
+ */
+static gboolean load_size(JP2Context *context, const CodestreamInfo *info, guint *reduce, GError **error)
+{
+	guint64 width = (guint64) info->x1 - info->x0;
+	guint64 height = (guint64) info->y1 - info->y0;
+
+	*reduce = 0;
+
+	if(width > G_MAXINT || height > G_MAXINT)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Image dimensions are too large");
+		return FALSE;
+	}
+
+	context->width = (gint) width;
+	context->height = (gint) height;
+
+	if(context->size_func)
+	{
+		context->size_func(&context->width, &context->height, context->user_data);
+
+		if(context->width == 0 || context->height == 0)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Transformed JPEG2000 has zero width or height");
+			return FALSE;
+		}
+	}
+
+	if(context->width < 0 || context->height < 0)
+	{
+		return TRUE;
+	}
+
+	while(*reduce + 1 < info->resolutions &&
+		util_ceildivpow2(info->x1, *reduce + 1) - util_ceildivpow2(info->x0, *reduce + 1) >= (guint32) context->width &&
+		util_ceildivpow2(info->y1, *reduce + 1) - util_ceildivpow2(info->y0, *reduce + 1) >= (guint32) context->height)
+	{
+		(*reduce)++;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Look the image in the context's buffer up in the cache at reduce, selection and the size asked for, handing a hit to
+ * prepare_func and update_func as if it were decoded. The path of the entry is stored in cache for storing a miss.
+ */
+static gboolean load_cached(JP2Context *context, guint reduce, const ColorComponents *selection, gchar **cache)
+{
+	gchar *identity = cache_identify_buffer(context->buffer->data, context->buffer->len);
+	GdkPixbuf *pixbuf;
+
+	*cache = cache_path(identity, reduce, 0, selection, context->width, context->height);
+	g_free(identity);
+
+	pixbuf = cache_lookup(*cache);
+	if(!pixbuf)
+	{
+		return FALSE;
+	}
+
+	context->pixbuf = pixbuf;
+	gdk_pixbuf_set_option(pixbuf, "jp2::cache", "hit");
+
+	if(context->prepare_func)
+	{
+		context->prepare_func(pixbuf, NULL, context->user_data);
+	}
+
+	if(context->update_func)
+	{
+		context->update_func(pixbuf, 0, 0, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), context->user_data);
+	}
+
+	return TRUE;
+}
 
 static gpointer gdk_pixbuf__jp2_image_begin_load
 (
@@ -199,27 +897,161 @@ static gpointer gdk_pixbuf__jp2_image_begin_load
 	context->prepare_func = prepare_func;
 	context->update_func  = update_func;
 	context->user_data = user_data;
+	context->buffer = g_byte_array_new();
+	context->timing = timing_begin(&context->timing_data);
+
+	// Callers cancel a load with g_cancellable_push_current before creating the loader, GdkPixbufLoader has no way to pass one
+	if(g_cancellable_get_current())
+	{
+		context->cancellable = g_object_ref(g_cancellable_get_current());
+	}
+
 	return context;
 }
 
-static gboolean gdk_pixbuf__jp2_image_stop_load(gpointer context, GError **error)
+/**
+ * libopenjp2 needs to seek, so the data is collected until the end and decoded here.
+ * Tiles are decoded and converted by the pipeline, each one reported through update_func as it lands.
+ */
+static gboolean gdk_pixbuf__jp2_image_stop_load(gpointer data, GError **error)
 {
-	JP2Context *data = (JP2Context *) context;
-	g_return_val_if_fail(data != NULL, TRUE);
-	if (data->pixbuf) {
-		g_object_unref(data->pixbuf);
+	JP2Context *context = (JP2Context *) data;
+	CodestreamInfo info;
+	ColorComponents selection;
+	gsize offset, size;
+	int codec_type;
+	guint depth = load_queue_depth(), reduce = 0, requested = 0;
+	guint64 cost = 0, planes;
+	gboolean ok = FALSE, movie = FALSE;
+	gint64 begin = PROFILE_BEGIN(), start;
+	gchar *cache = NULL;
+
+	g_return_val_if_fail(context != NULL, TRUE);
+
+	timing_alloc(context->timing, context->buffer->len);
+	start = timing_now(context->timing);
+
+	memset(&info, 0, sizeof(CodestreamInfo));
+	codec_type = util_identify_buffer(context->buffer->data, context->buffer->len);
+	PROFILE_MARK(begin, "identify", "%s", codec_type == OPJ_CODEC_JP2 ? "JP2" : codec_type == OPJ_CODEC_J2K ? "J2K" : "unknown");
+
+	if(codec_type < 0)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unknown filetype!");
 	}
-	return TRUE;
+	else if(codec_type == OPJ_CODEC_JP2 && mj2_identify_buffer(context->buffer->data, context->buffer->len))
+	{
+		// A Motion JPEG 2000 clip, the animation takes over the buffer
+
+		GBytes *bytes = g_byte_array_free_to_bytes(context->buffer);
+		GdkPixbufAnimation *animation = mj2_animation_new(bytes, error);
+
+		context->buffer = NULL;
+		g_bytes_unref(bytes);
+
+		if(animation)
+		{
+			GdkPixbuf *pixbuf = gdk_pixbuf_animation_get_static_image(animation);
+
+			if(context->prepare_func)
+			{
+				context->prepare_func(pixbuf, animation, context->user_data);
+			}
+
+			if(context->update_func)
+			{
+				context->update_func(pixbuf, 0, 0, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), context->user_data);
+			}
+
+			g_object_unref(animation);
+			movie = TRUE;
+		}
+	}
+	else if(!codestream_locate(context->buffer->data, context->buffer->len, &offset, &size) || codestream_parse(context->buffer->data + offset, size, &info) != CODESTREAM_OK || (guint64) info.tiles_x * info.tiles_y > G_MAXUINT)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Failed to read header");
+	}
+	else if(load_check_ht(&info, error) && load_size(context, &info, &reduce, error))
+	{
+		requested = reduce;
+		load_components(&info, TRUE, &selection);
+		ok = load_cached(context, reduce, &selection, &cache);
+
+		if(!ok && budget_acquire(&info, depth + 2, FALSE, context->cancellable, &reduce, &cost, error))
+		{
+			// One tile being decoded, one being converted and up to depth waiting in between
+
+			timing_add(context->timing, TIMING_HEADER, start);
+			start = timing_now(context->timing);
+			planes = budget_planes(&info, reduce, FALSE) * MIN(depth + 2, (guint64) info.tiles_x * info.tiles_y);
+			timing_alloc(context->timing, planes);
+
+			ok = pipeline_decode(context->buffer->data, context->buffer->len, codec_type, info.tiles_x * info.tiles_y, reduce, &selection, depth, context->cancellable, load_tile, context, error);
+			budget_release(cost);
+
+			timing_add(context->timing, TIMING_DECODE, start);
+			timing_alloc(context->timing, context->scratch_size);
+			timing_free(context->timing, planes);
+
+			if(context->timing)
+			{
+				context->timing->decodes++;
+			}
+
+			// A memory budget may have decoded at a lower resolution than the entry stands for
+
+			if(ok && context->pixbuf && reduce == requested)
+			{
+				cache_store(cache, context->pixbuf);
+			}
+		}
+	}
+
+	g_free(cache);
+
+	if(movie)
+	{
+		ok = TRUE;
+	}
+	else if(ok && context->pixbuf)
+	{
+		load_options(context->pixbuf, &info, TRUE, reduce, 0);
+		timing_attach(context->timing, context->pixbuf);
+		timing_log(context->timing, "load");
+	}
+
+	if(context->pixbuf)
+	{
+		g_object_unref(context->pixbuf);
+	}
+	if(context->buffer)
+	{
+		g_byte_array_unref(context->buffer);
+	}
+	g_free(context->scratch);
+	scale_clear(&context->scale);
+	g_clear_object(&context->cancellable);
+	g_free(context);
+
+	return ok;
 }
 
-static gboolean gdk_pixbuf__jp2_image_load_increment(gpointer context, const guchar *buf, guint size, GError **error)
+static gboolean gdk_pixbuf__jp2_image_load_increment(gpointer data, const guchar *buf, guint size, GError **error)
 {
-	JP2Context *data = (JP2Context *) context;
+	JP2Context *context = (JP2Context *) data;
+
+	if(g_cancellable_set_error_if_cancelled(context->cancellable, error))
+	{
+		return FALSE;
+	}
 
-	g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Bro, I just can't...");
-	return FALSE;
+	g_byte_array_append(context->buffer, buf, size);
+
+	return TRUE;
 }
 
+#if FALSE
+
 static gboolean gdk_pixbuf__jp2_image_save_to_callback
 (
 	GdkPixbufSaveFunc save_func,
@@ -234,6 +1066,144 @@ static gboolean gdk_pixbuf__jp2_image_save_to_callback
 
 #endif
 
+static gboolean save_option_boolean(const gchar *key, const gchar *value, gboolean *result, GError **error)
+{
+	if(g_ascii_strcasecmp(value, "yes") == 0 || g_ascii_strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0)
+	{
+		*result = TRUE;
+	}
+	else if(g_ascii_strcasecmp(value, "no") == 0 || g_ascii_strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0)
+	{
+		*result = FALSE;
+	} else {
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "JPEG2000 option %s must be yes or no, not \"%s\"", key, value);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Apply save options to the encoder parameters.
+ *
+ * tile-size:  "N" or "WxH", split the image into tiles of that size, tiles under 32 pixels get fewer resolution levels
+ * tile-parts: "R", "L" or "C", split each tile into tile-parts by resolution, layer or component
+ * tlm:        "yes" to write tile-part lengths (TLM) in the main header
+ * plt:        "yes" to write packet lengths (PLT) in every tile-part header
+ */
+static gboolean save_options(gchar **keys, gchar **values, opj_cparameters_t *parameters, gboolean *tlm, gboolean *plt, GError **error)
+{
+	*tlm = FALSE;
+	*plt = FALSE;
+
+	for(int i = 0; keys && keys[i]; i++)
+	{
+		if(strcmp(keys[i], "tile-size") == 0)
+		{
+			gchar *end = NULL;
+			guint64 tile_width = g_ascii_strtoull(values[i], &end, 10);
+			guint64 tile_height = tile_width;
+
+			if(end && *end == 'x')
+			{
+				tile_height = g_ascii_strtoull(end + 1, &end, 10);
+			}
+
+			if(!end || *end != '\0' || tile_width == 0 || tile_height == 0 || tile_width > G_MAXINT || tile_height > G_MAXINT)
+			{
+				g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "JPEG2000 tile-size must be N or WxH, not \"%s\"", values[i]);
+				return FALSE;
+			}
+
+			parameters->tile_size_on = OPJ_TRUE;
+			parameters->cp_tdx = (int) tile_width;
+			parameters->cp_tdy = (int) tile_height;
+
+			// libopenjp2 needs tiles of at least 2^(numresolution - 1) pixels on a side, small tiles get fewer resolution levels
+
+			while(parameters->numresolution > 1 && (MIN(tile_width, tile_height) >> (parameters->numresolution - 1)) == 0)
+			{
+				parameters->numresolution--;
+			}
+		}
+		else if(strcmp(keys[i], "tile-parts") == 0)
+		{
+			gchar flag = g_ascii_toupper(values[i][0]);
+
+			if((flag != 'R' && flag != 'L' && flag != 'C') || values[i][1] != '\0')
+			{
+				g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "JPEG2000 tile-parts must be R, L or C, not \"%s\"", values[i]);
+				return FALSE;
+			}
+
+			parameters->tp_on = 1;
+			parameters->tp_flag = flag;
+		}
+		else if(strcmp(keys[i], "tlm") == 0)
+		{
+			if(!save_option_boolean(keys[i], values[i], tlm, error))
+			{
+				return FALSE;
+			}
+		}
+		else if(strcmp(keys[i], "plt") == 0)
+		{
+			if(!save_option_boolean(keys[i], values[i], plt, error))
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Enable TLM and PLT marker generation, which libopenjp2 only exposes as extra options.
+ * PLT needs libopenjp2 2.4.0 or newer, TLM needs 2.5.0 or newer.
+ */
+static gboolean save_markers(opj_codec_t *codec, gboolean tlm, gboolean plt, GError **error)
+{
+	const char *options[3] = { NULL, NULL, NULL };
+	int count = 0;
+
+	if(!tlm && !plt)
+	{
+		return TRUE;
+	}
+
+	#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 5)
+		if(tlm)
+		{
+			options[count++] = "TLM=YES";
+		}
+	#else
+		if(tlm)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "JPEG2000 tlm needs libopenjp2 2.5.0 or newer");
+			return FALSE;
+		}
+	#endif
+
+	#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 4)
+		if(plt)
+		{
+			options[count++] = "PLT=YES";
+		}
+
+		if(!opj_encoder_set_extra_options(codec, options))
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to enable TLM/PLT markers");
+			return FALSE;
+		}
+	#else
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "JPEG2000 plt needs libopenjp2 2.4.0 or newer");
+		return FALSE;
+	#endif
+
+	return TRUE;
+}
+
 static gboolean save_jp2
 (
 	GdkPixbuf *pixbuf,
@@ -242,22 +1212,31 @@ static gboolean save_jp2
 	GError **error,
 	FILE *fp
 ) {
-	int counter = 0;
+	gsize rowstride;
 	guchar *pixels;
-	gboolean has_alpha;
+	gboolean has_alpha, tlm, plt;
 	opj_codec_t *codec = NULL;
 	opj_image_t *image = NULL;
 	opj_stream_t *stream = NULL;
 	opj_cparameters_t parameters;
 	int components, precision, width, height;
 	opj_image_cmptparm_t component_parameters[4]; /* RGBA: max. 4 components */
+	Timing timing_data;
+	Timing *timing = timing_begin(&timing_data);
+	gint64 start, begin;
 
 	opj_set_default_encoder_parameters(&parameters);
 	parameters.cod_format = JP2_CFMT;
 
+	if(!save_options(keys, values, &parameters, &tlm, &plt, error))
+	{
+		return FALSE;
+	}
+
 	width = gdk_pixbuf_get_width(pixbuf);
     height = gdk_pixbuf_get_height(pixbuf);
 	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	rowstride = (gsize) gdk_pixbuf_get_rowstride(pixbuf);
 	components = gdk_pixbuf_get_n_channels(pixbuf);
 	precision = gdk_pixbuf_get_bits_per_sample(pixbuf);
 
@@ -276,7 +1255,9 @@ static gboolean save_jp2
 		component_parameters[i].h = (OPJ_UINT32) height;
 	}
 
+	start = timing_now(timing);
 	image = opj_image_create((OPJ_UINT32) components, &component_parameters[0], OPJ_CLRSPC_SRGB);
+	timing_add(timing, TIMING_ALLOCATE, start);
 
 	if(!image)
 	{
@@ -289,20 +1270,34 @@ static gboolean save_jp2
 	image->x1 = (OPJ_UINT32) width;
 	image->y1 = (OPJ_UINT32) height;
 
-	for(int i = 0; i < width * height; i++)
+	// Rows of the pixbuf may be padded, walk them by rowstride
+
+	start = timing_now(timing);
+
+	for(gsize y = 0; y < (gsize) height; y++)
 	{
-		image->comps[0].data[i] = pixels[counter++];
-		image->comps[1].data[i] = pixels[counter++];
-		image->comps[2].data[i] = pixels[counter++];
+		const guchar *row = pixels + y * rowstride;
+		gsize i = y * (gsize) width;
 
-		if(has_alpha)
+		for(gsize x = 0; x < (gsize) width; x++, i++)
 		{
-			image->comps[3].data[i] = pixels[counter++];
+			image->comps[0].data[i] = *row++;
+			image->comps[1].data[i] = *row++;
+			image->comps[2].data[i] = *row++;
+
+			if(has_alpha)
+			{
+				image->comps[3].data[i] = *row++;
+			}
 		}
 	}
 
+	timing_add(timing, TIMING_CONVERT, start);
+
 	// Encode
 
+	start = timing_now(timing);
+
 	switch(parameters.cod_format)
 	{
 		case J2K_CFMT:
@@ -332,6 +1327,12 @@ static gboolean save_jp2
 		return FALSE;
 	}
 
+	if(!save_markers(codec, tlm, plt, error))
+	{
+		util_destroy(codec, stream, image);
+		return FALSE;
+	}
+
 	stream = util_create_stream(fp, IS_OUTPUT);
 
 	if(!stream)
@@ -341,6 +1342,10 @@ static gboolean save_jp2
 		return FALSE;
 	}
 
+	timing_add(timing, TIMING_STREAM, start);
+	start = timing_now(timing);
+	begin = PROFILE_BEGIN();
+
 	if(!opj_start_compress(codec, image, stream))
 	{
 		util_destroy(codec, stream, image);
@@ -362,8 +1367,13 @@ static gboolean save_jp2
 		}
 	}
 
+	timing_add(timing, TIMING_ENCODE, start);
+	PROFILE_MARK(begin, "encode", "%dx%d, %d components", width, height, components);
+
 	util_destroy(codec, stream, image);
 
+	timing_log(timing, "save");
+
 	return TRUE;
 }
 
@@ -378,6 +1388,15 @@ static gboolean gdk_pixbuf__jp2_image_save
 	return save_jp2(pixbuf, keys, values, error, fp);
 }
 
+static gboolean gdk_pixbuf__jp2_is_save_option_supported(const gchar *option_key)
+{
+	return
+		g_strcmp0(option_key, "tile-size") == 0 ||
+		g_strcmp0(option_key, "tile-parts") == 0 ||
+		g_strcmp0(option_key, "tlm") == 0 ||
+		g_strcmp0(option_key, "plt") == 0;
+}
+
 /*
  * Module entry points - This is where it all starts
  */
@@ -385,11 +1404,13 @@ G_MODULE_EXPORT
 void fill_vtable(GdkPixbufModule *module)
 {
 	module->load             = gdk_pixbuf__jp2_image_load;
+	module->load_animation   = gdk_pixbuf__jp2_image_load_animation;
 	module->save             = gdk_pixbuf__jp2_image_save;
+	module->is_save_option_supported = gdk_pixbuf__jp2_is_save_option_supported;
+	module->stop_load        = gdk_pixbuf__jp2_image_stop_load;
+	module->begin_load       = gdk_pixbuf__jp2_image_begin_load;
+	module->load_increment   = gdk_pixbuf__jp2_image_load_increment;
 	// TODO: consider implementing these
-	//module->stop_load        = gdk_pixbuf__jp2_image_stop_load;
-	//module->begin_load       = gdk_pixbuf__jp2_image_begin_load;
-	//module->load_increment   = gdk_pixbuf__jp2_image_load_increment;
 	//module->save_to_callback = gdk_pixbuf__jp2_image_save_to_callback;
 }
 
@@ -410,6 +1431,9 @@ void fill_info(GdkPixbufFormat *info)
 		"image/jpx",
 		"image/jpeg2000",
 		"image/x-jp2-codestream",
+		"image/jph",
+		"image/jphc",
+		"video/mj2",
 		NULL
 	};
 
@@ -417,11 +1441,15 @@ void fill_info(GdkPixbufFormat *info)
 	{
 		"j2c",
 		"j2k",
+		"jhc",
 		"jp2",
+		"jph",
 		"jpc",
 		"jpf",
 		"jpm",
 		"jpx",
+		"mj2",
+		"mjp2",
 		NULL
 	};
 
@@ -0,0 +1,231 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <codestream.h>
+
+// Time-budget decoding: pick the resolution level and quality layers that should decode within the budget,
+// then decode again at a finer level while time is left. The cost model is a time per sample, scaled down for fewer
+// layers, which is recalibrated after every decode in the process. HTJ2K codestreams get a model of their own, their
+// block coder is several times faster than the classic one and calibrating one with the other would mispredict both.
+
+#define LATENCY_DEFAULT_NS_PER_SAMPLE 40.0    // about what libopenjp2 takes for lossless 8 bit images on one core
+#define LATENCY_DEFAULT_HT_NS_PER_SAMPLE 15.0 // the same with the HT block coder, the wavelet and color conversion stay
+#define LATENCY_FIXED_SHARE 0.3               // share of the cost that doesn't depend on the layers: wavelet, color conversion
+#define LATENCY_UNTILED_MARGIN 2              // untiled refinements can't be cancelled, they must be predicted to fit in half the time left
+
+static GMutex latency_mutex;
+static gdouble latency_ns_per_sample[2] = {LATENCY_DEFAULT_NS_PER_SAMPLE, LATENCY_DEFAULT_HT_NS_PER_SAMPLE}; // classic, HT
+
+/**
+ * Time budget in microseconds from GDK_PIXBUF_JP2_TIME_BUDGET, which is in milliseconds. 0 means no budget.
+ */
+gint64 latency_budget(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_TIME_BUDGET");
+
+	if(value && *value)
+	{
+		guint64 budget = g_ascii_strtoull(value, NULL, 10);
+		return (gint64) MIN(budget, G_MAXINT64 / 1000) * 1000;
+	}
+
+	return 0;
+}
+
+/**
+ * Work of decoding info at reduce and layers, in samples weighted by the share of layers decoded.
+ */
+static gdouble latency_work(const CodestreamInfo *info, guint reduce, guint layers)
+{
+	gdouble samples = (gdouble) (info->samples >> (2 * MIN(reduce, 31))) + info->components;
+	gdouble share = info->layers > 0 ? (gdouble) MIN(layers, info->layers) / info->layers : 1.0;
+
+	return samples * (LATENCY_FIXED_SHARE + (1.0 - LATENCY_FIXED_SHARE) * share);
+}
+
+/**
+ * Predicted time in microseconds to decode info at reduce and layers.
+ */
+gint64 latency_estimate(const CodestreamInfo *info, guint reduce, guint layers)
+{
+	gdouble ns_per_sample;
+
+	g_mutex_lock(&latency_mutex);
+	ns_per_sample = latency_ns_per_sample[codestream_is_ht(info) ? 1 : 0];
+	g_mutex_unlock(&latency_mutex);
+
+	return (gint64) (latency_work(info, reduce, layers) * ns_per_sample / 1000.0);
+}
+
+/**
+ * Fold the time a decode of info at reduce and layers took, in microseconds, into the cost model.
+ * Decodes of tiny images are mostly overhead and left out.
+ */
+void latency_calibrate(const CodestreamInfo *info, guint reduce, guint layers, gint64 elapsed)
+{
+	gdouble work = latency_work(info, reduce, layers);
+	gdouble *ns_per_sample = &latency_ns_per_sample[codestream_is_ht(info) ? 1 : 0];
+
+	if(work < 65536.0 || elapsed <= 0)
+	{
+		return;
+	}
+
+	g_mutex_lock(&latency_mutex);
+	*ns_per_sample = (*ns_per_sample + (gdouble) elapsed * 1000.0 / work) / 2.0;
+	g_mutex_unlock(&latency_mutex);
+}
+
+/**
+ * Pick the best resolution level and layer count, no finer than min_reduce, predicted to decode in remaining microseconds.
+ * Fewer discarded resolution levels beat more layers. With has_current only picks better than current_reduce and
+ * current_layers are considered, and FALSE is returned when none fits. Without, the cheapest is picked when nothing fits.
+ */
+gboolean latency_pick(const CodestreamInfo *info, guint min_reduce, gint64 remaining, gboolean has_current, guint current_reduce, guint current_layers, guint *reduce, guint *layers)
+{
+	guint levels = info->resolutions > 0 ? info->resolutions - 1u : 0;
+	guint all_layers = MAX(info->layers, 1);
+
+	min_reduce = MIN(min_reduce, levels);
+
+	for(guint r = min_reduce; r <= levels; r++)
+	{
+		for(guint l = all_layers; l >= 1; l--)
+		{
+			if(has_current && (r > current_reduce || (r == current_reduce && l <= current_layers)))
+			{
+				continue;
+			}
+
+			if(latency_estimate(info, r, l) <= remaining)
+			{
+				*reduce = r;
+				*layers = l;
+				return TRUE;
+			}
+		}
+	}
+
+	if(has_current)
+	{
+		return FALSE;
+	}
+
+	*reduce = levels;
+	*layers = 1;
+
+	return TRUE;
+}
+
+// A refinement only happens when the model says it fits, which it may not. The deadline cancels a cancellable once the
+// budget is spent, the tile-parallel decoder checks it before every tile. It also follows the caller's cancellable.
+// Untiled images are decoded by a single opj_decode that nothing interrupts, so they get LATENCY_UNTILED_MARGIN instead.
+
+typedef struct {
+	GCancellable *cancellable; // cancelled at end or when parent is
+	GCancellable *parent;
+	gulong handler;
+	GThread *thread;
+	GMutex mutex;
+	GCond cond;
+	gint64 end;                // monotonic time in microseconds
+	gboolean stopped;
+} LatencyDeadline;
+
+static void latency_deadline_forward(GCancellable *parent, gpointer data)
+{
+	g_cancellable_cancel(data);
+}
+
+static gpointer latency_deadline_thread(gpointer data)
+{
+	LatencyDeadline *deadline = data;
+
+	g_mutex_lock(&deadline->mutex);
+
+	// Woken early only by latency_deadline_stop, or spuriously
+
+	while(!deadline->stopped && g_cond_wait_until(&deadline->cond, &deadline->mutex, deadline->end))
+	{
+	}
+
+	if(!deadline->stopped)
+	{
+		g_cancellable_cancel(deadline->cancellable);
+	}
+
+	g_mutex_unlock(&deadline->mutex);
+
+	return NULL;
+}
+
+/**
+ * Start a deadline that cancels deadline->cancellable at the monotonic time end, or as soon as parent is cancelled.
+ */
+void latency_deadline_start(LatencyDeadline *deadline, GCancellable *parent, gint64 end)
+{
+	memset(deadline, 0, sizeof(LatencyDeadline));
+	g_mutex_init(&deadline->mutex);
+	g_cond_init(&deadline->cond);
+	deadline->cancellable = g_cancellable_new();
+	deadline->end = end;
+
+	if(parent)
+	{
+		deadline->parent = g_object_ref(parent);
+		deadline->handler = g_cancellable_connect(parent, G_CALLBACK(latency_deadline_forward), deadline->cancellable, NULL);
+	}
+
+	deadline->thread = g_thread_new("jp2-deadline", latency_deadline_thread, deadline);
+}
+
+/**
+ * Whether the deadline ran out, rather than the caller cancelling.
+ */
+gboolean latency_deadline_expired(const LatencyDeadline *deadline)
+{
+	return g_cancellable_is_cancelled(deadline->cancellable) && !g_cancellable_is_cancelled(deadline->parent);
+}
+
+void latency_deadline_stop(LatencyDeadline *deadline)
+{
+	g_mutex_lock(&deadline->mutex);
+	deadline->stopped = TRUE;
+	g_cond_signal(&deadline->cond);
+	g_mutex_unlock(&deadline->mutex);
+	g_thread_join(deadline->thread);
+
+	if(deadline->parent)
+	{
+		g_cancellable_disconnect(deadline->parent, deadline->handler);
+		g_object_unref(deadline->parent);
+	}
+
+	g_object_unref(deadline->cancellable);
+	g_mutex_clear(&deadline->mutex);
+	g_cond_clear(&deadline->cond);
+}
+
+#endif
@@ -0,0 +1,864 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef MJ2_H
+#define MJ2_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <string.h>
+#include <codestream.h>
+#include <thumbnail.h>
+
+// Motion JPEG 2000 (ITU-T T.802): a clip is an ISO base media file whose video track holds one JPEG2000 codestream per
+// sample, in a jp2c box. The sample tables are read once, frames are decoded when asked for. A worker thread keeps
+// the frames after the one shown last decoded in a small ring, so playback doesn't wait for the decoder.
+// Needs GDK_PIXBUF_ENABLE_BACKEND for the animation classes, so only the loader module includes it.
+
+#define MJ2_BRAND 0x6D6A7032 /* mjp2 */
+#define MJ2_BOX_FTYP 0x66747970
+#define MJ2_BOX_MOOV 0x6D6F6F76
+#define MJ2_BOX_TRAK 0x7472616B
+#define MJ2_BOX_MDIA 0x6D646961
+#define MJ2_BOX_MDHD 0x6D646864
+#define MJ2_BOX_HDLR 0x68646C72
+#define MJ2_BOX_MINF 0x6D696E66
+#define MJ2_BOX_STBL 0x7374626C
+#define MJ2_BOX_STSD 0x73747364
+#define MJ2_BOX_STTS 0x73747473
+#define MJ2_BOX_STSC 0x73747363
+#define MJ2_BOX_STSZ 0x7374737A
+#define MJ2_BOX_STCO 0x7374636F
+#define MJ2_BOX_CO64 0x636F3634
+#define MJ2_HANDLER_VIDE 0x76696465
+
+#define MJ2_MIN_DELAY 10 // milliseconds, for samples without a duration
+#define MJ2_FTYP_MAX 65536 // bytes read to identify a file, the signature and file type boxes of any real file fit
+
+typedef struct {
+	guint64 offset; // of the sample in the file
+	guint32 size;
+	guint32 delay;  // milliseconds
+	guint64 start;  // milliseconds from the start of the clip
+} Mj2Sample;
+
+typedef struct {
+	GdkPixbuf *pixbuf;
+	guint index;
+} Mj2Frame;
+
+// Boxes
+
+/**
+ * Read the box at *pos of data, moving *pos past it. A length of 0 runs to the end of data.
+ */
+static gboolean mj2_box(const guint8 *data, gsize length, gsize *pos, guint32 *type, const guint8 **payload, gsize *payload_length)
+{
+	guint64 box_length;
+	gsize header = 8;
+
+	if(*pos + 8 > length)
+	{
+		return FALSE;
+	}
+
+	box_length = codestream_read32(data + *pos);
+	*type = codestream_read32(data + *pos + 4);
+
+	if(box_length == 1)
+	{
+		if(*pos + 16 > length)
+		{
+			return FALSE;
+		}
+		box_length = codestream_read64(data + *pos + 8);
+		header = 16;
+	}
+	else if(box_length == 0)
+	{
+		box_length = length - *pos;
+	}
+
+	if(box_length < header || box_length > length - *pos)
+	{
+		return FALSE;
+	}
+
+	*payload = data + *pos + header;
+	*payload_length = (gsize) box_length - header;
+	*pos += (gsize) box_length;
+
+	return TRUE;
+}
+
+/**
+ * First box of type among the boxes in data.
+ */
+static gboolean mj2_find(const guint8 *data, gsize length, guint32 type, const guint8 **payload, gsize *payload_length)
+{
+	gsize pos = 0;
+	guint32 box_type;
+
+	while(mj2_box(data, length, &pos, &box_type, payload, payload_length))
+	{
+		if(box_type == type)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether data starts like a Motion JPEG 2000 file: the JP2 signature and a file type box naming mjp2.
+ */
+gboolean mj2_identify_buffer(const guint8 *data, gsize length)
+{
+	const guint8 *payload;
+	gsize payload_length, pos = 0;
+	guint32 type;
+
+	if(!mj2_box(data, length, &pos, &type, &payload, &payload_length) || !mj2_box(data, length, &pos, &type, &payload, &payload_length) || type != MJ2_BOX_FTYP || payload_length < 8)
+	{
+		return FALSE;
+	}
+
+	// Brand, minor version, then the compatibility list
+
+	if(codestream_read32(payload) == MJ2_BRAND)
+	{
+		return TRUE;
+	}
+
+	for(gsize i = 8; i + 4 <= payload_length; i += 4)
+	{
+		if(codestream_read32(payload + i) == MJ2_BRAND)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Whether the file in fp is a Motion JPEG 2000 file, leaving fp at its start.
+ */
+gboolean mj2_identify(FILE *fp)
+{
+	guint8 header[20];
+	guint8 *buffer;
+	gsize length, size;
+	gboolean found;
+
+	// The 12 byte signature box, then the file type box, whose compatibility list can name any number of brands
+
+	fseek(fp, 0, SEEK_SET);
+	length = fread(header, 1, sizeof(header), fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(length < sizeof(header))
+	{
+		return FALSE;
+	}
+
+	size = CLAMP(12 + (gsize) codestream_read32(header + 12), sizeof(header), MJ2_FTYP_MAX);
+	buffer = g_malloc(size);
+
+	length = fread(buffer, 1, size, fp);
+	fseek(fp, 0, SEEK_SET);
+
+	found = mj2_identify_buffer(buffer, length);
+	g_free(buffer);
+
+	return found;
+}
+
+// Sample tables
+
+/**
+ * Fill samples from the sample table in stbl, converting durations from timescale units to milliseconds. Returns FALSE for tables that don't
+ * describe samples that lie within length bytes of file.
+ */
+static gboolean mj2_samples(const guint8 *stbl, gsize stbl_length, guint32 timescale, gsize length, GArray *samples)
+{
+	const guint8 *stts, *stsc, *stsz, *stco;
+	gsize stts_length, stsc_length, stsz_length, stco_length;
+	guint32 count, constant, chunks, runs, deltas;
+	gboolean wide = FALSE;
+	guint64 start = 0;
+	guint sample = 0, delta_run = 0, delta_left;
+
+	if(!mj2_find(stbl, stbl_length, MJ2_BOX_STTS, &stts, &stts_length) || !mj2_find(stbl, stbl_length, MJ2_BOX_STSC, &stsc, &stsc_length) ||
+		!mj2_find(stbl, stbl_length, MJ2_BOX_STSZ, &stsz, &stsz_length) || stts_length < 8 || stsc_length < 8 || stsz_length < 12)
+	{
+		return FALSE;
+	}
+
+	if(!mj2_find(stbl, stbl_length, MJ2_BOX_STCO, &stco, &stco_length))
+	{
+		if(!mj2_find(stbl, stbl_length, MJ2_BOX_CO64, &stco, &stco_length))
+		{
+			return FALSE;
+		}
+		wide = TRUE;
+	}
+
+	if(stco_length < 8)
+	{
+		return FALSE;
+	}
+
+	// Every table is a version and flags, a count, then its entries. Counts are checked against the box lengths first.
+
+	constant = codestream_read32(stsz + 4);
+	count = codestream_read32(stsz + 8);
+	deltas = codestream_read32(stts + 4);
+	runs = codestream_read32(stsc + 4);
+	chunks = codestream_read32(stco + 4);
+
+	if(count == 0 || (constant == 0 && count > (stsz_length - 12) / 4) || deltas > (stts_length - 8) / 8 || runs == 0 || runs > (stsc_length - 8) / 12 ||
+		chunks > (stco_length - 8) / (wide ? 8 : 4) || (constant > 0 && count > length / constant))
+	{
+		return FALSE;
+	}
+
+	g_array_set_size(samples, count);
+	delta_left = deltas > 0 ? codestream_read32(stts + 8) : 0;
+
+	for(guint32 run = 0; run < runs && sample < count; run++)
+	{
+		const guint8 *entry = stsc + 8 + (gsize) run * 12;
+		guint32 first = codestream_read32(entry);
+		guint32 last = run + 1 < runs ? codestream_read32(entry + 12) : chunks + 1;
+		guint32 per_chunk = codestream_read32(entry + 4);
+
+		if(first == 0 || last > chunks + 1 || first > last)
+		{
+			return FALSE;
+		}
+
+		for(guint32 chunk = first; chunk < last && sample < count; chunk++)
+		{
+			guint64 offset = wide ? codestream_read64(stco + 8 + (gsize) (chunk - 1) * 8) : codestream_read32(stco + 8 + (gsize) (chunk - 1) * 4);
+
+			for(guint32 i = 0; i < per_chunk && sample < count; i++, sample++)
+			{
+				Mj2Sample *s = &g_array_index(samples, Mj2Sample, sample);
+				guint64 delta = 0;
+
+				s->size = constant > 0 ? constant : codestream_read32(stsz + 12 + (gsize) sample * 4);
+				s->offset = offset;
+
+				if(offset > length || s->size > length - offset)
+				{
+					return FALSE;
+				}
+
+				offset += s->size;
+
+				// Time-to-sample runs: a count of samples that share a duration, then the duration
+
+				while(delta_run < deltas && delta_left == 0)
+				{
+					if(++delta_run < deltas)
+					{
+						delta_left = codestream_read32(stts + 8 + (gsize) delta_run * 8);
+					}
+				}
+
+				if(delta_run < deltas)
+				{
+					delta = codestream_read32(stts + 12 + (gsize) delta_run * 8);
+					delta_left--;
+				}
+
+				s->delay = (guint32) MAX(MIN(delta * 1000 / MAX(timescale, 1), G_MAXUINT32), MJ2_MIN_DELAY);
+				s->start = start;
+				start += s->delay;
+			}
+		}
+	}
+
+	if(sample < count)
+	{
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Read the samples of the first Motion JPEG 2000 video track in data.
+ */
+gboolean mj2_parse(const guint8 *data, gsize length, GArray *samples, GError **error)
+{
+	const guint8 *moov, *trak, *mdia, *box, *minf, *stbl;
+	gsize moov_length, trak_length, mdia_length, box_length, minf_length, stbl_length, pos = 0;
+	guint32 type;
+
+	if(!mj2_identify_buffer(data, length) || !mj2_find(data, length, MJ2_BOX_MOOV, &moov, &moov_length))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Motion JPEG 2000 file without a movie box");
+		return FALSE;
+	}
+
+	while(mj2_box(moov, moov_length, &pos, &type, &trak, &trak_length))
+	{
+		guint32 timescale;
+
+		if(type != MJ2_BOX_TRAK || !mj2_find(trak, trak_length, MJ2_BOX_MDIA, &mdia, &mdia_length))
+		{
+			continue;
+		}
+
+		// Handler: version and flags, pre-defined, then the handler type
+
+		if(!mj2_find(mdia, mdia_length, MJ2_BOX_HDLR, &box, &box_length) || box_length < 12 || codestream_read32(box + 8) != MJ2_HANDLER_VIDE)
+		{
+			continue;
+		}
+
+		// Media header: version and flags, creation and modification times, which are 64 bits in version 1, then the timescale
+
+		if(!mj2_find(mdia, mdia_length, MJ2_BOX_MDHD, &box, &box_length) || box_length < 16 || box_length < (box[0] == 1 ? 24u : 16u))
+		{
+			continue;
+		}
+
+		timescale = codestream_read32(box + (box[0] == 1 ? 20 : 12));
+
+		if(!mj2_find(mdia, mdia_length, MJ2_BOX_MINF, &minf, &minf_length) || !mj2_find(minf, minf_length, MJ2_BOX_STBL, &stbl, &stbl_length))
+		{
+			continue;
+		}
+
+		// Sample description: version and flags, a count, then entries that start with their size and format
+
+		if(!mj2_find(stbl, stbl_length, MJ2_BOX_STSD, &box, &box_length) || box_length < 16 || codestream_read32(box + 12) != MJ2_BRAND)
+		{
+			continue;
+		}
+
+		if(mj2_samples(stbl, stbl_length, timescale, length, samples))
+		{
+			return TRUE;
+		}
+
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid sample tables in Motion JPEG 2000 file");
+		return FALSE;
+	}
+
+	g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Motion JPEG 2000 file without a video track");
+
+	return FALSE;
+}
+
+/**
+ * Codestream of a sample: the payload of its jp2c box, or the whole sample when it is a bare codestream.
+ */
+static gboolean mj2_codestream(const guint8 *sample, gsize size, const guint8 **codestream, gsize *length)
+{
+	if(size >= 4 && memcmp(sample, J2K_CODESTREAM_MAGIC, 4) == 0)
+	{
+		*codestream = sample;
+		*length = size;
+		return TRUE;
+	}
+
+	return mj2_find(sample, size, CODESTREAM_BOX_JP2C, codestream, length);
+}
+
+// Animation
+
+typedef struct _Mj2Animation Mj2Animation;
+typedef struct _Mj2AnimationClass Mj2AnimationClass;
+typedef struct _Mj2AnimationIter Mj2AnimationIter;
+typedef struct _Mj2AnimationIterClass Mj2AnimationIterClass;
+
+struct _Mj2Animation {
+	GdkPixbufAnimation parent_instance;
+	GBytes *bytes;     // the whole file, usually mapped
+	GArray *samples;   // of Mj2Sample
+	guint64 duration;  // milliseconds
+	GdkPixbuf *first;  // the static image, frame 0
+	gint width, height;
+
+	GMutex mutex;      // guards everything below
+	GCond cond;
+	Mj2Frame *ring;    // frame i is kept in slot i % depth
+	guint depth;
+	guint wanted;      // frame shown last, the worker decodes the depth frames from there on
+	gint decoding;     // frame the worker is decoding, -1 for none
+	gboolean stopping;
+	GThread *worker;
+};
+
+struct _Mj2AnimationClass {
+	GdkPixbufAnimationClass parent_class;
+};
+
+struct _Mj2AnimationIter {
+	GdkPixbufAnimationIter parent_instance;
+	Mj2Animation *animation;
+	gint64 start;       // milliseconds of wall clock time when the clip started
+	guint64 position;   // milliseconds into the clip
+	guint frame;
+	GdkPixbuf *pixbuf;  // of frame, once asked for
+};
+
+struct _Mj2AnimationIterClass {
+	GdkPixbufAnimationIterClass parent_class;
+};
+
+GType mj2_animation_get_type(void);
+GType mj2_animation_iter_get_type(void);
+
+G_DEFINE_TYPE(Mj2Animation, mj2_animation, GDK_TYPE_PIXBUF_ANIMATION)
+G_DEFINE_TYPE(Mj2AnimationIter, mj2_animation_iter, GDK_TYPE_PIXBUF_ANIMATION_ITER)
+
+/**
+ * Frames the worker decodes ahead, from GDK_PIXBUF_JP2_PREFETCH_FRAMES.
+ */
+static guint mj2_prefetch_frames(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_PREFETCH_FRAMES");
+
+	if(value && *value)
+	{
+		guint64 frames = g_ascii_strtoull(value, NULL, 10);
+		return (guint) CLAMP(frames, 1, 64);
+	}
+
+	return 4;
+}
+
+/**
+ * Decode frame index of animation. Frames that fail to decode, or don't match the size of the first, show the first.
+ */
+static GdkPixbuf *mj2_animation_decode(Mj2Animation *animation, guint index, ThumbnailState *state, GError **error)
+{
+	const Mj2Sample *sample = &g_array_index(animation->samples, Mj2Sample, index);
+	const guint8 *data = (const guint8 *) g_bytes_get_data(animation->bytes, NULL) + sample->offset;
+	const guint8 *codestream;
+	gsize length;
+	GdkPixbuf *pixbuf;
+
+	if(!mj2_codestream(data, sample->size, &codestream, &length))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Frame %u has no codestream", index);
+		return NULL;
+	}
+
+	pixbuf = thumbnail_decode(state, codestream, length, 0, 0, error);
+
+	if(pixbuf && animation->first && (gdk_pixbuf_get_width(pixbuf) != animation->width || gdk_pixbuf_get_height(pixbuf) != animation->height ||
+		gdk_pixbuf_get_n_channels(pixbuf) != gdk_pixbuf_get_n_channels(animation->first)))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Frame %u differs in size from the first", index);
+		g_clear_object(&pixbuf);
+	}
+
+	return pixbuf;
+}
+
+/**
+ * Whether frame index is among the depth frames from wanted on, which the ring is meant to hold.
+ */
+static gboolean mj2_animation_ahead(Mj2Animation *animation, guint index)
+{
+	guint frames = animation->samples->len;
+
+	return (index + frames - animation->wanted) % frames < animation->depth;
+}
+
+static gpointer mj2_animation_worker(gpointer data)
+{
+	Mj2Animation *animation = (Mj2Animation *) data;
+	ThumbnailState state;
+	guint frames = animation->samples->len;
+
+	memset(&state, 0, sizeof(ThumbnailState));
+	g_mutex_lock(&animation->mutex);
+
+	while(!animation->stopping)
+	{
+		gint next = -1;
+		GdkPixbuf *pixbuf;
+		Mj2Frame *slot;
+
+		for(guint k = 0; k < animation->depth && next < 0; k++)
+		{
+			guint index = (animation->wanted + k) % frames;
+			slot = &animation->ring[index % animation->depth];
+
+			// The first frame is always kept as the static image
+
+			if(index != 0 && (!slot->pixbuf || slot->index != index))
+			{
+				next = (gint) index;
+			}
+		}
+
+		if(next < 0)
+		{
+			g_cond_wait(&animation->cond, &animation->mutex);
+			continue;
+		}
+
+		animation->decoding = next;
+		g_mutex_unlock(&animation->mutex);
+
+		pixbuf = mj2_animation_decode(animation, (guint) next, &state, NULL);
+
+		g_mutex_lock(&animation->mutex);
+		animation->decoding = -1;
+
+		if(!pixbuf)
+		{
+			pixbuf = g_object_ref(animation->first);
+		}
+
+		// Playback may have moved on while decoding, the frame is only kept while it's still ahead
+
+		if(mj2_animation_ahead(animation, (guint) next))
+		{
+			slot = &animation->ring[(guint) next % animation->depth];
+			g_clear_object(&slot->pixbuf);
+			slot->pixbuf = pixbuf;
+			slot->index = (guint) next;
+		} else {
+			g_object_unref(pixbuf);
+		}
+
+		g_cond_broadcast(&animation->cond);
+	}
+
+	g_mutex_unlock(&animation->mutex);
+	thumbnail_clear(&state);
+
+	return NULL;
+}
+
+/**
+ * Frame index of animation, from the ring when the worker got to it, otherwise decoded right here.
+ * Moves the worker on to the frames after it.
+ */
+static GdkPixbuf *mj2_animation_frame(Mj2Animation *animation, guint index)
+{
+	GdkPixbuf *pixbuf = NULL;
+	ThumbnailState state;
+	Mj2Frame *slot = &animation->ring[index % animation->depth];
+
+	g_mutex_lock(&animation->mutex);
+	animation->wanted = index;
+	g_cond_broadcast(&animation->cond);
+
+	if(index == 0)
+	{
+		g_mutex_unlock(&animation->mutex);
+		return g_object_ref(animation->first);
+	}
+
+	if(!animation->worker)
+	{
+		animation->worker = g_thread_try_new("jp2-mj2", mj2_animation_worker, animation, NULL);
+	}
+
+	while(animation->decoding == (gint) index)
+	{
+		g_cond_wait(&animation->cond, &animation->mutex);
+	}
+
+	if(slot->pixbuf && slot->index == index)
+	{
+		pixbuf = g_object_ref(slot->pixbuf);
+	}
+
+	g_mutex_unlock(&animation->mutex);
+
+	if(pixbuf)
+	{
+		return pixbuf;
+	}
+
+	// The worker fell behind, or couldn't start
+
+	memset(&state, 0, sizeof(ThumbnailState));
+	pixbuf = mj2_animation_decode(animation, index, &state, NULL);
+	thumbnail_clear(&state);
+
+	if(!pixbuf)
+	{
+		pixbuf = g_object_ref(animation->first);
+	}
+
+	g_mutex_lock(&animation->mutex);
+	if(mj2_animation_ahead(animation, index))
+	{
+		g_clear_object(&slot->pixbuf);
+		slot->pixbuf = g_object_ref(pixbuf);
+		slot->index = index;
+	}
+	g_mutex_unlock(&animation->mutex);
+
+	return pixbuf;
+}
+
+/**
+ * Sample playing position milliseconds into the clip.
+ */
+static guint mj2_animation_find(Mj2Animation *animation, guint64 position)
+{
+	guint low = 0, high = animation->samples->len;
+
+	while(high - low > 1)
+	{
+		guint middle = (low + high) / 2;
+
+		if(g_array_index(animation->samples, Mj2Sample, middle).start <= position)
+		{
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+
+static gint64 mj2_time(const GTimeVal *time)
+{
+	if(!time)
+	{
+		return g_get_real_time() / 1000;
+	}
+
+	return (gint64) time->tv_sec * 1000 + time->tv_usec / 1000;
+}
+
+static gboolean mj2_animation_iter_advance(GdkPixbufAnimationIter *base, const GTimeVal *current_time)
+{
+	Mj2AnimationIter *iter = (Mj2AnimationIter *) base;
+	gint64 now = mj2_time(current_time);
+	guint frame;
+
+	if(now < iter->start)
+	{
+		// The clock went back, start over from there
+
+		iter->start = now;
+	}
+
+	iter->position = (guint64) (now - iter->start) % MAX(iter->animation->duration, 1);
+	frame = mj2_animation_find(iter->animation, iter->position);
+
+	if(frame == iter->frame)
+	{
+		return FALSE;
+	}
+
+	iter->frame = frame;
+	g_clear_object(&iter->pixbuf);
+
+	return TRUE;
+}
+
+static GdkPixbufAnimationIter *mj2_animation_get_iter(GdkPixbufAnimation *base, const GTimeVal *start_time)
+{
+	Mj2AnimationIter *iter = g_object_new(mj2_animation_iter_get_type(), NULL);
+
+	iter->animation = g_object_ref((Mj2Animation *) base);
+	iter->start = mj2_time(start_time);
+
+	return (GdkPixbufAnimationIter *) iter;
+}
+
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static int mj2_animation_iter_get_delay_time(GdkPixbufAnimationIter *base)
+{
+	Mj2AnimationIter *iter = (Mj2AnimationIter *) base;
+	const Mj2Sample *sample = &g_array_index(iter->animation->samples, Mj2Sample, iter->frame);
+
+	if(iter->animation->samples->len == 1)
+	{
+		return -1;
+	}
+
+	return (int) MAX(sample->start + sample->delay - iter->position, 1);
+}
+
+static GdkPixbuf *mj2_animation_iter_get_pixbuf(GdkPixbufAnimationIter *base)
+{
+	Mj2AnimationIter *iter = (Mj2AnimationIter *) base;
+
+	if(!iter->pixbuf)
+	{
+		iter->pixbuf = mj2_animation_frame(iter->animation, iter->frame);
+	}
+
+	return iter->pixbuf;
+}
+
+static gboolean mj2_animation_iter_on_currently_loading_frame(GdkPixbufAnimationIter *base)
+{
+	return FALSE;
+}
+
+static void mj2_animation_iter_finalize(GObject *object)
+{
+	Mj2AnimationIter *iter = (Mj2AnimationIter *) object;
+
+	g_clear_object(&iter->pixbuf);
+	g_clear_object(&iter->animation);
+
+	G_OBJECT_CLASS(mj2_animation_iter_parent_class)->finalize(object);
+}
+
+static void mj2_animation_iter_class_init(Mj2AnimationIterClass *klass)
+{
+	GdkPixbufAnimationIterClass *iter_class = GDK_PIXBUF_ANIMATION_ITER_CLASS(klass);
+
+	G_OBJECT_CLASS(klass)->finalize = mj2_animation_iter_finalize;
+	iter_class->get_delay_time = mj2_animation_iter_get_delay_time;
+	iter_class->get_pixbuf = mj2_animation_iter_get_pixbuf;
+	iter_class->on_currently_loading_frame = mj2_animation_iter_on_currently_loading_frame;
+	iter_class->advance = mj2_animation_iter_advance;
+}
+
+static void mj2_animation_iter_init(Mj2AnimationIter *iter)
+{
+}
+
+static gboolean mj2_animation_is_static_image(GdkPixbufAnimation *base)
+{
+	return ((Mj2Animation *) base)->samples->len == 1;
+}
+
+static GdkPixbuf *mj2_animation_get_static_image(GdkPixbufAnimation *base)
+{
+	return ((Mj2Animation *) base)->first;
+}
+
+static void mj2_animation_get_size(GdkPixbufAnimation *base, int *width, int *height)
+{
+	Mj2Animation *animation = (Mj2Animation *) base;
+
+	if(width)
+	{
+		*width = animation->width;
+	}
+
+	if(height)
+	{
+		*height = animation->height;
+	}
+}
+
+static void mj2_animation_finalize(GObject *object)
+{
+	Mj2Animation *animation = (Mj2Animation *) object;
+
+	if(animation->worker)
+	{
+		g_mutex_lock(&animation->mutex);
+		animation->stopping = TRUE;
+		g_cond_broadcast(&animation->cond);
+		g_mutex_unlock(&animation->mutex);
+		g_thread_join(animation->worker);
+	}
+
+	for(guint i = 0; i < animation->depth; i++)
+	{
+		g_clear_object(&animation->ring[i].pixbuf);
+	}
+
+	g_free(animation->ring);
+	g_clear_object(&animation->first);
+	g_array_unref(animation->samples);
+	g_bytes_unref(animation->bytes);
+	g_cond_clear(&animation->cond);
+	g_mutex_clear(&animation->mutex);
+
+	G_OBJECT_CLASS(mj2_animation_parent_class)->finalize(object);
+}
+
+static void mj2_animation_class_init(Mj2AnimationClass *klass)
+{
+	GdkPixbufAnimationClass *animation_class = GDK_PIXBUF_ANIMATION_CLASS(klass);
+
+	G_OBJECT_CLASS(klass)->finalize = mj2_animation_finalize;
+	animation_class->is_static_image = mj2_animation_is_static_image;
+	animation_class->get_static_image = mj2_animation_get_static_image;
+	animation_class->get_size = mj2_animation_get_size;
+	animation_class->get_iter = mj2_animation_get_iter;
+}
+
+static void mj2_animation_init(Mj2Animation *animation)
+{
+	g_mutex_init(&animation->mutex);
+	g_cond_init(&animation->cond);
+	animation->samples = g_array_new(FALSE, TRUE, sizeof(Mj2Sample));
+	animation->decoding = -1;
+}
+
+/**
+ * Animation of the Motion JPEG 2000 file in bytes, which it keeps a reference to. Only the first frame is decoded here,
+ * the worker that decodes ahead starts when a frame after it is asked for.
+ */
+GdkPixbufAnimation *mj2_animation_new(GBytes *bytes, GError **error)
+{
+	Mj2Animation *animation = g_object_new(mj2_animation_get_type(), NULL);
+	ThumbnailState state;
+	gsize length;
+	const guint8 *data = g_bytes_get_data(bytes, &length);
+	Mj2Sample *last;
+
+	animation->bytes = g_bytes_ref(bytes);
+
+	if(!mj2_parse(data, length, animation->samples, error))
+	{
+		g_object_unref(animation);
+		return NULL;
+	}
+
+	memset(&state, 0, sizeof(ThumbnailState));
+	animation->first = mj2_animation_decode(animation, 0, &state, error);
+	thumbnail_clear(&state);
+
+	if(!animation->first)
+	{
+		g_object_unref(animation);
+		return NULL;
+	}
+
+	last = &g_array_index(animation->samples, Mj2Sample, animation->samples->len - 1);
+	animation->duration = last->start + last->delay;
+	animation->width = gdk_pixbuf_get_width(animation->first);
+	animation->height = gdk_pixbuf_get_height(animation->first);
+	animation->depth = MIN(mj2_prefetch_frames(), animation->samples->len);
+	animation->ring = g_new0(Mj2Frame, animation->depth);
+
+	return (GdkPixbufAnimation *) animation;
+}
+
+#endif
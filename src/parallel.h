@@ -0,0 +1,407 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <openjpeg.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+#include <profile.h>
+
+// Tile-parallel decoding: every worker opens its own codec over the same buffer and
+// decodes whole tiles with opj_get_decoded_tile, converting them straight into the output.
+
+typedef struct {
+	GMutex mutex;
+	guint next; // next tile the owner decodes
+	guint end;  // one past the last tile of the range
+} ParallelRange;
+
+typedef struct {
+	const guint8 *data;
+	gsize length;
+	int codec_type;
+	guint reduce;  // highest resolution levels to discard
+	guint layers;  // quality layers to decode, 0 for all
+	const ColorComponents *selection; // components to decode
+	guint workers;
+	GCancellable *cancellable; // checked before every tile
+	ParallelRange *ranges; // one per worker
+	gint failed;           // set atomically, stops every worker
+
+	GMutex mutex; // guards everything below
+	gboolean has_size;
+	guint32 x0, y0;        // origin of component 0 of the whole image, at the decoded resolution
+	guint32 width, height; // size of component 0 of the whole image, at the decoded resolution
+	int components;
+	COLOR_SPACE colorspace;
+	guint8 *pixels;
+	gsize rowstride;
+	GdkPixbufDestroyNotify destroy; // releases pixels, from util_alloc_pixels
+	gpointer destroy_data;
+	GError *error;
+} Parallel;
+
+typedef struct {
+	Parallel *parallel;
+	guint index;
+} ParallelWorker;
+
+/**
+ * Record the first error and stop all workers, later errors are dropped.
+ */
+static void parallel_fail(Parallel *parallel, GError *error)
+{
+	g_mutex_lock(&parallel->mutex);
+	if(!parallel->error)
+	{
+		parallel->error = error;
+		error = NULL;
+	}
+	g_mutex_unlock(&parallel->mutex);
+
+	g_clear_error(&error);
+	g_atomic_int_set(&parallel->failed, TRUE);
+}
+
+/**
+ * Pick the next tile for worker.
+ * Workers take tiles from the front of their own range, and when it runs dry steal the back half of the fullest other range.
+ * Returns FALSE when no tiles are left anywhere.
+ */
+static gboolean parallel_take(Parallel *parallel, guint worker, guint *tile)
+{
+	ParallelRange *own = &parallel->ranges[worker];
+
+	g_mutex_lock(&own->mutex);
+	if(own->next < own->end)
+	{
+		*tile = own->next++;
+		g_mutex_unlock(&own->mutex);
+		return TRUE;
+	}
+	g_mutex_unlock(&own->mutex);
+
+	while(!g_atomic_int_get(&parallel->failed))
+	{
+		ParallelRange *victim = NULL;
+		guint most = 0, start, end;
+
+		for(guint i = 0; i < parallel->workers; i++)
+		{
+			guint left;
+
+			if(i == worker)
+			{
+				continue;
+			}
+
+			g_mutex_lock(&parallel->ranges[i].mutex);
+			left = parallel->ranges[i].end - parallel->ranges[i].next;
+			g_mutex_unlock(&parallel->ranges[i].mutex);
+
+			if(left > most)
+			{
+				most = left;
+				victim = &parallel->ranges[i];
+			}
+		}
+
+		if(!victim)
+		{
+			return FALSE;
+		}
+
+		g_mutex_lock(&victim->mutex);
+		if(victim->next >= victim->end)
+		{
+			// Emptied since we looked, try again
+			g_mutex_unlock(&victim->mutex);
+			continue;
+		}
+		start = victim->next + (victim->end - victim->next) / 2;
+		end = victim->end;
+		victim->end = start;
+		g_mutex_unlock(&victim->mutex);
+
+		g_mutex_lock(&own->mutex);
+		own->next = start + 1;
+		own->end = end;
+		g_mutex_unlock(&own->mutex);
+
+		*tile = start;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Convert a decoded tile and copy it into its place in the output.
+ * The output is allocated by whichever worker gets here first, the tile's colorspace decides its layout.
+ */
+static gboolean parallel_convert(Parallel *parallel, opj_image_t *image, guint tile, guint8 **scratch, gsize *scratch_size)
+{
+	int components = -1;
+	COLOR_SPACE colorspace = -1;
+	guint32 tile_x0, tile_y0;
+	gsize x, y, width, height;
+	gint64 begin;
+
+	if(!color_info(image, &components, &colorspace))
+	{
+		parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unsupported colorspace"));
+		return FALSE;
+	}
+
+	g_mutex_lock(&parallel->mutex);
+	if(!parallel->pixels)
+	{
+		gsize size;
+
+		if(!util_pixels_size(parallel->width, parallel->height, components, &size, &parallel->rowstride))
+		{
+			g_mutex_unlock(&parallel->mutex);
+			parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Image dimensions are too large"));
+			return FALSE;
+		}
+
+		parallel->components = components;
+		parallel->colorspace = colorspace;
+		parallel->pixels = util_alloc_pixels(size, &parallel->destroy, &parallel->destroy_data);
+	}
+	g_mutex_unlock(&parallel->mutex);
+
+	if(!parallel->pixels)
+	{
+		parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Not enough memory to load image"));
+		return FALSE;
+	}
+
+	if(parallel->components != components || parallel->colorspace != colorspace)
+	{
+		parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Tile %u has a different colorspace than the rest of the image", tile));
+		return FALSE;
+	}
+
+	util_tile_origin(image, &tile_x0, &tile_y0);
+	width = image->comps[0].w;
+	height = image->comps[0].h;
+	x = tile_x0 - parallel->x0;
+	y = tile_y0 - parallel->y0;
+
+	if(tile_x0 < parallel->x0 || tile_y0 < parallel->y0 || x + width > parallel->width || y + height > parallel->height)
+	{
+		parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Tile %u lies outside the image", tile));
+		return FALSE;
+	}
+
+	// Tiles are small enough that converting into a scratch buffer and copying the rows stays in cache
+
+	begin = PROFILE_BEGIN();
+	color_convert_tile(image, colorspace, components, parallel->pixels, parallel->rowstride, x, y, scratch, scratch_size);
+	PROFILE_MARK(begin, "convert", "tile %u, %" G_GSIZE_FORMAT "x%" G_GSIZE_FORMAT " %s", tile, width, height, color_space_name(colorspace));
+
+	return TRUE;
+}
+
+static gpointer parallel_worker(gpointer data)
+{
+	ParallelWorker *worker = (ParallelWorker *) data;
+	Parallel *parallel = worker->parallel;
+	opj_codec_t *codec = NULL;
+	opj_image_t *image = NULL;
+	opj_stream_t *stream = NULL;
+	opj_dparameters_t parameters;
+	guint8 *scratch = NULL;
+	gsize scratch_size = 0;
+	gboolean subset = FALSE;
+	GError *error = NULL;
+	guint tile;
+
+	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = parallel->reduce;
+	parameters.cp_layer = parallel->layers;
+	color_components_setup(&parameters, parallel->selection);
+
+	stream = util_create_buffer_stream(parallel->data, parallel->length);
+	codec = opj_create_decompress(parallel->codec_type);
+
+	#if DEBUG == TRUE
+		opj_set_info_handler(codec, info_callback, 00);
+		opj_set_warning_handler(codec, warning_callback, 00);
+		opj_set_error_handler(codec, error_callback, 00);
+	#endif
+
+	if(!stream || !codec || !opj_setup_decoder(codec, &parameters) || !opj_codec_set_threads(codec, 1) || !opj_read_header(stream, codec, &image))
+	{
+		util_destroy(codec, stream, image);
+		parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to read header"));
+		return NULL;
+	}
+
+	if(!color_components_select(codec, image, parallel->selection, &subset, &error))
+	{
+		util_destroy(codec, stream, image);
+		parallel_fail(parallel, error);
+		return NULL;
+	}
+
+	// Every worker sees the same header, the first one to get here records the image size
+
+	g_mutex_lock(&parallel->mutex);
+	if(!parallel->has_size)
+	{
+		util_component_area(image, parallel->reduce, &parallel->x0, &parallel->y0, &parallel->width, &parallel->height);
+		parallel->has_size = TRUE;
+	}
+	g_mutex_unlock(&parallel->mutex);
+
+	while(!g_atomic_int_get(&parallel->failed) && parallel_take(parallel, worker->index, &tile))
+	{
+		gint64 begin;
+
+		if(g_cancellable_set_error_if_cancelled(parallel->cancellable, &error))
+		{
+			parallel_fail(parallel, error);
+			break;
+		}
+
+		begin = PROFILE_BEGIN();
+
+		if(!opj_get_decoded_tile(codec, stream, image, tile))
+		{
+			parallel_fail(parallel, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode tile %u", tile));
+			break;
+		}
+
+		PROFILE_MARK(begin, "decode", "tile %u, worker %u", tile, worker->index);
+
+		color_components_apply(image, parallel->selection, subset);
+
+		if(!parallel_convert(parallel, image, tile, &scratch, &scratch_size))
+		{
+			break;
+		}
+	}
+
+	g_free(scratch);
+	util_destroy(codec, stream, image);
+
+	return NULL;
+}
+
+/**
+ * Decode all tiles of the codestream or JP2 file in data on up to workers threads, the calling thread included.
+ * Tiles are handed out as contiguous ranges, one per worker, and idle workers steal from the others.
+ * reduce discards that many of the highest resolution levels, like cp_reduce, layers limits the quality layers like cp_layer,
+ * and only the components picked by selection are decoded. Cancelling cancellable stops every worker before its next tile.
+ */
+GdkPixbuf *parallel_decode(const guint8 *data, gsize length, int codec_type, guint tiles, guint reduce, guint layers, const ColorComponents *selection, guint workers, GCancellable *cancellable, GError **error)
+{
+	Parallel parallel;
+	ParallelWorker *worker_data;
+	GThread **threads;
+	GdkPixbuf *pixbuf = NULL;
+
+	workers = CLAMP(workers, 1, MAX(tiles, 1));
+
+	memset(&parallel, 0, sizeof(Parallel));
+	parallel.data = data;
+	parallel.length = length;
+	parallel.codec_type = codec_type;
+	parallel.reduce = reduce;
+	parallel.layers = layers;
+	parallel.selection = selection;
+	parallel.workers = workers;
+	parallel.cancellable = cancellable;
+	parallel.ranges = g_new0(ParallelRange, workers);
+	g_mutex_init(&parallel.mutex);
+
+	worker_data = g_new0(ParallelWorker, workers);
+	threads = g_new0(GThread *, workers);
+
+	for(guint i = 0; i < workers; i++)
+	{
+		g_mutex_init(&parallel.ranges[i].mutex);
+		parallel.ranges[i].next = (guint) ((guint64) tiles * i / workers);
+		parallel.ranges[i].end = (guint) ((guint64) tiles * (i + 1) / workers);
+		worker_data[i].parallel = &parallel;
+		worker_data[i].index = i;
+	}
+
+	// A worker that fails to start leaves its range to be stolen by the others
+
+	for(guint i = 1; i < workers; i++)
+	{
+		threads[i] = g_thread_try_new("jp2-tile", parallel_worker, &worker_data[i], NULL);
+	}
+
+	parallel_worker(&worker_data[0]);
+
+	for(guint i = 1; i < workers; i++)
+	{
+		if(threads[i])
+		{
+			g_thread_join(threads[i]);
+		}
+	}
+
+	if(parallel.error)
+	{
+		g_propagate_error(error, parallel.error);
+
+		if(parallel.pixels)
+		{
+			parallel.destroy(parallel.pixels, parallel.destroy_data);
+		}
+	}
+	else if(!parallel.pixels)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Image has no tiles");
+	} else {
+		pixbuf = gdk_pixbuf_new_from_data(
+			(const guchar*) parallel.pixels,
+			GDK_COLORSPACE_RGB,
+			(parallel.components == 4),
+			8,
+			(int) parallel.width,
+			(int) parallel.height,
+			(int) parallel.rowstride,
+			parallel.destroy,
+			parallel.destroy_data
+		);
+	}
+
+	for(guint i = 0; i < workers; i++)
+	{
+		g_mutex_clear(&parallel.ranges[i].mutex);
+	}
+	g_mutex_clear(&parallel.mutex);
+	g_free(parallel.ranges);
+	g_free(worker_data);
+	g_free(threads);
+
+	return pixbuf;
+}
+
+#endif
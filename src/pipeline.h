@@ -0,0 +1,306 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <openjpeg.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+#include <profile.h>
+
+// Decode/convert pipeline: a decoder thread entropy decodes tile N+1 while the calling thread
+// converts tile N. Decoded tiles wait in a queue that holds at most depth tiles.
+
+typedef struct {
+	guint32 x0, y0;        // origin of component 0 of the whole image, at the decoded resolution
+	guint32 width, height; // size of component 0 of the whole image, at the decoded resolution
+} PipelineImage;
+
+/**
+ * Called on the thread that runs pipeline_decode for every decoded tile, in tile order.
+ * tile is only valid during the call. Return FALSE and set error to stop decoding.
+ */
+typedef gboolean (*PipelineTileFunc)(const PipelineImage *image, opj_image_t *tile, guint index, gpointer user_data, GError **error);
+
+typedef struct {
+	opj_image_t *image;
+	guint index;
+} PipelineTile;
+
+typedef struct {
+	const guint8 *data;
+	gsize length;
+	int codec_type;
+	guint tiles;
+	guint reduce; // highest resolution levels to discard
+	const ColorComponents *selection; // components to decode
+	guint depth;
+	GCancellable *cancellable; // checked before every tile, on both threads
+
+	GMutex mutex; // guards everything below
+	GCond cond;
+	GQueue queue;       // of PipelineTile, at most depth long
+	gboolean done;      // decoder is finished, nothing more will be queued
+	gboolean cancelled; // converter gave up, decoder should stop
+	PipelineImage image;
+	GError *error;      // set by the decoder
+} Pipeline;
+
+/**
+ * Take the decoded data out of image into an image of its own, leaving image ready for the next opj_get_decoded_tile.
+ */
+static opj_image_t *pipeline_detach(opj_image_t *image)
+{
+	opj_image_t *tile = g_new0(opj_image_t, 1);
+
+	*tile = *image;
+	tile->icc_profile_buf = NULL;
+	tile->icc_profile_len = 0;
+	tile->comps = g_new(opj_image_comp_t, image->numcomps);
+	memcpy(tile->comps, image->comps, image->numcomps * sizeof(opj_image_comp_t));
+
+	for(OPJ_UINT32 i = 0; i < image->numcomps; i++)
+	{
+		image->comps[i].data = NULL;
+	}
+
+	return tile;
+}
+
+static void pipeline_free(opj_image_t *tile)
+{
+	for(OPJ_UINT32 i = 0; i < tile->numcomps; i++)
+	{
+		opj_image_data_free(tile->comps[i].data);
+	}
+
+	g_free(tile->comps);
+	g_free(tile);
+}
+
+static void pipeline_finish(Pipeline *pipeline, GError *error)
+{
+	g_mutex_lock(&pipeline->mutex);
+	pipeline->done = TRUE;
+	pipeline->error = error;
+	g_cond_broadcast(&pipeline->cond);
+	g_mutex_unlock(&pipeline->mutex);
+}
+
+static gpointer pipeline_decoder(gpointer data)
+{
+	Pipeline *pipeline = (Pipeline *) data;
+	opj_codec_t *codec = NULL;
+	opj_image_t *image = NULL;
+	opj_stream_t *stream = NULL;
+	opj_dparameters_t parameters;
+	gboolean subset = FALSE;
+	GError *error = NULL;
+
+	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = pipeline->reduce;
+	color_components_setup(&parameters, pipeline->selection);
+
+	stream = util_create_buffer_stream(pipeline->data, pipeline->length);
+	codec = opj_create_decompress(pipeline->codec_type);
+
+	#if DEBUG == TRUE
+		opj_set_info_handler(codec, info_callback, 00);
+		opj_set_warning_handler(codec, warning_callback, 00);
+		opj_set_error_handler(codec, error_callback, 00);
+	#endif
+
+	if(!stream || !codec || !opj_setup_decoder(codec, &parameters) || !opj_codec_set_threads(codec, 1) || !opj_read_header(stream, codec, &image))
+	{
+		util_destroy(codec, stream, image);
+		pipeline_finish(pipeline, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to read header"));
+		return NULL;
+	}
+
+	if(!color_components_select(codec, image, pipeline->selection, &subset, &error))
+	{
+		util_destroy(codec, stream, image);
+		pipeline_finish(pipeline, error);
+		return NULL;
+	}
+
+	g_mutex_lock(&pipeline->mutex);
+	util_component_area(image, pipeline->reduce, &pipeline->image.x0, &pipeline->image.y0, &pipeline->image.width, &pipeline->image.height);
+	g_mutex_unlock(&pipeline->mutex);
+
+	for(guint i = 0; i < pipeline->tiles; i++)
+	{
+		PipelineTile *tile;
+		gint64 begin;
+
+		if(g_cancellable_set_error_if_cancelled(pipeline->cancellable, &error))
+		{
+			util_destroy(codec, stream, image);
+			pipeline_finish(pipeline, error);
+			return NULL;
+		}
+
+		begin = PROFILE_BEGIN();
+
+		if(!opj_get_decoded_tile(codec, stream, image, i))
+		{
+			util_destroy(codec, stream, image);
+			pipeline_finish(pipeline, g_error_new(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode tile %u", i));
+			return NULL;
+		}
+
+		PROFILE_MARK(begin, "decode", "tile %u", i);
+
+		color_components_apply(image, pipeline->selection, subset);
+
+		tile = g_new(PipelineTile, 1);
+		tile->image = pipeline_detach(image);
+		tile->index = i;
+
+		g_mutex_lock(&pipeline->mutex);
+		while(pipeline->queue.length >= pipeline->depth && !pipeline->cancelled)
+		{
+			g_cond_wait(&pipeline->cond, &pipeline->mutex);
+		}
+
+		if(pipeline->cancelled)
+		{
+			g_mutex_unlock(&pipeline->mutex);
+			pipeline_free(tile->image);
+			g_free(tile);
+			break;
+		}
+
+		g_queue_push_tail(&pipeline->queue, tile);
+		g_cond_broadcast(&pipeline->cond);
+		g_mutex_unlock(&pipeline->mutex);
+	}
+
+	util_destroy(codec, stream, image);
+	pipeline_finish(pipeline, NULL);
+
+	return NULL;
+}
+
+/**
+ * Decode the tiles of the codestream or JP2 file in data on a second thread, handing each to tile_func on this one.
+ * depth is the number of decoded tiles that may wait for tile_func, which bounds the memory held by the pipeline.
+ * reduce discards that many of the highest resolution levels, like cp_reduce, and only the components picked by selection are decoded.
+ * Cancelling cancellable stops both threads before their next tile, tiles that were already decoded are dropped.
+ */
+gboolean pipeline_decode(const guint8 *data, gsize length, int codec_type, guint tiles, guint reduce, const ColorComponents *selection, guint depth, GCancellable *cancellable, PipelineTileFunc tile_func, gpointer user_data, GError **error)
+{
+	Pipeline pipeline;
+	GThread *thread;
+	GError *tile_error = NULL;
+	gboolean ok = TRUE;
+
+	memset(&pipeline, 0, sizeof(Pipeline));
+	pipeline.data = data;
+	pipeline.length = length;
+	pipeline.codec_type = codec_type;
+	pipeline.tiles = tiles;
+	pipeline.reduce = reduce;
+	pipeline.selection = selection;
+	pipeline.depth = MAX(depth, 1);
+	pipeline.cancellable = cancellable;
+	g_mutex_init(&pipeline.mutex);
+	g_cond_init(&pipeline.cond);
+	g_queue_init(&pipeline.queue);
+
+	thread = g_thread_try_new("jp2-decode", pipeline_decoder, &pipeline, error);
+	if(!thread)
+	{
+		g_cond_clear(&pipeline.cond);
+		g_mutex_clear(&pipeline.mutex);
+		return FALSE;
+	}
+
+	for(;;)
+	{
+		PipelineTile *tile;
+		PipelineImage image;
+
+		g_mutex_lock(&pipeline.mutex);
+		while(g_queue_is_empty(&pipeline.queue) && !pipeline.done)
+		{
+			g_cond_wait(&pipeline.cond, &pipeline.mutex);
+		}
+		tile = g_queue_pop_head(&pipeline.queue);
+		image = pipeline.image;
+		g_cond_broadcast(&pipeline.cond);
+		g_mutex_unlock(&pipeline.mutex);
+
+		if(!tile)
+		{
+			break;
+		}
+
+		if(!g_cancellable_set_error_if_cancelled(cancellable, &tile_error))
+		{
+			ok = tile_func(&image, tile->image, tile->index, user_data, &tile_error);
+		} else {
+			ok = FALSE;
+		}
+
+		pipeline_free(tile->image);
+		g_free(tile);
+
+		if(!ok)
+		{
+			g_mutex_lock(&pipeline.mutex);
+			pipeline.cancelled = TRUE;
+			g_cond_broadcast(&pipeline.cond);
+			g_mutex_unlock(&pipeline.mutex);
+			break;
+		}
+	}
+
+	g_thread_join(thread);
+
+	// Whatever the decoder queued after we stopped taking tiles
+
+	while(!g_queue_is_empty(&pipeline.queue))
+	{
+		PipelineTile *tile = g_queue_pop_head(&pipeline.queue);
+		pipeline_free(tile->image);
+		g_free(tile);
+	}
+
+	if(tile_error)
+	{
+		g_propagate_error(error, tile_error);
+		g_clear_error(&pipeline.error);
+	}
+	else if(pipeline.error)
+	{
+		g_propagate_error(error, pipeline.error);
+		ok = FALSE;
+	}
+
+	g_cond_clear(&pipeline.cond);
+	g_mutex_clear(&pipeline.mutex);
+
+	return ok;
+}
+
+#endif
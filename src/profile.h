@@ -0,0 +1,46 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <glib.h>
+
+// Sysprof capture marks, built with -Dsysprof=enabled. Marks land on the timeline of whatever application loads the
+// module while sysprof records it, in the "jp2" group. Without sysprof the macros compile to nothing.
+
+#ifdef HAVE_SYSPROF
+	#include <sysprof-capture.h>
+
+	/**
+	 * Start of a marked span.
+	 */
+	#define PROFILE_BEGIN() SYSPROF_CAPTURE_CURRENT_TIME
+
+	/**
+	 * Mark the span from begin until now as name, with a printf-style message.
+	 */
+	#define PROFILE_MARK(begin, name, ...) \
+		sysprof_collector_mark_printf((begin), SYSPROF_CAPTURE_CURRENT_TIME - (begin), "jp2", (name), __VA_ARGS__)
+#else
+	#define PROFILE_BEGIN() ((gint64) 0)
+	#define PROFILE_MARK(begin, name, ...) G_STMT_START { (void) (begin); } G_STMT_END
+#endif
+
+#endif
@@ -0,0 +1,287 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <glib.h>
+#include <openjpeg.h>
+#include <string.h>
+#include <color.h>
+
+// Area-average downscaling while converting: every converted source pixel is added to the sum of the output pixel
+// it falls in, so the output is produced straight from small strips and the full-size image never exists. Sums are only
+// kept for a band of output rows: tiles arrive in raster order, and once the last tile of a row of tiles is added the
+// output rows above its bottom edge are final, stored and dropped from the band.
+
+typedef struct {
+	guint32 src_width, src_height; // size of the decoded image
+	guint32 width, height;         // size of the output, at most the decoded size
+	int components;
+	guint32 *columns;   // output column of every source column
+	guint32 *rows;      // output row of every source row
+	guint32 *sums;      // running sum of every output sample in the band
+	guint32 *counts;    // source pixels added to every output pixel of the band so far
+	guint32 band_y;     // first output row of the band, the rows above it are stored
+	guint32 band_rows;  // output rows the band has room for, grown as tiles need
+} Scale;
+
+/**
+ * Prepare scale to shrink src_width x src_height pixels of components bytes each to width x height.
+ * Returns FALSE when the output isn't smaller, or when that many source pixels per output pixel could overflow the sums.
+ */
+gboolean scale_init(Scale *scale, guint32 src_width, guint32 src_height, guint32 width, guint32 height, int components)
+{
+	guint64 per_pixel;
+
+	memset(scale, 0, sizeof(Scale));
+
+	if(width == 0 || height == 0 || width > src_width || height > src_height || (width == src_width && height == src_height))
+	{
+		return FALSE;
+	}
+
+	// The widest output pixel covers ceil(src / dst) source pixels in each direction
+
+	per_pixel = (((guint64) src_width + width - 1) / width) * (((guint64) src_height + height - 1) / height);
+
+	if(per_pixel > G_MAXUINT32 / 255 || (guint64) width * (guint64) components > G_MAXSIZE / sizeof(guint32) / height)
+	{
+		return FALSE;
+	}
+
+	scale->src_width = src_width;
+	scale->src_height = src_height;
+	scale->width = width;
+	scale->height = height;
+	scale->components = components;
+	scale->band_rows = 1;
+	scale->columns = g_try_new(guint32, src_width);
+	scale->rows = g_try_new(guint32, src_height);
+	scale->sums = g_try_new0(guint32, (gsize) width * (gsize) components);
+	scale->counts = g_try_new0(guint32, (gsize) width);
+
+	if(!scale->columns || !scale->rows || !scale->sums || !scale->counts)
+	{
+		g_free(scale->columns);
+		g_free(scale->rows);
+		g_free(scale->sums);
+		g_free(scale->counts);
+		memset(scale, 0, sizeof(Scale));
+		return FALSE;
+	}
+
+	for(guint32 x = 0; x < src_width; x++)
+	{
+		scale->columns[x] = (guint32) ((guint64) x * width / src_width);
+	}
+
+	for(guint32 y = 0; y < src_height; y++)
+	{
+		scale->rows[y] = (guint32) ((guint64) y * height / src_height);
+	}
+
+	return TRUE;
+}
+
+void scale_clear(Scale *scale)
+{
+	g_free(scale->columns);
+	g_free(scale->rows);
+	g_free(scale->sums);
+	g_free(scale->counts);
+	memset(scale, 0, sizeof(Scale));
+}
+
+/**
+ * Bytes held by scale, which grow with the band.
+ */
+gsize scale_size(const Scale *scale)
+{
+	return ((gsize) scale->src_width + scale->src_height + (gsize) scale->width * scale->band_rows * (gsize) (scale->components + 1)) * sizeof(guint32);
+}
+
+/**
+ * Make room in the band for output rows up to and including row.
+ */
+static void scale_band(Scale *scale, guint32 row)
+{
+	gsize samples = (gsize) scale->width * (gsize) scale->components;
+	guint32 rows;
+
+	if(row - scale->band_y < scale->band_rows)
+	{
+		return;
+	}
+
+	rows = MIN(MAX(scale->band_rows * 2, row - scale->band_y + 1), scale->height - scale->band_y);
+
+	scale->sums = g_renew(guint32, scale->sums, samples * rows);
+	scale->counts = g_renew(guint32, scale->counts, (gsize) scale->width * rows);
+	memset(scale->sums + samples * scale->band_rows, 0, samples * (rows - scale->band_rows) * sizeof(guint32));
+	memset(scale->counts + (gsize) scale->width * scale->band_rows, 0, (gsize) scale->width * (rows - scale->band_rows) * sizeof(guint32));
+	scale->band_rows = rows;
+}
+
+/**
+ * Write the averages of output rows first to last, which must be in the band, columns x0 to x1 into pixels.
+ */
+static void scale_write(Scale *scale, guint8 *pixels, gsize rowstride, gsize x0, gsize x1, gsize first, gsize last)
+{
+	int components = scale->components;
+
+	for(gsize row = first; row <= last; row++)
+	{
+		guint8 *destination = pixels + row * rowstride + x0 * (gsize) components;
+		gsize band_row = (row - scale->band_y) * scale->width;
+
+		for(gsize column = x0; column <= x1; column++)
+		{
+			const guint32 *sum = scale->sums + (band_row + column) * (gsize) components;
+			guint32 count = scale->counts[band_row + column];
+
+			for(int i = 0; i < components; i++)
+			{
+				*destination++ = count ? (guint8) ((sum[i] + count / 2) / count) : 0;
+			}
+		}
+	}
+}
+
+/**
+ * Store the output rows above end, which have all their source pixels, into pixels and drop them from the band.
+ */
+static void scale_flush(Scale *scale, guint8 *pixels, gsize rowstride, guint32 end)
+{
+	gsize samples = (gsize) scale->width * (gsize) scale->components;
+	guint32 done, kept;
+
+	if(end <= scale->band_y)
+	{
+		return;
+	}
+
+	done = end - scale->band_y;
+	scale_write(scale, pixels, rowstride, 0, scale->width - 1, scale->band_y, end - 1);
+
+	kept = done < scale->band_rows ? scale->band_rows - done : 0;
+	memmove(scale->sums, scale->sums + samples * MIN(done, scale->band_rows), samples * kept * sizeof(guint32));
+	memmove(scale->counts, scale->counts + (gsize) scale->width * MIN(done, scale->band_rows), (gsize) scale->width * kept * sizeof(guint32));
+	memset(scale->sums + samples * kept, 0, samples * (scale->band_rows - kept) * sizeof(guint32));
+	memset(scale->counts + (gsize) scale->width * kept, 0, (gsize) scale->width * (scale->band_rows - kept) * sizeof(guint32));
+	scale->band_y = end;
+}
+
+/**
+ * Add rows of converted pixels, packed width pixels to a row, whose top left pixel is at column x, row y of the source.
+ * Rows above the band were stored already and must not be added to again.
+ */
+void scale_add(Scale *scale, const guint8 *pixels, gsize x, gsize y, gsize width, gsize rows)
+{
+	int components = scale->components;
+
+	scale_band(scale, scale->rows[y + rows - 1]);
+
+	for(gsize row = 0; row < rows; row++)
+	{
+		const guint8 *source = pixels + row * width * (gsize) components;
+		gsize output_row = (gsize) (scale->rows[y + row] - scale->band_y) * scale->width;
+
+		for(gsize column = 0; column < width; column++)
+		{
+			gsize output = output_row + scale->columns[x + column];
+			guint32 *sum = scale->sums + output * (gsize) components;
+
+			for(int i = 0; i < components; i++)
+			{
+				sum[i] += source[i];
+			}
+
+			scale->counts[output]++;
+			source += components;
+		}
+	}
+}
+
+/**
+ * Convert a decoded tile whose top left pixel is at column x, row y of the source and add it to the sums.
+ * Tiles must come in raster order. The last tile of a row of tiles finishes the output rows above its bottom edge,
+ * which are stored into pixels as each strip of it lands.
+ * Tiles are converted a strip of rows at a time into scratch, which is grown as needed and can be reused between tiles.
+ * Only sYCC 4:2:0 tiles, whose chroma rows are shared, are converted whole.
+ */
+void scale_convert_tile(Scale *scale, opj_image_t *image, COLOR_SPACE colorspace, gsize x, gsize y, guint8 *pixels, gsize rowstride, guint8 **scratch, gsize *scratch_size)
+{
+	gsize width = image->comps[0].w;
+	gsize height = image->comps[0].h;
+	gsize tile_rowstride = width * (gsize) scale->components;
+	gsize strip = color_convert_by_rows(image) ? CLAMP(65536 / MAX(tile_rowstride, 1), 1, height) : height;
+
+	if(*scratch_size < tile_rowstride * strip)
+	{
+		g_free(*scratch);
+		*scratch_size = tile_rowstride * strip;
+		*scratch = g_malloc(*scratch_size);
+	}
+
+	for(gsize row = 0; row < height; row += strip)
+	{
+		gsize rows = MIN(strip, height - row);
+		gsize next = y + row + rows;
+
+		if(strip == height)
+		{
+			color_convert(image, colorspace, *scratch);
+		} else {
+			color_convert_rows(image, colorspace, row, rows, *scratch);
+		}
+
+		scale_add(scale, *scratch, x, y + row, width, rows);
+
+		if(x + width == scale->src_width)
+		{
+			scale_flush(scale, pixels, rowstride, next < scale->src_height ? scale->rows[next] : scale->height);
+		}
+	}
+}
+
+/**
+ * Write the averages of every output pixel touched by the source area x, y, width, height into pixels.
+ * Pixels on the edges of the area may still be waiting for source pixels of a neighbouring area, they show the average so far.
+ * The output area that was written is returned in out_x, out_y, out_width and out_height.
+ */
+void scale_store(Scale *scale, guint8 *pixels, gsize rowstride, gsize x, gsize y, gsize width, gsize height, gsize *out_x, gsize *out_y, gsize *out_width, gsize *out_height)
+{
+	gsize x0 = scale->columns[x], x1 = scale->columns[x + width - 1];
+	gsize y0 = scale->rows[y], y1 = scale->rows[y + height - 1];
+
+	// Rows above the band were stored with their final values already
+
+	if(y1 >= scale->band_y)
+	{
+		scale_write(scale, pixels, rowstride, x0, x1, MAX(y0, scale->band_y), y1);
+	}
+
+	*out_x = x0;
+	*out_y = y0;
+	*out_width = x1 - x0 + 1;
+	*out_height = y1 - y0 + 1;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <openjpeg.h>
+#include <string.h>
+#include <util.h>
+#include <codestream.h>
+#include <color.h>
+#include <scale.h>
+
+// Thumbnails and previews: decode at the lowest resolution level that still covers the output size, then shrink
+// the rest of the way by area-averaging while converting, like the loader does for GdkPixbufLoader sizes.
+// Shared by jp2-batch and the thumbnailer service, which decode many images in one process.
+
+// The thumbnailer service answers one request per connection on a Unix domain socket. A request is a single line of
+// tab separated fields: priority, "visible" or "background", the size of the box, and the absolute paths of the input
+// and the PNG output. The reply is "OK" or "ERR" and a message, also on a single line. "ERR busy" means the queue
+// was full, "ERR stopping" that the service is shutting down and "ERR timed out" that the request didn't arrive in time,
+// the client should then make the thumbnail itself.
+
+#define THUMBNAIL_REQUEST_MAX 8192 // longest request line
+#define THUMBNAIL_SIZE_MAX 16384   // largest box a request may ask for
+#define THUMBNAIL_REPLY_TIMEOUT 10 // seconds a client waits on the service before making the thumbnail itself
+
+typedef struct {
+	guint8 *scratch; // conversion strips, reused between images
+	gsize scratch_size;
+	guint64 decoded_pixels; // at the decoded resolution, of every image so far
+	guint64 output_pixels;
+} ThumbnailState;
+
+/**
+ * Path of the thumbnailer service socket, from GDK_PIXBUF_JP2_THUMBNAILER_SOCKET or in the user's runtime directory.
+ */
+gchar *thumbnail_socket_path(void)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_THUMBNAILER_SOCKET");
+
+	if(value && *value)
+	{
+		return g_strdup(value);
+	}
+
+	return g_build_filename(g_get_user_runtime_dir(), "jp2-thumbnailer.sock", NULL);
+}
+
+void thumbnail_clear(ThumbnailState *state)
+{
+	g_free(state->scratch);
+	memset(state, 0, sizeof(ThumbnailState));
+}
+
+/**
+ * Size to fit width x height in a size x size box, keeping the aspect ratio. Images that already fit keep their size,
+ * as do all of them when size is 0.
+ */
+void thumbnail_fit(guint64 width, guint64 height, guint size, guint32 *out_width, guint32 *out_height)
+{
+	if(size == 0 || (width <= size && height <= size))
+	{
+		*out_width = (guint32) width;
+		*out_height = (guint32) height;
+	}
+	else if(width >= height)
+	{
+		*out_width = (guint32) size;
+		*out_height = (guint32) MAX((height * (guint64) size + width / 2) / width, 1);
+	} else {
+		*out_height = (guint32) size;
+		*out_width = (guint32) MAX((width * (guint64) size + height / 2) / height, 1);
+	}
+}
+
+/**
+ * Most resolution levels of info to discard that still leave at least width x height, or reduce when it isn't negative.
+ */
+guint thumbnail_reduce(const CodestreamInfo *info, gint reduce, guint32 width, guint32 height)
+{
+	guint levels = info->resolutions > 0 ? info->resolutions - 1u : 0;
+	guint r = 0;
+
+	if(reduce >= 0)
+	{
+		return MIN((guint) reduce, levels);
+	}
+
+	while(r < levels &&
+		util_ceildivpow2(info->x1, r + 1) - util_ceildivpow2(info->x0, r + 1) >= width &&
+		util_ceildivpow2(info->y1, r + 1) - util_ceildivpow2(info->y0, r + 1) >= height)
+	{
+		r++;
+	}
+
+	return r;
+}
+
+/**
+ * Decode the JP2 file or codestream in data at the level for a size x size box, or at reduce when it isn't negative,
+ * and convert it to a pixbuf fitting the box. Decoding is single-threaded, callers decode several images at once.
+ */
+GdkPixbuf *thumbnail_decode(ThumbnailState *state, const guint8 *data, gsize length, guint size, gint reduce, GError **error)
+{
+	CodestreamInfo info;
+	opj_dparameters_t parameters;
+	opj_codec_t *codec = NULL;
+	opj_stream_t *stream = NULL;
+	opj_image_t *image = NULL;
+	int codec_type = util_identify_buffer(data, length);
+	int components = -1;
+	COLOR_SPACE colorspace = -1;
+	gsize offset, codestream_size, pixels_size, rowstride;
+	guint32 width, height, decoded_width, decoded_height;
+	guint8 *pixels;
+	Scale scale;
+	gboolean scaling;
+	GdkPixbuf *pixbuf;
+
+	memset(&info, 0, sizeof(CodestreamInfo));
+
+	if(codec_type < 0)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Not a JPEG2000 file");
+		return NULL;
+	}
+
+	if(!codestream_locate(data, length, &offset, &codestream_size) || codestream_parse(data + offset, codestream_size, &info) != CODESTREAM_OK)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Failed to read header");
+		return NULL;
+	}
+
+	if(reduce >= 0)
+	{
+		// The size box applies to the level picked by hand
+
+		guint r = thumbnail_reduce(&info, reduce, 0, 0);
+		thumbnail_fit(util_ceildivpow2(info.x1, r) - util_ceildivpow2(info.x0, r), util_ceildivpow2(info.y1, r) - util_ceildivpow2(info.y0, r), size, &width, &height);
+	} else {
+		thumbnail_fit((guint64) info.x1 - info.x0, (guint64) info.y1 - info.y0, size, &width, &height);
+	}
+
+	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = thumbnail_reduce(&info, reduce, width, height);
+
+	stream = util_create_buffer_stream(data, length);
+	codec = opj_create_decompress(codec_type);
+
+	if(!stream || !codec || !opj_setup_decoder(codec, &parameters) || !opj_codec_set_threads(codec, 1) || !opj_read_header(stream, codec, &image) ||
+		!opj_decode(codec, stream, image) || !opj_end_decompress(codec, stream))
+	{
+		util_destroy(codec, stream, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode");
+		return NULL;
+	}
+
+	util_destroy(codec, stream, NULL);
+
+	if(!color_info(image, &components, &colorspace))
+	{
+		util_destroy(NULL, NULL, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unsupported colorspace");
+		return NULL;
+	}
+
+	decoded_width = image->comps[0].w;
+	decoded_height = image->comps[0].h;
+	state->decoded_pixels += (guint64) decoded_width * decoded_height;
+
+	// The decoded level is never smaller than asked for, the rest of the way is area-averaged while converting
+
+	scaling = scale_init(&scale, decoded_width, decoded_height, MIN(width, decoded_width), MIN(height, decoded_height), components);
+
+	if(!scaling)
+	{
+		width = decoded_width;
+		height = decoded_height;
+	}
+
+	if(!util_pixels_size(width, height, components, &pixels_size, &rowstride) || !(pixels = g_try_malloc(pixels_size)))
+	{
+		scale_clear(&scale);
+		util_destroy(NULL, NULL, image);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Not enough memory for %ux%u pixels", width, height);
+		return NULL;
+	}
+
+	if(scaling)
+	{
+		// The whole image is one tile, so every output row is stored as its strips land
+
+		scale_convert_tile(&scale, image, colorspace, 0, 0, pixels, rowstride, &state->scratch, &state->scratch_size);
+		scale_clear(&scale);
+	} else {
+		color_convert(image, colorspace, pixels);
+	}
+
+	opj_image_destroy(image);
+
+	pixbuf = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, components == 4, 8, (int) width, (int) height, (int) rowstride, util_free_pixels, NULL);
+	state->output_pixels += (guint64) width * height;
+
+	return pixbuf;
+}
+
+#endif
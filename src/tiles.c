@@ -0,0 +1,533 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <openjpeg.h>
+#include <string.h>
+#include <util.h>
+#include <color.h>
+#include <codestream.h>
+#include <tiles.h>
+
+// A TileSource serves the codestream's own tiles when it has more than one, otherwise areas of TILES_AREA_SIZE pixels
+// decoded with opj_set_decode_area. Decoders keep their codec, header and stream between requests, one for every
+// request in flight at a level. Decoded tiles stay in a cache capped in bytes that drops the least recently used first.
+
+#define TILES_AREA_SIZE 512                      // pixels on a side of the tiles of untiled codestreams
+#define TILES_CACHE_SIZE ((guint64) 256 << 20)   // default byte limit of decoded tiles
+
+typedef struct {
+	opj_codec_t *codec;
+	opj_stream_t *stream;
+	opj_image_t *image; // header, then the last tile decoded
+} TileDecoder;
+
+typedef struct {
+	guint64 key;
+	GdkPixbuf *pixbuf; // NULL while being decoded
+	GError *error;     // why the decode failed, for the requests waiting on it
+	gsize size;
+	guint waiters;     // requests waiting for the decode, the entry stays until they've all seen it
+	GList link;        // in the LRU list once decoded
+} TileEntry;
+
+struct _TileSource {
+	GBytes *bytes;        // the whole file, usually mapped
+	int codec_type;
+	CodestreamInfo info;
+	guint levels;         // resolution levels, 0 is full resolution
+	gboolean tiled;       // served in the codestream's tiles rather than areas
+
+	GMutex mutex;         // guards everything below
+	GCond cond;
+	GHashTable *entries;  // key to TileEntry
+	GQueue lru;           // decoded entries, most recently used first
+	guint64 limit;        // bytes
+	TileStats stats;
+	GQueue *decoders;     // idle TileDecoders, a queue per level
+};
+
+/**
+ * Bytes of decoded tiles a TileSource keeps, GDK_PIXBUF_JP2_TILE_CACHE_SIZE or 256 MiB.
+ */
+guint64 tile_source_cache_limit(void)
+{
+	return util_parse_size(g_getenv("GDK_PIXBUF_JP2_TILE_CACHE_SIZE"), TILES_CACHE_SIZE);
+}
+
+// Decoders
+
+static void tile_decoder_free(TileDecoder *decoder)
+{
+	util_destroy(decoder->codec, decoder->stream, decoder->image);
+	g_free(decoder);
+}
+
+/**
+ * Decoder for level, with its header read.
+ */
+static TileDecoder *tile_decoder_new(TileSource *source, guint level, GError **error)
+{
+	TileDecoder *decoder = g_new0(TileDecoder, 1);
+	opj_dparameters_t parameters;
+	gsize length;
+	const guint8 *data = g_bytes_get_data(source->bytes, &length);
+
+	opj_set_default_decoder_parameters(&parameters);
+	parameters.cp_reduce = level;
+
+	decoder->stream = util_create_buffer_stream(data, length);
+	decoder->codec = opj_create_decompress(source->codec_type);
+
+	if(!decoder->stream || !decoder->codec || !opj_setup_decoder(decoder->codec, &parameters) || !opj_codec_set_threads(decoder->codec, 1) ||
+		!opj_read_header(decoder->stream, decoder->codec, &decoder->image))
+	{
+		tile_decoder_free(decoder);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to read header");
+		return NULL;
+	}
+
+	return decoder;
+}
+
+/**
+ * An idle decoder for level, or a new one when every one of them is busy.
+ */
+static TileDecoder *tile_decoder_acquire(TileSource *source, guint level, GError **error)
+{
+	TileDecoder *decoder;
+
+	g_mutex_lock(&source->mutex);
+	decoder = g_queue_pop_head(&source->decoders[level]);
+	g_mutex_unlock(&source->mutex);
+
+	if(decoder)
+	{
+		return decoder;
+	}
+
+	return tile_decoder_new(source, level, error);
+}
+
+static void tile_decoder_release(TileSource *source, guint level, TileDecoder *decoder)
+{
+	g_mutex_lock(&source->mutex);
+	g_queue_push_head(&source->decoders[level], decoder);
+	g_mutex_unlock(&source->mutex);
+}
+
+// Geometry
+
+/**
+ * Size of the image at level.
+ */
+void tile_source_get_size(TileSource *source, guint level, guint32 *width, guint32 *height)
+{
+	*width = util_ceildivpow2(source->info.x1, level) - util_ceildivpow2(source->info.x0, level);
+	*height = util_ceildivpow2(source->info.y1, level) - util_ceildivpow2(source->info.y0, level);
+}
+
+/**
+ * Resolution levels of source, tiles can be asked for at levels 0 to one less than this.
+ */
+guint tile_source_get_levels(TileSource *source)
+{
+	return source->levels;
+}
+
+/**
+ * Whether source serves the codestream's own tiles, rather than areas of an untiled image.
+ */
+gboolean tile_source_is_tiled(TileSource *source)
+{
+	return source->tiled;
+}
+
+/**
+ * Columns and rows of tiles at level, and the size of a whole one. Tiles at the edges of the image may be smaller.
+ */
+void tile_source_get_grid(TileSource *source, guint level, guint32 *tiles_x, guint32 *tiles_y, guint32 *tile_width, guint32 *tile_height)
+{
+	guint32 width, height;
+
+	if(source->tiled)
+	{
+		*tiles_x = source->info.tiles_x;
+		*tiles_y = source->info.tiles_y;
+		*tile_width = util_ceildivpow2(source->info.tile_width, level);
+		*tile_height = util_ceildivpow2(source->info.tile_height, level);
+		return;
+	}
+
+	tile_source_get_size(source, level, &width, &height);
+	*tiles_x = (width + TILES_AREA_SIZE - 1) / TILES_AREA_SIZE;
+	*tiles_y = (height + TILES_AREA_SIZE - 1) / TILES_AREA_SIZE;
+	*tile_width = TILES_AREA_SIZE;
+	*tile_height = TILES_AREA_SIZE;
+}
+
+/**
+ * Decode tile x, y of level with decoder.
+ */
+static GdkPixbuf *tile_source_decode(TileSource *source, TileDecoder *decoder, guint level, guint32 x, guint32 y, guint32 tiles_x, GError **error)
+{
+	opj_image_t *image = decoder->image;
+	int components = -1;
+	COLOR_SPACE colorspace = -1;
+	gsize size, rowstride;
+	guint8 *pixels;
+
+	if(source->tiled)
+	{
+		if(!opj_get_decoded_tile(decoder->codec, decoder->stream, image, y * tiles_x + x))
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode tile %u, %u at level %u", x, y, level);
+			return NULL;
+		}
+	} else {
+		// The area is given on the reference grid, at full resolution
+
+		guint64 x0 = ((guint64) util_ceildivpow2(source->info.x0, level) + (guint64) x * TILES_AREA_SIZE) << level;
+		guint64 y0 = ((guint64) util_ceildivpow2(source->info.y0, level) + (guint64) y * TILES_AREA_SIZE) << level;
+		guint64 x1 = MIN(x0 + ((guint64) TILES_AREA_SIZE << level), source->info.x1);
+		guint64 y1 = MIN(y0 + ((guint64) TILES_AREA_SIZE << level), source->info.y1);
+
+		if(!opj_set_decode_area(decoder->codec, image, (OPJ_INT32) x0, (OPJ_INT32) y0, (OPJ_INT32) x1, (OPJ_INT32) y1) ||
+			!opj_decode(decoder->codec, decoder->stream, image))
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Failed to decode tile %u, %u at level %u", x, y, level);
+			return NULL;
+		}
+	}
+
+	if(!color_info(image, &components, &colorspace))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Unsupported colorspace");
+		return NULL;
+	}
+
+	if(!util_pixels_size(image->comps[0].w, image->comps[0].h, components, &size, &rowstride) || !(pixels = g_try_malloc(size)))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Not enough memory for %ux%u pixels", image->comps[0].w, image->comps[0].h);
+		return NULL;
+	}
+
+	color_convert(image, colorspace, pixels);
+
+	return gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, components == 4, 8, (int) image->comps[0].w, (int) image->comps[0].h, (int) rowstride, util_free_pixels, NULL);
+}
+
+// Cache
+
+static void tile_entry_free(TileEntry *entry)
+{
+	g_clear_object(&entry->pixbuf);
+	g_clear_error(&entry->error);
+	g_free(entry);
+}
+
+/**
+ * Drop the least recently used tiles until the cache fits its limit. Tiles still to be handed to waiting requests stay.
+ * Called with the mutex held.
+ */
+static void tile_source_trim(TileSource *source)
+{
+	GList *link = source->lru.tail;
+
+	while(link && source->stats.bytes > source->limit)
+	{
+		TileEntry *entry = link->data;
+		link = link->prev;
+
+		if(entry->waiters > 0)
+		{
+			continue;
+		}
+
+		g_queue_unlink(&source->lru, &entry->link);
+		g_hash_table_remove(source->entries, &entry->key);
+		source->stats.bytes -= entry->size;
+		source->stats.tiles--;
+		source->stats.evicted++;
+		tile_entry_free(entry);
+	}
+}
+
+/**
+ * Tile x, y of level as a pixbuf, from the cache or decoded. Safe to call from any number of threads, requests for a tile
+ * that is being decoded wait for it rather than decoding it again. Tiles are counted from the top left, level 0 is full resolution.
+ */
+GdkPixbuf *tile_source_get_tile(TileSource *source, guint level, guint32 x, guint32 y, GCancellable *cancellable, GError **error)
+{
+	guint32 tiles_x, tiles_y, tile_width, tile_height;
+	guint64 key;
+	TileEntry *entry;
+	TileDecoder *decoder;
+	GdkPixbuf *pixbuf = NULL;
+	GError *decode_error = NULL;
+
+	if(level >= source->levels)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Level %u is past the lowest resolution, %u", level, source->levels - 1);
+		return NULL;
+	}
+
+	tile_source_get_grid(source, level, &tiles_x, &tiles_y, &tile_width, &tile_height);
+
+	if(x >= tiles_x || y >= tiles_y)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Tile %u, %u is outside the %ux%u tiles of level %u", x, y, tiles_x, tiles_y, level);
+		return NULL;
+	}
+
+	// Tile indices stay far below 2^56, images are at most 2^31 pixels on a side
+
+	key = (guint64) level << 56 | ((guint64) y * tiles_x + x);
+
+	g_mutex_lock(&source->mutex);
+	entry = g_hash_table_lookup(source->entries, &key);
+
+	if(entry && entry->pixbuf)
+	{
+		g_queue_unlink(&source->lru, &entry->link);
+		g_queue_push_head_link(&source->lru, &entry->link);
+		source->stats.hits++;
+		pixbuf = g_object_ref(entry->pixbuf);
+		g_mutex_unlock(&source->mutex);
+		return pixbuf;
+	}
+
+	if(entry)
+	{
+		// Being decoded, a failed decode is out of the table by the time it wakes us and the last waiter frees it
+
+		source->stats.merged++;
+		entry->waiters++;
+
+		while(!entry->pixbuf && !entry->error)
+		{
+			g_cond_wait(&source->cond, &source->mutex);
+		}
+
+		entry->waiters--;
+
+		if(entry->pixbuf)
+		{
+			pixbuf = g_object_ref(entry->pixbuf);
+		} else {
+			g_propagate_error(error, g_error_copy(entry->error));
+
+			if(entry->waiters == 0)
+			{
+				tile_entry_free(entry);
+			}
+		}
+
+		g_mutex_unlock(&source->mutex);
+		return pixbuf;
+	}
+
+	if(g_cancellable_set_error_if_cancelled(cancellable, error))
+	{
+		g_mutex_unlock(&source->mutex);
+		return NULL;
+	}
+
+	entry = g_new0(TileEntry, 1);
+	entry->key = key;
+	entry->link.data = entry;
+	g_hash_table_insert(source->entries, &entry->key, entry);
+	source->stats.misses++;
+	g_mutex_unlock(&source->mutex);
+
+	decoder = tile_decoder_acquire(source, level, &decode_error);
+
+	if(decoder)
+	{
+		pixbuf = tile_source_decode(source, decoder, level, x, y, tiles_x, &decode_error);
+
+		// A decoder that failed may be left anywhere in the stream
+
+		if(pixbuf)
+		{
+			tile_decoder_release(source, level, decoder);
+		} else {
+			tile_decoder_free(decoder);
+		}
+	}
+
+	g_mutex_lock(&source->mutex);
+
+	if(pixbuf)
+	{
+		entry->pixbuf = g_object_ref(pixbuf);
+		entry->size = (gsize) gdk_pixbuf_get_rowstride(pixbuf) * gdk_pixbuf_get_height(pixbuf) + sizeof(TileEntry);
+		g_queue_push_head_link(&source->lru, &entry->link);
+		source->stats.bytes += entry->size;
+		source->stats.tiles++;
+		tile_source_trim(source);
+	} else {
+		g_hash_table_remove(source->entries, &entry->key);
+		source->stats.failed++;
+
+		if(entry->waiters > 0)
+		{
+			entry->error = g_error_copy(decode_error);
+		} else {
+			tile_entry_free(entry);
+		}
+
+		g_propagate_error(error, decode_error);
+	}
+
+	g_cond_broadcast(&source->cond);
+	g_mutex_unlock(&source->mutex);
+
+	return pixbuf;
+}
+
+/**
+ * Change the byte limit of the cache, dropping tiles when it shrinks. 0 keeps no tiles past their requests.
+ */
+void tile_source_set_cache_limit(TileSource *source, guint64 limit)
+{
+	g_mutex_lock(&source->mutex);
+	source->limit = limit;
+	tile_source_trim(source);
+	g_mutex_unlock(&source->mutex);
+}
+
+/**
+ * Counters of source since it was opened.
+ */
+void tile_source_get_stats(TileSource *source, TileStats *stats)
+{
+	g_mutex_lock(&source->mutex);
+	*stats = source->stats;
+	g_mutex_unlock(&source->mutex);
+}
+
+// Lifetime
+
+/**
+ * Free source. No requests may be in flight.
+ */
+void tile_source_free(TileSource *source)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, source->entries);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		tile_entry_free(value);
+	}
+	g_hash_table_unref(source->entries);
+
+	for(guint i = 0; i < source->levels; i++)
+	{
+		TileDecoder *decoder;
+
+		while((decoder = g_queue_pop_head(&source->decoders[i])))
+		{
+			tile_decoder_free(decoder);
+		}
+	}
+	g_free(source->decoders);
+
+	g_bytes_unref(source->bytes);
+	g_cond_clear(&source->cond);
+	g_mutex_clear(&source->mutex);
+	g_free(source);
+}
+
+/**
+ * Tile source over the JPEG2000 file or codestream in bytes, which it keeps a reference to.
+ */
+TileSource *tile_source_new_from_bytes(GBytes *bytes, GError **error)
+{
+	TileSource *source;
+	TileDecoder *decoder;
+	gsize length, offset, size;
+	const guint8 *data = g_bytes_get_data(bytes, &length);
+	int codec_type = util_identify_buffer(data, length);
+
+	if(codec_type < 0)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "Not a JPEG2000 file");
+		return NULL;
+	}
+
+	source = g_new0(TileSource, 1);
+	source->bytes = g_bytes_ref(bytes);
+	source->codec_type = codec_type;
+	source->limit = tile_source_cache_limit();
+	source->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+	g_mutex_init(&source->mutex);
+	g_cond_init(&source->cond);
+
+	if(!codestream_locate(data, length, &offset, &size) || codestream_parse(data + offset, size, &source->info) != CODESTREAM_OK ||
+		source->info.resolutions == 0 || (guint64) source->info.tiles_x * source->info.tiles_y > G_MAXUINT ||
+		source->info.x1 > G_MAXINT32 || source->info.y1 > G_MAXINT32)
+	{
+		tile_source_free(source);
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Failed to read header");
+		return NULL;
+	}
+
+	source->levels = source->info.resolutions;
+	source->tiled = (guint64) source->info.tiles_x * source->info.tiles_y > 1;
+	source->decoders = g_new0(GQueue, source->levels);
+
+	// Read the header once up front, so a file libopenjp2 won't open fails here rather than on every tile
+
+	decoder = tile_decoder_new(source, 0, error);
+
+	if(!decoder)
+	{
+		tile_source_free(source);
+		return NULL;
+	}
+
+	tile_decoder_release(source, 0, decoder);
+
+	return source;
+}
+
+/**
+ * Tile source over the JPEG2000 file at filename, which is mapped rather than read.
+ */
+TileSource *tile_source_new(const gchar *filename, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+	TileSource *source;
+	GBytes *bytes;
+
+	if(!file)
+	{
+		return NULL;
+	}
+
+	bytes = g_mapped_file_get_bytes(file);
+	g_mapped_file_unref(file);
+
+	source = tile_source_new_from_bytes(bytes, error);
+	g_bytes_unref(bytes);
+
+	return source;
+}
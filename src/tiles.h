@@ -0,0 +1,69 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TILES_H
+#define TILES_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+// Tiled access to huge JPEG2000 images, for deep zoom viewers, from the jp2-tiles library. A TileSource maps a file once
+// and hands out tiles at any resolution level as pixbufs, keeping the ones it decoded in a cache of a fixed size in bytes.
+// Any number of threads can ask one source for tiles at once, asking for a tile that is being decoded waits for that decode.
+
+#if defined(TILES_COMPILATION) && defined(_WIN32)
+	#define TILES_API __declspec(dllexport)
+#elif defined(TILES_COMPILATION) && defined(__GNUC__)
+	#define TILES_API __attribute__((visibility("default")))
+#else
+	#define TILES_API
+#endif
+
+typedef struct _TileSource TileSource;
+
+typedef struct {
+	guint64 hits;     // requests served from the cache
+	guint64 misses;   // requests that decoded their tile
+	guint64 merged;   // requests that waited for a decode another one started
+	guint64 evicted;  // tiles dropped from the cache
+	guint64 failed;   // decodes that failed
+	guint64 bytes;    // of the tiles in the cache
+	guint tiles;      // in the cache
+} TileStats;
+
+// Opening and closing
+
+TILES_API TileSource *tile_source_new(const gchar *filename, GError **error);
+TILES_API TileSource *tile_source_new_from_bytes(GBytes *bytes, GError **error);
+TILES_API void tile_source_free(TileSource *source);
+
+// Geometry, level 0 is full resolution and every level after it halves the size
+
+TILES_API guint tile_source_get_levels(TileSource *source);
+TILES_API void tile_source_get_size(TileSource *source, guint level, guint32 *width, guint32 *height);
+TILES_API gboolean tile_source_is_tiled(TileSource *source);
+TILES_API void tile_source_get_grid(TileSource *source, guint level, guint32 *tiles_x, guint32 *tiles_y, guint32 *tile_width, guint32 *tile_height);
+
+// Tiles and their cache
+
+TILES_API GdkPixbuf *tile_source_get_tile(TileSource *source, guint level, guint32 x, guint32 y, GCancellable *cancellable, GError **error);
+TILES_API guint64 tile_source_cache_limit(void);
+TILES_API void tile_source_set_cache_limit(TileSource *source, guint64 limit);
+TILES_API void tile_source_get_stats(TileSource *source, TileStats *stats);
+
+#endif
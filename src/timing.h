@@ -0,0 +1,197 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <string.h>
+
+// Per-stage timers and memory accounting for loads and saves, enabled by GDK_PIXBUF_JP2_TIMING. Everything takes
+// a Timing that is NULL when timing is off, so a disabled timer costs a pointer test and never reads the clock.
+// Memory is what the loader allocates itself plus libopenjp2's component planes as estimated from the header,
+// accounted on the thread that runs the load.
+
+typedef enum {
+	TIMING_STREAM = 0,   // creating the stream and codec
+	TIMING_HEADER = 1,   // scanning the codestream and opj_read_header
+	TIMING_DECODE = 2,   // opj_decode, or the whole tile-parallel decode including its conversion
+	TIMING_CONVERT = 3,  // color_convert, or copying the pixbuf into the image when saving
+	TIMING_ALLOCATE = 4, // the pixel buffer, or the opj_image_t when saving
+	TIMING_ENCODE = 5,   // opj_start_compress up to opj_end_compress
+	TIMING_STAGES = 6,
+} TIMING_STAGE;
+
+static const gchar *timing_names[TIMING_STAGES] = {"stream", "header", "decode", "convert", "allocate", "encode"};
+
+typedef struct {
+	gint64 start;
+	gint64 us[TIMING_STAGES]; // microseconds spent in every stage, summed over repeated decodes
+	guint decodes;            // full decodes, more than one when a time budget refines the image
+	guint64 allocated;        // bytes allocated over the whole load
+	guint64 live;             // bytes allocated and not released yet
+	guint64 peak;             // highest live
+} Timing;
+
+/**
+ * Start timing into timing when GDK_PIXBUF_JP2_TIMING is set to anything but "0", returning timing, otherwise NULL.
+ */
+Timing *timing_begin(Timing *timing)
+{
+	const gchar *value = g_getenv("GDK_PIXBUF_JP2_TIMING");
+
+	if(!value || !*value || g_strcmp0(value, "0") == 0)
+	{
+		return NULL;
+	}
+
+	memset(timing, 0, sizeof(Timing));
+	timing->start = g_get_monotonic_time();
+
+	return timing;
+}
+
+/**
+ * Start of a stage, 0 without timing.
+ */
+static inline gint64 timing_now(const Timing *timing)
+{
+	return timing ? g_get_monotonic_time() : 0;
+}
+
+/**
+ * Add the time since start, from timing_now, to stage.
+ */
+static inline void timing_add(Timing *timing, TIMING_STAGE stage, gint64 start)
+{
+	if(timing)
+	{
+		timing->us[stage] += g_get_monotonic_time() - start;
+	}
+}
+
+/**
+ * Account for bytes allocated by the load.
+ */
+static inline void timing_alloc(Timing *timing, guint64 bytes)
+{
+	if(timing)
+	{
+		timing->allocated += bytes;
+		timing->live += bytes;
+		timing->peak = MAX(timing->peak, timing->live);
+	}
+}
+
+/**
+ * Account for bytes released by the load.
+ */
+static inline void timing_free(Timing *timing, guint64 bytes)
+{
+	if(timing)
+	{
+		timing->live -= MIN(bytes, timing->live);
+	}
+}
+
+/**
+ * Attach the stages of a load to pixbuf as "jp2::<stage>-us" options, with "jp2::total-us" and "jp2::decodes",
+ * and its memory as "jp2::allocated-bytes" and "jp2::peak-bytes".
+ */
+void timing_attach(const Timing *timing, GdkPixbuf *pixbuf)
+{
+	gchar key[32], value[32];
+
+	if(!timing || !pixbuf)
+	{
+		return;
+	}
+
+	for(int i = 0; i < TIMING_STAGES; i++)
+	{
+		if(i != TIMING_ENCODE)
+		{
+			g_snprintf(key, sizeof(key), "jp2::%s-us", timing_names[i]);
+			g_snprintf(value, sizeof(value), "%" G_GINT64_FORMAT, timing->us[i]);
+			gdk_pixbuf_set_option(pixbuf, key, value);
+		}
+	}
+
+	g_snprintf(value, sizeof(value), "%" G_GINT64_FORMAT, g_get_monotonic_time() - timing->start);
+	gdk_pixbuf_set_option(pixbuf, "jp2::total-us", value);
+
+	g_snprintf(value, sizeof(value), "%u", timing->decodes);
+	gdk_pixbuf_set_option(pixbuf, "jp2::decodes", value);
+
+	g_snprintf(value, sizeof(value), "%" G_GUINT64_FORMAT, timing->allocated);
+	gdk_pixbuf_set_option(pixbuf, "jp2::allocated-bytes", value);
+
+	g_snprintf(value, sizeof(value), "%" G_GUINT64_FORMAT, timing->peak);
+	gdk_pixbuf_set_option(pixbuf, "jp2::peak-bytes", value);
+}
+
+/**
+ * Log the stages of operation, "load" or "save", as a structured message with a JP2_<STAGE>_US field per stage,
+ * and JP2_ALLOCATED_BYTES and JP2_PEAK_BYTES fields.
+ */
+void timing_log(const Timing *timing, const gchar *operation)
+{
+	GLogField fields[TIMING_STAGES + 7];
+	gchar names[TIMING_STAGES][32], values[TIMING_STAGES + 1][32], allocated[32], peak[32];
+	gchar *message;
+	gsize n = 0;
+
+	if(!timing)
+	{
+		return;
+	}
+
+	g_snprintf(values[TIMING_STAGES], sizeof(values[TIMING_STAGES]), "%" G_GINT64_FORMAT, g_get_monotonic_time() - timing->start);
+	g_snprintf(allocated, sizeof(allocated), "%" G_GUINT64_FORMAT, timing->allocated);
+	g_snprintf(peak, sizeof(peak), "%" G_GUINT64_FORMAT, timing->peak);
+	message = g_strdup_printf("%s took %s us: stream %" G_GINT64_FORMAT ", header %" G_GINT64_FORMAT ", decode %" G_GINT64_FORMAT
+		", convert %" G_GINT64_FORMAT ", allocate %" G_GINT64_FORMAT ", encode %" G_GINT64_FORMAT "; allocated %s bytes, peak %s bytes",
+		operation, values[TIMING_STAGES], timing->us[TIMING_STREAM], timing->us[TIMING_HEADER], timing->us[TIMING_DECODE],
+		timing->us[TIMING_CONVERT], timing->us[TIMING_ALLOCATE], timing->us[TIMING_ENCODE], allocated, peak);
+
+	fields[n++] = (GLogField) {"GLIB_DOMAIN", "GdkPixbuf-JP2", -1};
+	fields[n++] = (GLogField) {"PRIORITY", "5", -1};
+	fields[n++] = (GLogField) {"MESSAGE", message, -1};
+	fields[n++] = (GLogField) {"JP2_OPERATION", operation, -1};
+	fields[n++] = (GLogField) {"JP2_TOTAL_US", values[TIMING_STAGES], -1};
+	fields[n++] = (GLogField) {"JP2_ALLOCATED_BYTES", allocated, -1};
+	fields[n++] = (GLogField) {"JP2_PEAK_BYTES", peak, -1};
+
+	for(int i = 0; i < TIMING_STAGES; i++)
+	{
+		gchar *name = g_ascii_strup(timing_names[i], -1);
+
+		g_snprintf(names[i], sizeof(names[i]), "JP2_%s_US", name);
+		g_snprintf(values[i], sizeof(values[i]), "%" G_GINT64_FORMAT, timing->us[i]);
+		g_free(name);
+
+		fields[n++] = (GLogField) {names[i], values[i], -1};
+	}
+
+	g_log_structured_array(G_LOG_LEVEL_MESSAGE, fields, n);
+
+	g_free(message);
+}
+
+#endif
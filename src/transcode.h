@@ -0,0 +1,1808 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+// Rewrites a codestream with fewer quality layers and/or resolution levels by dropping packets.
+// Nothing is decoded: packet boundaries come from PLT markers when present, otherwise from the
+// packet headers (ITU-T T.800 Annex B.10), and the kept packets are copied byte for byte.
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <openjpeg.h>
+#include <string.h>
+#include <codestream.h>
+
+#define CODESTREAM_COC 0xFF53
+#define CODESTREAM_QCD 0xFF5C
+#define CODESTREAM_QCC 0xFF5D
+#define CODESTREAM_POC 0xFF5F
+#define CODESTREAM_PPT 0xFF61
+#define CODESTREAM_SOP 0xFF91
+#define CODESTREAM_EPH 0xFF92
+
+#define CODESTREAM_BOX_JP2H 0x6A703268 /* jp2h */
+#define CODESTREAM_BOX_IHDR 0x69686472 /* ihdr */
+
+typedef enum {
+	TRANSCODE_FORMAT_SAME = 0, // keep the container of the input
+	TRANSCODE_FORMAT_J2K = 1,  // raw codestream
+	TRANSCODE_FORMAT_JP2 = 2,  // JP2 container
+} TRANSCODE_FORMAT;
+
+typedef struct {
+	guint layers; // quality layers to keep, 0 keeps all
+	guint reduce; // highest resolution levels to discard, 0 keeps all
+	TRANSCODE_FORMAT format;
+} TranscodeOptions;
+
+typedef struct {
+	guint8 levels;       // decomposition levels
+	guint8 cblk_width;   // code-block width exponent
+	guint8 cblk_height;  // code-block height exponent
+	guint8 cblk_style;
+	guint8 precincts[33]; // PPx | PPy << 4 per resolution level
+} TranscodeComponent;
+
+typedef struct {
+	guint8 scod;        // bit 1 SOP, bit 2 EPH
+	guint8 progression;
+	guint16 layers;
+	TranscodeComponent *comps;
+} TranscodeCoding;
+
+typedef struct {
+	gint32 value;
+	gint32 low;
+	gint64 parent;
+} TranscodeTagNode;
+
+typedef struct {
+	TranscodeTagNode *nodes;
+	guint64 count;
+} TranscodeTagTree;
+
+typedef struct {
+	gboolean included;
+	guint lblock;
+	guint8 segment_max;
+	guint8 segment_passes;
+} TranscodeBlock;
+
+typedef struct {
+	guint64 cw, ch;
+	TranscodeTagTree inclusion;
+	TranscodeTagTree msb;
+	TranscodeBlock *blocks;
+} TranscodeBand;
+
+typedef struct {
+	gboolean ready;
+	TranscodeBand bands[3];
+} TranscodePrecinct;
+
+typedef struct {
+	gint64 x0, y0, x1, y1;
+	gint64 band_x0[3], band_y0[3], band_x1[3], band_y1[3];
+	guint64 pw, ph;
+	guint8 ppx, ppy;
+	TranscodePrecinct *precincts;
+} TranscodeResolution;
+
+typedef struct {
+	guint16 layer;
+	guint8 resolution;
+	guint16 component;
+	guint64 precinct;
+} TranscodePacket;
+
+typedef struct {
+	gboolean started;
+	gboolean use_plt;
+	TranscodeCoding coding;
+	TranscodeResolution **resolutions; // per component, levels + 1 each
+	TranscodePacket *packets;
+	guint64 n_packets;
+	guint64 cursor;
+	guint parts;                       // tile-parts seen in the input
+	guint8 output_parts;               // tile-parts kept in the output
+} TranscodeTile;
+
+typedef struct {
+	gsize offset;
+	gsize length;
+} TranscodeRange;
+
+typedef struct {
+	guint32 tile;
+	gboolean first;
+	GByteArray *header;  // rewritten tile-part header, without SOT, PLT and SOD
+	GByteArray *plt;     // regenerated PLT segments
+	GArray *ranges;      // kept packets, as TranscodeRange into the codestream
+	GArray *lengths;     // kept packet lengths, for PLT
+	guint64 body;
+} TranscodePart;
+
+typedef struct {
+	const guint8 *data;
+	gsize length;
+	const TranscodeOptions *options;
+	CodestreamInfo info;
+	guint32 *dx, *dy;              // component subsampling from SIZ
+	gboolean wide_components;      // Csiz > 256, component indices are 2 bytes
+	TranscodeCoding coding;        // main header coding style
+	TranscodeTile *tiles;
+	GByteArray *header;            // rewritten main header, SOC included
+	GPtrArray *parts;
+	gboolean markers_tlm;
+	gboolean markers_plt;       // a PLM or PLT was seen, every output tile-part gets a PLT
+} Transcode;
+
+typedef struct {
+	const guint8 *pos, *end;
+	guint32 buffer;
+	guint count;
+	gboolean overrun;
+} TranscodeBits;
+
+static gint64 transcode_ceildiv(gint64 a, gint64 b)
+{
+	return (a + b - 1) / b;
+}
+
+static gint64 transcode_ceildivpow2(gint64 a, guint e)
+{
+	return (a + ((gint64) 1 << e) - 1) >> e;
+}
+
+static gint64 transcode_floordivpow2(gint64 a, guint e)
+{
+	return a >> e;
+}
+
+static guint transcode_floorlog2(guint32 a)
+{
+	guint l = 0;
+
+	while(a > 1)
+	{
+		a >>= 1;
+		l++;
+	}
+
+	return l;
+}
+
+static void transcode_put16(GByteArray *out, guint16 value)
+{
+	guint8 bytes[2] = { value >> 8, value & 0xFF };
+	g_byte_array_append(out, bytes, 2);
+}
+
+static void transcode_put32(GByteArray *out, guint32 value)
+{
+	guint8 bytes[4] = { value >> 24, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF };
+	g_byte_array_append(out, bytes, 4);
+}
+
+static void transcode_write32(guint8 *p, guint32 value)
+{
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 0xFF;
+	p[2] = (value >> 8) & 0xFF;
+	p[3] = value & 0xFF;
+}
+
+// Bit reader for packet headers, a 0xFF byte is followed by a stuffed bit (T.800 B.10.1)
+
+static void transcode_byte(TranscodeBits *bits)
+{
+	bits->buffer = (bits->buffer << 8) & 0xFFFF;
+	bits->count = bits->buffer == 0xFF00 ? 7 : 8;
+	if(bits->pos < bits->end)
+	{
+		bits->buffer |= *bits->pos++;
+	} else {
+		bits->overrun = TRUE;
+	}
+}
+
+static guint transcode_bit(TranscodeBits *bits)
+{
+	if(bits->count == 0)
+	{
+		transcode_byte(bits);
+	}
+
+	bits->count--;
+	return (bits->buffer >> bits->count) & 1;
+}
+
+static guint32 transcode_bits(TranscodeBits *bits, guint n)
+{
+	guint32 value = 0;
+
+	if(n > 32)
+	{
+		bits->overrun = TRUE;
+		return 0;
+	}
+
+	while(n-- > 0)
+	{
+		value |= (guint32) transcode_bit(bits) << n;
+	}
+
+	return value;
+}
+
+static void transcode_align(TranscodeBits *bits)
+{
+	if((bits->buffer & 0xFF) == 0xFF)
+	{
+		transcode_byte(bits);
+	}
+	bits->count = 0;
+}
+
+// Tag trees (T.800 B.10.2)
+
+static void transcode_tag_tree_init(TranscodeTagTree *tree, guint64 width, guint64 height)
+{
+	guint64 level_width[64], level_height[64];
+	guint64 base = 0, n;
+	int levels = 0;
+
+	tree->nodes = NULL;
+	tree->count = 0;
+
+	if(width == 0 || height == 0)
+	{
+		return;
+	}
+
+	level_width[0] = width;
+	level_height[0] = height;
+	do {
+		n = level_width[levels] * level_height[levels];
+		level_width[levels + 1] = (level_width[levels] + 1) / 2;
+		level_height[levels + 1] = (level_height[levels] + 1) / 2;
+		tree->count += n;
+		levels++;
+	} while(n > 1);
+
+	tree->nodes = g_new(TranscodeTagNode, tree->count);
+
+	for(int level = 0; level < levels; level++)
+	{
+		guint64 parent_base = base + level_width[level] * level_height[level];
+
+		for(guint64 j = 0; j < level_height[level]; j++)
+		{
+			for(guint64 i = 0; i < level_width[level]; i++)
+			{
+				TranscodeTagNode *node = &tree->nodes[base + j * level_width[level] + i];
+
+				node->value = G_MAXINT32;
+				node->low = 0;
+				node->parent = (level == levels - 1) ? -1 : (gint64) (parent_base + (j / 2) * level_width[level + 1] + i / 2);
+			}
+		}
+
+		base = parent_base;
+	}
+}
+
+static gboolean transcode_tag_tree_decode(TranscodeBits *bits, TranscodeTagTree *tree, guint64 leaf, gint32 threshold)
+{
+	TranscodeTagNode *stack[64];
+	TranscodeTagNode *node = &tree->nodes[leaf];
+	int depth = 0;
+	gint32 low = 0;
+
+	while(node->parent >= 0)
+	{
+		stack[depth++] = node;
+		node = &tree->nodes[node->parent];
+	}
+
+	for(;;)
+	{
+		if(low > node->low)
+		{
+			node->low = low;
+		} else {
+			low = node->low;
+		}
+
+		while(low < threshold && low < node->value)
+		{
+			if(transcode_bit(bits))
+			{
+				node->value = low;
+			} else {
+				low++;
+			}
+		}
+
+		node->low = low;
+
+		if(depth == 0)
+		{
+			break;
+		}
+		node = stack[--depth];
+	}
+
+	return node->value < threshold;
+}
+
+static void transcode_tag_tree_free(TranscodeTagTree *tree)
+{
+	g_free(tree->nodes);
+	tree->nodes = NULL;
+}
+
+// Coding style
+
+static void transcode_coding_copy(TranscodeCoding *to, const TranscodeCoding *from, guint16 components)
+{
+	to->scod = from->scod;
+	to->progression = from->progression;
+	to->layers = from->layers;
+	to->comps = g_new(TranscodeComponent, components);
+	memcpy(to->comps, from->comps, sizeof(TranscodeComponent) * components);
+}
+
+static gboolean transcode_coding_component(TranscodeComponent *comp, guint8 style, const guint8 *data, gsize length)
+{
+	if(length < 5 || data[0] > 32)
+	{
+		return FALSE;
+	}
+
+	comp->levels = data[0];
+	comp->cblk_width = data[1] + 2;
+	comp->cblk_height = data[2] + 2;
+	comp->cblk_style = data[3];
+
+	for(int r = 0; r <= comp->levels; r++)
+	{
+		if(style & 1)
+		{
+			if(length < 5 + (gsize) r + 1)
+			{
+				return FALSE;
+			}
+			comp->precincts[r] = data[5 + r];
+		} else {
+			comp->precincts[r] = 0xFF;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Apply COD and COC segments of one header to coding.
+ * COC takes precedence over COD within the same header regardless of order (T.800 A.6.1).
+ */
+static gboolean transcode_coding_header(Transcode *tc, TranscodeCoding *coding, const guint8 *header, gsize length)
+{
+	gsize pos = 0;
+	int pass;
+
+	for(pass = 0; pass < 2; pass++)
+	{
+		for(pos = 0; pos + 4 <= length; pos += 2 + codestream_read16(header + pos + 2))
+		{
+			guint16 marker = codestream_read16(header + pos);
+			gsize segment = codestream_read16(header + pos + 2);
+			const guint8 *data = header + pos + 4;
+
+			if(segment < 2 || pos + 2 + segment > length)
+			{
+				return FALSE;
+			}
+			segment -= 2;
+
+			if(pass == 0 && marker == CODESTREAM_COD)
+			{
+				TranscodeComponent comp;
+
+				if(segment < 5 || !transcode_coding_component(&comp, data[0], data + 5, segment - 5))
+				{
+					return FALSE;
+				}
+
+				coding->scod = data[0];
+				coding->progression = data[1];
+				coding->layers = codestream_read16(data + 2);
+
+				for(int c = 0; c < tc->info.components; c++)
+				{
+					coding->comps[c] = comp;
+				}
+			}
+			else if(pass == 1 && marker == CODESTREAM_COC)
+			{
+				gsize index = tc->wide_components ? 2 : 1;
+				guint16 c = tc->wide_components ? codestream_read16(data) : data[0];
+
+				if(segment < index + 1 || c >= tc->info.components || !transcode_coding_component(&coding->comps[c], data[index], data + index + 1, segment - index - 1))
+				{
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Append a header segment to out, patched for the kept layers and resolutions.
+ * Returns FALSE if the segment cannot be transcoded, sets *unsupported for features that are not handled.
+ */
+static gboolean transcode_segment(Transcode *tc, GByteArray *out, guint16 marker, const guint8 *data, gsize segment, gboolean *unsupported)
+{
+	guint reduce = tc->options->reduce;
+	gsize start = out->len;
+
+	switch(marker)
+	{
+		case CODESTREAM_SIZ:
+			if(reduce == 0)
+			{
+				break;
+			}
+
+			transcode_put16(out, marker);
+			transcode_put16(out, (guint16) (segment + 2));
+			g_byte_array_append(out, data, (guint) segment);
+			{
+				guint8 *siz = out->data + start + 4;
+				guint32 tile_width = tc->info.tile_width, tile_height = tc->info.tile_height;
+				guint32 new_width, new_height;
+
+				if(tc->info.tiles_x > 1)
+				{
+					if(tile_width % (1U << reduce) != 0)
+					{
+						*unsupported = TRUE;
+						return FALSE;
+					}
+					new_width = tile_width >> reduce;
+				} else {
+					new_width = (guint32) transcode_ceildivpow2(tile_width, reduce);
+				}
+
+				if(tc->info.tiles_y > 1)
+				{
+					if(tile_height % (1U << reduce) != 0)
+					{
+						*unsupported = TRUE;
+						return FALSE;
+					}
+					new_height = tile_height >> reduce;
+				} else {
+					new_height = (guint32) transcode_ceildivpow2(tile_height, reduce);
+				}
+
+				transcode_write32(siz + 2, (guint32) transcode_ceildivpow2(tc->info.x1, reduce));
+				transcode_write32(siz + 6, (guint32) transcode_ceildivpow2(tc->info.y1, reduce));
+				transcode_write32(siz + 10, (guint32) transcode_ceildivpow2(tc->info.x0, reduce));
+				transcode_write32(siz + 14, (guint32) transcode_ceildivpow2(tc->info.y0, reduce));
+				transcode_write32(siz + 18, new_width);
+				transcode_write32(siz + 22, new_height);
+				transcode_write32(siz + 26, (guint32) transcode_ceildivpow2(tc->info.tile_x0, reduce));
+				transcode_write32(siz + 30, (guint32) transcode_ceildivpow2(tc->info.tile_y0, reduce));
+			}
+			return TRUE;
+		case CODESTREAM_COD:
+		case CODESTREAM_COC:
+			{
+				gsize style = (marker == CODESTREAM_COD) ? 0 : (tc->wide_components ? 2 : 1);
+				gsize levels = (marker == CODESTREAM_COD) ? 5 : style + 1;
+				gsize kept;
+
+				if(segment <= levels || data[levels] < reduce)
+				{
+					*unsupported = segment > levels;
+					return FALSE;
+				}
+
+				// Explicit precinct sizes are listed per resolution level, drop the discarded ones
+				kept = (data[style] & 1) ? segment - reduce : segment;
+
+				transcode_put16(out, marker);
+				transcode_put16(out, (guint16) (kept + 2));
+				g_byte_array_append(out, data, (guint) kept);
+				out->data[start + 4 + levels] -= reduce;
+
+				if(marker == CODESTREAM_COD && tc->options->layers > 0 && tc->options->layers < codestream_read16(data + 2))
+				{
+					out->data[start + 6] = (guint8) (tc->options->layers >> 8);
+					out->data[start + 7] = (guint8) (tc->options->layers & 0xFF);
+				}
+			}
+			return TRUE;
+		case CODESTREAM_QCD:
+		case CODESTREAM_QCC:
+			if(reduce == 0)
+			{
+				break;
+			}
+			{
+				gsize style = (marker == CODESTREAM_QCD) ? 0 : (tc->wide_components ? 2 : 1);
+				gsize size, bands, kept;
+
+				if(segment <= style)
+				{
+					return FALSE;
+				}
+
+				// Scalar derived quantization only signals the LL band, everything else has one entry per subband
+				if((data[style] & 0x1F) == 1)
+				{
+					break;
+				}
+
+				size = ((data[style] & 0x1F) == 0) ? 1 : 2;
+				bands = (segment - style - 1) / size;
+				if(bands < 3 * reduce + 1)
+				{
+					return FALSE;
+				}
+				kept = style + 1 + (bands - 3 * reduce) * size;
+
+				transcode_put16(out, marker);
+				transcode_put16(out, (guint16) (kept + 2));
+				g_byte_array_append(out, data, (guint) kept);
+			}
+			return TRUE;
+		case CODESTREAM_TLM:
+		case CODESTREAM_PLM:
+		case CODESTREAM_PLT:
+			// Regenerated from the output lengths
+			return TRUE;
+		case CODESTREAM_POC:
+		case CODESTREAM_PPM:
+		case CODESTREAM_PPT:
+			*unsupported = TRUE;
+			return FALSE;
+	}
+
+	transcode_put16(out, marker);
+	transcode_put16(out, (guint16) (segment + 2));
+	g_byte_array_append(out, data, (guint) segment);
+
+	return TRUE;
+}
+
+// Tile structure (T.800 B.5 - B.7)
+
+static void transcode_tile_bounds(Transcode *tc, guint32 tile, gint64 *tx0, gint64 *ty0, gint64 *tx1, gint64 *ty1)
+{
+	guint32 p = tile % tc->info.tiles_x, q = tile / tc->info.tiles_x;
+
+	*tx0 = MAX((gint64) tc->info.tile_x0 + (gint64) p * tc->info.tile_width, (gint64) tc->info.x0);
+	*ty0 = MAX((gint64) tc->info.tile_y0 + (gint64) q * tc->info.tile_height, (gint64) tc->info.y0);
+	*tx1 = MIN((gint64) tc->info.tile_x0 + (gint64) (p + 1) * tc->info.tile_width, (gint64) tc->info.x1);
+	*ty1 = MIN((gint64) tc->info.tile_y0 + (gint64) (q + 1) * tc->info.tile_height, (gint64) tc->info.y1);
+}
+
+static void transcode_emit(TranscodeTile *t, guint64 *count, guint16 layer, guint8 resolution, guint16 component, guint64 precinct)
+{
+	TranscodePacket *packet;
+
+	// Caught by the count check once the progression is done
+	if(*count >= t->n_packets)
+	{
+		(*count)++;
+		return;
+	}
+
+	packet = &t->packets[(*count)++];
+
+	packet->layer = layer;
+	packet->resolution = resolution;
+	packet->component = component;
+	packet->precinct = precinct;
+}
+
+/**
+ * Emit the packets of the precinct at position x, y for the position driven progressions,
+ * following the checks of T.800 B.12.1.3.
+ */
+static void transcode_emit_position(Transcode *tc, TranscodeTile *t, guint64 *count, gint64 tx0, gint64 ty0, gint64 x, gint64 y, guint16 c, guint8 r)
+{
+	TranscodeComponent *comp = &t->coding.comps[c];
+	TranscodeResolution *res;
+	guint level;
+	gint64 trx0, try0;
+
+	if(r > comp->levels)
+	{
+		return;
+	}
+
+	res = &t->resolutions[c][r];
+	level = comp->levels - r;
+	trx0 = transcode_ceildiv(tx0, (gint64) tc->dx[c] << level);
+	try0 = transcode_ceildiv(ty0, (gint64) tc->dy[c] << level);
+
+	if(!((y % ((gint64) tc->dy[c] << (res->ppy + level)) == 0) || (y == ty0 && ((try0 << level) % ((gint64) 1 << (res->ppy + level))))))
+	{
+		return;
+	}
+	if(!((x % ((gint64) tc->dx[c] << (res->ppx + level)) == 0) || (x == tx0 && ((trx0 << level) % ((gint64) 1 << (res->ppx + level))))))
+	{
+		return;
+	}
+	if(res->pw == 0 || res->ph == 0 || res->x0 == res->x1 || res->y0 == res->y1)
+	{
+		return;
+	}
+
+	{
+		guint64 i = transcode_floordivpow2(transcode_ceildiv(x, (gint64) tc->dx[c] << level), res->ppx) - transcode_floordivpow2(res->x0, res->ppx);
+		guint64 j = transcode_floordivpow2(transcode_ceildiv(y, (gint64) tc->dy[c] << level), res->ppy) - transcode_floordivpow2(res->y0, res->ppy);
+
+		for(guint16 l = 0; l < t->coding.layers; l++)
+		{
+			transcode_emit(t, count, l, r, c, i + j * res->pw);
+		}
+	}
+}
+
+static gboolean transcode_tile_start(Transcode *tc, guint32 tile, const guint8 *header, gsize length, GError **error)
+{
+	TranscodeTile *t = &tc->tiles[tile];
+	guint16 components = tc->info.components;
+	gint64 tx0, ty0, tx1, ty1;
+	guint8 max_resolutions = 0;
+	guint64 count = 0;
+	guint64 dx = G_MAXINT64, dy = G_MAXINT64;
+
+	t->started = TRUE;
+	transcode_coding_copy(&t->coding, &tc->coding, components);
+
+	if(!transcode_coding_header(tc, &t->coding, header, length))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid coding style in tile %u", tile);
+		return FALSE;
+	}
+
+	transcode_tile_bounds(tc, tile, &tx0, &ty0, &tx1, &ty1);
+
+	t->resolutions = g_new0(TranscodeResolution *, components);
+
+	for(guint16 c = 0; c < components; c++)
+	{
+		TranscodeComponent *comp = &t->coding.comps[c];
+		gint64 tcx0 = transcode_ceildiv(tx0, tc->dx[c]), tcy0 = transcode_ceildiv(ty0, tc->dy[c]);
+		gint64 tcx1 = transcode_ceildiv(tx1, tc->dx[c]), tcy1 = transcode_ceildiv(ty1, tc->dy[c]);
+
+		if(comp->levels < tc->options->reduce)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "Cannot discard %u resolution levels, tile %u component %u only has %u decomposition levels", tc->options->reduce, tile, c, comp->levels);
+			return FALSE;
+		}
+
+		if(comp->cblk_style & 0x40)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION, "High throughput code-blocks cannot be transcoded");
+			return FALSE;
+		}
+
+		max_resolutions = MAX(max_resolutions, comp->levels + 1);
+		t->resolutions[c] = g_new0(TranscodeResolution, comp->levels + 1);
+
+		for(guint8 r = 0; r <= comp->levels; r++)
+		{
+			TranscodeResolution *res = &t->resolutions[c][r];
+			guint level = comp->levels - r;
+			gint64 prc_x0, prc_y0;
+
+			res->ppx = comp->precincts[r] & 0x0F;
+			res->ppy = comp->precincts[r] >> 4;
+			res->x0 = transcode_ceildivpow2(tcx0, level);
+			res->y0 = transcode_ceildivpow2(tcy0, level);
+			res->x1 = transcode_ceildivpow2(tcx1, level);
+			res->y1 = transcode_ceildivpow2(tcy1, level);
+
+			prc_x0 = transcode_floordivpow2(res->x0, res->ppx) << res->ppx;
+			prc_y0 = transcode_floordivpow2(res->y0, res->ppy) << res->ppy;
+			res->pw = (res->x0 == res->x1) ? 0 : (guint64) (((transcode_ceildivpow2(res->x1, res->ppx) << res->ppx) - prc_x0) >> res->ppx);
+			res->ph = (res->y0 == res->y1) ? 0 : (guint64) (((transcode_ceildivpow2(res->y1, res->ppy) << res->ppy) - prc_y0) >> res->ppy);
+			count += res->pw * res->ph * t->coding.layers;
+
+			if(r == 0)
+			{
+				res->band_x0[0] = res->x0;
+				res->band_y0[0] = res->y0;
+				res->band_x1[0] = res->x1;
+				res->band_y1[0] = res->y1;
+			} else {
+				for(int b = 0; b < 3; b++)
+				{
+					gint64 xo = (b + 1) & 1, yo = (b + 1) >> 1;
+
+					res->band_x0[b] = transcode_ceildivpow2(tcx0 - ((gint64) 1 << level) * xo, level + 1);
+					res->band_y0[b] = transcode_ceildivpow2(tcy0 - ((gint64) 1 << level) * yo, level + 1);
+					res->band_x1[b] = transcode_ceildivpow2(tcx1 - ((gint64) 1 << level) * xo, level + 1);
+					res->band_y1[b] = transcode_ceildivpow2(tcy1 - ((gint64) 1 << level) * yo, level + 1);
+				}
+			}
+
+			dx = MIN(dx, (guint64) tc->dx[c] << (res->ppx + level));
+			dy = MIN(dy, (guint64) tc->dy[c] << (res->ppy + level));
+		}
+	}
+
+	t->packets = g_new(TranscodePacket, MAX(count, 1));
+	t->n_packets = count;
+	count = 0;
+
+	switch(t->coding.progression)
+	{
+		case OPJ_LRCP:
+			for(guint16 l = 0; l < t->coding.layers; l++)
+				for(guint8 r = 0; r < max_resolutions; r++)
+					for(guint16 c = 0; c < components; c++)
+						if(r <= t->coding.comps[c].levels)
+							for(guint64 p = 0; p < t->resolutions[c][r].pw * t->resolutions[c][r].ph; p++)
+								transcode_emit(t, &count, l, r, c, p);
+			break;
+		case OPJ_RLCP:
+			for(guint8 r = 0; r < max_resolutions; r++)
+				for(guint16 l = 0; l < t->coding.layers; l++)
+					for(guint16 c = 0; c < components; c++)
+						if(r <= t->coding.comps[c].levels)
+							for(guint64 p = 0; p < t->resolutions[c][r].pw * t->resolutions[c][r].ph; p++)
+								transcode_emit(t, &count, l, r, c, p);
+			break;
+		case OPJ_RPCL:
+			for(guint8 r = 0; r < max_resolutions; r++)
+				for(gint64 y = ty0; y < ty1; y += dy - (y % dy))
+					for(gint64 x = tx0; x < tx1; x += dx - (x % dx))
+						for(guint16 c = 0; c < components; c++)
+							transcode_emit_position(tc, t, &count, tx0, ty0, x, y, c, r);
+			break;
+		case OPJ_PCRL:
+			for(gint64 y = ty0; y < ty1; y += dy - (y % dy))
+				for(gint64 x = tx0; x < tx1; x += dx - (x % dx))
+					for(guint16 c = 0; c < components; c++)
+						for(guint8 r = 0; r < max_resolutions; r++)
+							transcode_emit_position(tc, t, &count, tx0, ty0, x, y, c, r);
+			break;
+		case OPJ_CPRL:
+			for(guint16 c = 0; c < components; c++)
+			{
+				guint64 cdx = G_MAXINT64, cdy = G_MAXINT64;
+
+				for(guint8 r = 0; r <= t->coding.comps[c].levels; r++)
+				{
+					guint level = t->coding.comps[c].levels - r;
+
+					cdx = MIN(cdx, (guint64) tc->dx[c] << (t->resolutions[c][r].ppx + level));
+					cdy = MIN(cdy, (guint64) tc->dy[c] << (t->resolutions[c][r].ppy + level));
+				}
+
+				for(gint64 y = ty0; y < ty1; y += cdy - (y % cdy))
+					for(gint64 x = tx0; x < tx1; x += cdx - (x % cdx))
+						for(guint8 r = 0; r <= t->coding.comps[c].levels; r++)
+							transcode_emit_position(tc, t, &count, tx0, ty0, x, y, c, r);
+			}
+			break;
+		default:
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Unknown progression order %u in tile %u", t->coding.progression, tile);
+			return FALSE;
+	}
+
+	if(count != t->n_packets)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Inconsistent precinct partition in tile %u", tile);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void transcode_precinct_init(TranscodeTile *t, TranscodePacket *packet)
+{
+	TranscodeComponent *comp = &t->coding.comps[packet->component];
+	TranscodeResolution *res = &t->resolutions[packet->component][packet->resolution];
+	TranscodePrecinct *precinct;
+	gint64 prc_x0 = transcode_floordivpow2(res->x0, res->ppx) << res->ppx;
+	gint64 prc_y0 = transcode_floordivpow2(res->y0, res->ppy) << res->ppy;
+	guint cbg_width = res->ppx, cbg_height = res->ppy;
+
+	if(!res->precincts)
+	{
+		res->precincts = g_new0(TranscodePrecinct, res->pw * res->ph);
+	}
+
+	precinct = &res->precincts[packet->precinct];
+	if(precinct->ready)
+	{
+		return;
+	}
+	precinct->ready = TRUE;
+
+	if(packet->resolution > 0)
+	{
+		prc_x0 = transcode_ceildivpow2(prc_x0, 1);
+		prc_y0 = transcode_ceildivpow2(prc_y0, 1);
+		cbg_width--;
+		cbg_height--;
+	}
+
+	for(int b = 0; b < (packet->resolution == 0 ? 1 : 3); b++)
+	{
+		TranscodeBand *band = &precinct->bands[b];
+		guint cblk_width = MIN(comp->cblk_width, cbg_width), cblk_height = MIN(comp->cblk_height, cbg_height);
+		gint64 x0 = prc_x0 + (gint64) (packet->precinct % res->pw) * ((gint64) 1 << cbg_width);
+		gint64 y0 = prc_y0 + (gint64) (packet->precinct / res->pw) * ((gint64) 1 << cbg_height);
+		gint64 x1 = MIN(x0 + ((gint64) 1 << cbg_width), res->band_x1[b]);
+		gint64 y1 = MIN(y0 + ((gint64) 1 << cbg_height), res->band_y1[b]);
+
+		x0 = MAX(x0, res->band_x0[b]);
+		y0 = MAX(y0, res->band_y0[b]);
+
+		if(x1 <= x0 || y1 <= y0)
+		{
+			continue;
+		}
+
+		band->cw = (guint64) (((transcode_ceildivpow2(x1, cblk_width) << cblk_width) - (transcode_floordivpow2(x0, cblk_width) << cblk_width)) >> cblk_width);
+		band->ch = (guint64) (((transcode_ceildivpow2(y1, cblk_height) << cblk_height) - (transcode_floordivpow2(y0, cblk_height) << cblk_height)) >> cblk_height);
+		band->blocks = g_new0(TranscodeBlock, band->cw * band->ch);
+		transcode_tag_tree_init(&band->inclusion, band->cw, band->ch);
+		transcode_tag_tree_init(&band->msb, band->cw, band->ch);
+	}
+}
+
+static void transcode_tile_free(Transcode *tc, TranscodeTile *t)
+{
+	if(!t->resolutions)
+	{
+		return;
+	}
+
+	for(guint16 c = 0; c < tc->info.components; c++)
+	{
+		for(guint8 r = 0; r <= t->coding.comps[c].levels; r++)
+		{
+			TranscodeResolution *res = &t->resolutions[c][r];
+
+			if(!res->precincts)
+			{
+				continue;
+			}
+
+			for(guint64 p = 0; p < res->pw * res->ph; p++)
+			{
+				for(int b = 0; b < 3; b++)
+				{
+					g_free(res->precincts[p].bands[b].blocks);
+					transcode_tag_tree_free(&res->precincts[p].bands[b].inclusion);
+					transcode_tag_tree_free(&res->precincts[p].bands[b].msb);
+				}
+			}
+			g_free(res->precincts);
+		}
+		g_free(t->resolutions[c]);
+	}
+
+	g_free(t->resolutions);
+	g_free(t->packets);
+	t->resolutions = NULL;
+	t->packets = NULL;
+}
+
+static guint8 transcode_segment_max(guint8 style, gboolean first, guint8 previous)
+{
+	if(style & 0x04) // TERMALL
+	{
+		return 1;
+	}
+	if(style & 0x01) // BYPASS
+	{
+		if(first)
+		{
+			return 10;
+		}
+		return (previous == 1 || previous == 10) ? 2 : 1;
+	}
+	return 109;
+}
+
+/**
+ * Measure the packet at data by decoding its header (T.800 B.10).
+ * Returns the packet length including SOP and EPH markers, or 0 if it does not fit in length.
+ */
+static gsize transcode_packet_length(TranscodeTile *t, TranscodePacket *packet, const guint8 *data, gsize length)
+{
+	TranscodeComponent *comp = &t->coding.comps[packet->component];
+	TranscodeResolution *res = &t->resolutions[packet->component][packet->resolution];
+	TranscodePrecinct *precinct;
+	TranscodeBits bits = { data, data + length, 0, 0, FALSE };
+	guint64 body = 0;
+	gsize header;
+
+	transcode_precinct_init(t, packet);
+	precinct = &res->precincts[packet->precinct];
+
+	if((t->coding.scod & 2) && length >= 6 && codestream_read16(data) == CODESTREAM_SOP)
+	{
+		bits.pos += 6;
+	}
+
+	if(transcode_bit(&bits))
+	{
+		for(int b = 0; b < (packet->resolution == 0 ? 1 : 3); b++)
+		{
+			TranscodeBand *band = &precinct->bands[b];
+
+			if(res->band_x0[b] == res->band_x1[b] || res->band_y0[b] == res->band_y1[b])
+			{
+				continue;
+			}
+
+			for(guint64 i = 0; i < band->cw * band->ch; i++)
+			{
+				TranscodeBlock *block = &band->blocks[i];
+				guint32 passes, remaining;
+				gboolean included;
+
+				if(!block->included)
+				{
+					included = transcode_tag_tree_decode(&bits, &band->inclusion, i, packet->layer + 1);
+				} else {
+					included = transcode_bit(&bits);
+				}
+
+				if(!included)
+				{
+					continue;
+				}
+
+				if(!block->included)
+				{
+					// Zero bit-planes, decoded only to advance the tag tree
+					gint32 planes = 0;
+
+					while(!transcode_tag_tree_decode(&bits, &band->msb, i, planes + 1) && !bits.overrun)
+					{
+						planes++;
+					}
+
+					block->included = TRUE;
+					block->lblock = 3;
+					block->segment_max = transcode_segment_max(comp->cblk_style, TRUE, 0);
+					block->segment_passes = 0;
+				}
+
+				if(!transcode_bit(&bits))
+				{
+					passes = 1;
+				}
+				else if(!transcode_bit(&bits))
+				{
+					passes = 2;
+				}
+				else if((passes = transcode_bits(&bits, 2)) != 3)
+				{
+					passes += 3;
+				}
+				else if((passes = transcode_bits(&bits, 5)) != 31)
+				{
+					passes += 6;
+				} else {
+					passes = 37 + transcode_bits(&bits, 7);
+				}
+
+				while(transcode_bit(&bits) && !bits.overrun)
+				{
+					block->lblock++;
+				}
+
+				for(remaining = passes; remaining > 0 && !bits.overrun;)
+				{
+					guint32 segment;
+
+					if(block->segment_passes == block->segment_max)
+					{
+						block->segment_max = transcode_segment_max(comp->cblk_style, FALSE, block->segment_max);
+						block->segment_passes = 0;
+					}
+
+					segment = MIN((guint32) (block->segment_max - block->segment_passes), remaining);
+					body += transcode_bits(&bits, block->lblock + transcode_floorlog2(segment));
+					block->segment_passes += segment;
+					remaining -= segment;
+				}
+
+				if(bits.overrun)
+				{
+					return 0;
+				}
+			}
+		}
+	}
+
+	transcode_align(&bits);
+	if(bits.overrun)
+	{
+		return 0;
+	}
+
+	header = bits.pos - data;
+	if((t->coding.scod & 4) && header + 2 <= length && codestream_read16(bits.pos) == CODESTREAM_EPH)
+	{
+		header += 2;
+	}
+
+	if(body > length - header)
+	{
+		return 0;
+	}
+
+	return header + (gsize) body;
+}
+
+static void transcode_part_free(gpointer data)
+{
+	TranscodePart *part = data;
+
+	g_byte_array_unref(part->header);
+	g_byte_array_unref(part->plt);
+	g_array_unref(part->ranges);
+	g_array_unref(part->lengths);
+	g_free(part);
+}
+
+static void transcode_plt(TranscodePart *part)
+{
+	GByteArray *entries = g_byte_array_new();
+	guint8 index = 0;
+	gsize pos = 0;
+
+	for(guint i = 0; i < part->lengths->len; i++)
+	{
+		guint32 length = g_array_index(part->lengths, guint32, i);
+		guint8 bytes[5];
+		int n = 0;
+
+		// 7 bits per byte, most significant first, high bit set on all but the last byte
+		do {
+			bytes[4 - n] = (length & 0x7F) | (n ? 0x80 : 0);
+			length >>= 7;
+			n++;
+		} while(length);
+
+		g_byte_array_append(entries, bytes + 5 - n, n);
+	}
+
+	// Split into segments of at most 65535 bytes without splitting an entry
+	while(pos < entries->len)
+	{
+		gsize end = MIN(pos + 65532, (gsize) entries->len);
+
+		while(end < entries->len && end > pos && (entries->data[end - 1] & 0x80))
+		{
+			end--;
+		}
+
+		transcode_put16(part->plt, CODESTREAM_PLT);
+		transcode_put16(part->plt, (guint16) (end - pos + 3));
+		g_byte_array_append(part->plt, &index, 1);
+		g_byte_array_append(part->plt, entries->data + pos, (guint) (end - pos));
+
+		index++;
+		pos = end;
+	}
+
+	g_byte_array_unref(entries);
+}
+
+static void transcode_keep(TranscodePart *part, gsize offset, gsize length)
+{
+	TranscodeRange *last = part->ranges->len ? &g_array_index(part->ranges, TranscodeRange, part->ranges->len - 1) : NULL;
+	guint32 packet = (guint32) length;
+
+	if(last && last->offset + last->length == offset)
+	{
+		last->length += length;
+	} else {
+		TranscodeRange range = { offset, length };
+		g_array_append_val(part->ranges, range);
+	}
+
+	g_array_append_val(part->lengths, packet);
+	part->body += length;
+}
+
+/**
+ * Walk one tile-part, starting at its SOT, and plan which of its packets to keep.
+ */
+static gboolean transcode_tile_part(Transcode *tc, gsize pos, gsize *next, GError **error)
+{
+	const guint8 *sot = tc->data + pos;
+	guint32 tile, psot;
+	gsize header_start, header_end, end;
+	TranscodeTile *t;
+	TranscodePart *part;
+	GArray *plt = NULL;
+	gboolean unsupported = FALSE;
+
+	if(pos + 12 > tc->length || codestream_read16(sot + 2) != 10)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid SOT marker at %" G_GSIZE_FORMAT, pos);
+		return FALSE;
+	}
+
+	tile = codestream_read16(sot + 4);
+	psot = codestream_read32(sot + 6);
+	end = psot ? pos + psot : tc->length;
+
+	if(tile >= (guint64) tc->info.tiles_x * tc->info.tiles_y || end > tc->length || (psot && psot < 14))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid tile-part at %" G_GSIZE_FORMAT, pos);
+		return FALSE;
+	}
+
+	// Without Psot the tile-part runs up to EOC
+	if(!psot && end >= pos + 14 && codestream_read16(tc->data + end - 2) == CODESTREAM_EOC)
+	{
+		end -= 2;
+	}
+
+	header_start = pos + 12;
+	for(header_end = header_start; header_end + 2 <= end && codestream_read16(tc->data + header_end) != CODESTREAM_SOD;)
+	{
+		if(header_end + 4 > end)
+		{
+			break;
+		}
+		header_end += 2 + codestream_read16(tc->data + header_end + 2);
+	}
+
+	if(header_end + 2 > end || codestream_read16(tc->data + header_end) != CODESTREAM_SOD)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Missing SOD in tile-part at %" G_GSIZE_FORMAT, pos);
+		return FALSE;
+	}
+
+	t = &tc->tiles[tile];
+	if(!t->started)
+	{
+		if(!transcode_tile_start(tc, tile, tc->data + header_start, header_end - header_start, error))
+		{
+			return FALSE;
+		}
+	}
+
+	part = g_new0(TranscodePart, 1);
+	part->tile = tile;
+	part->first = (t->parts == 0);
+	part->header = g_byte_array_new();
+	part->plt = g_byte_array_new();
+	part->ranges = g_array_new(FALSE, FALSE, sizeof(TranscodeRange));
+	part->lengths = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_ptr_array_add(tc->parts, part);
+
+	// Rewrite the tile-part header, collecting PLT packet lengths on the way
+
+	for(gsize p = header_start; p < header_end; p += 2 + codestream_read16(tc->data + p + 2))
+	{
+		guint16 marker = codestream_read16(tc->data + p);
+		gsize segment = codestream_read16(tc->data + p + 2);
+
+		if(segment < 2)
+		{
+			if(plt)
+			{
+				g_array_unref(plt);
+			}
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid marker in tile %u", tile);
+			return FALSE;
+		}
+		segment -= 2;
+
+		if(marker == CODESTREAM_PLT)
+		{
+			const guint8 *entries = tc->data + p + 5;
+			guint32 value = 0;
+
+			if(!plt)
+			{
+				plt = g_array_new(FALSE, FALSE, sizeof(guint32));
+			}
+
+			for(gsize i = 0; i + 1 < segment; i++)
+			{
+				value = (value << 7) | (entries[i] & 0x7F);
+				if(!(entries[i] & 0x80))
+				{
+					g_array_append_val(plt, value);
+					value = 0;
+				}
+			}
+			tc->markers_plt = TRUE;
+		}
+
+		// Coding style may only change in the first tile-part, some writers repeat it in every part anyway
+		if(!part->first && (marker == CODESTREAM_COD || marker == CODESTREAM_COC || marker == CODESTREAM_QCD || marker == CODESTREAM_QCC))
+		{
+			continue;
+		}
+
+		if(!transcode_segment(tc, part->header, marker, tc->data + p + 4, segment, &unsupported))
+		{
+			if(plt)
+			{
+				g_array_unref(plt);
+			}
+			g_set_error(error, GDK_PIXBUF_ERROR, unsupported ? GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION : GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Cannot transcode marker %04X in tile %u", marker, tile);
+			return FALSE;
+		}
+	}
+
+	if(part->first)
+	{
+		t->use_plt = (plt != NULL);
+	}
+	t->parts++;
+
+	if(t->use_plt && !plt)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION, "Tile %u has PLT markers in only some of its tile-parts", tile);
+		return FALSE;
+	}
+
+	// Walk the packets of the body
+
+	{
+		guint reduce = tc->options->reduce;
+		guint layers = tc->options->layers ? tc->options->layers : G_MAXUINT;
+		gsize body = header_end + 2;
+		guint index = 0;
+
+		while(body < end && t->cursor < t->n_packets)
+		{
+			TranscodePacket *packet = &t->packets[t->cursor];
+			gsize length;
+
+			if(t->use_plt)
+			{
+				if(index >= plt->len)
+				{
+					break;
+				}
+				length = g_array_index(plt, guint32, index++);
+				if(length > end - body)
+				{
+					length = 0;
+				}
+			} else {
+				length = transcode_packet_length(t, packet, tc->data + body, end - body);
+			}
+
+			if(length == 0)
+			{
+				if(plt)
+				{
+					g_array_unref(plt);
+				}
+				g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Truncated packet in tile %u", tile);
+				return FALSE;
+			}
+
+			if(packet->layer < layers && packet->resolution + reduce <= t->coding.comps[packet->component].levels)
+			{
+				transcode_keep(part, body, length);
+			}
+
+			body += length;
+			t->cursor++;
+		}
+	}
+
+	if(plt)
+	{
+		g_array_unref(plt);
+	}
+
+	if(t->cursor == t->n_packets)
+	{
+		transcode_tile_free(tc, t);
+	}
+
+	*next = psot ? pos + psot : tc->length;
+	return TRUE;
+}
+
+/**
+ * Append TLM segments for the planned tile-parts to the main header.
+ */
+static void transcode_tlm(Transcode *tc)
+{
+	guint i = 0;
+	guint8 index = 0;
+
+	while(i < tc->parts->len)
+	{
+		guint count = 0;
+		gsize start = tc->header->len;
+
+		transcode_put16(tc->header, CODESTREAM_TLM);
+		transcode_put16(tc->header, 0);
+		g_byte_array_append(tc->header, &index, 1);
+		g_byte_array_append(tc->header, (const guint8 *) "\x60", 1); // 16 bit tile index, 32 bit length
+
+		for(; i < tc->parts->len && count < 10921; i++)
+		{
+			TranscodePart *part = g_ptr_array_index(tc->parts, i);
+
+			if(!part->first && part->body == 0)
+			{
+				continue;
+			}
+
+			transcode_put16(tc->header, (guint16) part->tile);
+			transcode_put32(tc->header, (guint32) (12 + part->header->len + part->plt->len + 2 + part->body));
+			count++;
+		}
+
+		tc->header->data[start + 2] = (guint8) ((tc->header->len - start - 2) >> 8);
+		tc->header->data[start + 3] = (guint8) ((tc->header->len - start - 2) & 0xFF);
+		index++;
+	}
+}
+
+static void transcode_free(Transcode *tc)
+{
+	if(tc->tiles)
+	{
+		for(guint64 i = 0; i < (guint64) tc->info.tiles_x * tc->info.tiles_y; i++)
+		{
+			transcode_tile_free(tc, &tc->tiles[i]);
+			g_free(tc->tiles[i].coding.comps);
+		}
+	}
+
+	g_free(tc->tiles);
+	g_free(tc->coding.comps);
+	g_free(tc->dx);
+	g_free(tc->dy);
+
+	if(tc->header)
+	{
+		g_byte_array_unref(tc->header);
+	}
+	if(tc->parts)
+	{
+		g_ptr_array_unref(tc->parts);
+	}
+}
+
+/**
+ * Plan the output codestream, returns its length in *size.
+ */
+static gboolean transcode_plan(Transcode *tc, guint64 *size, GError **error)
+{
+	gsize pos;
+	gboolean unsupported = FALSE;
+
+	if(codestream_parse(tc->data, tc->length, &tc->info) != CODESTREAM_OK)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid codestream main header");
+		return FALSE;
+	}
+
+	if(tc->info.has_ppm)
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION, "Packed packet headers cannot be transcoded");
+		return FALSE;
+	}
+
+	tc->wide_components = tc->info.components > 256;
+	tc->dx = g_new(guint32, tc->info.components);
+	tc->dy = g_new(guint32, tc->info.components);
+	tc->coding.comps = g_new0(TranscodeComponent, tc->info.components);
+	tc->tiles = g_new0(TranscodeTile, (gsize) tc->info.tiles_x * tc->info.tiles_y);
+	tc->header = g_byte_array_new();
+	tc->parts = g_ptr_array_new_with_free_func(transcode_part_free);
+	tc->markers_tlm = tc->info.has_tlm;
+	tc->markers_plt = tc->info.has_plm;
+
+	if(!transcode_coding_header(tc, &tc->coding, tc->data + 2, tc->info.header_length - 2))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid coding style in main header");
+		return FALSE;
+	}
+
+	// The main COD and COC set the levels of every tile that doesn't override them, check them before rewriting anything
+
+	for(guint16 c = 0; c < tc->info.components; c++)
+	{
+		if(tc->coding.comps[c].levels < tc->options->reduce)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "Cannot discard %u resolution levels, component %u only has %u decomposition levels", tc->options->reduce, c, tc->coding.comps[c].levels);
+			return FALSE;
+		}
+	}
+
+	transcode_put16(tc->header, CODESTREAM_SOC);
+
+	for(pos = 2; pos < tc->info.header_length; pos += 2 + codestream_read16(tc->data + pos + 2))
+	{
+		guint16 marker = codestream_read16(tc->data + pos);
+		gsize segment = codestream_read16(tc->data + pos + 2) - 2;
+
+		// codestream_parse has already checked the segment lengths
+		if(marker == CODESTREAM_SIZ)
+		{
+			if(segment < 36 + 3 * (gsize) tc->info.components)
+			{
+				g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid SIZ marker");
+				return FALSE;
+			}
+
+			for(guint16 c = 0; c < tc->info.components; c++)
+			{
+				tc->dx[c] = tc->data[pos + 4 + 37 + 3 * c];
+				tc->dy[c] = tc->data[pos + 4 + 38 + 3 * c];
+
+				if(tc->dx[c] == 0 || tc->dy[c] == 0)
+				{
+					g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid SIZ marker");
+					return FALSE;
+				}
+			}
+		}
+
+		if(!transcode_segment(tc, tc->header, marker, tc->data + pos + 4, segment, &unsupported))
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, unsupported ? GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION : GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Cannot transcode marker %04X in main header", marker);
+			return FALSE;
+		}
+	}
+
+	for(pos = tc->info.header_length; pos + 2 <= tc->length && codestream_read16(tc->data + pos) == CODESTREAM_SOT;)
+	{
+		if(!transcode_tile_part(tc, pos, &pos, error))
+		{
+			return FALSE;
+		}
+	}
+
+	// A PLT anywhere in the codestream, or a PLM, gets every tile-part a PLT, so it is only decided once all are walked
+
+	if(tc->markers_plt)
+	{
+		for(guint i = 0; i < tc->parts->len; i++)
+		{
+			transcode_plt(g_ptr_array_index(tc->parts, i));
+		}
+	}
+
+	if(tc->markers_tlm)
+	{
+		transcode_tlm(tc);
+	}
+
+	*size = tc->header->len + 2;
+
+	for(guint i = 0; i < tc->parts->len; i++)
+	{
+		TranscodePart *part = g_ptr_array_index(tc->parts, i);
+		guint64 psot = 12 + part->header->len + part->plt->len + 2 + part->body;
+
+		if(!part->first && part->body == 0)
+		{
+			continue;
+		}
+
+		if(psot > G_MAXUINT32)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNSUPPORTED_OPERATION, "Tile-part of tile %u is too large", part->tile);
+			return FALSE;
+		}
+
+		*size += psot;
+		tc->tiles[part->tile].output_parts++;
+	}
+
+	return TRUE;
+}
+
+static gboolean transcode_write(Transcode *tc, GdkPixbufSaveFunc save_func, gpointer user_data, GError **error)
+{
+	guint8 *index;
+	gboolean ok;
+
+	if(!tc->header)
+	{
+		return save_func((const gchar *) tc->data, tc->length, error, user_data);
+	}
+
+	index = g_new0(guint8, (gsize) tc->info.tiles_x * tc->info.tiles_y);
+	ok = save_func((const gchar *) tc->header->data, tc->header->len, error, user_data);
+
+	for(guint i = 0; ok && i < tc->parts->len; i++)
+	{
+		TranscodePart *part = g_ptr_array_index(tc->parts, i);
+		GByteArray *sot;
+
+		if(!part->first && part->body == 0)
+		{
+			continue;
+		}
+
+		sot = g_byte_array_sized_new(12);
+		transcode_put16(sot, CODESTREAM_SOT);
+		transcode_put16(sot, 10);
+		transcode_put16(sot, (guint16) part->tile);
+		transcode_put32(sot, (guint32) (12 + part->header->len + part->plt->len + 2 + part->body));
+		g_byte_array_append(sot, &index[part->tile], 1);
+		g_byte_array_append(sot, &tc->tiles[part->tile].output_parts, 1);
+		index[part->tile]++;
+
+		ok = save_func((const gchar *) sot->data, sot->len, error, user_data) &&
+			save_func((const gchar *) part->header->data, part->header->len, error, user_data) &&
+			save_func((const gchar *) part->plt->data, part->plt->len, error, user_data) &&
+			save_func("\xff\x93", 2, error, user_data);
+
+		for(guint j = 0; ok && j < part->ranges->len; j++)
+		{
+			TranscodeRange *range = &g_array_index(part->ranges, TranscodeRange, j);
+			ok = save_func((const gchar *) tc->data + range->offset, range->length, error, user_data);
+		}
+
+		g_byte_array_unref(sot);
+	}
+
+	g_free(index);
+
+	return ok && save_func("\xff\xd9", 2, error, user_data);
+}
+
+/**
+ * Write a box header for a box with payload bytes of content.
+ */
+static gboolean transcode_box(guint32 type, guint64 payload, GdkPixbufSaveFunc save_func, gpointer user_data, GError **error)
+{
+	GByteArray *box = g_byte_array_sized_new(16);
+	gboolean ok;
+
+	if(payload + 8 > G_MAXUINT32)
+	{
+		transcode_put32(box, 1);
+		transcode_put32(box, type);
+		transcode_put32(box, (guint32) ((payload + 16) >> 32));
+		transcode_put32(box, (guint32) ((payload + 16) & 0xFFFFFFFF));
+	} else {
+		transcode_put32(box, (guint32) (payload + 8));
+		transcode_put32(box, type);
+	}
+
+	ok = save_func((const gchar *) box->data, box->len, error, user_data);
+	g_byte_array_unref(box);
+
+	return ok;
+}
+
+/**
+ * Write the JP2 boxes up to the codestream: signature, file type and a header derived from SIZ.
+ */
+static gboolean transcode_jp2_header(Transcode *tc, const guint8 *siz, GdkPixbufSaveFunc save_func, gpointer user_data, GError **error)
+{
+	GByteArray *header = g_byte_array_new();
+	guint16 components = codestream_read16(siz + 34);
+	guint8 depth = siz[36];
+	guint32 colorspace = 17; // greyscale
+	gboolean ok;
+
+	for(guint16 c = 1; c < components; c++)
+	{
+		if(siz[36 + 3 * c] != siz[36])
+		{
+			depth = 0xFF;
+		}
+	}
+
+	if(components >= 3)
+	{
+		// Subsampled chroma is only meaningful for YCC
+		colorspace = (siz[37 + 3] != siz[37] || siz[38 + 3] != siz[38]) ? 18 : 16;
+	}
+
+	g_byte_array_append(header, (const guint8 *) "\x00\x00\x00\x0c" "jP  " "\x0d\x0a\x87\x0a", 12);
+	g_byte_array_append(header, (const guint8 *) "\x00\x00\x00\x14" "ftyp" "jp2 " "\x00\x00\x00\x00" "jp2 ", 20);
+
+	transcode_put32(header, 8 + 22 + 15 + (depth == 0xFF ? 8 + components : 0));
+	transcode_put32(header, CODESTREAM_BOX_JP2H);
+
+	transcode_put32(header, 22);
+	transcode_put32(header, CODESTREAM_BOX_IHDR);
+	transcode_put32(header, codestream_read32(siz + 6) - codestream_read32(siz + 14));
+	transcode_put32(header, codestream_read32(siz + 2) - codestream_read32(siz + 10));
+	transcode_put16(header, components);
+	g_byte_array_append(header, &depth, 1);
+	g_byte_array_append(header, (const guint8 *) "\x07\x00\x00", 3);
+
+	if(depth == 0xFF)
+	{
+		transcode_put32(header, 8 + components);
+		g_byte_array_append(header, (const guint8 *) "bpcc", 4);
+		for(guint16 c = 0; c < components; c++)
+		{
+			g_byte_array_append(header, &siz[36 + 3 * c], 1);
+		}
+	}
+
+	transcode_put32(header, 15);
+	g_byte_array_append(header, (const guint8 *) "colr" "\x01\x00\x00", 7);
+	transcode_put32(header, colorspace);
+
+	ok = save_func((const gchar *) header->data, header->len, error, user_data);
+	g_byte_array_unref(header);
+
+	return ok;
+}
+
+/**
+ * Rewrite the codestream in input with fewer layers and resolution levels, and/or rewrap it in another container.
+ * Output is passed to save_func in order, packets are copied straight from input.
+ */
+gboolean transcode(const guint8 *input, gsize length, const TranscodeOptions *options, GdkPixbufSaveFunc save_func, gpointer user_data, GError **error)
+{
+	Transcode tc;
+	gsize offset, size;
+	guint64 output;
+	gboolean is_jp2, to_jp2, ok;
+	const guint8 *siz;
+
+	memset(&tc, 0, sizeof(Transcode));
+
+	if(!codestream_locate(input, length, &offset, &size))
+	{
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE, "No JPEG2000 codestream found");
+		return FALSE;
+	}
+
+	is_jp2 = (offset != 0);
+	to_jp2 = (options->format == TRANSCODE_FORMAT_JP2) || (options->format == TRANSCODE_FORMAT_SAME && is_jp2);
+
+	tc.data = input + offset;
+	tc.length = size;
+	tc.options = options;
+
+	if(options->layers == 0 && options->reduce == 0)
+	{
+		// Nothing to drop, the codestream is copied as is
+		CodestreamInfo info;
+
+		memset(&info, 0, sizeof(CodestreamInfo));
+		if(codestream_parse(tc.data, tc.length, &info) != CODESTREAM_OK)
+		{
+			g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid codestream main header");
+			return FALSE;
+		}
+		output = size;
+	}
+	else if(!transcode_plan(&tc, &output, error))
+	{
+		transcode_free(&tc);
+		return FALSE;
+	}
+
+	// SIZ directly follows SOC
+	siz = (tc.header ? tc.header->data : tc.data) + 6;
+
+	ok = TRUE;
+
+	if(to_jp2 && is_jp2)
+	{
+		// Copy every box verbatim except the codestream, patching the image size in ihdr
+		gsize pos = 0;
+
+		while(ok && pos + 8 <= length)
+		{
+			guint64 box = codestream_read32(input + pos);
+			guint32 type = codestream_read32(input + pos + 4);
+			gsize header = 8;
+
+			if(box == 1)
+			{
+				if(pos + 16 > length)
+				{
+					g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Truncated box at %" G_GSIZE_FORMAT, pos);
+					ok = FALSE;
+					break;
+				}
+
+				box = codestream_read64(input + pos + 8);
+				header = 16;
+			}
+			else if(box == 0)
+			{
+				box = length - pos;
+			}
+
+			if(pos + header == offset && box > length - pos)
+			{
+				box = length - pos;
+			}
+
+			if(box < header || box > length - pos)
+			{
+				g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "Invalid box at %" G_GSIZE_FORMAT, pos);
+				ok = FALSE;
+				break;
+			}
+
+			if(pos + header == offset)
+			{
+				ok = transcode_box(CODESTREAM_BOX_JP2C, output, save_func, user_data, error) && transcode_write(&tc, save_func, user_data, error);
+			}
+			else if(type == CODESTREAM_BOX_JP2H)
+			{
+				guint8 *copy = g_malloc((gsize) box);
+
+				memcpy(copy, input + pos, (gsize) box);
+
+				for(gsize child = header; child + 16 <= box; child += MAX(codestream_read32(copy + child), 8))
+				{
+					if(codestream_read32(copy + child + 4) == CODESTREAM_BOX_IHDR)
+					{
+						transcode_write32(copy + child + 8, codestream_read32(siz + 6) - codestream_read32(siz + 14));
+						transcode_write32(copy + child + 12, codestream_read32(siz + 2) - codestream_read32(siz + 10));
+						break;
+					}
+				}
+
+				ok = save_func((const gchar *) copy, (gsize) box, error, user_data);
+				g_free(copy);
+			} else {
+				ok = save_func((const gchar *) input + pos, (gsize) box, error, user_data);
+			}
+
+			pos += (gsize) box;
+		}
+	}
+	else if(to_jp2)
+	{
+		ok = transcode_jp2_header(&tc, siz, save_func, user_data, error) &&
+			transcode_box(CODESTREAM_BOX_JP2C, output, save_func, user_data, error) &&
+			transcode_write(&tc, save_func, user_data, error);
+	} else {
+		ok = transcode_write(&tc, save_func, user_data, error);
+	}
+
+	transcode_free(&tc);
+
+	return ok;
+}
+
+#endif
@@ -20,8 +20,16 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
 #include <openjpeg.h>
 
+#ifdef G_OS_UNIX
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
 // The following defines and functions were copied from openjpeg.c
 // They are not included in libopenjp2 for whatever reason.
 // If they are ever included we should remove these and use them from libopenjp2 instead.
@@ -108,6 +116,85 @@ opj_stream_t* util_create_stream(FILE *fp, int is_input)
 	return stream;
 }
 
+typedef struct {
+	const guint8 *data;
+	gsize length;
+	gsize offset;
+} UtilBuffer;
+
+static OPJ_SIZE_T util_read_from_buffer(void *p_buffer, OPJ_SIZE_T p_nb_bytes, UtilBuffer *buffer)
+{
+	OPJ_SIZE_T length = MIN(p_nb_bytes, buffer->length - buffer->offset);
+
+	if(length == 0)
+	{
+		return (OPJ_SIZE_T) -1;
+	}
+
+	memcpy(p_buffer, buffer->data + buffer->offset, length);
+	buffer->offset += length;
+
+	return length;
+}
+
+// Seeking and skipping past the end succeeds like fseek does, the next read then reports the end of the stream
+
+static OPJ_BOOL util_seek_from_buffer(OPJ_OFF_T p_nb_bytes, UtilBuffer *buffer)
+{
+	if(p_nb_bytes < 0)
+	{
+		return OPJ_FALSE;
+	}
+
+	buffer->offset = (gsize) MIN((guint64) p_nb_bytes, buffer->length);
+
+	return OPJ_TRUE;
+}
+
+static OPJ_OFF_T util_skip_from_buffer(OPJ_OFF_T p_nb_bytes, UtilBuffer *buffer)
+{
+	if(p_nb_bytes < 0)
+	{
+		if((guint64) -p_nb_bytes > buffer->offset)
+		{
+			return -1;
+		}
+		buffer->offset -= (gsize) -p_nb_bytes;
+	} else {
+		buffer->offset += (gsize) MIN((guint64) p_nb_bytes, buffer->length - buffer->offset);
+	}
+
+	return p_nb_bytes;
+}
+
+/**
+ * Create a read-only stream over a buffer in memory, such as a mapped file.
+ * Every stream keeps its own position, so several codecs can decode from the same buffer at once.
+ */
+opj_stream_t* util_create_buffer_stream(const guint8 *data, gsize length)
+{
+	opj_stream_t *stream;
+	UtilBuffer *buffer;
+
+	stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+	if(!stream)
+	{
+		return NULL;
+	}
+
+	buffer = g_new0(UtilBuffer, 1);
+	buffer->data = data;
+	buffer->length = length;
+
+	opj_stream_set_read_function(stream, (opj_stream_read_fn) util_read_from_buffer);
+	opj_stream_set_seek_function(stream, (opj_stream_seek_fn) util_seek_from_buffer);
+	opj_stream_set_skip_function(stream, (opj_stream_skip_fn) util_skip_from_buffer);
+	opj_stream_set_user_data(stream, buffer, g_free);
+	opj_stream_set_user_data_length(stream, length);
+
+	return stream;
+}
+
 /**
  * Destroy stream, codec, and image. As long as they aren't null pointers.
  */
@@ -127,6 +214,47 @@ void util_destroy(opj_codec_t *codec, opj_stream_t* stream, opj_image_t *image)
 	}
 }
 
+/**
+ * Identify what OPJ_CODEC to use for the first bytes of a file.
+ */
+int util_identify_buffer(const guint8 *buffer, gsize length)
+{
+	if(length < 12)
+	{
+		return -1;
+	}
+
+	if(memcmp(buffer, JP2_RFC3745_MAGIC, 12) == 0 || memcmp(buffer, JP2_MAGIC, 4) == 0)
+	{
+		return OPJ_CODEC_JP2;
+	}
+	else if(memcmp(buffer, J2K_CODESTREAM_MAGIC, 4) == 0)
+	{
+		return OPJ_CODEC_J2K;
+	}
+
+	// JPH files start with the JP2 signature and differ only by their jph brand, libopenjp2 reads them as JP2.
+	// HTJ2K codestreams start like any other.
+	// TODO: OPJ_CODEC_JPT? OPJ_CODEC_JPP? OPJ_CODEC_JPX?
+
+	return -1;
+}
+
+/**
+ * Whether the libopenjp2 in use decodes HTJ2K code-blocks, which it does from 2.5.0 on.
+ */
+gboolean util_supports_ht(void)
+{
+	guint major = 0, minor = 0;
+
+	if(sscanf(opj_version(), "%u.%u", &major, &minor) != 2)
+	{
+		return FALSE;
+	}
+
+	return major > 2 || (major == 2 && minor >= 5);
+}
+
 /**
  * Identify what OPJ_CODEC to use for input file.
  */
@@ -143,27 +271,192 @@ int util_identify(FILE *fp)
 	}
 	fseek(fp, 0, SEEK_SET);
 
-	if(memcmp(buffer, JP2_RFC3745_MAGIC, 12) == 0 || memcmp(buffer, JP2_MAGIC, 4) == 0)
+	return util_identify_buffer(buffer, 12);
+}
+
+/**
+ * Divide by 2^shift rounding up, the way libopenjp2 scales coordinates down to a lower resolution.
+ */
+guint32 util_ceildivpow2(guint64 value, guint shift)
+{
+	return (guint32) ((value + (G_GUINT64_CONSTANT(1) << shift) - 1) >> shift);
+}
+
+/**
+ * Area of component 0 of the whole image after discarding the reduce highest resolution levels.
+ * Works on the image from opj_read_header, which is always at full resolution.
+ */
+void util_component_area(opj_image_t *image, guint reduce, guint32 *x0, guint32 *y0, guint32 *width, guint32 *height)
+{
+	guint64 dx = image->comps[0].dx, dy = image->comps[0].dy;
+
+	*x0 = util_ceildivpow2((image->x0 + dx - 1) / dx, reduce);
+	*y0 = util_ceildivpow2((image->y0 + dy - 1) / dy, reduce);
+	*width = util_ceildivpow2((image->x1 + dx - 1) / dx, reduce) - *x0;
+	*height = util_ceildivpow2((image->y1 + dy - 1) / dy, reduce) - *y0;
+}
+
+/**
+ * Bytes of the 32 bit planes opj_decode allocates for image with the highest reduce resolution levels discarded,
+ * from the header alone.
+ */
+guint64 util_planes_size(opj_image_t *image, guint reduce)
+{
+	guint64 size = 0;
+
+	for(OPJ_UINT32 i = 0; i < image->numcomps; i++)
 	{
-		return OPJ_CODEC_JP2;
+		guint64 dx = MAX(image->comps[i].dx, 1), dy = MAX(image->comps[i].dy, 1);
+		guint64 width = util_ceildivpow2((image->x1 + dx - 1) / dx, reduce) - util_ceildivpow2((image->x0 + dx - 1) / dx, reduce);
+		guint64 height = util_ceildivpow2((image->y1 + dy - 1) / dy, reduce) - util_ceildivpow2((image->y0 + dy - 1) / dy, reduce);
+
+		size += width * height * sizeof(OPJ_INT32);
 	}
-	else if(memcmp(buffer, J2K_CODESTREAM_MAGIC, 4) == 0)
+
+	return size;
+}
+
+/**
+ * Origin of component 0 of a tile from opj_get_decoded_tile, on the same grid as util_component_area.
+ * libopenjp2 reduces the size of tile components but leaves their origin at full resolution.
+ */
+void util_tile_origin(opj_image_t *tile, guint32 *x0, guint32 *y0)
+{
+	*x0 = util_ceildivpow2(tile->comps[0].x0, tile->comps[0].factor);
+	*y0 = util_ceildivpow2(tile->comps[0].y0, tile->comps[0].factor);
+}
+
+/**
+ * Size in bytes of width x height pixels of components bytes each, and of one row of them.
+ * Returns FALSE if either overflows, or if the result can't be described to GdkPixbuf, which takes int dimensions.
+ */
+gboolean util_pixels_size(guint64 width, guint64 height, int components, gsize *size, gsize *rowstride)
+{
+	if(width == 0 || height == 0 || width > G_MAXINT || height > G_MAXINT || components <= 0)
 	{
-		return OPJ_CODEC_J2K;
+		return FALSE;
 	}
 
-	// TODO: OPJ_CODEC_JPT? OPJ_CODEC_JPP? OPJ_CODEC_JPX? OPJ_CODEC_JPH?
+	if(!g_size_checked_mul(rowstride, (gsize) width, (gsize) components) || *rowstride > G_MAXINT)
+	{
+		return FALSE;
+	}
 
-	return -1;
+	return g_size_checked_mul(size, *rowstride, (gsize) height);
+}
+
+static void util_free_pixels(guchar *pixels, gpointer data)
+{
+	g_free(pixels);
+}
+
+static void util_free_image_data(guchar *pixels, gpointer data)
+{
+	opj_image_data_free(pixels);
+}
+
+#ifdef G_OS_UNIX
+	static void util_unmap_pixels(guchar *pixels, gpointer data)
+	{
+		munmap(pixels, GPOINTER_TO_SIZE(data));
+	}
+#endif
+
+/**
+ * Parse a size in bytes, optionally with a K, M or G suffix. Sizes too large to count saturate to G_MAXUINT64.
+ * Returns fallback for NULL or empty strings, and for anything that isn't digits and an optional suffix.
+ */
+guint64 util_parse_size(const gchar *value, guint64 fallback)
+{
+	gchar *end = NULL;
+	guint64 size;
+	guint shift = 0;
+
+	if(!value || !g_ascii_isdigit(*value))
+	{
+		return fallback;
+	}
+
+	size = g_ascii_strtoull(value, &end, 10);
+
+	switch(g_ascii_toupper(*end))
+	{
+		case 'G':
+			shift = 30;
+			end++;
+			break;
+		case 'M':
+			shift = 20;
+			end++;
+			break;
+		case 'K':
+			shift = 10;
+			end++;
+			break;
+	}
+
+	if(*end != '\0')
+	{
+		return fallback;
+	}
+
+	return size > (G_MAXUINT64 >> shift) ? G_MAXUINT64 : size << shift;
+}
+
+/**
+ * Output size in bytes from which pixels are mapped from a temporary file instead of allocated, 0 never maps.
+ * Set with GDK_PIXBUF_JP2_MMAP_THRESHOLD, in bytes or with a K, M or G suffix.
+ */
+guint64 util_mmap_threshold(void)
+{
+	return util_parse_size(g_getenv("GDK_PIXBUF_JP2_MMAP_THRESHOLD"), 0);
 }
 
 /**
- * Calculate rowstride for image
+ * Allocate size bytes for the pixels of a pixbuf, along with what gdk_pixbuf_new_from_data needs to release them.
+ * Above util_mmap_threshold the pixels live in an unlinked file in the temporary directory, so huge images can be paged out.
+ * Returns NULL when out of memory.
  */
-int util_rowstride(opj_image_t *image, int comps_needed)
+guint8 *util_alloc_pixels(gsize size, GdkPixbufDestroyNotify *destroy, gpointer *destroy_data)
 {
-	return image->comps[0].w * comps_needed;
-	// return ((image->comps[0].w * comps_needed * image->comps[0].prec + 7U) / 8U);
+	guint64 threshold = util_mmap_threshold();
+
+	#ifdef G_OS_UNIX
+		if(threshold > 0 && size >= threshold)
+		{
+			gchar *path = NULL;
+			gint fd = g_file_open_tmp("jp2-pixbuf-XXXXXX", &path, NULL);
+
+			if(fd >= 0)
+			{
+				void *pixels = MAP_FAILED;
+
+				g_unlink(path);
+				g_free(path);
+
+				if(ftruncate(fd, (off_t) size) == 0)
+				{
+					pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				}
+
+				close(fd);
+
+				if(pixels != MAP_FAILED)
+				{
+					*destroy = util_unmap_pixels;
+					*destroy_data = GSIZE_TO_POINTER(size);
+					return (guint8 *) pixels;
+				}
+			}
+		}
+	#else
+		(void) threshold;
+	#endif
+
+	*destroy = util_free_pixels;
+	*destroy_data = NULL;
+
+	return g_try_malloc(size);
 }
 
 /**
@@ -0,0 +1,84 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    g_setenv("GDK_PIXBUF_JP2_THREADS", "1", TRUE);
+
+    // Far too small a budget fails fast
+
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_BUDGET", "1K", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_POLICY", "fail", TRUE);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    g_assert(pixbuf == NULL);
+    g_assert(g_error_matches(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY));
+    g_clear_error(&error);
+
+    // The 400x300 test image needs about 5 MiB at full size and 1.2 MiB at half size
+
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_BUDGET", "1536K", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_POLICY", "reduce", TRUE);
+
+    pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_width(pixbuf) == 200);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == 150);
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::reduce"), "1") == 0);
+
+    g_object_unref(pixbuf);
+
+    // Loads that fit are untouched
+
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_BUDGET", "64M", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_MEMORY_POLICY", "wait", TRUE);
+
+    pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_width(pixbuf) == 400);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == 300);
+    g_assert(gdk_pixbuf_get_option(pixbuf, "jp2::reduce") == NULL);
+
+    g_strfreev(env);
+
+    g_object_unref(pixbuf);
+
+    return 0;
+}
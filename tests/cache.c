@@ -0,0 +1,210 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <utime.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static GdkPixbuf *load(const gchar *filename, int width, int height)
+{
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = width > 0 ? gdk_pixbuf_new_from_file_at_size(filename, width, height, &error) : gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(pixbuf != NULL);
+
+    return pixbuf;
+}
+
+static gboolean is_hit(GdkPixbuf *pixbuf)
+{
+    return g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::cache"), "hit") == 0;
+}
+
+static void assert_same(GdkPixbuf *a, GdkPixbuf *b)
+{
+    int width = gdk_pixbuf_get_width(a);
+    int height = gdk_pixbuf_get_height(a);
+    int channels = gdk_pixbuf_get_n_channels(a);
+
+    g_assert(width == gdk_pixbuf_get_width(b));
+    g_assert(height == gdk_pixbuf_get_height(b));
+    g_assert(channels == gdk_pixbuf_get_n_channels(b));
+
+    for(int y = 0; y < height; y++)
+    {
+        g_assert(memcmp(gdk_pixbuf_get_pixels(a) + y * gdk_pixbuf_get_rowstride(a), gdk_pixbuf_get_pixels(b) + y * gdk_pixbuf_get_rowstride(b), (gsize) width * channels) == 0);
+    }
+}
+
+/**
+ * Bytes in the entries of the cache, and their number in count.
+ */
+static guint64 cache_size(const gchar *directory, guint *count)
+{
+    GDir *dir = g_dir_open(directory, 0, NULL);
+    const gchar *name;
+    guint64 total = 0;
+
+    g_assert(dir != NULL);
+    *count = 0;
+
+    while((name = g_dir_read_name(dir)))
+    {
+        gchar *path = g_build_filename(directory, name, NULL);
+        GStatBuf st;
+
+        if(g_str_has_suffix(name, ".jp2c") && g_stat(path, &st) == 0)
+        {
+            total += (guint64) st.st_size;
+            (*count)++;
+        }
+
+        g_free(path);
+    }
+
+    g_dir_close(dir);
+
+    return total;
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+    gchar *contents = NULL;
+    gsize length = 0;
+    guint count = 0;
+
+    g_warning("%s", filename);
+
+    gchar *directory = g_dir_make_tmp("jp2-cache-XXXXXX", &error);
+    g_assert(directory != NULL);
+
+    gchar *cache = g_build_filename(directory, "cache", NULL);
+    gchar *image = g_build_filename(directory, "image.jp2", NULL);
+
+    g_assert(g_file_get_contents(filename, &contents, &length, NULL));
+    g_assert(g_file_set_contents(image, contents, (gssize) length, NULL));
+
+    g_setenv("GDK_PIXBUF_JP2_CACHE_DIR", cache, TRUE);
+    g_setenv("GDK_PIXBUF_JP2_CACHE_SIZE", "64M", TRUE);
+
+    // The first load decodes and stores, the second one is mapped from the entry
+
+    GdkPixbuf *full = load(image, -1, -1);
+    g_assert(!is_hit(full));
+    cache_size(cache, &count);
+    g_assert(count == 1);
+
+    GdkPixbuf *cached = load(image, -1, -1);
+    g_assert(is_hit(cached));
+    assert_same(full, cached);
+
+    // A smaller size is an entry of its own, through GdkPixbufLoader
+
+    GdkPixbuf *small = load(image, 200, 150);
+    g_assert(!is_hit(small));
+    g_assert(gdk_pixbuf_get_width(small) == 200);
+
+    GdkPixbuf *small_cached = load(image, 200, 150);
+    g_assert(is_hit(small_cached));
+    assert_same(small, small_cached);
+    cache_size(cache, &count);
+    g_assert(count == 2);
+
+    // Changing the pixels of a hit doesn't change the entry
+
+    memset(gdk_pixbuf_get_pixels(cached), 0, gdk_pixbuf_get_rowstride(cached));
+    GdkPixbuf *again = load(image, -1, -1);
+    g_assert(is_hit(again));
+    assert_same(full, again);
+
+    // A file that changed is a different image
+
+    struct utimbuf times = { 1000000, 1000000 };
+    g_assert(g_utime(image, &times) == 0);
+
+    GdkPixbuf *changed = load(image, -1, -1);
+    g_assert(!is_hit(changed));
+    assert_same(full, changed);
+
+    // Over the limit the entries used least recently are evicted, never the one just stored
+
+    g_setenv("GDK_PIXBUF_JP2_CACHE_SIZE", "400K", TRUE);
+
+    GdkPixbuf *tiny = load(image, 100, 75);
+    g_assert(!is_hit(tiny));
+    g_assert(cache_size(cache, &count) <= 400 * 1024);
+    g_assert(count >= 1);
+
+    GdkPixbuf *tiny_cached = load(image, 100, 75);
+    g_assert(is_hit(tiny_cached));
+    assert_same(tiny, tiny_cached);
+
+    // Turned off, nothing is looked up
+
+    g_setenv("GDK_PIXBUF_JP2_CACHE_SIZE", "0", TRUE);
+
+    GdkPixbuf *uncached = load(image, 100, 75);
+    g_assert(!is_hit(uncached));
+
+    g_object_unref(uncached);
+    g_object_unref(tiny_cached);
+    g_object_unref(tiny);
+    g_object_unref(changed);
+    g_object_unref(again);
+    g_object_unref(small_cached);
+    g_object_unref(small);
+    g_object_unref(cached);
+    g_object_unref(full);
+
+    GDir *dir = g_dir_open(cache, 0, NULL);
+    const gchar *name;
+
+    while(dir && (name = g_dir_read_name(dir)))
+    {
+        gchar *path = g_build_filename(cache, name, NULL);
+        g_unlink(path);
+        g_free(path);
+    }
+
+    if(dir)
+    {
+        g_dir_close(dir);
+    }
+
+    g_rmdir(cache);
+    g_unlink(image);
+    g_rmdir(directory);
+
+    g_free(image);
+    g_free(cache);
+    g_free(directory);
+    g_free(contents);
+    g_strfreev(env);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static void area_updated(GdkPixbufLoader *loader, gint x, gint y, gint width, gint height, gpointer data)
+{
+    GCancellable *cancellable = g_cancellable_get_current();
+
+    // Give up as soon as the first tile is shown
+
+    (*(int *) data)++;
+    g_cancellable_cancel(cancellable);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    int updates = 0;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    // Loads that are cancelled before they start don't decode anything
+
+    GCancellable *cancellable = g_cancellable_new();
+    g_cancellable_cancel(cancellable);
+    g_cancellable_push_current(cancellable);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    g_cancellable_pop_current(cancellable);
+    g_object_unref(cancellable);
+
+    g_assert(pixbuf == NULL);
+    g_assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+    g_clear_error(&error);
+
+    // Incremental loads stop after the tile they were cancelled on, the test image has four
+
+    g_file_get_contents(filename, &contents, &length, &error);
+    g_assert(error == NULL);
+
+    cancellable = g_cancellable_new();
+    g_cancellable_push_current(cancellable);
+
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "area-updated", G_CALLBACK(area_updated), &updates);
+
+    gdk_pixbuf_loader_write(loader, (const guchar *) contents, length, &error);
+    g_assert(error == NULL);
+
+    g_assert(!gdk_pixbuf_loader_close(loader, &error));
+    g_assert(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+    g_assert(updates == 1);
+    g_clear_error(&error);
+
+    g_cancellable_pop_current(cancellable);
+    g_object_unref(cancellable);
+
+    g_strfreev(env);
+    g_free(contents);
+
+    g_object_unref(loader);
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static GdkPixbuf *load(const gchar *filename, const gchar *components, GError **error)
+{
+    g_setenv("GDK_PIXBUF_JP2_COMPONENTS", components, TRUE);
+
+    return gdk_pixbuf_new_from_file(filename, error);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    GdkPixbuf *full = load(filename, "", &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    // The test image is RGB with the reversible component transform, so component 0 alone is its luma
+
+    GdkPixbuf *gray = load(filename, "gray", &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_width(gray) == gdk_pixbuf_get_width(full));
+    g_assert(gdk_pixbuf_get_height(gray) == gdk_pixbuf_get_height(full));
+    g_assert(gdk_pixbuf_get_n_channels(gray) == 3);
+
+    for(int y = 0; y < gdk_pixbuf_get_height(gray); y++)
+    {
+        const guchar *g = gdk_pixbuf_get_pixels(gray) + y * gdk_pixbuf_get_rowstride(gray);
+        const guchar *f = gdk_pixbuf_get_pixels(full) + y * gdk_pixbuf_get_rowstride(full);
+
+        for(int x = 0; x < gdk_pixbuf_get_width(gray); x++)
+        {
+            g_assert(g[x * 3] == g[x * 3 + 1] && g[x * 3] == g[x * 3 + 2]);
+            g_assert(abs(g[x * 3] - (f[x * 3] + 2 * f[x * 3 + 1] + f[x * 3 + 2]) / 4) <= 1);
+        }
+    }
+
+    // A single listed component is shown as gray as well
+
+    GdkPixbuf *band = load(filename, "0", &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(memcmp(gdk_pixbuf_get_pixels(band), gdk_pixbuf_get_pixels(gray), gdk_pixbuf_get_byte_length(gray)) == 0);
+
+    // Components that don't exist are an error
+
+    GdkPixbuf *missing = load(filename, "5", &error);
+
+    g_assert(missing == NULL);
+    g_assert(error != NULL);
+    g_clear_error(&error);
+
+    // Listing subsampled chroma with full-size luma is refused rather than read as planes of the same size
+
+    const gchar *subsampled = g_environ_getenv(env, "SUBSAMPLED_FILE");
+
+    GdkPixbuf *mixed = load(subsampled, "0,1,2", &error);
+
+    g_assert(mixed == NULL);
+    g_assert(g_error_matches(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION));
+    g_clear_error(&error);
+
+    mixed = load(subsampled, "0,1", &error);
+
+    g_assert(mixed == NULL);
+    g_assert(g_error_matches(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION));
+    g_clear_error(&error);
+
+    // Components of the same size still go together
+
+    GdkPixbuf *chroma = load(subsampled, "1,2", &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_width(chroma) == 240 && gdk_pixbuf_get_height(chroma) == 320);
+    g_assert(gdk_pixbuf_get_n_channels(chroma) == 4);
+
+    // More than four listed components is refused while parsing and decodes everything
+
+    GdkPixbuf *many = load(filename, "0,1,2,3,4", &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_byte_length(many) == gdk_pixbuf_get_byte_length(full));
+
+    g_unsetenv("GDK_PIXBUF_JP2_COMPONENTS");
+
+    g_strfreev(env);
+
+    g_object_unref(many);
+    g_object_unref(chroma);
+    g_object_unref(band);
+    g_object_unref(gray);
+    g_object_unref(full);
+
+    return 0;
+}
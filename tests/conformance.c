@@ -0,0 +1,504 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Differential conformance: every image is decoded with libopenjp2 and converted with color_convert, the scalar reference,
+// then converted and loaded through every other path the loader has. Each output is compared per channel against the
+// reference within the tolerance of its variant and a pass/fail matrix is printed, one row per image.
+// Files and directories of images are taken as arguments, TEST_FILE when there are none. TEST_VARIANTS limits the run to
+// a comma separated list of variants, so CI can exercise each path on its own.
+
+#include <stdio.h>
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <util.h>
+#include <codestream.h>
+#include <color.h>
+
+#define STRIP_BYTES 65536 // output per strip, as scale_convert_tile uses
+#define MAX_REDUCE 3      // lowest resolution level loaded by the reduced variant
+
+typedef enum {
+    VARIANT_IN_PLACE = 0, // color_convert over the first component plane, when color_convert_in_place allows it
+    VARIANT_ROWS,         // color_convert_rows a strip at a time, when color_convert_by_rows allows it
+    VARIANT_TILE,         // color_convert_tile into a larger buffer at an offset
+    VARIANT_FILE,         // gdk_pixbuf_new_from_file on one thread
+    VARIANT_THREADS,      // gdk_pixbuf_new_from_file with tiles decoded in parallel
+    VARIANT_MAPPED,       // gdk_pixbuf_new_from_file into pixels mapped from a temporary file
+    VARIANT_STREAM,       // GdkPixbufLoader, tiles decoded and converted by the pipeline
+    VARIANT_QUEUE,        // GdkPixbufLoader with a single decoded tile queued
+    VARIANT_REDUCED,      // GdkPixbufLoader at the size of each lower resolution level
+    VARIANTS,
+} VARIANT;
+
+typedef struct {
+    const gchar *name;
+    int tolerance; // largest difference allowed in any channel, 0 is bit-exact
+} Variant;
+
+// Every path shares the scalar kernels today, so all must match exactly. Kernels that round differently, like fixed-point
+// color transforms, get the tolerance they are documented to keep here.
+
+static const Variant variants[VARIANTS] = {
+    {"in-place", 0},
+    {"rows", 0},
+    {"tile", 0},
+    {"file", 0},
+    {"threads", 0},
+    {"mapped", 0},
+    {"stream", 0},
+    {"queue", 0},
+    {"reduced", 0},
+};
+
+typedef enum {
+    RESULT_SKIPPED = 0, // the variant doesn't apply to the image
+    RESULT_PASSED,
+    RESULT_FAILED,
+} RESULT;
+
+typedef struct {
+    RESULT result;
+    int difference; // largest difference in any channel, G_MAXINT when the output couldn't be compared
+} Outcome;
+
+static void outcome_add(Outcome *outcome, VARIANT variant, int difference)
+{
+    outcome->difference = MAX(outcome->difference, difference);
+
+    if(difference > variants[variant].tolerance)
+    {
+        outcome->result = RESULT_FAILED;
+    }
+    else if(outcome->result == RESULT_SKIPPED)
+    {
+        outcome->result = RESULT_PASSED;
+    }
+}
+
+/**
+ * Largest difference in any channel between width x height pixels and the packed reference.
+ */
+static int compare(const guint8 *reference, const guint8 *pixels, gsize rowstride, gsize width, gsize height, int components)
+{
+    gsize length = width * (gsize) components;
+    int difference = 0;
+
+    for(gsize y = 0; y < height; y++)
+    {
+        const guint8 *expected = reference + y * length;
+        const guint8 *actual = pixels + y * rowstride;
+
+        for(gsize i = 0; i < length; i++)
+        {
+            difference = MAX(difference, ABS((int) actual[i] - (int) expected[i]));
+        }
+    }
+
+    return difference;
+}
+
+static int compare_pixbuf(const guint8 *reference, GdkPixbuf *pixbuf, gsize width, gsize height, int components)
+{
+    if((gsize) gdk_pixbuf_get_width(pixbuf) != width || (gsize) gdk_pixbuf_get_height(pixbuf) != height || gdk_pixbuf_get_n_channels(pixbuf) != components)
+    {
+        g_warning("Got %dx%d with %d channels instead of %" G_GSIZE_FORMAT "x%" G_GSIZE_FORMAT " with %d", gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), gdk_pixbuf_get_n_channels(pixbuf), width, height, components);
+        return G_MAXINT;
+    }
+
+    return compare(reference, gdk_pixbuf_get_pixels(pixbuf), (gsize) gdk_pixbuf_get_rowstride(pixbuf), width, height, components);
+}
+
+/**
+ * Decode filename at reduce with libopenjp2 alone, the way the loader would without any of its own paths.
+ * Returns NULL when the file can't be decoded or its colorspace isn't supported.
+ */
+static opj_image_t *decode(const gchar *filename, guint reduce, CodestreamInfo *info, int *components, COLOR_SPACE *colorspace)
+{
+    FILE *fp = fopen(filename, "rb");
+    opj_codec_t *codec = NULL;
+    opj_stream_t *stream = NULL;
+    opj_image_t *image = NULL;
+    opj_dparameters_t parameters;
+    int codec_type;
+
+    if(!fp)
+    {
+        return NULL;
+    }
+
+    codec_type = util_identify(fp);
+    if(codec_type < 0 || !codestream_scan(fp, info))
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    opj_set_default_decoder_parameters(&parameters);
+    parameters.cp_reduce = reduce;
+
+    stream = util_create_stream(fp, OPJ_TRUE);
+    codec = opj_create_decompress(codec_type);
+
+    if(!stream || !codec || !opj_setup_decoder(codec, &parameters) || !opj_read_header(stream, codec, &image) ||
+        !opj_decode(codec, stream, image) || !opj_end_decompress(codec, stream) || !color_info(image, components, colorspace))
+    {
+        util_destroy(codec, stream, image);
+        fclose(fp);
+        return NULL;
+    }
+
+    util_destroy(codec, stream, NULL);
+    fclose(fp);
+
+    return image;
+}
+
+/**
+ * Load through the loader the way variant does, at width x height when those aren't -1.
+ */
+static GdkPixbuf *load(VARIANT variant, const gchar *filename, const gchar *contents, gsize length, gint width, gint height, GError **error)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf = NULL;
+
+    g_setenv("GDK_PIXBUF_JP2_THREADS", variant == VARIANT_THREADS ? "4" : "1", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_MMAP_THRESHOLD", variant == VARIANT_MAPPED ? "1" : "0", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_QUEUE_DEPTH", variant == VARIANT_QUEUE ? "1" : "2", TRUE);
+
+    if(variant == VARIANT_FILE || variant == VARIANT_THREADS || variant == VARIANT_MAPPED)
+    {
+        return gdk_pixbuf_new_from_file(filename, error);
+    }
+
+    loader = gdk_pixbuf_loader_new();
+
+    if(width > 0 && height > 0)
+    {
+        gdk_pixbuf_loader_set_size(loader, width, height);
+    }
+
+    if(gdk_pixbuf_loader_write(loader, (const guchar *) contents, length, error) && gdk_pixbuf_loader_close(loader, error))
+    {
+        pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+
+    g_object_unref(loader);
+
+    return pixbuf;
+}
+
+static void check_load(Outcome *outcome, VARIANT variant, const gchar *filename, const gchar *contents, gsize length, const guint8 *reference, gsize width, gsize height, int components, gboolean reduced)
+{
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = load(variant, filename, contents, length, reduced ? (gint) width : -1, reduced ? (gint) height : -1, &error);
+
+    if(!pixbuf)
+    {
+        g_warning("%s: %s", variants[variant].name, error ? error->message : "no pixbuf");
+        g_clear_error(&error);
+        outcome_add(outcome, variant, G_MAXINT);
+        return;
+    }
+
+    outcome_add(outcome, variant, compare_pixbuf(reference, pixbuf, width, height, components));
+    g_object_unref(pixbuf);
+}
+
+/**
+ * Run every enabled variant on filename. Returns FALSE when there is no reference to compare against.
+ */
+static gboolean check_image(const gchar *filename, const gboolean *enabled, Outcome *outcomes)
+{
+    CodestreamInfo info;
+    int components = -1;
+    COLOR_SPACE colorspace = -1;
+    opj_image_t *image = decode(filename, 0, &info, &components, &colorspace);
+    GError *error = NULL;
+    gchar *contents = NULL;
+    gsize length = 0;
+    gsize width, height, rowstride;
+    guint8 *reference;
+
+    memset(outcomes, 0, VARIANTS * sizeof(Outcome));
+
+    if(!image || !g_file_get_contents(filename, &contents, &length, &error))
+    {
+        g_clear_error(&error);
+        util_destroy(NULL, NULL, image);
+        return FALSE;
+    }
+
+    width = image->comps[0].w;
+    height = image->comps[0].h;
+    rowstride = width * (gsize) components;
+    reference = g_malloc(rowstride * height);
+    color_convert(image, colorspace, reference);
+
+    if(enabled[VARIANT_ROWS] && color_convert_by_rows(image))
+    {
+        guint8 *pixels = g_malloc(rowstride * height);
+        gsize strip = CLAMP(STRIP_BYTES / MAX(rowstride, 1), 1, height);
+
+        for(gsize row = 0; row < height; row += strip)
+        {
+            color_convert_rows(image, colorspace, row, MIN(strip, height - row), pixels + row * rowstride);
+        }
+
+        outcome_add(&outcomes[VARIANT_ROWS], VARIANT_ROWS, compare(reference, pixels, rowstride, width, height, components));
+        g_free(pixels);
+    }
+
+    if(enabled[VARIANT_TILE])
+    {
+        gsize padded = rowstride + 2 * (gsize) components;
+        guint8 *pixels = g_malloc0(padded * (height + 2));
+        guint8 *scratch = NULL;
+        gsize scratch_size = 0;
+
+        color_convert_tile(image, colorspace, components, pixels, padded, 1, 1, &scratch, &scratch_size);
+
+        outcome_add(&outcomes[VARIANT_TILE], VARIANT_TILE, compare(reference, pixels + padded + (gsize) components, padded, width, height, components));
+        g_free(scratch);
+        g_free(pixels);
+    }
+
+    // Last of the conversions, it overwrites the first plane
+
+    if(enabled[VARIANT_IN_PLACE] && color_convert_in_place(image, colorspace))
+    {
+        guint8 *pixels = (guint8 *) image->comps[0].data;
+
+        color_convert(image, colorspace, pixels);
+        outcome_add(&outcomes[VARIANT_IN_PLACE], VARIANT_IN_PLACE, compare(reference, pixels, rowstride, width, height, components));
+    }
+
+    opj_image_destroy(image);
+
+    for(VARIANT variant = VARIANT_FILE; variant <= VARIANT_QUEUE; variant++)
+    {
+        if(enabled[variant])
+        {
+            check_load(&outcomes[variant], variant, filename, contents, length, reference, width, height, components, FALSE);
+        }
+    }
+
+    g_free(reference);
+
+    // Every lower resolution level against libopenjp2 decoding at that level
+
+    for(guint reduce = 1; enabled[VARIANT_REDUCED] && reduce < info.resolutions && reduce <= MAX_REDUCE; reduce++)
+    {
+        CodestreamInfo reduced_info;
+
+        image = decode(filename, reduce, &reduced_info, &components, &colorspace);
+        if(!image)
+        {
+            outcome_add(&outcomes[VARIANT_REDUCED], VARIANT_REDUCED, G_MAXINT);
+            continue;
+        }
+
+        width = image->comps[0].w;
+        height = image->comps[0].h;
+        reference = g_malloc(width * height * (gsize) components);
+        color_convert(image, colorspace, reference);
+        opj_image_destroy(image);
+
+        check_load(&outcomes[VARIANT_REDUCED], VARIANT_REDUCED, filename, contents, length, reference, width, height, components, TRUE);
+        g_free(reference);
+    }
+
+    g_free(contents);
+
+    return TRUE;
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/**
+ * Add filename to files, or every JPEG2000 image in it, sorted by name, when it is a directory.
+ */
+static void add_files(GPtrArray *files, const gchar *filename)
+{
+    static const gchar *suffixes[] = {".jp2", ".jpf", ".j2k", ".j2c"};
+    GDir *dir = g_dir_open(filename, 0, NULL);
+    GPtrArray *entries;
+    const gchar *name;
+
+    if(!dir)
+    {
+        g_ptr_array_add(files, g_strdup(filename));
+        return;
+    }
+
+    entries = g_ptr_array_new();
+
+    while((name = g_dir_read_name(dir)))
+    {
+        for(gsize i = 0; i < G_N_ELEMENTS(suffixes); i++)
+        {
+            if(g_str_has_suffix(name, suffixes[i]))
+            {
+                g_ptr_array_add(entries, g_build_filename(filename, name, NULL));
+                break;
+            }
+        }
+    }
+
+    g_ptr_array_sort(entries, compare_names);
+
+    for(guint i = 0; i < entries->len; i++)
+    {
+        g_ptr_array_add(files, g_ptr_array_index(entries, i));
+    }
+
+    g_ptr_array_free(entries, TRUE);
+    g_dir_close(dir);
+}
+
+static void print_cell(const Outcome *outcome)
+{
+    gchar *cell;
+
+    switch(outcome->result)
+    {
+        case RESULT_SKIPPED:
+            cell = g_strdup("-");
+            break;
+        case RESULT_PASSED:
+            cell = outcome->difference ? g_strdup_printf("pass(%d)", outcome->difference) : g_strdup("pass");
+            break;
+        default:
+            cell = outcome->difference == G_MAXINT ? g_strdup("FAIL(err)") : g_strdup_printf("FAIL(%d)", outcome->difference);
+            break;
+    }
+
+    g_print(" %-9s", cell);
+    g_free(cell);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    gchar **env = g_get_environ();
+    const gchar *only = g_environ_getenv(env, "TEST_VARIANTS");
+    gboolean enabled[VARIANTS];
+    guint passed[VARIANTS], failed[VARIANTS];
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    guint failures = 0;
+
+    // Knobs that would change what the loader decodes
+
+    g_unsetenv("GDK_PIXBUF_JP2_COMPONENTS");
+    g_unsetenv("GDK_PIXBUF_JP2_MEMORY_BUDGET");
+    g_unsetenv("GDK_PIXBUF_JP2_TIME_BUDGET");
+
+    for(VARIANT variant = 0; variant < VARIANTS; variant++)
+    {
+        enabled[variant] = only == NULL || *only == '\0';
+        passed[variant] = failed[variant] = 0;
+    }
+
+    if(only && *only)
+    {
+        gchar **names = g_strsplit(only, ",", -1);
+
+        for(gchar **name = names; *name; name++)
+        {
+            VARIANT variant = 0;
+
+            while(variant < VARIANTS && strcmp(variants[variant].name, g_strstrip(*name)) != 0)
+            {
+                variant++;
+            }
+
+            if(variant == VARIANTS)
+            {
+                g_error("Unknown variant '%s'", *name);
+            }
+
+            enabled[variant] = TRUE;
+        }
+
+        g_strfreev(names);
+    }
+
+    for(gint i = 1; i < argc; i++)
+    {
+        add_files(files, argv[i]);
+    }
+
+    if(argc < 2)
+    {
+        g_assert(g_environ_getenv(env, "TEST_FILE") != NULL);
+        add_files(files, g_environ_getenv(env, "TEST_FILE"));
+    }
+
+    g_assert(files->len > 0);
+
+    g_print("%-24s", "image");
+    for(VARIANT variant = 0; variant < VARIANTS; variant++)
+    {
+        g_print(" %-9s", variants[variant].name);
+    }
+    g_print("\n");
+
+    for(guint i = 0; i < files->len; i++)
+    {
+        const gchar *filename = g_ptr_array_index(files, i);
+        gchar *basename = g_path_get_basename(filename);
+        Outcome outcomes[VARIANTS];
+
+        g_print("%-24s", basename);
+        g_free(basename);
+
+        if(!check_image(filename, enabled, outcomes))
+        {
+            g_print(" no reference, unsupported by libopenjp2 or the loader\n");
+            continue;
+        }
+
+        for(VARIANT variant = 0; variant < VARIANTS; variant++)
+        {
+            print_cell(&outcomes[variant]);
+            passed[variant] += outcomes[variant].result == RESULT_PASSED;
+            failed[variant] += outcomes[variant].result == RESULT_FAILED;
+        }
+        g_print("\n");
+    }
+
+    g_print("%-24s", "failed/run");
+    for(VARIANT variant = 0; variant < VARIANTS; variant++)
+    {
+        gchar *cell = g_strdup_printf("%u/%u", failed[variant], passed[variant] + failed[variant]);
+
+        g_print(" %-9s", cell);
+        g_free(cell);
+        failures += failed[variant];
+    }
+    g_print("\n");
+
+    g_ptr_array_free(files, TRUE);
+    g_strfreev(env);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <openjpeg.h>
+
+// The fixtures are a JPH file and a bare HTJ2K codestream of a 64x64 RGB image whose code-blocks are all empty,
+// so they decode to mid gray
+
+static void check(const gchar *filename, gboolean supported)
+{
+    GError *error = NULL;
+
+    g_warning("%s", filename);
+
+    GdkPixbufFormat *format = gdk_pixbuf_get_file_info(filename, NULL, NULL);
+    g_assert(format != NULL);
+    g_assert(g_strcmp0(gdk_pixbuf_format_get_name(format), "jp2") == 0);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(!supported)
+    {
+        // Older libopenjp2 can't decode the HT block coder, which is reported before it gets to try
+
+        g_assert(pixbuf == NULL);
+        g_assert(g_error_matches(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE));
+        g_clear_error(&error);
+        return;
+    }
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(gdk_pixbuf_get_width(pixbuf) == 64);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == 64);
+    g_assert(gdk_pixbuf_get_n_channels(pixbuf) == 3);
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::ht"), "yes") == 0);
+
+    const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+
+    for(int y = 0; y < 64; y++)
+    {
+        for(int x = 0; x < 64 * 3; x++)
+        {
+            g_assert(pixels[y * gdk_pixbuf_get_rowstride(pixbuf) + x] == 128);
+        }
+    }
+
+    // Through GdkPixbufLoader at a lower resolution level
+
+    GdkPixbuf *small = gdk_pixbuf_new_from_file_at_size(filename, 32, 32, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(gdk_pixbuf_get_width(small) == 32);
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(small, "jp2::ht"), "yes") == 0);
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(small, "jp2::reduce"), "1") == 0);
+
+    g_object_unref(small);
+    g_object_unref(pixbuf);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+    const gchar *codestream = g_environ_getenv(env, "TEST_CODESTREAM");
+    const gchar *classic = g_environ_getenv(env, "TEST_CLASSIC");
+    guint major = 0, minor = 0;
+
+    g_assert(sscanf(opj_version(), "%u.%u", &major, &minor) == 2);
+    gboolean supported = major > 2 || (major == 2 && minor >= 5);
+
+    check(filename, supported);
+    check(codestream, supported);
+
+    // Images with the classic block coder say so too
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(classic, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::ht"), "no") == 0);
+
+    g_object_unref(pixbuf);
+    g_strfreev(env);
+
+    return 0;
+}
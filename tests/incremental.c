@@ -0,0 +1,101 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static void area_updated(GdkPixbufLoader *loader, gint x, gint y, gint width, gint height, gpointer data)
+{
+    (*(int *) data)++;
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    int updates = 0;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    GdkPixbuf *reference = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    g_file_get_contents(filename, &contents, &length, &error);
+    g_assert(error == NULL);
+
+    // Feed the loader in small chunks with room for a single decoded tile in the queue
+
+    g_setenv("GDK_PIXBUF_JP2_QUEUE_DEPTH", "1", TRUE);
+
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "area-updated", G_CALLBACK(area_updated), &updates);
+
+    for(gsize i = 0; i < length && !error; i += 4096)
+    {
+        gdk_pixbuf_loader_write(loader, (const guchar *) contents + i, MIN(4096, length - i), &error);
+    }
+
+    if(!error)
+    {
+        gdk_pixbuf_loader_close(loader, &error);
+    }
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+
+    // The test image has four tiles, each one reported as it is converted
+
+    g_assert(updates == 4);
+    g_assert(gdk_pixbuf_get_width(pixbuf) == gdk_pixbuf_get_width(reference));
+    g_assert(gdk_pixbuf_get_height(pixbuf) == gdk_pixbuf_get_height(reference));
+    g_assert(gdk_pixbuf_get_n_channels(pixbuf) == gdk_pixbuf_get_n_channels(reference));
+
+    gsize row = (gsize) gdk_pixbuf_get_width(pixbuf) * (gsize) gdk_pixbuf_get_n_channels(pixbuf);
+    for(int y = 0; y < gdk_pixbuf_get_height(pixbuf); y++)
+    {
+        g_assert(memcmp(
+            gdk_pixbuf_get_pixels(pixbuf) + (gsize) y * (gsize) gdk_pixbuf_get_rowstride(pixbuf),
+            gdk_pixbuf_get_pixels(reference) + (gsize) y * (gsize) gdk_pixbuf_get_rowstride(reference),
+            row
+        ) == 0);
+    }
+
+    g_strfreev(env);
+    g_free(contents);
+
+    g_object_unref(loader);
+    g_object_unref(reference);
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    g_setenv("GDK_PIXBUF_JP2_THREADS", "1", TRUE);
+
+    // The 400x300 test image takes well over a millisecond at full size, so 1 ms gives a lower resolution
+
+    g_setenv("GDK_PIXBUF_JP2_TIME_BUDGET", "1", TRUE);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_option(pixbuf, "jp2::reduce") != NULL);
+    g_assert(gdk_pixbuf_get_option(pixbuf, "jp2::layers") != NULL);
+
+    guint reduce = (guint) g_ascii_strtoull(gdk_pixbuf_get_option(pixbuf, "jp2::reduce"), NULL, 10);
+
+    g_assert(reduce > 0);
+    g_assert(gdk_pixbuf_get_width(pixbuf) == (400 + (1 << reduce) - 1) >> reduce);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == (300 + (1 << reduce) - 1) >> reduce);
+
+    g_object_unref(pixbuf);
+
+    // Plenty of time gives the full image
+
+    g_setenv("GDK_PIXBUF_JP2_TIME_BUDGET", "60000", TRUE);
+
+    pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+    g_assert(gdk_pixbuf_get_width(pixbuf) == 400);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == 300);
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::reduce"), "0") == 0);
+
+    g_strfreev(env);
+
+    g_object_unref(pixbuf);
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#define MiB (G_GUINT64_CONSTANT(1) << 20)
+
+static void size_prepared(GdkPixbufLoader *loader, gint width, gint height, gpointer data)
+{
+    gint *size = (gint *) data;
+
+    if(size[0] > 0)
+    {
+        gdk_pixbuf_loader_set_size(loader, size[0], size[1]);
+    }
+}
+
+static guint64 peak_of(GdkPixbuf *pixbuf)
+{
+    const gchar *peak = gdk_pixbuf_get_option(pixbuf, "jp2::peak-bytes");
+
+    g_assert(peak != NULL);
+    g_assert(gdk_pixbuf_get_option(pixbuf, "jp2::allocated-bytes") != NULL);
+
+    return g_ascii_strtoull(peak, NULL, 10);
+}
+
+/**
+ * Feed the file to a GdkPixbufLoader, asking for width x height when width > 0, and return the peak of the load.
+ */
+static guint64 stream(const gchar *contents, gsize length, gint width, gint height)
+{
+    GError *error = NULL;
+    gint size[2] = {width, height};
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    guint64 peak;
+
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(size_prepared), size);
+
+    for(gsize i = 0; i < length && !error; i += 65536)
+    {
+        gdk_pixbuf_loader_write(loader, (const guchar *) contents + i, MIN(65536, length - i), &error);
+    }
+
+    if(!error)
+    {
+        gdk_pixbuf_loader_close(loader, &error);
+    }
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+
+    if(width > 0)
+    {
+        g_assert(gdk_pixbuf_get_width(pixbuf) == width);
+        g_assert(gdk_pixbuf_get_height(pixbuf) == height);
+    }
+
+    peak = peak_of(pixbuf);
+
+    g_object_unref(loader);
+
+    return peak;
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    g_setenv("GDK_PIXBUF_JP2_TIMING", "1", TRUE);
+    g_setenv("GDK_PIXBUF_JP2_THREADS", "1", TRUE);
+    g_unsetenv("GDK_PIXBUF_JP2_MMAP_THRESHOLD");
+
+    // The 2717x3701 RGB test image has 115 MiB of 32 bit planes and 29 MiB of pixels. Converting into the first
+    // plane keeps the peak at the planes and the stream buffer.
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    guint64 compacted = peak_of(pixbuf);
+
+    g_warning("compacted peak %" G_GUINT64_FORMAT, compacted);
+    g_assert(compacted < 120 * MiB);
+
+    g_object_unref(pixbuf);
+
+    g_file_get_contents(filename, &contents, &length, &error);
+    g_assert(error == NULL);
+
+    // Streaming at full size holds the file, the planes of its only tile and the pixels
+
+    guint64 streamed = stream(contents, length, 0, 0);
+
+    g_warning("streamed peak %" G_GUINT64_FORMAT, streamed);
+    g_assert(streamed < 150 * MiB);
+
+    // Streaming at an eighth of the size discards three resolution levels and never comes near the full planes
+
+    guint64 reduced = stream(contents, length, 340, 463);
+
+    g_warning("reduced peak %" G_GUINT64_FORMAT, reduced);
+    g_assert(reduced < 4 * MiB);
+
+    g_free(contents);
+    g_strfreev(env);
+
+    return 0;
+}
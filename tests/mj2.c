@@ -0,0 +1,401 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+// The clip is put together here from three solid colour frames saved by the loader, each a lossless codestream,
+// lasting 40, 100 and 100 milliseconds
+
+#define WIDTH 64
+#define HEIGHT 48
+#define FRAMES 3
+
+static const guint8 colors[FRAMES][3] = { { 200, 30, 30 }, { 30, 200, 30 }, { 30, 30, 200 } };
+static const guint32 delays[FRAMES] = { 40, 100, 100 };
+
+static void put32(GByteArray *array, guint32 value)
+{
+    guint8 bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+    g_byte_array_append(array, bytes, 4);
+}
+
+static void put_type(GByteArray *array, const gchar *type)
+{
+    g_byte_array_append(array, (const guint8 *) type, 4);
+}
+
+/**
+ * Start a box of type, returning where its length goes once end_box knows it.
+ */
+static guint begin_box(GByteArray *array, const gchar *type)
+{
+    guint start = array->len;
+
+    put32(array, 0);
+    put_type(array, type);
+
+    return start;
+}
+
+static void end_box(GByteArray *array, guint start)
+{
+    guint32 length = array->len - start;
+    guint8 bytes[4] = { length >> 24, length >> 16, length >> 8, length };
+
+    memcpy(array->data + start, bytes, 4);
+}
+
+/**
+ * Codestream of the JP2 file at path, the payload of its jp2c box.
+ */
+static GBytes *codestream(const gchar *path)
+{
+    GError *error = NULL;
+    gchar *data;
+    gsize length, pos = 0;
+
+    if(!g_file_get_contents(path, &data, &length, &error))
+    {
+        g_error("%s", error->message);
+    }
+
+    while(pos + 8 <= length)
+    {
+        const guint8 *box = (const guint8 *) data + pos;
+        gsize box_length = (gsize) box[0] << 24 | box[1] << 16 | box[2] << 8 | box[3];
+
+        if(box_length == 0)
+        {
+            box_length = length - pos;
+        }
+
+        g_assert(box_length >= 8 && box_length <= length - pos);
+
+        if(memcmp(box + 4, "jp2c", 4) == 0)
+        {
+            GBytes *bytes = g_bytes_new(box + 8, box_length - 8);
+            g_free(data);
+            return bytes;
+        }
+
+        pos += box_length;
+    }
+
+    g_error("%s has no codestream", path);
+
+    return NULL;
+}
+
+/**
+ * Write a Motion JPEG 2000 file to path with one sample per frame: the file type, the samples, then the movie box.
+ */
+static void write_clip(const gchar *directory, const gchar *path)
+{
+    GError *error = NULL;
+    GByteArray *file = g_byte_array_new();
+    guint32 offsets[FRAMES], sizes[FRAMES];
+    guint moov, trak, mdia, box, minf, stbl, mdat;
+
+    // Signature and file type
+
+    box = begin_box(file, "jP  ");
+    put32(file, 0x0D0A870A);
+    end_box(file, box);
+
+    // With mjp2 only at the end of a compatibility list that runs past the first 64 bytes of the file
+
+    box = begin_box(file, "ftyp");
+    put_type(file, "jp2 ");
+    put32(file, 0);
+    for(int i = 0; i < 15; i++)
+    {
+        put_type(file, "jpx ");
+    }
+    put_type(file, "mjp2");
+    end_box(file, box);
+
+    // Every sample is a jp2c box around a codestream the loader saved
+
+    mdat = begin_box(file, "mdat");
+
+    for(int i = 0; i < FRAMES; i++)
+    {
+        GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, WIDTH, HEIGHT);
+        gchar *name = g_strdup_printf("frame%d.jp2", i);
+        gchar *frame = g_build_filename(directory, name, NULL);
+
+        gdk_pixbuf_fill(pixbuf, (guint32) colors[i][0] << 24 | colors[i][1] << 16 | colors[i][2] << 8 | 0xFF);
+
+        if(!gdk_pixbuf_save(pixbuf, frame, "jp2", &error, NULL))
+        {
+            g_error("%s", error->message);
+        }
+
+        GBytes *bytes = codestream(frame);
+        gsize length;
+        const guint8 *data = g_bytes_get_data(bytes, &length);
+
+        offsets[i] = file->len;
+        box = begin_box(file, "jp2c");
+        g_byte_array_append(file, data, length);
+        end_box(file, box);
+        sizes[i] = file->len - offsets[i];
+
+        g_unlink(frame);
+        g_bytes_unref(bytes);
+        g_free(frame);
+        g_free(name);
+        g_object_unref(pixbuf);
+    }
+
+    end_box(file, mdat);
+
+    moov = begin_box(file, "moov");
+    trak = begin_box(file, "trak");
+    mdia = begin_box(file, "mdia");
+
+    box = begin_box(file, "mdhd");
+    put32(file, 0);    // version and flags
+    put32(file, 0);    // created
+    put32(file, 0);    // modified
+    put32(file, 1000); // timescale
+    put32(file, 240);  // duration
+    put32(file, 0);    // language
+    end_box(file, box);
+
+    box = begin_box(file, "hdlr");
+    put32(file, 0);
+    put32(file, 0);
+    put_type(file, "vide");
+    put32(file, 0);
+    put32(file, 0);
+    put32(file, 0);
+    g_byte_array_append(file, (const guint8 *) "", 1);
+    end_box(file, box);
+
+    minf = begin_box(file, "minf");
+    stbl = begin_box(file, "stbl");
+
+    box = begin_box(file, "stsd");
+    put32(file, 0);
+    put32(file, 1);
+    put32(file, 16);
+    put_type(file, "mjp2");
+    put32(file, 0);
+    put32(file, 1);    // data reference index
+    end_box(file, box);
+
+    box = begin_box(file, "stts");
+    put32(file, 0);
+    put32(file, 2);
+    put32(file, 1);
+    put32(file, delays[0]);
+    put32(file, 2);
+    put32(file, delays[1]);
+    end_box(file, box);
+
+    // One sample per chunk
+
+    box = begin_box(file, "stsc");
+    put32(file, 0);
+    put32(file, 1);
+    put32(file, 1);
+    put32(file, 1);
+    put32(file, 1);
+    end_box(file, box);
+
+    box = begin_box(file, "stsz");
+    put32(file, 0);
+    put32(file, 0);
+    put32(file, FRAMES);
+    for(int i = 0; i < FRAMES; i++)
+    {
+        put32(file, sizes[i]);
+    }
+    end_box(file, box);
+
+    box = begin_box(file, "stco");
+    put32(file, 0);
+    put32(file, FRAMES);
+    for(int i = 0; i < FRAMES; i++)
+    {
+        put32(file, offsets[i]);
+    }
+    end_box(file, box);
+
+    end_box(file, stbl);
+    end_box(file, minf);
+    end_box(file, mdia);
+    end_box(file, trak);
+    end_box(file, moov);
+
+    if(!g_file_set_contents(path, (const gchar *) file->data, file->len, &error))
+    {
+        g_error("%s", error->message);
+    }
+
+    g_byte_array_unref(file);
+}
+
+static void assert_frame(GdkPixbuf *pixbuf, int frame)
+{
+    const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+
+    g_assert(gdk_pixbuf_get_width(pixbuf) == WIDTH);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == HEIGHT);
+
+    for(int y = 0; y < HEIGHT; y++)
+    {
+        for(int x = 0; x < WIDTH; x++)
+        {
+            const guchar *pixel = pixels + y * gdk_pixbuf_get_rowstride(pixbuf) + x * channels;
+            g_assert(memcmp(pixel, colors[frame], 3) == 0);
+        }
+    }
+}
+
+static void check_animation(GdkPixbufAnimation *animation)
+{
+    GTimeVal start = { 1000, 0 }, now = start;
+    GdkPixbufAnimationIter *iter;
+
+    g_assert(!gdk_pixbuf_animation_is_static_image(animation));
+    g_assert(gdk_pixbuf_animation_get_width(animation) == WIDTH);
+    g_assert(gdk_pixbuf_animation_get_height(animation) == HEIGHT);
+    assert_frame(gdk_pixbuf_animation_get_static_image(animation), 0);
+
+    iter = gdk_pixbuf_animation_get_iter(animation, &start);
+    assert_frame(gdk_pixbuf_animation_iter_get_pixbuf(iter), 0);
+    g_assert(gdk_pixbuf_animation_iter_get_delay_time(iter) == 40);
+
+    // Halfway into the second frame
+
+    now.tv_usec = 90000;
+    g_assert(gdk_pixbuf_animation_iter_advance(iter, &now));
+    assert_frame(gdk_pixbuf_animation_iter_get_pixbuf(iter), 1);
+    g_assert(gdk_pixbuf_animation_iter_get_delay_time(iter) == 50);
+
+    // Still the second frame, then the third
+
+    now.tv_usec = 100000;
+    g_assert(!gdk_pixbuf_animation_iter_advance(iter, &now));
+    now.tv_usec = 150000;
+    g_assert(gdk_pixbuf_animation_iter_advance(iter, &now));
+    assert_frame(gdk_pixbuf_animation_iter_get_pixbuf(iter), 2);
+
+    // The clip loops
+
+    now.tv_usec = 250000;
+    g_assert(gdk_pixbuf_animation_iter_advance(iter, &now));
+    assert_frame(gdk_pixbuf_animation_iter_get_pixbuf(iter), 0);
+    now.tv_usec = 300000;
+    g_assert(gdk_pixbuf_animation_iter_advance(iter, &now));
+    assert_frame(gdk_pixbuf_animation_iter_get_pixbuf(iter), 1);
+
+    g_object_unref(iter);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *directory = g_dir_make_tmp("jp2-mj2-XXXXXX", &error);
+    gchar *path, *data;
+    gsize length;
+
+    if(!directory)
+    {
+        g_error("%s", error->message);
+    }
+
+    path = g_build_filename(directory, "clip.mj2", NULL);
+    write_clip(directory, path);
+
+    // As an animation
+
+    GdkPixbufAnimation *animation = gdk_pixbuf_animation_new_from_file(path, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    check_animation(animation);
+    g_object_unref(animation);
+
+    // With frames decoded one at a time
+
+    g_setenv("GDK_PIXBUF_JP2_PREFETCH_FRAMES", "1", TRUE);
+    animation = gdk_pixbuf_animation_new_from_file(path, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    check_animation(animation);
+    g_object_unref(animation);
+    g_unsetenv("GDK_PIXBUF_JP2_PREFETCH_FRAMES");
+
+    // As an image, the first frame
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    assert_frame(pixbuf, 0);
+    g_object_unref(pixbuf);
+
+    // Through GdkPixbufLoader, which hands over the animation
+
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+    if(!g_file_get_contents(path, &data, &length, &error) || !gdk_pixbuf_loader_write(loader, (const guchar *) data, length, &error) || !gdk_pixbuf_loader_close(loader, &error))
+    {
+        g_error("%s", error->message);
+    }
+
+    check_animation(gdk_pixbuf_loader_get_animation(loader));
+    g_object_unref(loader);
+    g_free(data);
+
+    // Still images load as animations of one frame
+
+    animation = gdk_pixbuf_animation_new_from_file(g_getenv("TEST_FILE"), &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(gdk_pixbuf_animation_is_static_image(animation));
+    g_object_unref(animation);
+
+    g_unlink(path);
+    g_rmdir(directory);
+    g_free(path);
+    g_free(directory);
+
+    return 0;
+}
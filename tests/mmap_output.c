@@ -0,0 +1,65 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static GdkPixbuf *load(const gchar *filename, const gchar *threshold)
+{
+    GError *error = NULL;
+
+    g_setenv("GDK_PIXBUF_JP2_MMAP_THRESHOLD", threshold, TRUE);
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    return pixbuf;
+}
+
+gint main(gint argc, gchar **argv)
+{
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    // A threshold of one byte puts every output in a mapped temporary file
+
+    GdkPixbuf *allocated = load(filename, "0");
+    GdkPixbuf *mapped = load(filename, "1");
+
+    g_assert(gdk_pixbuf_get_width(mapped) == gdk_pixbuf_get_width(allocated));
+    g_assert(gdk_pixbuf_get_height(mapped) == gdk_pixbuf_get_height(allocated));
+    g_assert(gdk_pixbuf_get_rowstride(mapped) == gdk_pixbuf_get_rowstride(allocated));
+
+    gsize length = (gsize) gdk_pixbuf_get_rowstride(allocated) * (gsize) gdk_pixbuf_get_height(allocated);
+    g_assert(memcmp(gdk_pixbuf_get_pixels(mapped), gdk_pixbuf_get_pixels(allocated), length) == 0);
+
+    g_strfreev(env);
+
+    g_object_unref(mapped);
+    g_object_unref(allocated);
+
+    return 0;
+}
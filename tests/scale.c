@@ -0,0 +1,86 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+
+    g_warning("%s", filename);
+
+    GdkPixbuf *full = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file_at_scale(filename, 256, 256, TRUE, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+
+    g_assert(width == 256);
+    g_assert(abs(height - gdk_pixbuf_get_height(full) * 256 / gdk_pixbuf_get_width(full)) <= 1);
+
+    // The test image is 1808x1316, two resolution levels are discarded and the rest is averaged while converting
+
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::reduce"), "2") == 0);
+
+    // Close to scaling the full image down with a box filter
+
+    GdkPixbuf *reference = gdk_pixbuf_scale_simple(full, width, height, GDK_INTERP_TILES);
+    const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    const guchar *reference_pixels = gdk_pixbuf_get_pixels(reference);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    guint64 difference = 0;
+
+    g_assert(channels == gdk_pixbuf_get_n_channels(reference));
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width * channels; x++)
+        {
+            difference += abs(pixels[y * gdk_pixbuf_get_rowstride(pixbuf) + x] - reference_pixels[y * gdk_pixbuf_get_rowstride(reference) + x]);
+        }
+    }
+
+    g_assert(difference / ((guint64) width * height * channels) < 8);
+
+    g_strfreev(env);
+
+    g_object_unref(reference);
+    g_object_unref(pixbuf);
+    g_object_unref(full);
+
+    return 0;
+}
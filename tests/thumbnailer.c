@@ -0,0 +1,186 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+static gchar **env = NULL;
+
+/**
+ * Run the client, with option when it isn't NULL, on input into output and return its exit status.
+ */
+static gint thumbnail(const gchar *client, const gchar *option, const gchar *size, const gchar *input, const gchar *output)
+{
+    GPtrArray *argv = g_ptr_array_new();
+    GError *error = NULL;
+    gint status = -1;
+
+    g_ptr_array_add(argv, (gpointer) client);
+    if(option)
+    {
+        g_ptr_array_add(argv, (gpointer) option);
+    }
+    g_ptr_array_add(argv, (gpointer) "-s");
+    g_ptr_array_add(argv, (gpointer) size);
+    g_ptr_array_add(argv, (gpointer) input);
+    g_ptr_array_add(argv, (gpointer) output);
+    g_ptr_array_add(argv, NULL);
+
+    g_spawn_sync(NULL, (gchar **) argv->pdata, env, G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL, &status, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_ptr_array_free(argv, TRUE);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Whether the service at path accepts connections yet. It binds its socket before it listens, so the file alone
+ * doesn't tell.
+ */
+static gboolean is_listening(const gchar *path)
+{
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    gboolean listening;
+
+    g_assert(fd >= 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+
+    listening = connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0;
+    close(fd);
+
+    return listening;
+}
+
+static void check_size(const gchar *filename, gint width, gint height)
+{
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(gdk_pixbuf_get_width(pixbuf) == width);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == height);
+
+    g_object_unref(pixbuf);
+    g_remove(filename);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **variables = g_get_environ();
+    const gchar *filename = g_environ_getenv(variables, "TEST_FILE");
+    const gchar *daemon = g_environ_getenv(variables, "THUMBNAILD");
+    const gchar *client = g_environ_getenv(variables, "THUMBNAILER");
+
+    g_warning("%s", filename);
+
+    gchar *directory = g_dir_make_tmp("jp2-thumbnailer-XXXXXX", &error);
+    g_assert(error == NULL);
+
+    gchar *socket_path = g_build_filename(directory, "socket", NULL);
+    gchar *output = g_build_filename(directory, "thumbnail.png", NULL);
+    gchar *uri = g_filename_to_uri(filename, NULL, &error);
+    g_assert(error == NULL);
+
+    env = g_environ_setenv(g_get_environ(), "GDK_PIXBUF_JP2_THUMBNAILER_SOCKET", socket_path, TRUE);
+
+    // Start the service and wait until it accepts connections
+
+    gchar *daemon_argv[] = { (gchar *) daemon, (gchar *) "--socket", socket_path, (gchar *) "--workers", (gchar *) "2", NULL };
+    GPid pid;
+
+    g_spawn_async(NULL, daemon_argv, env, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    gboolean listening = FALSE;
+
+    for(int i = 0; i < 500 && !(listening = is_listening(socket_path)); i++)
+    {
+        g_usleep(10000);
+    }
+
+    g_assert(listening);
+
+    // The test image is 400x300, the service fits it in the box like gdk-pixbuf-thumbnailer
+
+    g_assert(thumbnail(client, "--no-fallback", "128", uri, output) == 0);
+    check_size(output, 128, 96);
+
+    g_assert(thumbnail(client, "--priority=background", "64", filename, output) == 0);
+    check_size(output, 64, 48);
+
+    // Images that already fit keep their size
+
+    g_assert(thumbnail(client, "--no-fallback", "1024", filename, output) == 0);
+    check_size(output, 400, 300);
+
+    // A missing file fails in the service, the client doesn't try again itself
+
+    g_assert(thumbnail(client, NULL, "128", output, output) != 0);
+
+    // Stopping the service removes its socket
+
+    gint status = -1;
+
+    kill(pid, SIGTERM);
+    g_assert(waitpid(pid, &status, 0) == pid);
+    g_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    g_spawn_close_pid(pid);
+    g_assert(!g_file_test(socket_path, G_FILE_TEST_EXISTS));
+
+    // Without the service the client fails when asked to, or makes the thumbnail itself
+
+    g_assert(thumbnail(client, "--no-fallback", "128", filename, output) != 0);
+    g_assert(thumbnail(client, NULL, "128", filename, output) == 0);
+    check_size(output, 128, 96);
+
+    g_rmdir(directory);
+
+    g_free(uri);
+    g_free(output);
+    g_free(socket_path);
+    g_free(directory);
+    g_strfreev(env);
+    g_strfreev(variables);
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Tiles of a tiled and an untiled image, saved losslessly by the loader, are compared with the matching area of the
+// whole image as gdk_pixbuf_new_from_file loads it, on one thread and then on many sharing a small cache.
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <tiles.h>
+
+#define WIDTH 1100 // over TILES_AREA_SIZE both ways, so untiled images take several areas
+#define HEIGHT 700
+#define THREADS 8
+#define REQUESTS 200 // per thread
+
+typedef struct {
+    TileSource *source;
+    GdkPixbuf *reference;
+    guint seed;
+} Worker;
+
+static GdkPixbuf *gradient(void)
+{
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, WIDTH, HEIGHT);
+    guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+
+    for(int y = 0; y < HEIGHT; y++)
+    {
+        for(int x = 0; x < WIDTH; x++)
+        {
+            guchar *pixel = pixels + y * gdk_pixbuf_get_rowstride(pixbuf) + x * 3;
+            pixel[0] = (guchar) (x * 7 + y);
+            pixel[1] = (guchar) (y * 5 + x / 3);
+            pixel[2] = (guchar) (x ^ y);
+        }
+    }
+
+    return pixbuf;
+}
+
+/**
+ * Whether tile x, y of level 0 matches its area of the whole image.
+ */
+static gboolean matches(TileSource *source, GdkPixbuf *reference, GdkPixbuf *tile, guint32 x, guint32 y)
+{
+    guint32 tiles_x, tiles_y, tile_width, tile_height;
+    int width = gdk_pixbuf_get_width(tile);
+    int height = gdk_pixbuf_get_height(tile);
+    gsize left, top;
+
+    tile_source_get_grid(source, 0, &tiles_x, &tiles_y, &tile_width, &tile_height);
+    left = (gsize) x * tile_width;
+    top = (gsize) y * tile_height;
+
+    if(gdk_pixbuf_get_n_channels(tile) != 3 || width != (int) MIN(tile_width, WIDTH - left) || height != (int) MIN(tile_height, HEIGHT - top))
+    {
+        return FALSE;
+    }
+
+    for(int row = 0; row < height; row++)
+    {
+        const guchar *expected = gdk_pixbuf_get_pixels(reference) + (top + row) * gdk_pixbuf_get_rowstride(reference) + left * 3;
+
+        if(memcmp(gdk_pixbuf_get_pixels(tile) + row * gdk_pixbuf_get_rowstride(tile), expected, (gsize) width * 3) != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static GdkPixbuf *get_tile(TileSource *source, guint level, guint32 x, guint32 y)
+{
+    GError *error = NULL;
+    GdkPixbuf *tile = tile_source_get_tile(source, level, x, y, NULL, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(tile != NULL);
+
+    return tile;
+}
+
+static gpointer worker_thread(gpointer data)
+{
+    Worker *worker = (Worker *) data;
+    GRand *rand = g_rand_new_with_seed(worker->seed);
+    guint32 tiles_x, tiles_y, tile_width, tile_height;
+
+    tile_source_get_grid(worker->source, 0, &tiles_x, &tiles_y, &tile_width, &tile_height);
+
+    for(int i = 0; i < REQUESTS; i++)
+    {
+        // Most requests go to a few tiles, so some wait on each other's decodes
+
+        guint32 x = (guint32) g_rand_int_range(rand, 0, (gint32) (i % 4 == 0 ? tiles_x : MIN(2, tiles_x)));
+        guint32 y = (guint32) g_rand_int_range(rand, 0, (gint32) (i % 4 == 0 ? tiles_y : MIN(2, tiles_y)));
+        GdkPixbuf *tile = get_tile(worker->source, 0, x, y);
+
+        g_assert(matches(worker->source, worker->reference, tile, x, y));
+        g_object_unref(tile);
+    }
+
+    g_rand_free(rand);
+
+    return NULL;
+}
+
+static void check(const gchar *path, gboolean tiled)
+{
+    GError *error = NULL;
+    GdkPixbuf *reference = gdk_pixbuf_new_from_file(path, &error);
+    guint32 tiles_x, tiles_y, tile_width, tile_height, width, height;
+    TileStats stats;
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    TileSource *source = tile_source_new(path, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(tile_source_is_tiled(source) == tiled);
+    g_assert(tile_source_get_levels(source) > 2);
+
+    // Every tile of the full resolution
+
+    tile_source_get_grid(source, 0, &tiles_x, &tiles_y, &tile_width, &tile_height);
+    g_assert(tiles_x > 1 && tiles_y > 1);
+
+    for(guint32 y = 0; y < tiles_y; y++)
+    {
+        for(guint32 x = 0; x < tiles_x; x++)
+        {
+            GdkPixbuf *tile = get_tile(source, 0, x, y);
+            g_assert(matches(source, reference, tile, x, y));
+            g_object_unref(tile);
+        }
+    }
+
+    // The tiles of a lower level cover it exactly
+
+    tile_source_get_size(source, 2, &width, &height);
+    g_assert(width == (WIDTH + 3) / 4 && height == (HEIGHT + 3) / 4);
+    tile_source_get_grid(source, 2, &tiles_x, &tiles_y, &tile_width, &tile_height);
+
+    guint64 area = 0;
+
+    for(guint32 y = 0; y < tiles_y; y++)
+    {
+        for(guint32 x = 0; x < tiles_x; x++)
+        {
+            GdkPixbuf *tile = get_tile(source, 2, x, y);
+            area += (guint64) gdk_pixbuf_get_width(tile) * gdk_pixbuf_get_height(tile);
+            g_object_unref(tile);
+        }
+    }
+
+    g_assert(area == (guint64) width * height);
+
+    // Asking again is served from the cache
+
+    tile_source_get_stats(source, &stats);
+    guint64 hits = stats.hits, misses = stats.misses;
+    GdkPixbuf *first = get_tile(source, 0, 0, 0);
+    GdkPixbuf *again = get_tile(source, 0, 0, 0);
+
+    g_assert(first == again);
+    tile_source_get_stats(source, &stats);
+    g_assert(stats.hits == hits + 2 && stats.misses == misses);
+
+    g_object_unref(first);
+    g_object_unref(again);
+
+    // Requests outside the image fail
+
+    g_assert(tile_source_get_tile(source, tile_source_get_levels(source), 0, 0, NULL, &error) == NULL);
+    g_clear_error(&error);
+    g_assert(tile_source_get_tile(source, 0, 1000, 0, NULL, &error) == NULL);
+    g_clear_error(&error);
+
+    // Many threads over a cache that holds only a few tiles
+
+    tile_source_set_cache_limit(source, 0);
+    tile_source_get_stats(source, &stats);
+    g_assert(stats.tiles == 0 && stats.bytes == 0);
+
+    tile_source_set_cache_limit(source, (guint64) tile_width * tile_height * 3 * 4);
+    tile_source_get_stats(source, &stats);
+    guint64 before = stats.hits + stats.misses + stats.merged;
+
+    Worker workers[THREADS];
+    GThread *threads[THREADS];
+
+    for(int i = 0; i < THREADS; i++)
+    {
+        workers[i].source = source;
+        workers[i].reference = reference;
+        workers[i].seed = (guint) i + 1;
+        threads[i] = g_thread_new("tiles", worker_thread, &workers[i]);
+    }
+
+    for(int i = 0; i < THREADS; i++)
+    {
+        g_thread_join(threads[i]);
+    }
+
+    tile_source_get_stats(source, &stats);
+    g_assert(stats.hits + stats.misses + stats.merged == before + THREADS * REQUESTS);
+    g_assert(stats.failed == 0);
+    g_assert(stats.bytes <= (guint64) tile_width * tile_height * 3 * 4 + THREADS * ((guint64) tile_width * tile_height * 3 + 256));
+
+    g_print("%s: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " merged, %" G_GUINT64_FORMAT " evicted\n",
+        path, stats.hits, stats.misses, stats.merged, stats.evicted);
+
+    tile_source_free(source);
+    g_object_unref(reference);
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *directory = g_dir_make_tmp("jp2-tiles-XXXXXX", &error);
+
+    if(!directory)
+    {
+        g_error("%s", error->message);
+    }
+
+    gchar *tiled = g_build_filename(directory, "tiled.jp2", NULL);
+    gchar *untiled = g_build_filename(directory, "untiled.jp2", NULL);
+    GdkPixbuf *pixbuf = gradient();
+
+    if(!gdk_pixbuf_save(pixbuf, tiled, "jp2", &error, "tile-size", "256", NULL) || !gdk_pixbuf_save(pixbuf, untiled, "jp2", &error, NULL))
+    {
+        g_error("%s", error->message);
+    }
+
+    check(tiled, TRUE);
+    check(untiled, FALSE);
+
+    g_unlink(tiled);
+    g_unlink(untiled);
+    g_rmdir(directory);
+    g_object_unref(pixbuf);
+    g_free(tiled);
+    g_free(untiled);
+    g_free(directory);
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar **env = g_get_environ();
+    const gchar *filename = g_environ_getenv(env, "TEST_FILE");
+    const gchar *stages[] = {"jp2::stream-us", "jp2::header-us", "jp2::decode-us", "jp2::convert-us", "jp2::allocate-us", "jp2::total-us"};
+
+    g_warning("%s", filename);
+
+    // Timing is off unless asked for
+
+    g_unsetenv("GDK_PIXBUF_JP2_TIMING");
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    for(gsize i = 0; i < G_N_ELEMENTS(stages); i++)
+    {
+        g_assert(gdk_pixbuf_get_option(pixbuf, stages[i]) == NULL);
+    }
+
+    g_object_unref(pixbuf);
+
+    // Every stage is attached once it is on
+
+    g_setenv("GDK_PIXBUF_JP2_TIMING", "1", TRUE);
+
+    pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    for(gsize i = 0; i < G_N_ELEMENTS(stages); i++)
+    {
+        g_assert(gdk_pixbuf_get_option(pixbuf, stages[i]) != NULL);
+    }
+
+    g_assert(g_strcmp0(gdk_pixbuf_get_option(pixbuf, "jp2::decodes"), "1") == 0);
+    g_assert(g_ascii_strtoull(gdk_pixbuf_get_option(pixbuf, "jp2::total-us"), NULL, 10) >= g_ascii_strtoull(gdk_pixbuf_get_option(pixbuf, "jp2::decode-us"), NULL, 10));
+
+    // Saving logs its stages
+
+    gdk_pixbuf_save(pixbuf, "test_timing.jp2", "jp2", &error, NULL);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_strfreev(env);
+
+    g_object_unref(pixbuf);
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <util.h>
+#include <transcode.h>
+
+static gboolean append_func(const gchar *buf, gsize count, GError **error, gpointer data)
+{
+    g_byte_array_append((GByteArray *) data, (const guint8 *) buf, (guint) count);
+    return TRUE;
+}
+
+static GdkPixbuf *load(GByteArray *array)
+{
+    GError *error = NULL;
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+    gdk_pixbuf_loader_write(loader, array->data, array->len, &error);
+    if(!error)
+    {
+        gdk_pixbuf_loader_close(loader, &error);
+    }
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    GdkPixbuf *pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+    g_object_unref(loader);
+
+    return pixbuf;
+}
+
+/**
+ * Decode filename with libopenjp2 alone, discarding reduce resolution levels and keeping layers quality layers.
+ */
+static opj_image_t *decode(const gchar *filename, guint reduce, guint layers)
+{
+    FILE *fp = fopen(filename, "rb");
+    opj_codec_t *codec = NULL;
+    opj_stream_t *stream = NULL;
+    opj_image_t *image = NULL;
+    opj_dparameters_t parameters;
+    int codec_type;
+
+    g_assert(fp != NULL);
+
+    codec_type = util_identify(fp);
+    g_assert(codec_type >= 0);
+
+    opj_set_default_decoder_parameters(&parameters);
+    parameters.cp_reduce = reduce;
+    parameters.cp_layer = layers;
+
+    stream = util_create_stream(fp, OPJ_TRUE);
+    codec = opj_create_decompress(codec_type);
+
+    g_assert(stream && codec && opj_setup_decoder(codec, &parameters) && opj_read_header(stream, codec, &image));
+    g_assert(opj_decode(codec, stream, image) && opj_end_decompress(codec, stream));
+
+    util_destroy(codec, stream, NULL);
+    fclose(fp);
+
+    return image;
+}
+
+/**
+ * Dropping packets must leave exactly the samples a decoder gets by skipping them itself.
+ */
+static void assert_same_samples(const opj_image_t *a, const opj_image_t *b)
+{
+    g_assert(a->numcomps == b->numcomps);
+
+    for(OPJ_UINT32 c = 0; c < a->numcomps; c++)
+    {
+        g_assert(a->comps[c].w == b->comps[c].w && a->comps[c].h == b->comps[c].h);
+        g_assert(a->comps[c].prec == b->comps[c].prec && a->comps[c].sgnd == b->comps[c].sgnd);
+        g_assert(memcmp(a->comps[c].data, b->comps[c].data, (gsize) a->comps[c].w * a->comps[c].h * sizeof(OPJ_INT32)) == 0);
+    }
+}
+
+gint main(gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize length;
+    gchar **env = g_get_environ();
+
+    g_warning("%s", g_environ_getenv(env, "TEST_FILE"));
+    g_file_get_contents(g_environ_getenv(env, "TEST_FILE"), &contents, &length, &error);
+
+    if(error)
+    {
+        g_error("%s", error->message);
+    }
+
+    g_assert(error == NULL);
+
+    // Unchanged layers and resolutions copy the codestream verbatim
+
+    TranscodeOptions same = { 0, 0, TRANSCODE_FORMAT_SAME };
+    GByteArray *copy = g_byte_array_new();
+
+    g_assert(transcode((const guint8 *) contents, length, &same, append_func, copy, &error));
+    g_assert(copy->len == length);
+    g_assert(memcmp(copy->data, contents, length) == 0);
+
+    // One layer at half resolution, unwrapped to a raw codestream
+
+    TranscodeOptions reduced = { 1, 1, TRANSCODE_FORMAT_J2K };
+    GByteArray *j2k = g_byte_array_new();
+
+    g_assert(transcode((const guint8 *) contents, length, &reduced, append_func, j2k, &error));
+    g_assert(error == NULL);
+    g_assert(j2k->len < length);
+    g_assert(j2k->data[0] == 0xFF && j2k->data[1] == 0x4F);
+
+    GdkPixbuf *pixbuf = load(j2k);
+
+    g_assert(gdk_pixbuf_get_width(pixbuf) == 200);
+    g_assert(gdk_pixbuf_get_height(pixbuf) == 150);
+
+    // Sample for sample what libopenjp2 decodes from the source with the same reduce and layers
+
+    gchar *directory = g_dir_make_tmp("jp2-transcode-XXXXXX", &error);
+    g_assert(directory != NULL);
+
+    gchar *path = g_build_filename(directory, "reduced.j2k", NULL);
+    g_assert(g_file_set_contents(path, (const gchar *) j2k->data, (gssize) j2k->len, NULL));
+
+    opj_image_t *expected = decode(g_environ_getenv(env, "TEST_FILE"), 1, 1);
+    opj_image_t *transcoded = decode(path, 0, 0);
+
+    assert_same_samples(expected, transcoded);
+
+    opj_image_destroy(expected);
+    opj_image_destroy(transcoded);
+    g_unlink(path);
+    g_rmdir(directory);
+    g_free(path);
+    g_free(directory);
+
+    // Discarding more levels than the image has is refused before anything is written
+
+    TranscodeOptions too_far = { 0, 33, TRANSCODE_FORMAT_J2K };
+    GByteArray *refused = g_byte_array_new();
+
+    g_assert(!transcode((const guint8 *) contents, length, &too_far, append_func, refused, &error));
+    g_assert(g_error_matches(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION));
+    g_assert(refused->len == 0);
+    g_clear_error(&error);
+    g_byte_array_unref(refused);
+
+    // And wrapped back into a JP2 container
+
+    TranscodeOptions wrap = { 0, 0, TRANSCODE_FORMAT_JP2 };
+    GByteArray *jp2 = g_byte_array_new();
+
+    g_assert(transcode(j2k->data, j2k->len, &wrap, append_func, jp2, &error));
+    g_assert(error == NULL);
+    g_assert(jp2->len > j2k->len);
+
+    GdkPixbuf *wrapped = load(jp2);
+
+    g_assert(gdk_pixbuf_get_width(wrapped) == 200);
+    g_assert(gdk_pixbuf_get_height(wrapped) == 150);
+    g_assert(gdk_pixbuf_get_n_channels(wrapped) == gdk_pixbuf_get_n_channels(pixbuf));
+
+    g_strfreev(env);
+    g_free(contents);
+
+    g_byte_array_unref(copy);
+    g_byte_array_unref(j2k);
+    g_byte_array_unref(jp2);
+
+    g_object_unref(wrapped);
+    g_object_unref(pixbuf);
+
+    return 0;
+}
@@ -0,0 +1,586 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <util.h>
+#include <thumbnail.h>
+
+#ifdef G_OS_UNIX
+	#include <fcntl.h>
+#endif
+
+// Decodes many JPEG2000 files in one process into thumbnails or previews. Every file is decoded at the lowest resolution
+// level that is still at least as large as the output, then shrunk by area-averaging while converting, like the loader does.
+// Files are dealt out to one queue per worker, workers take from the head of their own and steal from the tail of others
+// once theirs runs dry, and hint the kernel to read ahead the next files in their queue.
+
+static gchar *output_dir = NULL;
+static gchar *list = NULL;
+static gchar *format = NULL;
+static gint size = 256;
+static gint reduce = -1;
+static gint workers = 0;
+static gint prefetch = 4;
+static gboolean skip_existing = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Directory to write the outputs to", "DIR" },
+	{ "list", 'l', 0, G_OPTION_ARG_FILENAME, &list, "File with one input path per line, - for standard input", "FILE" },
+	{ "format", 'f', 0, G_OPTION_ARG_STRING, &format, "Output format, png or jp2 (default: png)", "FORMAT" },
+	{ "size", 's', 0, G_OPTION_ARG_INT, &size, "Fit outputs in N x N pixels, 0 to keep the decoded size (default: 256)", "N" },
+	{ "reduce", 'r', 0, G_OPTION_ARG_INT, &reduce, "Discard the R highest resolution levels instead of picking them from the size", "R" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &workers, "Files decoded at once (default: number of processors)", "N" },
+	{ "prefetch", 'p', 0, G_OPTION_ARG_INT, &prefetch, "Upcoming files each worker asks the kernel to read ahead (default: 4)", "N" },
+	{ "skip-existing", 'k', 0, G_OPTION_ARG_NONE, &skip_existing, "Leave inputs whose output already exists alone", NULL },
+	{ NULL }
+};
+
+typedef struct {
+	gchar *input;
+	gchar *output;
+	gboolean prefetched;
+} BatchItem;
+
+typedef struct {
+	GMutex mutex;
+	GQueue items; // of BatchItem, the owner takes from the head and thieves from the tail
+} BatchQueue;
+
+typedef struct {
+	BatchQueue *queues;
+	guint index;
+
+	ThumbnailState thumbnail;
+
+	guint converted, skipped, failed, steals;
+	guint64 bytes; // read from inputs
+} BatchWorker;
+
+static void batch_item_free(BatchItem *item)
+{
+	g_free(item->input);
+	g_free(item->output);
+	g_free(item);
+}
+
+// Inputs
+
+static gboolean batch_is_jpeg2000(const gchar *name)
+{
+	static const gchar *suffixes[] = {".jp2", ".jpf", ".jph", ".j2k", ".j2c", ".jhc"};
+	gchar *lower = g_ascii_strdown(name, -1);
+	gboolean found = FALSE;
+
+	for(gsize i = 0; i < G_N_ELEMENTS(suffixes) && !found; i++)
+	{
+		found = g_str_has_suffix(lower, suffixes[i]);
+	}
+
+	g_free(lower);
+
+	return found;
+}
+
+/**
+ * Output path for input, relative being the part of its path to keep under output_dir, with the extension swapped.
+ */
+static gchar *batch_output(const gchar *relative)
+{
+	gchar *stem = g_strdup(relative);
+	gchar *dot = strrchr(stem, '.');
+	gchar *separator = strrchr(stem, G_DIR_SEPARATOR);
+	gchar *name, *path;
+
+	if(dot && (!separator || dot > separator))
+	{
+		*dot = '\0';
+	}
+
+	name = g_strconcat(stem, ".", format, NULL);
+	path = g_build_filename(output_dir, name, NULL);
+
+	g_free(name);
+	g_free(stem);
+
+	return path;
+}
+
+static void batch_add(GPtrArray *items, const gchar *input, const gchar *relative)
+{
+	BatchItem *item = g_new0(BatchItem, 1);
+
+	item->input = g_strdup(input);
+	item->output = batch_output(relative);
+	g_ptr_array_add(items, item);
+}
+
+/**
+ * Add every JPEG2000 file under directory, keeping their paths below root in the output directory.
+ */
+static void batch_add_directory(GPtrArray *items, const gchar *root, const gchar *directory)
+{
+	GDir *dir = g_dir_open(directory, 0, NULL);
+	const gchar *name;
+
+	if(!dir)
+	{
+		g_printerr("Failed to open '%s'\n", directory);
+		return;
+	}
+
+	while((name = g_dir_read_name(dir)))
+	{
+		gchar *path = g_build_filename(directory, name, NULL);
+
+		if(g_file_test(path, G_FILE_TEST_IS_DIR))
+		{
+			// Symlinked directories aren't followed, they could lead back up the tree
+			if(!g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+			{
+				batch_add_directory(items, root, path);
+			}
+		}
+		else if(batch_is_jpeg2000(name))
+		{
+			const gchar *relative = path + strlen(root);
+
+			while(G_IS_DIR_SEPARATOR(*relative))
+			{
+				relative++;
+			}
+
+			batch_add(items, path, relative);
+		}
+
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+}
+
+/**
+ * Part of path to keep under the output directory: a relative path that stays below the current directory as it is,
+ * without . components, anything else by its name alone.
+ */
+static gchar *batch_relative(const gchar *path)
+{
+	gchar **parts;
+	GPtrArray *kept;
+	gchar *relative;
+
+	if(g_path_is_absolute(path))
+	{
+		return g_path_get_basename(path);
+	}
+
+	parts = g_strsplit_set(path, "/" G_DIR_SEPARATOR_S, -1);
+	kept = g_ptr_array_new();
+
+	for(gchar **part = parts; *part; part++)
+	{
+		if(strcmp(*part, "..") == 0)
+		{
+			g_ptr_array_free(kept, TRUE);
+			g_strfreev(parts);
+			return g_path_get_basename(path);
+		}
+
+		if(**part && strcmp(*part, ".") != 0)
+		{
+			g_ptr_array_add(kept, *part);
+		}
+	}
+
+	g_ptr_array_add(kept, NULL);
+	relative = g_strjoinv(G_DIR_SEPARATOR_S, (gchar **) kept->pdata);
+
+	g_ptr_array_free(kept, TRUE);
+	g_strfreev(parts);
+
+	return relative;
+}
+
+static void batch_add_path(GPtrArray *items, const gchar *path)
+{
+	if(g_file_test(path, G_FILE_TEST_IS_DIR))
+	{
+		batch_add_directory(items, path, path);
+	} else {
+		gchar *relative = batch_relative(path);
+		batch_add(items, path, relative);
+		g_free(relative);
+	}
+}
+
+static gboolean batch_add_list(GPtrArray *items, const gchar *filename)
+{
+	FILE *fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	gchar line[4096];
+
+	if(!fp)
+	{
+		g_printerr("Failed to open '%s'\n", filename);
+		return FALSE;
+	}
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		g_strchomp(line);
+
+		if(*line)
+		{
+			batch_add_path(items, line);
+		}
+	}
+
+	if(fp != stdin)
+	{
+		fclose(fp);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Drop inputs listed more than once, and give inputs that would still write the same output, like a.jp2 and a.j2k or
+ * files of the same name from different directories, a name with a hash of their input path instead.
+ */
+static void batch_deduplicate(GPtrArray *items)
+{
+	GHashTable *inputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GHashTable *outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL); // to the number of inputs writing it
+
+	for(guint i = 0; i < items->len;)
+	{
+		BatchItem *item = g_ptr_array_index(items, i);
+
+		if(!g_hash_table_add(inputs, g_strdup(item->input)))
+		{
+			g_printerr("Skipping '%s', it is listed more than once\n", item->input);
+			batch_item_free(item);
+			g_ptr_array_remove_index(items, i);
+			continue;
+		}
+
+		g_hash_table_insert(outputs, g_strdup(item->output), GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(outputs, item->output)) + 1));
+		i++;
+	}
+
+	for(guint i = 0; i < items->len; i++)
+	{
+		BatchItem *item = g_ptr_array_index(items, i);
+
+		if(GPOINTER_TO_UINT(g_hash_table_lookup(outputs, item->output)) > 1)
+		{
+			gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, item->input, -1);
+			gchar *output = g_strdup_printf("%.*s-%.8s.%s", (int) (strlen(item->output) - strlen(format) - 1), item->output, hash, format);
+
+			g_free(item->output);
+			item->output = output;
+			g_free(hash);
+		}
+	}
+
+	g_hash_table_unref(outputs);
+	g_hash_table_unref(inputs);
+}
+
+// Queues
+
+/**
+ * Ask the kernel to start reading path into the page cache, so it is there by the time a worker maps it.
+ */
+static void batch_prefetch(const gchar *path)
+{
+	#if defined(G_OS_UNIX) && defined(POSIX_FADV_WILLNEED)
+		int fd = g_open(path, O_RDONLY, 0);
+
+		if(fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	#endif
+}
+
+/**
+ * Take the next item for worker: from the head of its own queue, or else stolen from the tail of another.
+ * The next prefetch items left in its own queue are read ahead. Returns NULL when every queue is empty.
+ */
+static BatchItem *batch_take(BatchWorker *worker, guint count)
+{
+	BatchQueue *own = &worker->queues[worker->index];
+	gchar *upcoming[64];
+	guint hints = 0;
+	BatchItem *item;
+	GList *link;
+
+	g_mutex_lock(&own->mutex);
+	item = g_queue_pop_head(&own->items);
+
+	for(link = own->items.head; link && hints < MIN((guint) prefetch, G_N_ELEMENTS(upcoming)); link = link->next)
+	{
+		BatchItem *next = (BatchItem *) link->data;
+
+		if(!next->prefetched)
+		{
+			next->prefetched = TRUE;
+			upcoming[hints++] = g_strdup(next->input);
+		}
+	}
+	g_mutex_unlock(&own->mutex);
+
+	// Copies, a thief may take and free the items meanwhile
+
+	for(guint i = 0; i < hints; i++)
+	{
+		batch_prefetch(upcoming[i]);
+		g_free(upcoming[i]);
+	}
+
+	for(guint i = 1; !item && i < count; i++)
+	{
+		BatchQueue *victim = &worker->queues[(worker->index + i) % count];
+
+		g_mutex_lock(&victim->mutex);
+		item = g_queue_pop_tail(&victim->items);
+		g_mutex_unlock(&victim->mutex);
+
+		if(item)
+		{
+			worker->steals++;
+			batch_prefetch(item->input);
+		}
+	}
+
+	return item;
+}
+
+// Conversion
+
+/**
+ * Convert one input into its output, which is written under a temporary name and renamed when complete.
+ */
+static gboolean batch_convert(BatchWorker *worker, const BatchItem *item, GError **error)
+{
+	GMappedFile *mapped;
+	GdkPixbuf *pixbuf;
+	gchar *directory, *partial;
+	gboolean ok;
+
+	mapped = g_mapped_file_new(item->input, FALSE, error);
+	if(!mapped)
+	{
+		return FALSE;
+	}
+
+	worker->bytes += g_mapped_file_get_length(mapped);
+	pixbuf = thumbnail_decode(&worker->thumbnail, (const guint8 *) g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), (guint) size, reduce, error);
+	g_mapped_file_unref(mapped);
+
+	if(!pixbuf)
+	{
+		return FALSE;
+	}
+
+	directory = g_path_get_dirname(item->output);
+	partial = g_strconcat(item->output, ".partial", NULL);
+
+	ok = g_mkdir_with_parents(directory, 0755) == 0;
+	if(!ok)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to create '%s'", directory);
+	}
+
+	ok = ok && gdk_pixbuf_save(pixbuf, partial, format, error, NULL);
+
+	if(ok && g_rename(partial, item->output) != 0)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to rename '%s'", partial);
+		ok = FALSE;
+	}
+
+	if(!ok)
+	{
+		g_remove(partial);
+	}
+
+	g_free(partial);
+	g_free(directory);
+	g_object_unref(pixbuf);
+
+	return ok;
+}
+
+static gpointer batch_worker(gpointer data)
+{
+	BatchWorker *worker = (BatchWorker *) data;
+	BatchItem *item;
+
+	while((item = batch_take(worker, (guint) workers)))
+	{
+		GError *error = NULL;
+
+		if(skip_existing && g_file_test(item->output, G_FILE_TEST_EXISTS))
+		{
+			worker->skipped++;
+		}
+		else if(batch_convert(worker, item, &error))
+		{
+			worker->converted++;
+		} else {
+			g_printerr("%s: %s\n", item->input, error ? error->message : "failed");
+			g_clear_error(&error);
+			worker->failed++;
+		}
+
+		batch_item_free(item);
+	}
+
+	return NULL;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	GPtrArray *items;
+	BatchQueue *queues;
+	BatchWorker *state, total;
+	GThread **threads;
+	gint64 start, elapsed;
+	gdouble seconds;
+	gchar *lower;
+
+	context = g_option_context_new("[FILE|DIR...]");
+	g_option_context_set_summary(context, "Decode JPEG2000 files at a reduced resolution into PNG or JP2 thumbnails and previews, many at once.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(!format)
+	{
+		format = g_strdup("png");
+	}
+
+	if(!output_dir || (argc < 2 && !list) || size < 0 || prefetch < 0 || workers < 0 ||
+		(g_ascii_strcasecmp(format, "png") != 0 && g_ascii_strcasecmp(format, "jp2") != 0))
+	{
+		g_printerr("Usage: %s --output DIR [--list FILE] [--format png|jp2] [--size N] [--reduce R] [--workers N] [--prefetch N] [--skip-existing] [FILE|DIR...]\n", argv[0]);
+		return 1;
+	}
+
+	lower = g_ascii_strdown(format, -1);
+	g_free(format);
+	format = lower;
+
+	if(workers == 0)
+	{
+		workers = MAX(g_get_num_processors(), 1);
+	}
+
+	items = g_ptr_array_new();
+
+	for(gint i = 1; i < argc; i++)
+	{
+		batch_add_path(items, argv[i]);
+	}
+
+	if(list && !batch_add_list(items, list))
+	{
+		return 1;
+	}
+
+	batch_deduplicate(items);
+
+	workers = (gint) MAX(MIN((guint) workers, items->len), 1);
+
+	// Dealt out round-robin, so neighbouring files, often alike in size, spread over the workers
+
+	queues = g_new0(BatchQueue, workers);
+	state = g_new0(BatchWorker, workers);
+	threads = g_new0(GThread *, workers);
+
+	for(gint i = 0; i < workers; i++)
+	{
+		g_mutex_init(&queues[i].mutex);
+		g_queue_init(&queues[i].items);
+		state[i].queues = queues;
+		state[i].index = (guint) i;
+	}
+
+	for(guint i = 0; i < items->len; i++)
+	{
+		g_queue_push_tail(&queues[i % (guint) workers].items, g_ptr_array_index(items, i));
+	}
+
+	start = g_get_monotonic_time();
+
+	for(gint i = 0; i < workers; i++)
+	{
+		threads[i] = g_thread_new("jp2-batch", batch_worker, &state[i]);
+	}
+
+	memset(&total, 0, sizeof(BatchWorker));
+
+	for(gint i = 0; i < workers; i++)
+	{
+		g_thread_join(threads[i]);
+
+		total.converted += state[i].converted;
+		total.skipped += state[i].skipped;
+		total.failed += state[i].failed;
+		total.steals += state[i].steals;
+		total.bytes += state[i].bytes;
+		total.thumbnail.decoded_pixels += state[i].thumbnail.decoded_pixels;
+		total.thumbnail.output_pixels += state[i].thumbnail.output_pixels;
+
+		thumbnail_clear(&state[i].thumbnail);
+		g_mutex_clear(&queues[i].mutex);
+	}
+
+	elapsed = MAX(g_get_monotonic_time() - start, 1);
+	seconds = (gdouble) elapsed / 1e6;
+
+	g_printerr("Converted %u of %u files (%u skipped, %u failed) in %.3f s with %d workers\n", total.converted, items->len, total.skipped, total.failed, seconds, workers);
+	g_printerr("%.1f files/s, %.1f MB/s read, %.1f MPix/s decoded, %.1f MPix/s written, %u steals\n",
+		(gdouble) total.converted / seconds, (gdouble) total.bytes / (gdouble) elapsed, (gdouble) total.thumbnail.decoded_pixels / (gdouble) elapsed,
+		(gdouble) total.thumbnail.output_pixels / (gdouble) elapsed, total.steals);
+
+	for(gint i = 0; i < workers; i++)
+	{
+		g_printerr("  worker %d: %u files, %u stolen\n", i, state[i].converted + state[i].skipped + state[i].failed, state[i].steals);
+	}
+
+	g_ptr_array_free(items, TRUE);
+	g_free(threads);
+	g_free(state);
+	g_free(queues);
+	g_free(format);
+
+	return total.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,623 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <util.h>
+#include <thumbnail.h>
+
+// Thumbnailer service: a long-running process that makes thumbnails for jp2-thumbnailer, so each one doesn't pay for
+// starting a process, loading modules and setting up. Requests wait in a bounded queue for a pool of workers that keep
+// their buffers between images, visible items are always taken before background ones and push them out of a full queue.
+// Listens on the socket passed by systemd when socket activated, otherwise creates its own.
+
+#define SD_LISTEN_FDS_START 3
+#define REQUEST_TIMEOUT 5 // seconds a client gets to send its request
+#define CONNECTIONS_MAX 256 // requests read at once, more wait in the listen backlog
+
+static gchar *socket_path = NULL;
+static gint workers = 0;
+static gint queue_limit = 64;
+static gint idle_timeout = 0;
+
+static GOptionEntry entries[] =
+{
+	{ "socket", 's', 0, G_OPTION_ARG_FILENAME, &socket_path, "Socket to listen on (default: jp2-thumbnailer.sock in the runtime directory)", "PATH" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &workers, "Thumbnails made at once (default: number of processors)", "N" },
+	{ "queue", 'q', 0, G_OPTION_ARG_INT, &queue_limit, "Requests that may wait, more are turned away as busy (default: 64)", "N" },
+	{ "idle-timeout", 'i', 0, G_OPTION_ARG_INT, &idle_timeout, "Exit after S seconds without requests, 0 to run until stopped (default: 0)", "S" },
+	{ NULL }
+};
+
+typedef struct {
+	int fd;           // connection to reply on
+	gboolean visible; // taken before background jobs
+	guint size;
+	gchar *input;
+	gchar *output;
+} Job;
+
+typedef struct {
+	GMutex mutex; // guards everything below
+	GCond cond;
+	GQueue visible;    // of Job
+	GQueue background; // of Job
+	guint busy;        // jobs being worked on
+	gboolean stopping; // no more jobs will be queued
+	gint64 last_active;
+	guint served, failed, rejected;
+} Service;
+
+typedef struct {
+	int fd;
+	gchar buffer[THUMBNAIL_REQUEST_MAX + 1];
+	gsize length;    // of the request read so far
+	gint64 deadline; // monotonic time the whole request must have arrived by
+} Connection;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int signum)
+{
+	stop_requested = 1;
+}
+
+/**
+ * Send a reply, OK without a message, and close the connection.
+ */
+static void reply(int fd, const gchar *message)
+{
+	gchar *text = g_strdup(message);
+	gchar *line;
+	gsize length, written = 0;
+
+	// The reply is a single line
+
+	if(text)
+	{
+		g_strdelimit(text, "\r\n", ' ');
+	}
+
+	line = text ? g_strdup_printf("ERR %s\n", text) : g_strdup("OK\n");
+	length = strlen(line);
+
+	while(written < length)
+	{
+		ssize_t result = write(fd, line + written, length - written);
+
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(result <= 0)
+		{
+			break;
+		}
+
+		written += (gsize) result;
+	}
+
+	close(fd);
+	g_free(line);
+	g_free(text);
+}
+
+static void job_finish(Job *job, const gchar *message)
+{
+	reply(job->fd, message);
+	g_free(job->input);
+	g_free(job->output);
+	g_free(job);
+}
+
+static gboolean job_run(ThumbnailState *state, const Job *job, GError **error)
+{
+	GMappedFile *mapped = g_mapped_file_new(job->input, FALSE, error);
+	GdkPixbuf *pixbuf;
+	gboolean ok;
+
+	if(!mapped)
+	{
+		return FALSE;
+	}
+
+	pixbuf = thumbnail_decode(state, (const guint8 *) g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), job->size, -1, error);
+	g_mapped_file_unref(mapped);
+
+	if(!pixbuf)
+	{
+		return FALSE;
+	}
+
+	ok = gdk_pixbuf_save(pixbuf, job->output, "png", error, NULL);
+	g_object_unref(pixbuf);
+
+	return ok;
+}
+
+static gpointer service_worker(gpointer data)
+{
+	Service *service = (Service *) data;
+	ThumbnailState state;
+
+	memset(&state, 0, sizeof(ThumbnailState));
+
+	for(;;)
+	{
+		GError *error = NULL;
+		Job *job;
+		gboolean ok;
+
+		g_mutex_lock(&service->mutex);
+		while(g_queue_is_empty(&service->visible) && g_queue_is_empty(&service->background) && !service->stopping)
+		{
+			g_cond_wait(&service->cond, &service->mutex);
+		}
+
+		// Whatever was queued before stopping is still served
+
+		job = g_queue_pop_head(&service->visible);
+		if(!job)
+		{
+			job = g_queue_pop_head(&service->background);
+		}
+
+		if(!job)
+		{
+			g_mutex_unlock(&service->mutex);
+			break;
+		}
+
+		service->busy++;
+		g_mutex_unlock(&service->mutex);
+
+		ok = job_run(&state, job, &error);
+		job_finish(job, ok ? NULL : error ? error->message : "failed");
+		g_clear_error(&error);
+
+		g_mutex_lock(&service->mutex);
+		service->busy--;
+		service->last_active = g_get_monotonic_time();
+		if(ok)
+		{
+			service->served++;
+		} else {
+			service->failed++;
+		}
+		g_mutex_unlock(&service->mutex);
+	}
+
+	thumbnail_clear(&state);
+
+	return NULL;
+}
+
+/**
+ * Job for the request line of the connection fd. Returns NULL for anything malformed.
+ */
+static Job *service_parse(int fd, const gchar *line)
+{
+	gchar **fields = g_strsplit(line, "\t", 4);
+	Job *job = NULL;
+
+	if(g_strv_length(fields) == 4 && (strcmp(fields[0], "visible") == 0 || strcmp(fields[0], "background") == 0) &&
+		g_path_is_absolute(fields[2]) && g_path_is_absolute(fields[3]))
+	{
+		guint64 size = g_ascii_strtoull(fields[1], NULL, 10);
+
+		if(size >= 1 && size <= THUMBNAIL_SIZE_MAX)
+		{
+			job = g_new0(Job, 1);
+			job->fd = fd;
+			job->visible = fields[0][0] == 'v';
+			job->size = (guint) size;
+			job->input = g_strdup(fields[2]);
+			job->output = g_strdup(fields[3]);
+		}
+	}
+
+	g_strfreev(fields);
+
+	return job;
+}
+
+/**
+ * Queue a job, or turn it away. A visible request that finds the queue full takes the place of the newest background one.
+ */
+static void service_queue(Service *service, Job *job)
+{
+	Job *evicted = NULL;
+	gboolean queued = TRUE;
+
+	g_mutex_lock(&service->mutex);
+	service->last_active = g_get_monotonic_time();
+
+	if(service->visible.length + service->background.length >= (guint) queue_limit)
+	{
+		if(job->visible && !g_queue_is_empty(&service->background))
+		{
+			evicted = g_queue_pop_tail(&service->background);
+		} else {
+			queued = FALSE;
+		}
+
+		service->rejected++;
+	}
+
+	if(queued)
+	{
+		g_queue_push_tail(job->visible ? &service->visible : &service->background, job);
+		g_cond_signal(&service->cond);
+	}
+	g_mutex_unlock(&service->mutex);
+
+	if(!queued)
+	{
+		job_finish(job, "busy");
+	}
+
+	if(evicted)
+	{
+		job_finish(evicted, "busy");
+	}
+}
+
+/**
+ * Read what the client sent so far, without waiting for more. Once the request line is complete the job is queued and
+ * TRUE returned, as it is when the connection was answered for being malformed. FALSE means the line isn't complete yet.
+ */
+static gboolean service_read(Service *service, Connection *connection)
+{
+	gchar *end;
+	Job *job;
+
+	while(connection->length < THUMBNAIL_REQUEST_MAX)
+	{
+		ssize_t result = read(connection->fd, connection->buffer + connection->length, THUMBNAIL_REQUEST_MAX - connection->length);
+
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return FALSE;
+		}
+
+		if(result <= 0)
+		{
+			break;
+		}
+
+		connection->length += (gsize) result;
+
+		if(memchr(connection->buffer, '\n', connection->length))
+		{
+			break;
+		}
+	}
+
+	end = memchr(connection->buffer, '\n', connection->length);
+	if(!end)
+	{
+		reply(connection->fd, "bad request");
+		return TRUE;
+	}
+
+	*end = '\0';
+
+	// Workers reply with plain blocking writes
+
+	fcntl(connection->fd, F_SETFL, fcntl(connection->fd, F_GETFL) & ~O_NONBLOCK);
+
+	job = service_parse(connection->fd, connection->buffer);
+	if(!job)
+	{
+		reply(connection->fd, "bad request");
+		return TRUE;
+	}
+
+	service_queue(service, job);
+
+	return TRUE;
+}
+
+/**
+ * Start reading the request of a freshly accepted connection. Requests are read as they arrive, a slow client
+ * never holds up accepting or reading the others.
+ */
+static void service_accept(GPtrArray *connections, int fd)
+{
+	Connection *connection = g_new0(Connection, 1);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	connection->fd = fd;
+	connection->deadline = g_get_monotonic_time() + REQUEST_TIMEOUT * G_USEC_PER_SEC;
+	g_ptr_array_add(connections, connection);
+}
+
+/**
+ * The socket systemd passed when socket activated, or -1.
+ */
+static int service_activated(void)
+{
+	const gchar *pid = g_getenv("LISTEN_PID");
+	const gchar *fds = g_getenv("LISTEN_FDS");
+
+	if(pid && fds && g_ascii_strtoull(pid, NULL, 10) == (guint64) getpid() && g_ascii_strtoull(fds, NULL, 10) >= 1)
+	{
+		return SD_LISTEN_FDS_START;
+	}
+
+	return -1;
+}
+
+/**
+ * Create, bind and listen on the socket at path, readable by this user only.
+ * A socket left behind by a service that is gone is replaced, one that still answers is not.
+ */
+static int service_listen(const gchar *path)
+{
+	struct sockaddr_un address;
+	int fd;
+
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		g_printerr("Socket path '%s' is too long\n", path);
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+	{
+		g_printerr("Failed to create socket: %s\n", g_strerror(errno));
+		return -1;
+	}
+
+	if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0)
+	{
+		g_printerr("Another service is listening on '%s'\n", path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if(fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(fd, SOMAXCONN) != 0)
+	{
+		g_printerr("Failed to listen on '%s': %s\n", path, g_strerror(errno));
+
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	return fd;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	Service service;
+	GThread **threads;
+	struct sigaction action;
+	int listen_fd;
+	gboolean activated;
+	GPtrArray *connections;
+	GArray *poll_fds;
+
+	context = g_option_context_new(NULL);
+	g_option_context_set_summary(context, "Make JPEG2000 thumbnails for jp2-thumbnailer from a long-running process.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(argc != 1 || workers < 0 || queue_limit < 1 || idle_timeout < 0)
+	{
+		g_printerr("Usage: %s [--socket PATH] [--workers N] [--queue N] [--idle-timeout S]\n", argv[0]);
+		return 1;
+	}
+
+	if(workers == 0)
+	{
+		workers = MAX(g_get_num_processors(), 1);
+	}
+
+	if(!socket_path)
+	{
+		socket_path = thumbnail_socket_path();
+	}
+
+	listen_fd = service_activated();
+	activated = listen_fd >= 0;
+
+	if(!activated && (listen_fd = service_listen(socket_path)) < 0)
+	{
+		return 1;
+	}
+
+	// Clients that hang up early must not take the service down with them
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	memset(&service, 0, sizeof(Service));
+	g_mutex_init(&service.mutex);
+	g_cond_init(&service.cond);
+	g_queue_init(&service.visible);
+	g_queue_init(&service.background);
+	service.last_active = g_get_monotonic_time();
+
+	threads = g_new0(GThread *, workers);
+
+	for(gint i = 0; i < workers; i++)
+	{
+		threads[i] = g_thread_new("jp2-thumbnaild", service_worker, &service);
+	}
+
+	connections = g_ptr_array_new_with_free_func(g_free);
+	poll_fds = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+
+	while(!stop_requested)
+	{
+		struct pollfd listen_poll = { listen_fd, POLLIN, 0 };
+		gint64 now = g_get_monotonic_time();
+		int timeout = 1000;
+		int ready;
+		guint offset, polled = connections->len;
+
+		// The listening socket, while there is room for more connections, then every connection still sending
+
+		g_array_set_size(poll_fds, 0);
+		if(connections->len < CONNECTIONS_MAX)
+		{
+			g_array_append_val(poll_fds, listen_poll);
+		}
+		offset = poll_fds->len;
+
+		for(guint i = 0; i < connections->len; i++)
+		{
+			Connection *connection = g_ptr_array_index(connections, i);
+			struct pollfd connection_poll = { connection->fd, POLLIN, 0 };
+
+			g_array_append_val(poll_fds, connection_poll);
+			timeout = (int) CLAMP((connection->deadline - now + 999) / 1000, 0, timeout);
+		}
+
+		ready = poll((struct pollfd *) poll_fds->data, poll_fds->len, timeout);
+		now = g_get_monotonic_time();
+
+		if(ready > 0 && offset == 1 && (g_array_index(poll_fds, struct pollfd, 0).revents & POLLIN))
+		{
+			int fd = accept(listen_fd, NULL, NULL);
+
+			if(fd >= 0)
+			{
+				service_accept(connections, fd);
+			}
+		}
+
+		// Connections were polled in order after the listening socket, the one just accepted comes last and wasn't
+
+		for(guint i = 0, k = 0; i < connections->len; k++)
+		{
+			Connection *connection = g_ptr_array_index(connections, i);
+			gboolean done = FALSE;
+
+			if(ready > 0 && k < polled && g_array_index(poll_fds, struct pollfd, offset + k).revents != 0)
+			{
+				done = service_read(&service, connection);
+			}
+
+			if(!done && now >= connection->deadline)
+			{
+				reply(connection->fd, "timed out");
+				done = TRUE;
+			}
+
+			if(done)
+			{
+				g_ptr_array_remove_index(connections, i);
+			} else {
+				i++;
+			}
+		}
+
+		if(idle_timeout > 0)
+		{
+			gboolean idle;
+
+			g_mutex_lock(&service.mutex);
+			idle = connections->len == 0 && service.busy == 0 && g_queue_is_empty(&service.visible) && g_queue_is_empty(&service.background) &&
+				g_get_monotonic_time() - service.last_active > (gint64) idle_timeout * G_USEC_PER_SEC;
+			g_mutex_unlock(&service.mutex);
+
+			if(idle)
+			{
+				break;
+			}
+		}
+	}
+
+	// Stop taking requests, then let the workers finish the queued ones
+
+	for(guint i = 0; i < connections->len; i++)
+	{
+		reply(((Connection *) g_ptr_array_index(connections, i))->fd, "stopping");
+	}
+
+	g_ptr_array_unref(connections);
+	g_array_unref(poll_fds);
+	close(listen_fd);
+
+	if(!activated)
+	{
+		unlink(socket_path);
+	}
+
+	g_mutex_lock(&service.mutex);
+	service.stopping = TRUE;
+	g_cond_broadcast(&service.cond);
+	g_mutex_unlock(&service.mutex);
+
+	for(gint i = 0; i < workers; i++)
+	{
+		g_thread_join(threads[i]);
+	}
+
+	g_printerr("Served %u thumbnails, %u failed, %u turned away\n", service.served, service.failed, service.rejected);
+
+	g_cond_clear(&service.cond);
+	g_mutex_clear(&service.mutex);
+	g_free(threads);
+	g_free(socket_path);
+
+	return 0;
+}
@@ -0,0 +1,275 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <util.h>
+#include <thumbnail.h>
+
+// Thumbnailer entry client, called like gdk-pixbuf-thumbnailer: -s SIZE INPUT OUTPUT, INPUT a path or a URI.
+// Hands the thumbnail to jp2-thumbnaild and makes it itself when the service isn't running or is too busy.
+
+static gint size = 128;
+static gchar *priority = NULL;
+static gboolean no_fallback = FALSE;
+
+static GOptionEntry entries[] =
+{
+	{ "size", 's', 0, G_OPTION_ARG_INT, &size, "Fit the thumbnail in N x N pixels (default: 128)", "N" },
+	{ "priority", 'p', 0, G_OPTION_ARG_STRING, &priority, "visible or background (default: visible)", "PRIORITY" },
+	{ "no-fallback", 'n', 0, G_OPTION_ARG_NONE, &no_fallback, "Fail instead of making the thumbnail here when the service can't", NULL },
+	{ NULL }
+};
+
+/**
+ * Absolute path of a path or file URI, the service runs in a directory of its own.
+ */
+static gchar *absolute(const gchar *path)
+{
+	gchar *current, *result;
+
+	if(strstr(path, "://"))
+	{
+		return g_filename_from_uri(path, NULL, NULL);
+	}
+
+	if(g_path_is_absolute(path))
+	{
+		return g_strdup(path);
+	}
+
+	current = g_get_current_dir();
+	result = g_build_filename(current, path, NULL);
+	g_free(current);
+
+	return result;
+}
+
+/**
+ * Whether response is the service declining for reasons of its own rather than failing to make the thumbnail.
+ */
+static gboolean declined(const gchar *response)
+{
+	return strcmp(response, "ERR busy") == 0 || strcmp(response, "ERR stopping") == 0 || strcmp(response, "ERR timed out") == 0;
+}
+
+/**
+ * Send request to the service and read its reply into response. Returns FALSE when the service can't be reached,
+ * or doesn't answer within THUMBNAIL_REPLY_TIMEOUT seconds.
+ */
+static gboolean request(const gchar *path, const gchar *line, gchar **response)
+{
+	struct sockaddr_un address;
+	gchar buffer[1024];
+	gsize length = strlen(line), done = 0;
+	int fd;
+
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		return FALSE;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	// A wedged service, or one stuck behind large decodes, must not hang the client
+
+	if(fd >= 0)
+	{
+		struct timeval timeout = { THUMBNAIL_REPLY_TIMEOUT, 0 };
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+
+	if(fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+
+		return FALSE;
+	}
+
+	while(done < length)
+	{
+		ssize_t result = write(fd, line + done, length - done);
+
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(result <= 0)
+		{
+			close(fd);
+			return FALSE;
+		}
+
+		done += (gsize) result;
+	}
+
+	// The reply comes once the thumbnail is written
+
+	done = 0;
+
+	while(done < sizeof(buffer) - 1 && !memchr(buffer, '\n', done))
+	{
+		ssize_t result = read(fd, buffer + done, sizeof(buffer) - 1 - done);
+
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if(result <= 0)
+		{
+			break;
+		}
+
+		done += (gsize) result;
+	}
+
+	close(fd);
+
+	// Timed out or cut off before the end of the reply
+
+	if(!memchr(buffer, '\n', done))
+	{
+		return FALSE;
+	}
+
+	buffer[done] = '\0';
+	*response = g_strdup(g_strchomp(buffer));
+
+	return TRUE;
+}
+
+/**
+ * Make the thumbnail in this process, the way the service would.
+ */
+static gboolean make(const gchar *input, const gchar *output, GError **error)
+{
+	ThumbnailState state;
+	GMappedFile *mapped = g_mapped_file_new(input, FALSE, error);
+	GdkPixbuf *pixbuf;
+	gboolean ok;
+
+	if(!mapped)
+	{
+		return FALSE;
+	}
+
+	memset(&state, 0, sizeof(ThumbnailState));
+	pixbuf = thumbnail_decode(&state, (const guint8 *) g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped), (guint) size, -1, error);
+	g_mapped_file_unref(mapped);
+	thumbnail_clear(&state);
+
+	if(!pixbuf)
+	{
+		return FALSE;
+	}
+
+	ok = gdk_pixbuf_save(pixbuf, output, "png", error, NULL);
+	g_object_unref(pixbuf);
+
+	return ok;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	gchar *input, *output, *socket_path, *line, *response = NULL;
+	gboolean reached;
+	gint status = 0;
+
+	context = g_option_context_new("INPUT OUTPUT");
+	g_option_context_set_summary(context, "Make a PNG thumbnail of a JPEG2000 file through jp2-thumbnaild, or here when it isn't running.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(argc != 3 || size < 1 || size > THUMBNAIL_SIZE_MAX || (priority && strcmp(priority, "visible") != 0 && strcmp(priority, "background") != 0))
+	{
+		g_printerr("Usage: %s [--size N] [--priority visible|background] [--no-fallback] INPUT OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	input = absolute(argv[1]);
+	output = absolute(argv[2]);
+
+	if(!input || !output || strchr(input, '\t') || strchr(input, '\n') || strchr(output, '\t') || strchr(output, '\n'))
+	{
+		g_printerr("Unsupported input or output '%s', '%s'\n", argv[1], argv[2]);
+		g_free(input);
+		g_free(output);
+		return 1;
+	}
+
+	socket_path = thumbnail_socket_path();
+	line = g_strdup_printf("%s\t%d\t%s\t%s\n", priority ? priority : "visible", size, input, output);
+	reached = request(socket_path, line, &response);
+
+	if(reached && strcmp(response, "OK") == 0)
+	{
+		status = 0;
+	}
+	else if(reached && !declined(response))
+	{
+		// The service tried and failed, doing it again here would fail the same way
+
+		g_printerr("%s: %s\n", argv[1], g_str_has_prefix(response, "ERR ") ? response + 4 : response);
+		status = 1;
+	}
+	else if(no_fallback)
+	{
+		g_printerr("%s: %s\n", argv[1], reached ? response + 4 : "the service isn't running or didn't answer");
+		status = 1;
+	}
+	else if(!make(input, output, &error))
+	{
+		g_printerr("%s: %s\n", argv[1], error->message);
+		g_clear_error(&error);
+		status = 1;
+	}
+
+	g_free(response);
+	g_free(line);
+	g_free(socket_path);
+	g_free(input);
+	g_free(output);
+
+	return status;
+}
@@ -0,0 +1,126 @@
+/* GdkPixbuf library - JPEG2000 Image Loader
+ *
+ * Copyright © 2020 Nichlas Severinsen
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <transcode.h>
+
+static gint layers = 0;
+static gint reduce = 0;
+static gchar *format = NULL;
+
+static GOptionEntry entries[] =
+{
+	{ "layers", 'l', 0, G_OPTION_ARG_INT, &layers, "Keep only the first N quality layers", "N" },
+	{ "reduce", 'r', 0, G_OPTION_ARG_INT, &reduce, "Discard the R highest resolution levels", "R" },
+	{ "format", 'f', 0, G_OPTION_ARG_STRING, &format, "Output container, jp2 or j2k (default: same as input)", "FORMAT" },
+	{ NULL }
+};
+
+static gboolean write_func(const gchar *buf, gsize count, GError **error, gpointer data)
+{
+	if(fwrite(buf, 1, count, (FILE *) data) != count)
+	{
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "Failed to write output");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gint main(gint argc, gchar **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	GMappedFile *input;
+	TranscodeOptions options = { 0, 0, TRANSCODE_FORMAT_SAME };
+	FILE *output;
+	gboolean ok;
+
+	context = g_option_context_new("INPUT OUTPUT");
+	g_option_context_set_summary(context, "Rewrite a JPEG2000 file with fewer quality layers or resolution levels without decoding it.");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if(!g_option_context_parse(context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	g_option_context_free(context);
+
+	if(argc != 3 || layers < 0 || reduce < 0)
+	{
+		g_printerr("Usage: %s [--layers N] [--reduce R] [--format jp2|j2k] INPUT OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	options.layers = (guint) layers;
+	options.reduce = (guint) reduce;
+
+	if(format)
+	{
+		if(g_ascii_strcasecmp(format, "jp2") == 0)
+		{
+			options.format = TRANSCODE_FORMAT_JP2;
+		}
+		else if(g_ascii_strcasecmp(format, "j2k") == 0 || g_ascii_strcasecmp(format, "j2c") == 0)
+		{
+			options.format = TRANSCODE_FORMAT_J2K;
+		}
+		else
+		{
+			g_printerr("Unknown format '%s', expected jp2 or j2k\n", format);
+			return 1;
+		}
+	}
+
+	input = g_mapped_file_new(argv[1], FALSE, &error);
+	if(!input)
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	output = fopen(argv[2], "wb");
+	if(!output)
+	{
+		g_printerr("Failed to open '%s' for writing\n", argv[2]);
+		g_mapped_file_unref(input);
+		return 1;
+	}
+
+	ok = transcode((const guint8 *) g_mapped_file_get_contents(input), g_mapped_file_get_length(input), &options, write_func, output, &error);
+
+	if(fclose(output) != 0 && ok)
+	{
+		g_set_error(&error, G_FILE_ERROR, G_FILE_ERROR_IO, "Failed to write '%s'", argv[2]);
+		ok = FALSE;
+	}
+
+	g_mapped_file_unref(input);
+
+	if(!ok)
+	{
+		g_printerr("%s\n", error->message);
+		remove(argv[2]);
+		return 1;
+	}
+
+	return 0;
+}